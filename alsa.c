@@ -36,8 +36,8 @@
 #include "audio.h"
 #include "options.h"
 #include "log.h"
+#include "realtime.h"
 
-#define BUFFER_MAX_USEC	300000
 #define MAX_LINEAR_DB_SCALE	2400
 
 /* Check that ALSA's and MOC's byte/sample/frame conversions agree. */
@@ -67,11 +67,29 @@ static struct
 static snd_pcm_uframes_t buffer_frames;
 static snd_pcm_uframes_t chunk_frames;
 static int chunk_bytes = -1;
-static char alsa_buf[512 * 1024];
+static char *alsa_buf = NULL;	/* only with read/write access */
+static int alsa_buf_size = 0;
 static int alsa_buf_fill = 0;
 static int bytes_per_frame;
 static int bytes_per_sample;
 
+/* Is the sound put straight into the device's ring buffer (mmap access)? */
+static bool use_mmap = false;
+
+/* Offset of the ring buffer area returned by alsa_get_buf(). */
+static snd_pcm_uframes_t mmap_offset;
+
+/* The output thread is woken up when this many frames are free. */
+static snd_pcm_uframes_t wakeup_frames;
+
+/* Poll descriptors of the device. */
+static struct pollfd *pcm_fds = NULL;
+static int pcm_fds_count = 0;
+static int wait_timeout;	/* in ms */
+
+/* Number of underruns, read by other threads. */
+static int xruns = 0;
+
 static snd_mixer_t *mixer_handle = NULL;
 static snd_mixer_elem_t *mixer_elem1 = NULL;
 static snd_mixer_elem_t *mixer_elem2 = NULL;
@@ -582,6 +600,70 @@ static int alsa_init (struct output_driver_caps *caps)
 	return result;
 }
 
+/* Set the number of free frames which wake up the output thread and get the
+ * poll descriptors to wait for it.  Return 0 on error. */
+static int alsa_set_wakeup ()
+{
+	snd_pcm_sw_params_t *sw_params;
+	int rc, result = 0;
+
+	/* At least one period must stay in the buffer. */
+	wakeup_frames = MIN(chunk_frames * options_get_int ("ALSAWakeupPeriods"),
+	                    buffer_frames - chunk_frames);
+	debug ("Wakeup threshold: %lu frames", wakeup_frames);
+
+	wait_timeout = MAX(1000, (int)(2000 * buffer_frames / params.rate));
+
+	rc = snd_pcm_sw_params_malloc (&sw_params);
+	if (rc < 0) {
+		error_errno ("Can't allocate software parameters structure", rc);
+		return 0;
+	}
+
+	rc = snd_pcm_sw_params_current (handle, sw_params);
+	if (rc < 0) {
+		error_errno ("Can't get software parameters", rc);
+		goto err;
+	}
+
+	rc = snd_pcm_sw_params_set_avail_min (handle, sw_params, wakeup_frames);
+	if (rc < 0) {
+		error_errno ("Can't set the wakeup threshold", rc);
+		goto err;
+	}
+
+	rc = snd_pcm_sw_params (handle, sw_params);
+	if (rc < 0) {
+		error_errno ("Can't set software parameters", rc);
+		goto err;
+	}
+
+	pcm_fds_count = snd_pcm_poll_descriptors_count (handle);
+	if (pcm_fds_count <= 0) {
+		error ("Can't get the number of poll descriptors");
+		pcm_fds_count = 0;
+		goto err;
+	}
+
+	pcm_fds = (struct pollfd *)xcalloc (pcm_fds_count,
+	                                    sizeof(struct pollfd));
+	rc = snd_pcm_poll_descriptors (handle, pcm_fds, pcm_fds_count);
+	if (rc < 0) {
+		error_errno ("Can't get poll descriptors", rc);
+		free (pcm_fds);
+		pcm_fds = NULL;
+		pcm_fds_count = 0;
+		goto err;
+	}
+
+	result = 1;
+
+err:
+	snd_pcm_sw_params_free (sw_params);
+
+	return result;
+}
+
 static int alsa_open (struct sound_params *sound_params)
 {
 	int rc, result = 0;
@@ -606,13 +688,28 @@ static int alsa_open (struct sound_params *sound_params)
 	if (!hw_params)
 		return 0;
 
-	rc = snd_pcm_hw_params_set_access (handle, hw_params,
-	                                   SND_PCM_ACCESS_RW_INTERLEAVED);
-	if (rc < 0) {
-		error_errno ("Can't set ALSA access type", rc);
-		goto err;
+	use_mmap = false;
+	if (options_get_bool ("ALSAMmap")) {
+		rc = snd_pcm_hw_params_set_access (handle, hw_params,
+		                                   SND_PCM_ACCESS_MMAP_INTERLEAVED);
+		if (rc < 0)
+			log_errno ("Can't use mmap access, falling back to read/write",
+			           rc);
+		else
+			use_mmap = true;
+	}
+
+	if (!use_mmap) {
+		rc = snd_pcm_hw_params_set_access (handle, hw_params,
+		                                   SND_PCM_ACCESS_RW_INTERLEAVED);
+		if (rc < 0) {
+			error_errno ("Can't set ALSA access type", rc);
+			goto err;
+		}
 	}
 
+	logit ("Set access: %s", use_mmap ? "mmap" : "read/write");
+
 	rc = snd_pcm_hw_params_set_format (handle, hw_params, params.format);
 	if (rc < 0) {
 		error_errno ("Can't set sample format", rc);
@@ -646,8 +743,13 @@ static int alsa_open (struct sound_params *sound_params)
 		goto err;
 	}
 
-	buffer_time = MIN(buffer_time, BUFFER_MAX_USEC);
-	period_time = buffer_time / 4;
+	buffer_time = MIN(buffer_time,
+	                  options_get_int ("ALSABufferTime") * 1000U);
+	if (options_get_int ("ALSAPeriodTime"))
+		period_time = MIN(options_get_int ("ALSAPeriodTime") * 1000U,
+		                  buffer_time / 2);
+	else
+		period_time = buffer_time / 4;
 
 	rc = snd_pcm_hw_params_set_period_time_near (handle, hw_params,
 	                                             &period_time, 0);
@@ -688,6 +790,15 @@ static int alsa_open (struct sound_params *sound_params)
 		goto err;
 	}
 
+	if (!alsa_set_wakeup ())
+		goto err;
+
+	if (!use_mmap) {
+		alsa_buf_size = 2 * chunk_bytes;
+		alsa_buf = (char *)xmalloc (alsa_buf_size);
+		realtime_prefault (alsa_buf, alsa_buf_size);
+	}
+
 	rc = snd_pcm_prepare (handle);
 	if (rc < 0) {
 		error_errno ("Can't prepare audio interface for use", rc);
@@ -709,29 +820,74 @@ err:
 	return result;
 }
 
+/* Recover from an error returned by an ALSA function.  Return 0 if it's not
+ * possible. */
+static int alsa_recover (int rc)
+{
+	if (rc == -EPIPE) {
+		__atomic_add_fetch (&xruns, 1, __ATOMIC_RELAXED);
+		logit ("Underrun");
+	}
+
+	rc = snd_pcm_recover (handle, rc, 0);
+	if (rc < 0) {
+		error_errno ("Can't play", rc);
+		return 0;
+	}
+
+	return 1;
+}
+
+/* Sleep until the device can take wakeup_frames frames.  Return 0 on
+ * error. */
+static int alsa_wait ()
+{
+	while (1) {
+		unsigned short revents;
+		int rc;
+
+		rc = poll (pcm_fds, pcm_fds_count, wait_timeout);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			error_errno ("poll() failed", errno);
+			return 0;
+		}
+
+		if (rc == 0) {
+			logit ("Timeout while waiting for the device");
+			return 1;
+		}
+
+		rc = snd_pcm_poll_descriptors_revents (handle, pcm_fds,
+		                                       pcm_fds_count, &revents);
+		if (rc < 0)
+			return alsa_recover (rc);
+
+		/* Underrun or suspend, get the error. */
+		if (revents & POLLERR) {
+			snd_pcm_sframes_t avail = snd_pcm_avail_update (handle);
+
+			return avail < 0 ? alsa_recover (avail) : 1;
+		}
+
+		if (revents & POLLOUT)
+			return 1;
+	}
+}
+
 /* Play from alsa_buf as many chunks as possible. Move the remaining data
  * to the beginning of the buffer. Return the number of bytes written
  * or -1 on error. */
 static int play_buf_chunks ()
 {
 	int written = 0;
-	bool zero_logged = false;
 
 	while (alsa_buf_fill >= chunk_bytes) {
-		int rc;
+		snd_pcm_sframes_t rc;
 
 		rc = snd_pcm_writei (handle, alsa_buf + written, chunk_frames);
 
-		if (rc == 0) {
-			if (!zero_logged) {
-				debug ("Played 0 bytes");
-				zero_logged = true;
-			}
-			continue;
-		}
-
-		zero_logged = false;
-
 		if (rc > 0) {
 			int written_bytes = rc * bytes_per_frame;
 
@@ -742,19 +898,15 @@ static int play_buf_chunks ()
 			continue;
 		}
 
-		rc = snd_pcm_recover (handle, rc, 0);
+		/* The device is full, sleep instead of retrying. */
+		if (rc == 0 || rc == -EAGAIN) {
+			if (!alsa_wait ())
+				return -1;
+			continue;
+		}
 
-		switch (rc) {
-		case 0:
-			break;
-		case -EAGAIN:
-			if (snd_pcm_wait (handle, 500) < 0)
-				logit ("snd_pcm_wait() failed");
-			break;
-		default:
-			error_errno ("Can't play", rc);
+		if (!alsa_recover (rc))
 			return -1;
-		}
 	}
 
 	debug ("%d bytes remain in alsa_buf", alsa_buf_fill);
@@ -793,6 +945,16 @@ static void alsa_close ()
 	snd_pcm_close (handle);
 	logit ("ALSA device closed");
 
+	if (alsa_buf) {
+		realtime_release (alsa_buf, alsa_buf_size);
+		free (alsa_buf);
+		alsa_buf = NULL;
+	}
+	alsa_buf_size = 0;
+	free (pcm_fds);
+	pcm_fds = NULL;
+	pcm_fds_count = 0;
+
 	params.format = 0;
 	params.rate = 0;
 	params.channels = 0;
@@ -802,29 +964,118 @@ static void alsa_close ()
 	handle = NULL;
 }
 
-static int alsa_play (const char *buff, const size_t size)
+/* Wait until at least min frames of the ring buffer are free.  Return the
+ * number of free frames or -1 on error. */
+static snd_pcm_sframes_t mmap_wait (const snd_pcm_uframes_t min)
+{
+	while (1) {
+		snd_pcm_sframes_t avail;
+
+		avail = snd_pcm_avail_update (handle);
+		if (avail < 0) {
+			if (!alsa_recover (avail))
+				return -1;
+			continue;
+		}
+
+		if ((snd_pcm_uframes_t)avail >= min)
+			return avail;
+
+		if (!alsa_wait ())
+			return -1;
+	}
+}
+
+/* Return the place for the sound: the device's ring buffer with mmap access
+ * or alsa_buf otherwise. */
+static char *alsa_get_buf (const size_t size, size_t *avail)
 {
-	int to_write = size;
-	int buf_pos = 0;
+	const snd_pcm_channel_area_t *areas;
+	snd_pcm_uframes_t frames;
 
 	assert (chunk_bytes > 0);
+	assert (size % bytes_per_frame == 0);
 
-	debug ("Got %zu bytes to play", size);
+	if (!use_mmap) {
+		*avail = MIN(size, (size_t)(alsa_buf_size - alsa_buf_fill)
+		                   / bytes_per_frame * bytes_per_frame);
+		return alsa_buf + alsa_buf_fill;
+	}
+
+	while (1) {
+		snd_pcm_sframes_t free_frames;
+		int rc;
+
+		/* Write at least the wakeup threshold unless there is less
+		 * sound. */
+		frames = size / bytes_per_frame;
+		free_frames = mmap_wait (MIN(frames, wakeup_frames));
+		if (free_frames < 0)
+			return NULL;
+
+		frames = MIN(frames, (snd_pcm_uframes_t)free_frames);
+		rc = snd_pcm_mmap_begin (handle, &areas, &mmap_offset, &frames);
+		if (rc == 0)
+			break;
+		if (!alsa_recover (rc))
+			return NULL;
+	}
+
+	*avail = frames * bytes_per_frame;
+
+	return (char *)areas[0].addr + areas[0].first / 8
+		+ mmap_offset * (areas[0].step / 8);
+}
+
+/* Play the sound put in the place returned by alsa_get_buf(). */
+static int alsa_commit_buf (const size_t size)
+{
+	snd_pcm_uframes_t frames = size / bytes_per_frame;
+	snd_pcm_sframes_t rc;
+
+	if (!use_mmap) {
+		alsa_buf_fill += size;
+		return play_buf_chunks () < 0 ? 0 : 1;
+	}
+
+	rc = snd_pcm_mmap_commit (handle, mmap_offset, frames);
+	if (rc < 0 || (snd_pcm_uframes_t)rc != frames) {
 
-	while (to_write) {
-		int to_copy;
+		/* The sound is lost on an underrun. */
+		return alsa_recover (rc < 0 ? rc : -EPIPE);
+	}
 
-		to_copy = MIN(to_write, ssizeof(alsa_buf) - alsa_buf_fill);
-		memcpy (alsa_buf + alsa_buf_fill, buff + buf_pos, to_copy);
-		to_write -= to_copy;
-		buf_pos += to_copy;
-		alsa_buf_fill += to_copy;
+	/* Start like snd_pcm_writei() does with the default threshold. */
+	if (snd_pcm_state (handle) == SND_PCM_STATE_PREPARED) {
+		rc = snd_pcm_start (handle);
+		if (rc < 0)
+			return alsa_recover (rc);
+	}
 
-		debug ("Copied %d bytes to alsa_buf (now filled with %d bytes)",
-				to_copy, alsa_buf_fill);
+	debug ("Played %zu bytes", size);
+
+	return 1;
+}
 
-		if (play_buf_chunks() < 0)
+static int alsa_play (const char *buff, const size_t size)
+{
+	size_t pos = 0;
+
+	debug ("Got %zu bytes to play", size);
+
+	while (pos < size) {
+		char *dst;
+		size_t len;
+
+		dst = alsa_get_buf (size - pos, &len);
+		if (!dst)
+			return -1;
+
+		memcpy (dst, buff + pos, len);
+		if (!alsa_commit_buf (len))
 			return -1;
+
+		pos += len;
 	}
 
 	debug ("Played everything");
@@ -931,6 +1182,11 @@ static int alsa_get_buff_fill ()
 	return result;
 }
 
+static int alsa_get_xruns ()
+{
+	return __atomic_load_n (&xruns, __ATOMIC_RELAXED);
+}
+
 static int alsa_reset ()
 {
 	int result = 0;
@@ -994,9 +1250,12 @@ void alsa_funcs (struct hw_funcs *funcs)
 	funcs->open = alsa_open;
 	funcs->close = alsa_close;
 	funcs->play = alsa_play;
+	funcs->get_buf = alsa_get_buf;
+	funcs->commit_buf = alsa_commit_buf;
 	funcs->read_mixer = alsa_read_mixer;
 	funcs->set_mixer = alsa_set_mixer;
 	funcs->get_buff_fill = alsa_get_buff_fill;
+	funcs->get_xruns = alsa_get_xruns;
 	funcs->reset = alsa_reset;
 	funcs->get_rate = alsa_get_rate;
 	funcs->toggle_mixer_channel = alsa_toggle_mixer_channel;
@@ -47,6 +47,9 @@
 #ifdef HAVE_JACK
 # include "jack.h"
 #endif
+#ifdef HAVE_PIPEWIRE
+# include "pipewire_out.h"
+#endif
 
 #include "softmixer.h"
 #include "equalizer.h"
@@ -55,6 +58,7 @@
 #include "protocol.h"
 #include "options.h"
 #include "player.h"
+#include "pcm_cache.h"
 #include "audio.h"
 #include "files.h"
 #include "io.h"
@@ -529,6 +533,39 @@ static void go_to_another_file ()
 	UNLOCK (curr_playing_mtx);
 }
 
+/* Return the list of sound files to be played after the current one, for
+ * the PCM cache: the queue and then the playlist from the item next.
+ * Return NULL if the cache is disabled.  Must be called with plist_mtx
+ * locked. */
+static lists_t_strs *upcoming_files (int next)
+{
+	int max = options_get_int ("PrecacheFiles");
+	int ix;
+	lists_t_strs *files;
+
+	if (!max)
+		return NULL;
+
+	files = lists_strs_new (max);
+
+	if (curr_plist != &queue) {
+		for (ix = plist_next (&queue, -1);
+				ix != -1 && lists_strs_size (files) < max;
+				ix = plist_next (&queue, ix)) {
+			if (file_type (queue.items[ix].file) == F_SOUND)
+				lists_strs_append (files, queue.items[ix].file);
+		}
+	}
+
+	for (ix = next; ix != -1 && lists_strs_size (files) < max;
+			ix = plist_next (curr_plist, ix)) {
+		if (file_type (curr_plist->items[ix].file) == F_SOUND)
+			lists_strs_append (files, curr_plist->items[ix].file);
+	}
+
+	return files;
+}
+
 static void *play_thread (void *unused ATTR_UNUSED)
 {
 	logit ("Entering playing thread");
@@ -546,6 +583,7 @@ static void *play_thread (void *unused ATTR_UNUSED)
 		if (file) {
 			int next;
 			char *next_file;
+			lists_t_strs *upcoming;
 
 			LOCK (curr_playing_mtx);
 			LOCK (plist_mtx);
@@ -559,9 +597,13 @@ static void *play_thread (void *unused ATTR_UNUSED)
 
 			next = plist_next (curr_plist, curr_playing);
 			next_file = next != -1 ? plist_get_file (curr_plist, next) : NULL;
+			upcoming = upcoming_files (next);
 			UNLOCK (plist_mtx);
 			UNLOCK (curr_playing_mtx);
 
+			if (upcoming)
+				pcm_cache_want (upcoming);
+
 			player (file, next_file, out_buf);
 			if (next_file)
 				free (next_file);
@@ -590,6 +632,8 @@ static void *play_thread (void *unused ATTR_UNUSED)
 			go_to_another_file ();
 	}
 
+	player_gapless_flush (out_buf);
+
 	prev_state = state;
 	state = STATE_STOP;
 	state_change ();
@@ -800,7 +844,7 @@ int audio_open (struct sound_params *sound_params)
 
 	if (audio_opened) {
 		if (sound_params_eq(req_sound_params, *sound_params)) {
-			if (audio_get_bps() >= 88200) {
+			if (audio_get_bps() >= AUDIO_REOPEN_BPS) {
 				logit ("Audio device already opened with such parameters.");
 				return 1;
 			}
@@ -899,9 +943,6 @@ int audio_send_buf (const char *buf, const size_t size)
 	else
 		res = 0;
 
-	if (converted)
-		free (converted);
-
 	return res;
 }
 
@@ -926,17 +967,70 @@ int audio_get_buf_fill ()
 	return hw.get_buff_fill ();
 }
 
+/* Get the number of xruns of the driver, 0 if it doesn't count them. */
+int audio_get_xruns ()
+{
+	return hw.get_xruns ? hw.get_xruns () : 0;
+}
+
+/* Copy the sound to the driver's buffer and process it there.  Return the
+ * number of bytes played or -1 on error. */
+static int send_pcm_in_place (const char *buf, const size_t size)
+{
+	size_t pos = 0;
+
+	while (pos < size) {
+		char *dst;
+		size_t len;
+		int gain_applied = 0;
+
+		dst = hw.get_buf (size - pos, &len);
+		if (!dst)
+			return -1;
+
+		memcpy (dst, buf + pos, len);
+
+		if (equalizer_is_active ())
+			gain_applied = equalizer_process_buffer (dst, len,
+					&driver_sound_params,
+					softmixer_get_gain ());
+
+		if (softmixer_is_active () || softmixer_is_mono ())
+			softmixer_process_buffer (dst, len, &driver_sound_params,
+					!gain_applied);
+
+		if (!hw.commit_buf (len))
+			return -1;
+
+		pos += len;
+	}
+
+	return size;
+}
+
 int audio_send_pcm (const char *buf, const size_t size)
 {
 	char *softmixed = NULL;
 	char *equalized = NULL;
+	int gain_applied = 0;
+
+	if (hw.get_buf) {
+		int played = send_pcm_in_place (buf, size);
+
+		if (played < 0)
+			fatal ("Audio output error!");
+
+		return played;
+	}
 
 	if (equalizer_is_active ())
 	{
 		equalized = xmalloc (size);
 		memcpy (equalized, buf, size);
 
-		equalizer_process_buffer (equalized, size, &driver_sound_params);
+		/* The equalizer applies the softmixer gain in the same pass. */
+		gain_applied = equalizer_process_buffer (equalized, size,
+				&driver_sound_params, softmixer_get_gain ());
 
 		buf = equalized;
 	}
@@ -953,7 +1047,8 @@ int audio_send_pcm (const char *buf, const size_t size)
 			memcpy (softmixed, buf, size);
 		}
 
-		softmixer_process_buffer (softmixed, size, &driver_sound_params);
+		softmixer_process_buffer (softmixed, size, &driver_sound_params,
+				!gain_applied);
 
 		buf = softmixed;
 	}
@@ -1000,11 +1095,12 @@ static void find_working_driver (lists_t_strs *drivers, struct hw_funcs *funcs)
 {
 	int ix;
 
-	memset (funcs, 0, sizeof(*funcs));
-
 	for (ix = 0; ix < lists_strs_size (drivers); ix += 1) {
 		const char *name;
 
+		/* Don't keep optional functions of a driver which failed. */
+		memset (funcs, 0, sizeof(*funcs));
+
 		name = lists_strs_at (drivers, ix);
 
 #ifdef HAVE_SNDIO
@@ -1043,6 +1139,15 @@ static void find_working_driver (lists_t_strs *drivers, struct hw_funcs *funcs)
 		}
 #endif
 
+#ifdef HAVE_PIPEWIRE
+		if (!strcasecmp(name, "pipewire")) {
+			pipewire_funcs (funcs);
+			printf ("Trying PipeWire...\n");
+			if (funcs->init(&hw_caps))
+				return;
+		}
+#endif
+
 #ifndef NDEBUG
 		if (!strcasecmp(name, "null")) {
 			null_funcs (funcs);
@@ -1091,6 +1196,7 @@ void audio_initialize ()
 	int max_channels;
 
 	find_working_driver (options_get_list ("SoundDriver"), &hw);
+	audio_conv_init ();
 
 	if (hw_caps.max_channels < hw_caps.min_channels)
 		fatal ("Error initializing audio device: "
@@ -158,6 +158,30 @@ struct hw_funcs
 	 */
 	int (*play) (const char *buff, const size_t size);
 
+	/** Get a part of the driver's buffer to put sound in.
+	 *
+	 * Optional, can be NULL.  It lets the caller copy the sound straight
+	 * to the device's (or the driver's) buffer and process it there
+	 * instead of passing it to play().  Waits until there is space.
+	 * commit_buf() must be invoked before the next call.
+	 *
+	 * \param size Size (in bytes) of the sound the caller has, a
+	 * multiple of the frame size.
+	 * \param avail Set to the size of the returned buffer, a multiple of
+	 * the frame size not greater than size.
+	 *
+	 * \return The buffer or NULL on error.
+	 */
+	char *(*get_buf) (const size_t size, size_t *avail);
+
+	/** Play the sound put in the buffer returned by get_buf().
+	 *
+	 * \param size Number of bytes put in the buffer.
+	 *
+	 * \return 1 on success or 0 otherwise.
+	 */
+	int (*commit_buf) (const size_t size);
+
 	/** Read the volume setting.
 	 *
 	 * Read the current volume setting. This must work regardless if the
@@ -187,6 +211,15 @@ struct hw_funcs
 	 */
 	int (*get_buff_fill) ();
 
+	/** Get the number of xruns.
+	 *
+	 * Optional, can be NULL.  Count the times the device (or the sound
+	 * server) ran out of sound since the driver was initialized.
+	 *
+	 * \return Number of xruns.
+	 */
+	int (*get_xruns) ();
+
 	/** Stop playing immediately.
 	 *
 	 * Request that the sound should not be played. This should involve
@@ -224,6 +257,11 @@ struct hw_funcs
 #define sound_params_eq(p1, p2) ((p1).fmt == (p2).fmt \
 		&& (p1).channels == (p2).channels && (p1).rate == (p2).rate)
 
+/* Below this byte rate audio_open() reopens the device even if the sound
+ * parameters didn't change, so that the sound card buffer doesn't keep
+ * seconds of the previous file. */
+#define AUDIO_REOPEN_BPS	88200
+
 /* Maximum size of a string needed to hold the value returned by sfmt_str(). */
 #define SFMT_STR_MAX	280
 
@@ -249,6 +287,7 @@ void audio_reset ();
 int audio_get_bpf ();
 int audio_get_bps ();
 int audio_get_buf_fill ();
+int audio_get_xruns ();
 void audio_close ();
 int audio_get_time ();
 int audio_get_state ();
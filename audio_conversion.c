@@ -36,6 +36,15 @@
 #include "audio_conversion.h"
 #include "log.h"
 #include "options.h"
+#include "simd.h"
+
+/* Size of the sound chunk the scratch buffers are initially sized for, it's
+ * the size of the decoder's PCM buffer in the player. */
+#define CONV_CHUNK_SIZE		(36 * 1024)
+
+/* The largest float below 2^31, the biggest value which can be converted
+ * to int32_t. */
+#define FLOAT_S32_MAX		2147483520.0f
 
 static void float_to_u8 (const float *in, unsigned char *out, const size_t samples)
 {
@@ -329,16 +338,17 @@ static void s24_3_to_float (const char *in, float *out,
 		const size_t samples)
 {
 	size_t i;
-	const int8_t *in_8 = (int8_t *)in;
+	const uint8_t *in_8 = (uint8_t *)in;
 
 	assert (in != NULL);
 	assert (out != NULL);
 
+	/* Only the most significant byte carries the sign. */
 	for (i = 0; i < samples; i++) {
 #ifdef WORDS_BIGENDIAN
-		out[i] = (*(in_8+2)+(*(in_8+1)<<8)+(*(in_8)<<16)) / ((float)S24_MAX + 1.0);
+		out[i] = (*(in_8+2)+(*(in_8+1)<<8)+((int8_t)*(in_8)*65536)) / ((float)S24_MAX + 1.0);
 #else
-		out[i] = (*(in_8)+(*(in_8+1)<<8)+(*(in_8+2)<<16)) / ((float)S24_MAX + 1.0);
+		out[i] = (*(in_8)+(*(in_8+1)<<8)+((int8_t)*(in_8+2)*65536)) / ((float)S24_MAX + 1.0);
 #endif
 		in_8+=3;
 	}
@@ -388,12 +398,687 @@ static void s32_to_float (const char *in, float *out, const size_t samples)
 		out[i] = *in_32++ / ((float)INT32_MAX + 1.0);
 }
 
-/* Convert fixed point samples in format fmt (size in bytes) to float.
- * Size of converted sound is put in new_size. Returned memory is malloc()ed. */
-static float *fixed_to_float (const char *buf, const size_t size,
-		const long fmt, size_t *new_size)
+static void change_sign_8 (uint8_t *buf, const size_t samples)
+{
+	size_t i;
+
+	for (i = 0; i < samples; i++)
+		*buf++ ^= 1 << 7;
+}
+
+static void change_sign_16 (uint16_t *buf, const size_t samples)
+{
+	size_t i;
+
+	for (i = 0; i < samples; i++)
+		*buf++ ^= 1 << 15;
+}
+
+static void change_sign_24 (uint32_t *buf, const size_t samples)
+{
+	size_t i;
+
+	for (i = 0; i < samples; i++)
+		*buf++ ^= 1 << 23;
+}
+
+static void change_sign_32 (uint32_t *buf, const size_t samples)
+{
+	size_t i;
+
+	for (i = 0; i < samples; i++)
+		*buf++ ^= 1 << 31;
+}
+
+static void swap_16 (int16_t *buf, const size_t num)
+{
+	size_t i;
+
+	for (i = 0; i < num; i++)
+		buf[i] = bswap_16 (buf[i]);
+}
+
+static void swap_32 (int32_t *buf, const size_t num)
+{
+	size_t i;
+
+	for (i = 0; i < num; i++)
+		buf[i] = bswap_32 (buf[i]);
+}
+
+#ifdef HAVE_SIMD_X86
+
+/* Scale floats to the 32-bit integer range and convert them rounding to the
+ * nearest, saturating like the scalar code and turning NaN into 0. */
+ATTR_SSE2
+static inline __m128i scale_to_s32_sse2 (const __m128 in)
+{
+	__m128 f = _mm_mul_ps (in, _mm_set1_ps (INT32_MAX));
+
+	f = _mm_and_ps (f, _mm_cmpord_ps (f, f));
+	f = _mm_min_ps (f, _mm_set1_ps (FLOAT_S32_MAX));
+	f = _mm_max_ps (f, _mm_set1_ps (INT32_MIN));
+
+	return _mm_cvtps_epi32 (f);
+}
+
+ATTR_SSE2
+static void float_to_s16_sse2 (const float *in, char *out,
+		const size_t samples)
+{
+	size_t i;
+
+	for (i = 0; i + 8 <= samples; i += 8) {
+		__m128i lo = scale_to_s32_sse2 (_mm_loadu_ps (in + i));
+		__m128i hi = scale_to_s32_sse2 (_mm_loadu_ps (in + i + 4));
+
+		lo = _mm_srai_epi32 (lo, 16);
+		hi = _mm_srai_epi32 (hi, 16);
+		_mm_storeu_si128 ((__m128i *)(out + i * sizeof (int16_t)),
+				_mm_packs_epi32 (lo, hi));
+	}
+
+	float_to_s16 (in + i, out + i * sizeof (int16_t), samples - i);
+}
+
+ATTR_SSE2
+static void s16_to_float_sse2 (const char *in, float *out,
+		const size_t samples)
+{
+	const __m128 scale = _mm_set1_ps (1.0f / (INT16_MAX + 1));
+	size_t i;
+
+	for (i = 0; i + 8 <= samples; i += 8) {
+		__m128i v, lo, hi;
+
+		v = _mm_loadu_si128 ((const __m128i *)(in + i * sizeof (int16_t)));
+		lo = _mm_srai_epi32 (_mm_unpacklo_epi16 (v, v), 16);
+		hi = _mm_srai_epi32 (_mm_unpackhi_epi16 (v, v), 16);
+		_mm_storeu_ps (out + i, _mm_mul_ps (_mm_cvtepi32_ps (lo), scale));
+		_mm_storeu_ps (out + i + 4,
+				_mm_mul_ps (_mm_cvtepi32_ps (hi), scale));
+	}
+
+	s16_to_float (in + i * sizeof (int16_t), out + i, samples - i);
+}
+
+/* XOR size bytes of buf with mask, which is the sign bit of the samples. */
+ATTR_SSE2
+static void xor_sse2 (char *buf, const size_t size, const __m128i mask)
+{
+	size_t i;
+
+	for (i = 0; i + 16 <= size; i += 16) {
+		__m128i v = _mm_loadu_si128 ((__m128i *)(buf + i));
+
+		_mm_storeu_si128 ((__m128i *)(buf + i), _mm_xor_si128 (v, mask));
+	}
+}
+
+ATTR_SSE2
+static void change_sign_8_sse2 (uint8_t *buf, const size_t samples)
+{
+	size_t done = samples & ~(size_t)15;
+
+	xor_sse2 ((char *)buf, done, _mm_set1_epi8 ((char)0x80));
+	change_sign_8 (buf + done, samples - done);
+}
+
+ATTR_SSE2
+static void change_sign_16_sse2 (uint16_t *buf, const size_t samples)
+{
+	size_t done = samples & ~(size_t)7;
+
+	xor_sse2 ((char *)buf, done * 2, _mm_set1_epi16 ((short)0x8000));
+	change_sign_16 (buf + done, samples - done);
+}
+
+ATTR_SSE2
+static void change_sign_24_sse2 (uint32_t *buf, const size_t samples)
+{
+	size_t done = samples & ~(size_t)3;
+
+	xor_sse2 ((char *)buf, done * 4, _mm_set1_epi32 (1 << 23));
+	change_sign_24 (buf + done, samples - done);
+}
+
+ATTR_SSE2
+static void change_sign_32_sse2 (uint32_t *buf, const size_t samples)
+{
+	size_t done = samples & ~(size_t)3;
+
+	xor_sse2 ((char *)buf, done * 4, _mm_set1_epi32 (INT32_MIN));
+	change_sign_32 (buf + done, samples - done);
+}
+
+ATTR_SSE2
+static inline __m128i bswap_16_sse2 (const __m128i v)
+{
+	return _mm_or_si128 (_mm_slli_epi16 (v, 8), _mm_srli_epi16 (v, 8));
+}
+
+ATTR_SSE2
+static void swap_16_sse2 (int16_t *buf, const size_t num)
+{
+	size_t i;
+
+	for (i = 0; i + 8 <= num; i += 8) {
+		__m128i v = _mm_loadu_si128 ((__m128i *)(buf + i));
+
+		_mm_storeu_si128 ((__m128i *)(buf + i), bswap_16_sse2 (v));
+	}
+
+	swap_16 (buf + i, num - i);
+}
+
+ATTR_SSE2
+static void swap_32_sse2 (int32_t *buf, const size_t num)
+{
+	size_t i;
+
+	for (i = 0; i + 4 <= num; i += 4) {
+		__m128i v = _mm_loadu_si128 ((__m128i *)(buf + i));
+
+		/* swap the 16-bit halves, then the bytes in them */
+		v = _mm_shufflelo_epi16 (_mm_shufflehi_epi16 (v, 0xB1), 0xB1);
+		_mm_storeu_si128 ((__m128i *)(buf + i), bswap_16_sse2 (v));
+	}
+
+	swap_32 (buf + i, num - i);
+}
+
+ATTR_AVX2
+static inline __m256i scale_to_s32_avx2 (const __m256 in)
+{
+	__m256 f = _mm256_mul_ps (in, _mm256_set1_ps (INT32_MAX));
+
+	f = _mm256_and_ps (f, _mm256_cmp_ps (f, f, _CMP_ORD_Q));
+	f = _mm256_min_ps (f, _mm256_set1_ps (FLOAT_S32_MAX));
+	f = _mm256_max_ps (f, _mm256_set1_ps (INT32_MIN));
+
+	return _mm256_cvtps_epi32 (f);
+}
+
+ATTR_AVX2
+static void float_to_s16_avx2 (const float *in, char *out,
+		const size_t samples)
+{
+	size_t i;
+
+	for (i = 0; i + 16 <= samples; i += 16) {
+		__m256i lo = scale_to_s32_avx2 (_mm256_loadu_ps (in + i));
+		__m256i hi = scale_to_s32_avx2 (_mm256_loadu_ps (in + i + 8));
+		__m256i v;
+
+		lo = _mm256_srai_epi32 (lo, 16);
+		hi = _mm256_srai_epi32 (hi, 16);
+
+		/* packing works on 128-bit lanes, put them back in order */
+		v = _mm256_permute4x64_epi64 (_mm256_packs_epi32 (lo, hi), 0xD8);
+		_mm256_storeu_si256 ((__m256i *)(out + i * sizeof (int16_t)), v);
+	}
+
+	float_to_s16_sse2 (in + i, out + i * sizeof (int16_t), samples - i);
+}
+
+ATTR_AVX2
+static void s16_to_float_avx2 (const char *in, float *out,
+		const size_t samples)
+{
+	const __m256 scale = _mm256_set1_ps (1.0f / (INT16_MAX + 1));
+	size_t i;
+
+	for (i = 0; i + 8 <= samples; i += 8) {
+		__m128i v;
+
+		v = _mm_loadu_si128 ((const __m128i *)(in + i * sizeof (int16_t)));
+		_mm256_storeu_ps (out + i, _mm256_mul_ps (
+					_mm256_cvtepi32_ps (_mm256_cvtepi16_epi32 (v)),
+					scale));
+	}
+
+	s16_to_float (in + i * sizeof (int16_t), out + i, samples - i);
+}
+
+/* The 24_3 kernels load and store 16 bytes for every 4 samples (12 bytes),
+ * so they stop 2 samples before the end of the buffer. */
+
+ATTR_AVX2
+static void float_to_s24_3_avx2 (const float *in, char *out,
+		const size_t samples)
+{
+	const __m256i pack = _mm256_setr_epi8 (
+			0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+			0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+	size_t i;
+
+	for (i = 0; i + 10 <= samples; i += 8) {
+		__m256 f = _mm256_loadu_ps (in + i);
+		__m256i v;
+
+		f = _mm256_sub_ps (_mm256_mul_ps (f, _mm256_set1_ps (1 << 23)),
+				_mm256_set1_ps (1.0f));
+		f = _mm256_min_ps (_mm256_set1_ps (S24_MAX), f);
+		f = _mm256_max_ps (_mm256_set1_ps (S24_MIN), f);
+		v = _mm256_shuffle_epi8 (_mm256_cvtps_epi32 (f), pack);
+
+		_mm_storeu_si128 ((__m128i *)(out + 3 * i),
+				_mm256_castsi256_si128 (v));
+		_mm_storeu_si128 ((__m128i *)(out + 3 * i + 12),
+				_mm256_extracti128_si256 (v, 1));
+	}
+
+	float_to_s24_3 (in + i, out + 3 * i, samples - i);
+}
+
+ATTR_AVX2
+static void s24_3_to_float_avx2 (const char *in, float *out,
+		const size_t samples)
+{
+	const __m256i unpack = _mm256_setr_epi8 (
+			-1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11,
+			-1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11);
+	const __m256 scale = _mm256_set1_ps (1.0f / (1 << 23));
+	size_t i;
+
+	for (i = 0; i + 10 <= samples; i += 8) {
+		__m256i v;
+
+		v = _mm256_inserti128_si256 (_mm256_castsi128_si256 (
+					_mm_loadu_si128 ((const __m128i *)(in + 3 * i))),
+				_mm_loadu_si128 ((const __m128i *)(in + 3 * i + 12)),
+				1);
+
+		/* put the samples in the upper 3 bytes to get the sign */
+		v = _mm256_srai_epi32 (_mm256_shuffle_epi8 (v, unpack), 8);
+		_mm256_storeu_ps (out + i,
+				_mm256_mul_ps (_mm256_cvtepi32_ps (v), scale));
+	}
+
+	s24_3_to_float (in + 3 * i, out + i, samples - i);
+}
+
+ATTR_AVX2
+static void xor_avx2 (char *buf, const size_t size, const __m256i mask)
+{
+	size_t i;
+
+	for (i = 0; i + 32 <= size; i += 32) {
+		__m256i v = _mm256_loadu_si256 ((__m256i *)(buf + i));
+
+		_mm256_storeu_si256 ((__m256i *)(buf + i),
+				_mm256_xor_si256 (v, mask));
+	}
+}
+
+ATTR_AVX2
+static void change_sign_8_avx2 (uint8_t *buf, const size_t samples)
+{
+	size_t done = samples & ~(size_t)31;
+
+	xor_avx2 ((char *)buf, done, _mm256_set1_epi8 ((char)0x80));
+	change_sign_8 (buf + done, samples - done);
+}
+
+ATTR_AVX2
+static void change_sign_16_avx2 (uint16_t *buf, const size_t samples)
+{
+	size_t done = samples & ~(size_t)15;
+
+	xor_avx2 ((char *)buf, done * 2, _mm256_set1_epi16 ((short)0x8000));
+	change_sign_16 (buf + done, samples - done);
+}
+
+ATTR_AVX2
+static void change_sign_24_avx2 (uint32_t *buf, const size_t samples)
+{
+	size_t done = samples & ~(size_t)7;
+
+	xor_avx2 ((char *)buf, done * 4, _mm256_set1_epi32 (1 << 23));
+	change_sign_24 (buf + done, samples - done);
+}
+
+ATTR_AVX2
+static void change_sign_32_avx2 (uint32_t *buf, const size_t samples)
+{
+	size_t done = samples & ~(size_t)7;
+
+	xor_avx2 ((char *)buf, done * 4, _mm256_set1_epi32 (INT32_MIN));
+	change_sign_32 (buf + done, samples - done);
+}
+
+/* Byte swap with a shuffle mask in both 128-bit lanes. */
+ATTR_AVX2
+static void swap_avx2 (char *buf, const size_t size, const __m256i mask)
+{
+	size_t i;
+
+	for (i = 0; i + 32 <= size; i += 32) {
+		__m256i v = _mm256_loadu_si256 ((__m256i *)(buf + i));
+
+		_mm256_storeu_si256 ((__m256i *)(buf + i),
+				_mm256_shuffle_epi8 (v, mask));
+	}
+}
+
+ATTR_AVX2
+static void swap_16_avx2 (int16_t *buf, const size_t num)
+{
+	size_t done = num & ~(size_t)15;
+
+	swap_avx2 ((char *)buf, done * 2, _mm256_setr_epi8 (
+				1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+				1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14));
+	swap_16 (buf + done, num - done);
+}
+
+ATTR_AVX2
+static void swap_32_avx2 (int32_t *buf, const size_t num)
+{
+	size_t done = num & ~(size_t)7;
+
+	swap_avx2 ((char *)buf, done * 4, _mm256_setr_epi8 (
+				3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+				3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12));
+	swap_32 (buf + done, num - done);
+}
+
+#endif /* HAVE_SIMD_X86 */
+
+#ifdef HAVE_NEON
+
+static void s16_to_float_neon (const char *in, float *out,
+		const size_t samples)
+{
+	const float scale = 1.0f / (INT16_MAX + 1);
+	size_t i;
+
+	for (i = 0; i + 8 <= samples; i += 8) {
+		int16x8_t v = vld1q_s16 ((const int16_t *)in + i);
+
+		vst1q_f32 (out + i, vmulq_n_f32 (vcvtq_f32_s32 (
+						vmovl_s16 (vget_low_s16 (v))), scale));
+		vst1q_f32 (out + i + 4, vmulq_n_f32 (vcvtq_f32_s32 (
+						vmovl_s16 (vget_high_s16 (v))), scale));
+	}
+
+	s16_to_float (in + i * sizeof (int16_t), out + i, samples - i);
+}
+
+/* Make 8 floats from 8 samples split into their 3 bytes. */
+static inline void s24_3_to_float_half_neon (const uint8x8_t b0,
+		const uint8x8_t b1, const uint8x8_t b2, float *out)
+{
+	const float scale = 1.0f / (1 << 23);
+	uint16x8_t lo;
+	int16x8_t hi;
+	int32x4_t v;
+
+	lo = vorrq_u16 (vmovl_u8 (b0), vshlq_n_u16 (vmovl_u8 (b1), 8));
+	hi = vmovl_s8 (vreinterpret_s8_u8 (b2));
+
+	v = vorrq_s32 (vshlq_n_s32 (vmovl_s16 (vget_low_s16 (hi)), 16),
+			vreinterpretq_s32_u32 (vmovl_u16 (vget_low_u16 (lo))));
+	vst1q_f32 (out, vmulq_n_f32 (vcvtq_f32_s32 (v), scale));
+
+	v = vorrq_s32 (vshlq_n_s32 (vmovl_s16 (vget_high_s16 (hi)), 16),
+			vreinterpretq_s32_u32 (vmovl_u16 (vget_high_u16 (lo))));
+	vst1q_f32 (out + 4, vmulq_n_f32 (vcvtq_f32_s32 (v), scale));
+}
+
+static void s24_3_to_float_neon (const char *in, float *out,
+		const size_t samples)
+{
+	size_t i;
+
+	for (i = 0; i + 16 <= samples; i += 16) {
+		uint8x16x3_t b = vld3q_u8 ((const uint8_t *)in + 3 * i);
+
+		s24_3_to_float_half_neon (vget_low_u8 (b.val[0]),
+				vget_low_u8 (b.val[1]), vget_low_u8 (b.val[2]),
+				out + i);
+		s24_3_to_float_half_neon (vget_high_u8 (b.val[0]),
+				vget_high_u8 (b.val[1]), vget_high_u8 (b.val[2]),
+				out + i + 8);
+	}
+
+	s24_3_to_float (in + 3 * i, out + i, samples - i);
+}
+
+/* Rounding conversion from float to integer (vcvtnq) is only in ARMv8. */
+#ifdef __aarch64__
+static inline int32x4_t scale_to_s32_neon (const float32x4_t in)
+{
+	float32x4_t f = vmulq_n_f32 (in, INT32_MAX);
+
+	f = vminq_f32 (f, vdupq_n_f32 (FLOAT_S32_MAX));
+	f = vmaxq_f32 (f, vdupq_n_f32 (INT32_MIN));
+
+	return vcvtnq_s32_f32 (f);
+}
+
+static void float_to_s16_neon (const float *in, char *out,
+		const size_t samples)
+{
+	size_t i;
+
+	for (i = 0; i + 8 <= samples; i += 8) {
+		int16x4_t lo = vshrn_n_s32 (scale_to_s32_neon (
+					vld1q_f32 (in + i)), 16);
+		int16x4_t hi = vshrn_n_s32 (scale_to_s32_neon (
+					vld1q_f32 (in + i + 4)), 16);
+
+		vst1q_s16 ((int16_t *)out + i, vcombine_s16 (lo, hi));
+	}
+
+	float_to_s16 (in + i, out + i * sizeof (int16_t), samples - i);
+}
+
+static inline uint32x4_t scale_to_s24_neon (const float *in)
+{
+	float32x4_t f = vld1q_f32 (in);
+
+	f = vsubq_f32 (vmulq_n_f32 (f, 1 << 23), vdupq_n_f32 (1.0f));
+	f = vminq_f32 (f, vdupq_n_f32 (S24_MAX));
+	f = vmaxq_f32 (f, vdupq_n_f32 (S24_MIN));
+
+	return vreinterpretq_u32_s32 (vcvtnq_s32_f32 (f));
+}
+
+static void float_to_s24_3_neon (const float *in, char *out,
+		const size_t samples)
+{
+	size_t i;
+
+	for (i = 0; i + 16 <= samples; i += 16) {
+		uint32x4_t v0 = scale_to_s24_neon (in + i);
+		uint32x4_t v1 = scale_to_s24_neon (in + i + 4);
+		uint32x4_t v2 = scale_to_s24_neon (in + i + 8);
+		uint32x4_t v3 = scale_to_s24_neon (in + i + 12);
+		uint16x8_t lo01, lo23, hi01, hi23;
+		uint8x16x3_t b;
+
+		lo01 = vcombine_u16 (vmovn_u32 (v0), vmovn_u32 (v1));
+		lo23 = vcombine_u16 (vmovn_u32 (v2), vmovn_u32 (v3));
+		hi01 = vcombine_u16 (vshrn_n_u32 (v0, 16), vshrn_n_u32 (v1, 16));
+		hi23 = vcombine_u16 (vshrn_n_u32 (v2, 16), vshrn_n_u32 (v3, 16));
+
+		b.val[0] = vcombine_u8 (vmovn_u16 (lo01), vmovn_u16 (lo23));
+		b.val[1] = vcombine_u8 (vshrn_n_u16 (lo01, 8),
+				vshrn_n_u16 (lo23, 8));
+		b.val[2] = vcombine_u8 (vmovn_u16 (hi01), vmovn_u16 (hi23));
+		vst3q_u8 ((uint8_t *)out + 3 * i, b);
+	}
+
+	float_to_s24_3 (in + i, out + 3 * i, samples - i);
+}
+#endif
+
+static void xor_neon (uint8_t *buf, const size_t size, const uint8x16_t mask)
+{
+	size_t i;
+
+	for (i = 0; i + 16 <= size; i += 16)
+		vst1q_u8 (buf + i, veorq_u8 (vld1q_u8 (buf + i), mask));
+}
+
+static void change_sign_8_neon (uint8_t *buf, const size_t samples)
+{
+	size_t done = samples & ~(size_t)15;
+
+	xor_neon (buf, done, vdupq_n_u8 (0x80));
+	change_sign_8 (buf + done, samples - done);
+}
+
+static void change_sign_16_neon (uint16_t *buf, const size_t samples)
+{
+	size_t done = samples & ~(size_t)7;
+
+	xor_neon ((uint8_t *)buf, done * 2,
+			vreinterpretq_u8_u16 (vdupq_n_u16 (0x8000)));
+	change_sign_16 (buf + done, samples - done);
+}
+
+static void change_sign_24_neon (uint32_t *buf, const size_t samples)
+{
+	size_t done = samples & ~(size_t)3;
+
+	xor_neon ((uint8_t *)buf, done * 4,
+			vreinterpretq_u8_u32 (vdupq_n_u32 (1 << 23)));
+	change_sign_24 (buf + done, samples - done);
+}
+
+static void change_sign_32_neon (uint32_t *buf, const size_t samples)
+{
+	size_t done = samples & ~(size_t)3;
+
+	xor_neon ((uint8_t *)buf, done * 4,
+			vreinterpretq_u8_u32 (vdupq_n_u32 (1U << 31)));
+	change_sign_32 (buf + done, samples - done);
+}
+
+static void swap_16_neon (int16_t *buf, const size_t num)
+{
+	size_t i;
+
+	for (i = 0; i + 8 <= num; i += 8) {
+		uint8x16_t v = vld1q_u8 ((uint8_t *)(buf + i));
+
+		vst1q_u8 ((uint8_t *)(buf + i), vrev16q_u8 (v));
+	}
+
+	swap_16 (buf + i, num - i);
+}
+
+static void swap_32_neon (int32_t *buf, const size_t num)
+{
+	size_t i;
+
+	for (i = 0; i + 4 <= num; i += 4) {
+		uint8x16_t v = vld1q_u8 ((uint8_t *)(buf + i));
+
+		vst1q_u8 ((uint8_t *)(buf + i), vrev32q_u8 (v));
+	}
+
+	swap_32 (buf + i, num - i);
+}
+
+#endif /* HAVE_NEON */
+
+/* Sample format conversion functions which have SIMD implementations. */
+struct conv_kernels
+{
+	void (*float_to_s16) (const float *in, char *out, const size_t samples);
+	void (*s16_to_float) (const char *in, float *out, const size_t samples);
+	void (*float_to_s24_3) (const float *in, char *out,
+			const size_t samples);
+	void (*s24_3_to_float) (const char *in, float *out,
+			const size_t samples);
+	void (*change_sign_8) (uint8_t *buf, const size_t samples);
+	void (*change_sign_16) (uint16_t *buf, const size_t samples);
+	void (*change_sign_24) (uint32_t *buf, const size_t samples);
+	void (*change_sign_32) (uint32_t *buf, const size_t samples);
+	void (*swap_16) (int16_t *buf, const size_t num);
+	void (*swap_32) (int32_t *buf, const size_t num);
+};
+
+/* The kernels in use, the scalar ones until audio_conv_init() picks the
+ * fastest ones the CPU supports. */
+static struct conv_kernels kernels = {
+	float_to_s16,
+	s16_to_float,
+	float_to_s24_3,
+	s24_3_to_float,
+	change_sign_8,
+	change_sign_16,
+	change_sign_24,
+	change_sign_32,
+	swap_16,
+	swap_32
+};
+
+/* Choose the conversion functions for this CPU. */
+void audio_conv_init ()
+{
+	int features = simd_features ();
+	char features_str[SIMD_STR_MAX] LOGIT_ONLY;
+
+#ifdef HAVE_SIMD_X86
+	if (features & SIMD_SSE2) {
+		kernels.float_to_s16 = float_to_s16_sse2;
+		kernels.s16_to_float = s16_to_float_sse2;
+		kernels.change_sign_8 = change_sign_8_sse2;
+		kernels.change_sign_16 = change_sign_16_sse2;
+		kernels.change_sign_24 = change_sign_24_sse2;
+		kernels.change_sign_32 = change_sign_32_sse2;
+		kernels.swap_16 = swap_16_sse2;
+		kernels.swap_32 = swap_32_sse2;
+	}
+
+	if ((features & (SIMD_SSE2 | SIMD_AVX2)) == (SIMD_SSE2 | SIMD_AVX2)) {
+		kernels.float_to_s16 = float_to_s16_avx2;
+		kernels.s16_to_float = s16_to_float_avx2;
+		kernels.float_to_s24_3 = float_to_s24_3_avx2;
+		kernels.s24_3_to_float = s24_3_to_float_avx2;
+		kernels.change_sign_8 = change_sign_8_avx2;
+		kernels.change_sign_16 = change_sign_16_avx2;
+		kernels.change_sign_24 = change_sign_24_avx2;
+		kernels.change_sign_32 = change_sign_32_avx2;
+		kernels.swap_16 = swap_16_avx2;
+		kernels.swap_32 = swap_32_avx2;
+	}
+#endif
+
+#ifdef HAVE_NEON
+	if (features & SIMD_NEON) {
+		kernels.s16_to_float = s16_to_float_neon;
+		kernels.change_sign_8 = change_sign_8_neon;
+		kernels.change_sign_16 = change_sign_16_neon;
+		kernels.change_sign_24 = change_sign_24_neon;
+		kernels.change_sign_32 = change_sign_32_neon;
+		kernels.swap_16 = swap_16_neon;
+		kernels.swap_32 = swap_32_neon;
+# ifdef __aarch64__
+		kernels.float_to_s16 = float_to_s16_neon;
+# endif
+# ifndef WORDS_BIGENDIAN
+		kernels.s24_3_to_float = s24_3_to_float_neon;
+#  ifdef __aarch64__
+		kernels.float_to_s24_3 = float_to_s24_3_neon;
+#  endif
+# endif
+	}
+#endif
+
+	logit ("SIMD instructions used for sample conversion: %s",
+			simd_str (features, features_str, sizeof (features_str)));
+}
+
+/* Convert fixed point samples in format fmt (size in bytes) to float and
+ * put them in out.  Size of converted sound is put in new_size. */
+static void fixed_to_float (const char *buf, const size_t size,
+		const long fmt, float *out, size_t *new_size)
 {
-	float *out = NULL;
 	char fmt_name[SFMT_STR_MAX];
 
 	assert ((fmt & SFMT_MASK_FORMAT) != SFMT_FLOAT);
@@ -401,52 +1086,42 @@ static float *fixed_to_float (const char *buf, const size_t size,
 	switch (fmt & SFMT_MASK_FORMAT) {
 		case SFMT_U8:
 			*new_size = sizeof(float) * size;
-			out = (float *)xmalloc (*new_size);
 			u8_to_float ((unsigned char *)buf, out, size);
 			break;
 		case SFMT_S8:
 			*new_size = sizeof(float) * size;
-			out = (float *)xmalloc (*new_size);
 			s8_to_float (buf, out, size);
 			break;
 		case SFMT_U16:
 			*new_size = sizeof(float) * size / 2;
-			out = (float *)xmalloc (*new_size);
 			u16_to_float ((unsigned char *)buf, out, size / 2);
 			break;
 		case SFMT_S16:
 			*new_size = sizeof(float) * size / 2;
-			out = (float *)xmalloc (*new_size);
-			s16_to_float (buf, out, size / 2);
+			kernels.s16_to_float (buf, out, size / 2);
 			break;
 		case SFMT_U24:
 			*new_size = sizeof(float) * size / 4;
-			out = (float *)xmalloc (*new_size);
 			u24_to_float ((unsigned char *)buf, out, size / 4);
 			break;
 		case SFMT_S24:
 			*new_size = sizeof(float) * size / 4;
-			out = (float *)xmalloc (*new_size);
 			s24_to_float (buf, out, size / 4);
 			break;
 		case SFMT_S24_3:
 			*new_size = sizeof(float) * size / 3;
-			out = (float *)xmalloc (*new_size);
-			s24_3_to_float (buf, out, size / 3);
+			kernels.s24_3_to_float (buf, out, size / 3);
 			break;
 		case SFMT_U24_3:
 			*new_size = sizeof(float) * size / 3;
-			out = (float *)xmalloc (*new_size);
 			u24_3_to_float (buf, out, size / 3);
 			break;
 		case SFMT_U32:
 			*new_size = sizeof(float) * size / 4;
-			out = (float *)xmalloc (*new_size);
 			u32_to_float ((unsigned char *)buf, out, size / 4);
 			break;
 		case SFMT_S32:
 			*new_size = sizeof(float) * size / 4;
-			out = (float *)xmalloc (*new_size);
 			s32_to_float (buf, out, size / 4);
 			break;
 		default:
@@ -454,69 +1129,56 @@ static float *fixed_to_float (const char *buf, const size_t size,
 			       sfmt_str (fmt, fmt_name, sizeof (fmt_name)));
 			abort ();
 	}
-
-	return out;
 }
 
-/* Convert float samples to fixed point format fmt. Returned samples of size
- * new_size bytes is malloc()ed. */
-static char *float_to_fixed (const float *buf, const size_t samples,
-		const long fmt, size_t *new_size)
+/* Convert float samples to fixed point format fmt and put them in new_snd.
+ * Size of converted sound in bytes is put in new_size. */
+static void float_to_fixed (const float *buf, const size_t samples,
+		const long fmt, char *new_snd, size_t *new_size)
 {
 	char fmt_name[SFMT_STR_MAX];
-	char *new_snd = NULL;
 
 	assert ((fmt & SFMT_MASK_FORMAT) != SFMT_FLOAT);
 
 	switch (fmt & SFMT_MASK_FORMAT) {
 		case SFMT_U8:
 			*new_size = samples;
-			new_snd = (char *)xmalloc (samples);
 			float_to_u8 (buf, (unsigned char *)new_snd, samples);
 			break;
 		case SFMT_S8:
 			*new_size = samples;
-			new_snd = (char *)xmalloc (samples);
 			float_to_s8 (buf, new_snd, samples);
 			break;
 		case SFMT_U16:
 			*new_size = samples * 2;
-			new_snd = (char *)xmalloc (*new_size);
 			float_to_u16 (buf, (unsigned char *)new_snd, samples);
 			break;
 		case SFMT_S16:
 			*new_size = samples * 2;
-			new_snd = (char *)xmalloc (*new_size);
-			float_to_s16 (buf, new_snd, samples);
+			kernels.float_to_s16 (buf, new_snd, samples);
 			break;
 		case SFMT_U24:
 			*new_size = samples * 4;
-			new_snd = (char *)xmalloc (*new_size);
 			float_to_u24 (buf, (unsigned char *)new_snd, samples);
 			break;
 		case SFMT_S24:
 			*new_size = samples * 4;
-			new_snd = (char *)xmalloc (*new_size);
 			float_to_s24 (buf, new_snd, samples);
 			break;
 		case SFMT_U24_3:
 			*new_size = samples * 3;
-			new_snd = (char *)xmalloc (*new_size);
 			float_to_u24_3 (buf, (unsigned char *)new_snd, samples);
 			break;
 		case SFMT_S24_3:
 			*new_size = samples * 3;
-			new_snd = (char *)xmalloc (*new_size);
-			float_to_s24_3 (buf, new_snd, samples);
+			kernels.float_to_s24_3 (buf, new_snd, samples);
 			break;
 		case SFMT_U32:
 			*new_size = samples * 4;
-			new_snd = (char *)xmalloc (*new_size);
 			float_to_u32 (buf, (unsigned char *)new_snd, samples);
 			break;
 		case SFMT_S32:
 			*new_size = samples * 4;
-			new_snd = (char *)xmalloc (*new_size);
 			float_to_s32 (buf, new_snd, samples);
 			break;
 		default:
@@ -524,52 +1186,18 @@ static char *float_to_fixed (const float *buf, const size_t samples,
 			       sfmt_str (fmt, fmt_name, sizeof (fmt_name)));
 			abort ();
 	}
-
-	return new_snd;
-}
-
-static void change_sign_8 (uint8_t *buf, const size_t samples)
-{
-	size_t i;
-
-	for (i = 0; i < samples; i++)
-		*buf++ ^= 1 << 7;
-}
-
-static void change_sign_16 (uint16_t *buf, const size_t samples)
-{
-	size_t i;
-
-	for (i = 0; i < samples; i++)
-		*buf++ ^= 1 << 15;
-}
-
-static void change_sign_24 (uint32_t *buf, const size_t samples)
-{
-	size_t i;
-
-	for (i = 0; i < samples; i++)
-		*buf++ ^= 1 << 23;
-}
-
-static void change_sign_32 (uint32_t *buf, const size_t samples)
-{
-	size_t i;
-
-	for (i = 0; i < samples; i++)
-		*buf++ ^= 1 << 31;
 }
 
 /* Change the signs of samples in format *fmt.  Also changes fmt to the new
  * format. */
-static void change_sign (char *buf, const size_t size, long *fmt)
+void audio_conv_change_sign (char *buf, const size_t size, long *fmt)
 {
 	char fmt_name[SFMT_STR_MAX];
 
 	switch (*fmt & SFMT_MASK_FORMAT) {
 		case SFMT_S8:
 		case SFMT_U8:
-			change_sign_8 ((uint8_t *)buf, size);
+			kernels.change_sign_8 ((uint8_t *)buf, size);
 			if (*fmt & SFMT_S8)
 				*fmt = sfmt_set_fmt (*fmt, SFMT_U8);
 			else
@@ -577,7 +1205,7 @@ static void change_sign (char *buf, const size_t size, long *fmt)
 			break;
 		case SFMT_S16:
 		case SFMT_U16:
-			change_sign_16 ((uint16_t *)buf, size / 2);
+			kernels.change_sign_16 ((uint16_t *)buf, size / 2);
 			if (*fmt & SFMT_S16)
 				*fmt = sfmt_set_fmt (*fmt, SFMT_U16);
 			else
@@ -585,7 +1213,7 @@ static void change_sign (char *buf, const size_t size, long *fmt)
 			break;
 		case SFMT_S24:
 		case SFMT_U24:
-			change_sign_24 ((uint32_t *)buf, size/4);
+			kernels.change_sign_24 ((uint32_t *)buf, size/4);
 			if (*fmt & SFMT_S24)
 				*fmt = sfmt_set_fmt (*fmt, SFMT_U24);
 			else
@@ -593,7 +1221,7 @@ static void change_sign (char *buf, const size_t size, long *fmt)
 			break;
 		case SFMT_S32:
 		case SFMT_U32:
-			change_sign_32 ((uint32_t *)buf, size/4);
+			kernels.change_sign_32 ((uint32_t *)buf, size/4);
 			if (*fmt & SFMT_S32)
 				*fmt = sfmt_set_fmt (*fmt, SFMT_U32);
 			else
@@ -608,10 +1236,7 @@ static void change_sign (char *buf, const size_t size, long *fmt)
 
 void audio_conv_bswap_16 (int16_t *buf, const size_t num)
 {
-	size_t i;
-
-	for (i = 0; i < num; i++)
-		buf[i] = bswap_16 (buf[i]);
+	kernels.swap_16 (buf, num);
 }
 
 void audio_conv_bswap_24 (int8_t *buf, const size_t num)
@@ -628,10 +1253,7 @@ void audio_conv_bswap_24 (int8_t *buf, const size_t num)
 
 void audio_conv_bswap_32 (int32_t *buf, const size_t num)
 {
-	size_t i;
-
-	for (i = 0; i < num; i++)
-		buf[i] = bswap_32 (buf[i]);
+	kernels.swap_32 (buf, num);
 }
 
 /* Swap endianness of fixed point samples. */
@@ -662,6 +1284,101 @@ static void swap_endian (char *buf, const size_t size, const long fmt)
 	}
 }
 
+/* Convert size bytes of sound in format fmt to native endian float samples
+ * and put them in out.  The sound in buf may be byte-swapped in place. */
+void audio_conv_to_float (char *buf, const size_t size, const long fmt,
+		float *out)
+{
+	size_t new_size;
+
+	if ((fmt & SFMT_MASK_FORMAT) == SFMT_FLOAT) {
+		memcpy (out, buf, size);
+		return;
+	}
+
+	if (!(fmt & SFMT_NE))
+		swap_endian (buf, size, fmt);
+
+	fixed_to_float (buf, size, fmt, out, &new_size);
+}
+
+/* Convert float samples to the format fmt and put them in out. */
+void audio_conv_from_float (const float *in, const size_t samples,
+		const long fmt, char *out)
+{
+	size_t new_size;
+
+	if ((fmt & SFMT_MASK_FORMAT) == SFMT_FLOAT) {
+		memcpy (out, in, samples * sizeof (float));
+		return;
+	}
+
+	float_to_fixed (in, samples, fmt, out, &new_size);
+
+	if (!(fmt & SFMT_NE))
+		swap_endian (out, new_size, fmt);
+}
+
+/* Return the number of bytes of scratch memory needed to convert a chunk of
+ * size bytes at any stage of the conversion. */
+static size_t scratch_size (const struct audio_conversion *conv,
+		const size_t size)
+{
+	size_t samples, out_samples;
+	int Bps;
+
+	samples = size / sfmt_Bps (conv->from.fmt);
+#ifdef HAVE_SAMPLERATE
+	samples += conv->resample_buf_nsamples;
+#endif
+
+	/* Resampling may produce more samples than were given. */
+	out_samples = (double)samples * conv->to.rate / conv->from.rate
+		+ conv->to.channels;
+	samples = MAX(samples, out_samples);
+
+	if (conv->to.channels > conv->from.channels)
+		samples = samples * conv->to.channels / conv->from.channels;
+
+	Bps = MAX(sfmt_Bps (conv->from.fmt), sfmt_Bps (conv->to.fmt));
+	Bps = MAX(Bps, (int)sizeof (float));
+
+	return samples * Bps;
+}
+
+/* Make sure the scratch buffers are big enough to convert a chunk of size
+ * bytes.  They only grow, so once the biggest chunk has been seen, no more
+ * memory is allocated. */
+static void reserve_scratch (struct audio_conversion *conv, const size_t size)
+{
+	size_t needed = scratch_size (conv, size);
+
+	if (needed > conv->buf_size) {
+		conv->buf[0] = (char *)xrealloc (conv->buf[0], needed);
+		conv->buf[1] = (char *)xrealloc (conv->buf[1], needed);
+		conv->buf_size = needed;
+	}
+
+#ifdef HAVE_SAMPLERATE
+	if (conv->src_state) {
+		size_t nsamples = size / sfmt_Bps (conv->from.fmt)
+			+ conv->resample_buf_nsamples;
+
+		if (nsamples > conv->resample_buf_size) {
+			conv->resample_buf = (float *)xrealloc (conv->resample_buf,
+					nsamples * sizeof(float));
+			conv->resample_buf_size = nsamples;
+		}
+	}
+#endif
+}
+
+/* Return the scratch buffer which is not holding the sound in curr. */
+static char *other_scratch (struct audio_conversion *conv, const char *curr)
+{
+	return curr == conv->buf[0] ? conv->buf[1] : conv->buf[0];
+}
+
 /* Initialize the audio_conversion structure for conversion between parameters
  * from and to. Return 0 on error. */
 int audio_conv_new (struct audio_conversion *conv,
@@ -727,18 +1444,26 @@ int audio_conv_new (struct audio_conversion *conv,
 #ifdef HAVE_SAMPLERATE
 	conv->resample_buf = NULL;
 	conv->resample_buf_nsamples = 0;
+	conv->resample_buf_size = 0;
 #endif
 
+	conv->buf[0] = NULL;
+	conv->buf[1] = NULL;
+	conv->buf_size = 0;
+	reserve_scratch (conv, CONV_CHUNK_SIZE);
+
 	return 1;
 }
 
 #ifdef HAVE_SAMPLERATE
-static float *resample_sound (struct audio_conversion *conv, const float *buf,
-		const size_t samples, const int nchannels, size_t *resampled_samples)
+/* Resample samples from buf and put the result in output which must be big
+ * enough (see scratch_size()).  Samples which couldn't be used are kept in
+ * conv->resample_buf for the next call.  Return 0 on error. */
+static int resample_sound (struct audio_conversion *conv, const float *buf,
+		const size_t samples, const int nchannels, float *output,
+		size_t *resampled_samples)
 {
 	SRC_DATA resample_data;
-	float *output;
-	float *new_input_start;
 	int output_samples = 0;
 
 	resample_data.end_of_input = 0;
@@ -749,27 +1474,14 @@ static float *resample_sound (struct audio_conversion *conv, const float *buf,
 	resample_data.output_frames = resample_data.input_frames
 		* resample_data.src_ratio;
 
-	if (conv->resample_buf) {
-		conv->resample_buf = (float *)xrealloc (conv->resample_buf,
-				sizeof(float) * resample_data.input_frames
-				* nchannels);
-		new_input_start = conv->resample_buf
-			+ conv->resample_buf_nsamples;
-	}
-	else {
-		conv->resample_buf = (float *)xmalloc (sizeof(float)
-				* resample_data.input_frames
-				* nchannels);
-		new_input_start = conv->resample_buf;
-	}
-
-	output = (float *)xmalloc (sizeof(float) * resample_data.output_frames
-				* nchannels);
+	assert (conv->resample_buf_nsamples + samples
+			<= conv->resample_buf_size);
 
 	/*debug ("Resampling %lu bytes of data by ratio %f", (unsigned long)size,
 			resample_data.src_ratio);*/
 
-	memcpy (new_input_start, buf, samples * sizeof(float));
+	memcpy (conv->resample_buf + conv->resample_buf_nsamples, buf,
+			samples * sizeof(float));
 	resample_data.data_in = conv->resample_buf;
 	resample_data.data_out = output;
 
@@ -778,8 +1490,7 @@ static float *resample_sound (struct audio_conversion *conv, const float *buf,
 
 		if ((err = src_process(conv->src_state, &resample_data))) {
 			error ("Can't resample: %s", src_strerror (err));
-			free (output);
-			return NULL;
+			return 0;
 		}
 
 		resample_data.data_in += resample_data.input_frames_used
@@ -794,59 +1505,39 @@ static float *resample_sound (struct audio_conversion *conv, const float *buf,
 
 	*resampled_samples = output_samples;
 
-	if (resample_data.input_frames) {
-		conv->resample_buf_nsamples = resample_data.input_frames
-			* nchannels;
-		if (conv->resample_buf != resample_data.data_in) {
-			float *new;
-
-			new = (float *)xmalloc (sizeof(float) *
-					conv->resample_buf_nsamples);
-			memcpy (new, resample_data.data_in, sizeof(float) *
-					conv->resample_buf_nsamples);
-			free (conv->resample_buf);
-			conv->resample_buf = new;
-		}
-	}
-	else {
-		free (conv->resample_buf);
-		conv->resample_buf = NULL;
-		conv->resample_buf_nsamples = 0;
-	}
+	/* Keep the unused samples at the beginning of the buffer. */
+	conv->resample_buf_nsamples = resample_data.input_frames * nchannels;
+	if (conv->resample_buf_nsamples
+			&& conv->resample_buf != resample_data.data_in)
+		memmove (conv->resample_buf, resample_data.data_in,
+				sizeof(float) * conv->resample_buf_nsamples);
 
-	return output;
+	return 1;
 }
 #endif
 
-/* Double the channels from */
-static char *mono_to_stereo (const char *mono, const size_t size,
+/* Double the channels from mono and put them in stereo. */
+static void mono_to_stereo (const char *mono, char *stereo, const size_t size,
 		const long format)
 {
 	int Bps = sfmt_Bps (format);
 	size_t i;
-	char *stereo;
-
-	stereo = (char *)xmalloc (size * 2);
 
 	for (i = 0; i < size; i += Bps) {
 		memcpy (stereo + (i * 2), mono + i, Bps);
 		memcpy (stereo + (i * 2 + Bps), mono + i, Bps);
 	}
-
-	return stereo;
 }
 
 /* DPL downmix: 5.1 -> stereo */
-static char *ch6_to_stereo (const char *ch6, const size_t size,
+static void ch6_to_stereo (const char *ch6, char *stereo, const size_t size,
 		const long format)
 {
 	debug("Downmixing from 5.1 to 2.0");
 	int Bps = sfmt_Bps (format);
 	size_t i;
 	int j,k;
-	char *stereo;
 
-	stereo = (char *)xmalloc (size / 3);
 	float a[2][6]; //downmix matrix
 a[0][0] = 1.0; a[0][2]=0.707; a[0][1]=0; a[0][4]=-0.8165; a[0][5]= -0.5774; a[0][3]=0.707;
 a[1][0] = 0; a[1][2]=0.707; a[1][1]=1.0; a[1][4]= 0.5774; a[1][5]=0.8165; a[1][3]=0.707;
@@ -905,116 +1596,89 @@ a[1][0] = 0; a[1][2]=0.707; a[1][1]=1.0; a[1][4]= 0.5774; a[1][5]=0.8165; a[1][3
 	error("Can't downsample that sample format yet.");
 	abort ();
 	}
-	return stereo;
 }
 
-static int8_t *s32_to_s24_3 (int32_t *in, const size_t samples)
+static void s32_to_s24_3 (const int32_t *in, int8_t *out, const size_t samples)
 {
 	size_t i;
-	int8_t *new;
-
-	new = (int8_t *)xmalloc (samples * 3);
 
 	for (i = 0; i < samples; i++)
 	{
-		new[3*i] = (in[i]&0x0000FF00)>>8;
-		new[3*i+1] = (in[i]&0x00FF0000)>>16;
-		new[3*i+2] = (in[i]&0xFF000000)>>24;
+		out[3*i] = (in[i]&0x0000FF00)>>8;
+		out[3*i+1] = (in[i]&0x00FF0000)>>16;
+		out[3*i+2] = (in[i]&0xFF000000)>>24;
 	}
-	return new;
 }
 
 
-static int16_t *s32_to_s16 (int32_t *in, const size_t samples)
+static void s32_to_s16 (const int32_t *in, int16_t *out, const size_t samples)
 {
 	size_t i;
-	int16_t *new;
-
-	new = (int16_t *)xmalloc (samples * 2);
 
 	for (i = 0; i < samples; i++)
-		new[i] = in[i] >> 16;
-
-	return new;
+		out[i] = in[i] >> 16;
 }
 
-static uint16_t *u32_to_u16 (uint32_t *in, const size_t samples)
+static void u32_to_u16 (const uint32_t *in, uint16_t *out,
+		const size_t samples)
 {
 	size_t i;
-	uint16_t *new;
-
-	new = (uint16_t *)xmalloc (samples * 2);
 
 	for (i = 0; i < samples; i++)
-		new[i] = in[i] >> 16;
-
-	return new;
+		out[i] = in[i] >> 16;
 }
 
-static int32_t *s32_to_s24 (int32_t *in, const size_t samples)
+static void s32_to_s24 (const int32_t *in, int32_t *out, const size_t samples)
 {
 	size_t i;
-	int32_t *new;
-
-	new = (int32_t *)xmalloc (samples * 4);
 
 	for (i = 0; i < samples; i++)
-		new[i] = in[i] >> 8;
-
-	return new;
+		out[i] = in[i] >> 8;
 }
 
-static uint32_t *u32_to_u24 (uint32_t *in, const size_t samples)
+static void u32_to_u24 (const uint32_t *in, uint32_t *out,
+		const size_t samples)
 {
 	size_t i;
-	uint32_t *new;
-
-	new = (uint32_t *)xmalloc (samples * 4);
 
 	for (i = 0; i < samples; i++)
-		new[i] = in[i] >> 8;
-
-	return new;
+		out[i] = in[i] >> 8;
 }
 
-static int16_t *s24_to_s16 (int32_t *in, const size_t samples)
+static void s24_to_s16 (const int32_t *in, int16_t *out, const size_t samples)
 {
 	size_t i;
-	int16_t *new;
-
-	new = (int16_t *)xmalloc (samples * 2);
 
 	for (i = 0; i < samples; i++)
-		new[i] = in[i] >> 8;
-
-	return new;
+		out[i] = in[i] >> 8;
 }
 
-static uint16_t *u24_to_u16 (uint32_t *in, const size_t samples)
+static void u24_to_u16 (const uint32_t *in, uint16_t *out,
+		const size_t samples)
 {
 	size_t i;
-	uint16_t *new;
-
-	new = (uint16_t *)xmalloc (samples * 2);
 
 	for (i = 0; i < samples; i++)
-		new[i] = in[i] >> 8;
-
-	return new;
+		out[i] = in[i] >> 8;
 }
 
 /* Do the sound conversion.  buf of length size is the sample buffer to
  * convert and the size of the converted sound is put into *conv_len.
- * Return the converted sound in malloc()ed memory. */
+ * Return the converted sound, which is stored in conv's scratch memory and
+ * is valid until the next call or audio_conv_destroy().  Return NULL on
+ * error. */
 char *audio_conv (struct audio_conversion *conv, const char *buf,
 		const size_t size, size_t *conv_len)
 {
 	char *curr_sound;
+	char *new_sound;
 	long curr_sfmt = conv->from.fmt;
 
+	reserve_scratch (conv, size);
+
 	*conv_len = size;
 
-	curr_sound = (char *)xmalloc (size);
+	curr_sound = conv->buf[0];
 	memcpy (curr_sound, buf, size);
 
 	if (!(curr_sfmt & SFMT_NE)) {
@@ -1026,21 +1690,15 @@ char *audio_conv (struct audio_conversion *conv, const char *buf,
 	if ((curr_sfmt & (SFMT_S32 | SFMT_U32)) &&
 	    (conv->to.fmt & (SFMT_S24_3 | SFMT_U24_3)) &&
 	    conv->from.rate == conv->to.rate) {
-		char *new_sound;
+		new_sound = other_scratch (conv, curr_sound);
+		s32_to_s24_3 ((int32_t *)curr_sound, (int8_t *)new_sound,
+				*conv_len / 4);
 
-		if ((curr_sfmt & SFMT_MASK_FORMAT) == SFMT_S32) {
-			new_sound = (char *)s32_to_s24_3 ((int32_t *)curr_sound,
-					*conv_len / 4);
+		if ((curr_sfmt & SFMT_MASK_FORMAT) == SFMT_S32)
 			curr_sfmt = sfmt_set_fmt (curr_sfmt, SFMT_S24_3);
-		}
-		else {
-			new_sound = (char *)s32_to_s24_3 ((int32_t *)curr_sound,
-					*conv_len / 4);
+		else
 			curr_sfmt = sfmt_set_fmt (curr_sfmt, SFMT_U24_3);
-		}
 
-		if (curr_sound != buf)
-			free (curr_sound);
 		curr_sound = new_sound;
 		*conv_len = *conv_len *3/ 4;
 
@@ -1052,21 +1710,19 @@ char *audio_conv (struct audio_conversion *conv, const char *buf,
 	if ((curr_sfmt & (SFMT_S32 | SFMT_U32)) &&
 	    (conv->to.fmt & (SFMT_S16 | SFMT_U16)) &&
 	    conv->from.rate == conv->to.rate) {
-		char *new_sound;
+		new_sound = other_scratch (conv, curr_sound);
 
 		if ((curr_sfmt & SFMT_MASK_FORMAT) == SFMT_S32) {
-			new_sound = (char *)s32_to_s16 ((int32_t *)curr_sound,
+			s32_to_s16 ((int32_t *)curr_sound, (int16_t *)new_sound,
 					*conv_len / 4);
 			curr_sfmt = sfmt_set_fmt (curr_sfmt, SFMT_S16);
 		}
 		else {
-			new_sound = (char *)u32_to_u16 ((uint32_t *)curr_sound,
+			u32_to_u16 ((uint32_t *)curr_sound, (uint16_t *)new_sound,
 					*conv_len / 4);
 			curr_sfmt = sfmt_set_fmt (curr_sfmt, SFMT_U16);
 		}
 
-		if (curr_sound != buf)
-			free (curr_sound);
 		curr_sound = new_sound;
 		*conv_len /= 2;
 
@@ -1077,21 +1733,19 @@ char *audio_conv (struct audio_conversion *conv, const char *buf,
  	if ((curr_sfmt & (SFMT_S32 | SFMT_U32)) &&
  	    (conv->to.fmt & (SFMT_S24 | SFMT_U24)) &&
  	    conv->from.rate == conv->to.rate) {
-		char *new_sound;
+		new_sound = other_scratch (conv, curr_sound);
 
 		if ((curr_sfmt & SFMT_MASK_FORMAT) == SFMT_S32) {
-			new_sound = (char *)s32_to_s24 ((int32_t *)curr_sound,
+			s32_to_s24 ((int32_t *)curr_sound, (int32_t *)new_sound,
 					*conv_len/4);
 			curr_sfmt = sfmt_set_fmt (curr_sfmt, SFMT_S24);
 		}
 		else {
-			new_sound = (char *)u32_to_u24 ((uint32_t *)curr_sound,
+			u32_to_u24 ((uint32_t *)curr_sound, (uint32_t *)new_sound,
 					*conv_len/4);
 			curr_sfmt = sfmt_set_fmt (curr_sfmt, SFMT_U24);
 		}
 
-		if (curr_sound != buf)
-			free (curr_sound);
 		curr_sound = new_sound;
 		//*conv_len /= 2;
 
@@ -1102,21 +1756,19 @@ char *audio_conv (struct audio_conversion *conv, const char *buf,
 	if ((curr_sfmt & (SFMT_S24 | SFMT_U24)) &&
 	    (conv->to.fmt & (SFMT_S16 | SFMT_U16)) &&
 	    conv->from.rate == conv->to.rate) {
-		char *new_sound;
+		new_sound = other_scratch (conv, curr_sound);
 
 		if ((curr_sfmt & SFMT_MASK_FORMAT) == SFMT_S24) {
-			new_sound = (char *)s24_to_s16 ((int32_t *)curr_sound,
+			s24_to_s16 ((int32_t *)curr_sound, (int16_t *)new_sound,
 					*conv_len / 4);
 			curr_sfmt = sfmt_set_fmt (curr_sfmt, SFMT_S16);
 		}
 		else {
-			new_sound = (char *)u24_to_u16 ((uint32_t *)curr_sound,
+			u24_to_u16 ((uint32_t *)curr_sound, (uint16_t *)new_sound,
 					*conv_len / 4);
 			curr_sfmt = sfmt_set_fmt (curr_sfmt, SFMT_U16);
 		}
 
-		if (curr_sound != buf)
-			free (curr_sound);
 		curr_sound = new_sound;
 		*conv_len /= 2;
 
@@ -1129,26 +1781,25 @@ char *audio_conv (struct audio_conversion *conv, const char *buf,
 				|| (conv->to.fmt & SFMT_MASK_FORMAT) == SFMT_FLOAT
 				|| !sfmt_same_bps(conv->to.fmt, curr_sfmt))
 			&& (curr_sfmt & SFMT_MASK_FORMAT) != SFMT_FLOAT) {
-		char *new_sound;
+		new_sound = other_scratch (conv, curr_sound);
 
-		new_sound = (char *)fixed_to_float (curr_sound, *conv_len,
-				curr_sfmt, conv_len);
+		fixed_to_float (curr_sound, *conv_len, curr_sfmt,
+				(float *)new_sound, conv_len);
 		curr_sfmt = sfmt_set_fmt (curr_sfmt, SFMT_FLOAT);
 
-		if (curr_sound != buf)
-			free (curr_sound);
 		curr_sound = new_sound;
 	}
 
 #ifdef HAVE_SAMPLERATE
 	if (conv->from.rate != conv->to.rate) {
-		char *new_sound = (char *)resample_sound (conv,
-				(float *)curr_sound,
+		new_sound = other_scratch (conv, curr_sound);
+
+		if (!resample_sound (conv, (float *)curr_sound,
 				*conv_len / sizeof(float), conv->to.channels,
-				conv_len);
+				(float *)new_sound, conv_len))
+			return NULL;
 		*conv_len *= sizeof(float);
-		if (curr_sound != buf)
-			free (curr_sound);
+
 		curr_sound = new_sound;
 	}
 #endif
@@ -1157,43 +1808,36 @@ char *audio_conv (struct audio_conversion *conv, const char *buf,
 			!= (conv->to.fmt & SFMT_MASK_FORMAT)) {
 
 		if (sfmt_same_bps(curr_sfmt, conv->to.fmt))
-			change_sign (curr_sound, size, &curr_sfmt);
+			audio_conv_change_sign (curr_sound, *conv_len, &curr_sfmt);
 		else {
-			char *new_sound;
-
 			assert (curr_sfmt & SFMT_FLOAT);
 
-			new_sound = float_to_fixed ((float *)curr_sound,
+			new_sound = other_scratch (conv, curr_sound);
+			float_to_fixed ((float *)curr_sound,
 					*conv_len / sizeof(float),
-					conv->to.fmt, conv_len);
+					conv->to.fmt, new_sound, conv_len);
 			curr_sfmt = sfmt_set_fmt (curr_sfmt, conv->to.fmt);
 
-			if (curr_sound != buf)
-				free (curr_sound);
 			curr_sound = new_sound;
 		}
 	}
 
 	if (conv->from.channels == 1 && conv->to.channels == 2) {
-		char *new_sound;
+		new_sound = other_scratch (conv, curr_sound);
 
-		new_sound = mono_to_stereo (curr_sound, *conv_len, curr_sfmt);
+		mono_to_stereo (curr_sound, new_sound, *conv_len, curr_sfmt);
 		*conv_len *= 2;
 
-		if (curr_sound != buf)
-			free (curr_sound);
 		curr_sound = new_sound;
 	}
 
 	if (conv->from.channels == 6 && conv->to.channels == 2) {
-		char *new_sound;
+		new_sound = other_scratch (conv, curr_sound);
 
-		new_sound = ch6_to_stereo (curr_sound, *conv_len,
+		ch6_to_stereo (curr_sound, new_sound, *conv_len,
 				conv->from.fmt);
 		*conv_len /= 3;
 
-		if (curr_sound != buf)
-			free (curr_sound);
 		curr_sound = new_sound;
 	}
 
@@ -1207,10 +1851,16 @@ char *audio_conv (struct audio_conversion *conv, const char *buf,
 	return curr_sound;
 }
 
-void audio_conv_destroy (struct audio_conversion *conv ASSERT_ONLY)
+void audio_conv_destroy (struct audio_conversion *conv)
 {
 	assert (conv != NULL);
 
+	free (conv->buf[0]);
+	free (conv->buf[1]);
+	conv->buf[0] = NULL;
+	conv->buf[1] = NULL;
+	conv->buf_size = 0;
+
 #ifdef HAVE_SAMPLERATE
 	if (conv->resample_buf)
 		free (conv->resample_buf);
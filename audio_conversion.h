@@ -26,10 +26,16 @@ struct audio_conversion
 	SRC_STATE *src_state;
 	float *resample_buf;
 	size_t resample_buf_nsamples; /* in samples ( sizeof(float) ) */
+	size_t resample_buf_size; /* allocated, in samples */
 #endif
 
+	/* Scratch buffers used alternately by the conversion stages. */
+	char *buf[2];
+	size_t buf_size; /* in bytes, each */
+
 };
 
+void audio_conv_init ();
 int audio_conv_new (struct audio_conversion *conv,
 		const struct sound_params *from,
 		const struct sound_params *to);
@@ -37,6 +43,11 @@ char *audio_conv (struct audio_conversion *conv,
 		const char *buf, const size_t size, size_t *conv_len);
 void audio_conv_destroy (struct audio_conversion *conv);
 
+void audio_conv_change_sign (char *buf, const size_t size, long *fmt);
+void audio_conv_to_float (char *buf, const size_t size, const long fmt,
+		float *out);
+void audio_conv_from_float (const float *in, const size_t samples,
+		const long fmt, char *out);
 void audio_conv_bswap_16 (int16_t *buf, const size_t num);
 void audio_conv_bswap_32 (int32_t *buf, const size_t num);
 
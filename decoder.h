@@ -13,7 +13,7 @@ extern "C" {
  *
  * On every change in the decoder API this number will be changed, so
  * MOC will not load plugins compiled with older/newer decoder.h. */
-#define DECODER_API_VERSION	7
+#define DECODER_API_VERSION	8
 
 /** Type of the decoder error. */
 enum decoder_error_type
@@ -254,6 +254,23 @@ struct decoder
 	 * \return Average bitrate in kbps or -1 if not available.
 	 */
 	int (*get_avg_bitrate)(void *data);
+
+	/** Get the encoder delay and padding.
+	 *
+	 * Get the number of frames of silence added by the encoder (and the
+	 * decoder's own delay) at the beginning and the end of the sound,
+	 * which should be dropped for gapless playback.  Decoders whose
+	 * library already trims them should not provide this function.
+	 * This function is optional.
+	 *
+	 * \param data Decoder's private data.
+	 * \param delay Number of frames to drop at the beginning.
+	 * \param padding Number of frames to drop at the end.
+	 *
+	 * \return 1 if the values are known, 0 otherwise.
+	 */
+	int (*get_gapless_info)(void *data, unsigned int *delay,
+			unsigned int *padding);
 };
 
 /** Initialize decoder plugin.
@@ -17,6 +17,7 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <string.h>
 #include <strings.h>
 #include <assert.h>
@@ -31,6 +32,7 @@
 #include "io.h"
 #include "log.h"
 #include "files.h"
+#include "seek_index.h"
 
 /* FAAD_MIN_STREAMSIZE == 768, 6 == # of channels */
 #define BUFFER_SIZE	(FAAD_MIN_STREAMSIZE * 6 * 4)
@@ -56,6 +58,10 @@ struct aac_data
 	int bitrate;
 	int avg_bitrate;
 	int duration;
+
+	struct seek_index *index;
+	int indexing; /* is the position exact, so we can fill the index? */
+	uint64_t samples; /* per channel, from the beginning of the file */
 };
 
 static int buffer_length (const struct aac_data *data)
@@ -255,10 +261,26 @@ static int aac_count_time (struct aac_data *data)
 	return ((file_size / bytes) * samples) / data->sample_rate;
 }
 
+static NeAACDecHandle open_decoder ()
+{
+	NeAACDecHandle decoder;
+	NeAACDecConfigurationPtr neaac_cfg;
+
+	decoder = NeAACDecOpen();
+
+	/* set decoder config */
+	neaac_cfg = NeAACDecGetCurrentConfiguration(decoder);
+	neaac_cfg->outputFormat = FAAD_FMT_16BIT;	/* force 16 bit audio */
+	neaac_cfg->downMatrix = 1;			/* 5.1 -> stereo */
+	neaac_cfg->dontUpSampleImplicitSBR = 0;		/* upsample, please! */
+	NeAACDecSetConfiguration(decoder, neaac_cfg);
+
+	return decoder;
+}
+
 static void *aac_open_internal (struct io_stream *stream, const char *fname)
 {
 	struct aac_data *data;
-	NeAACDecConfigurationPtr neaac_cfg;
 	unsigned char channels;
 	unsigned long sample_rate;
 	int n;
@@ -267,14 +289,7 @@ static void *aac_open_internal (struct io_stream *stream, const char *fname)
 	data = (struct aac_data *)xmalloc (sizeof(struct aac_data));
 	memset (data, 0, sizeof(struct aac_data));
 	data->ok = 0;
-	data->decoder = NeAACDecOpen();
-
-	/* set decoder config */
-	neaac_cfg = NeAACDecGetCurrentConfiguration(data->decoder);
-	neaac_cfg->outputFormat = FAAD_FMT_16BIT;	/* force 16 bit audio */
-	neaac_cfg->downMatrix = 1;			/* 5.1 -> stereo */
-	neaac_cfg->dontUpSampleImplicitSBR = 0;		/* upsample, please! */
-	NeAACDecSetConfiguration(data->decoder, neaac_cfg);
+	data->decoder = open_decoder ();
 
 	if (stream)
 		data->stream = stream;
@@ -339,6 +354,7 @@ static void aac_close (void *prv_data)
 
 	NeAACDecClose (data->decoder);
 	io_close (data->stream);
+	seek_index_close (data->index);
 	decoder_error_clear (&data->error);
 	free (data);
 }
@@ -347,24 +363,34 @@ static void aac_close (void *prv_data)
 static void *aac_open (const char *file)
 {
 	struct aac_data *data;
+	struct seek_index *index;
 
+	index = seek_index_open (file);
 	data = aac_open_internal (NULL, file);
 
 	if (data->ok) {
-		int duration = -1;
+		int duration;
 		int avg_bitrate = -1;
 		off_t file_size;
 
-		duration = aac_count_time (data);
+		/* The exact time is known if the file was indexed to
+		 * the end. */
+		duration = seek_index_duration (index);
 		file_size = io_file_size (data->stream);
+		if (duration == -1) {
+			duration = aac_count_time (data);
+			aac_close (data);
+			data = aac_open_internal (NULL, file);
+		}
 		if (duration > 0 && file_size != -1)
 			avg_bitrate = file_size / duration * 8;
-		aac_close (data);
-		data = aac_open_internal (NULL, file);
 		data->duration = duration;
 		data->avg_bitrate = avg_bitrate;
 	}
 
+	data->index = index;
+	data->indexing = 1;
+
 	return data;
 }
 
@@ -426,6 +452,13 @@ static void aac_info (const char *file_name,
 
 	if (tags_sel & TAGS_TIME) {
 		struct aac_data *data;
+		struct seek_index *index;
+
+		index = seek_index_open (file_name);
+		info->time = seek_index_duration (index);
+		seek_index_close (index);
+		if (info->time != -1)
+			return;
 
 		data = aac_open_internal (NULL, file_name);
 
@@ -438,17 +471,53 @@ static void aac_info (const char *file_name,
 	}
 }
 
-static int aac_seek (void *unused ATTR_UNUSED, int sec ASSERT_ONLY)
+static int aac_seek (void *prv_data, int sec)
 {
+	struct aac_data *data = (struct aac_data *)prv_data;
+	unsigned char channels;
+	unsigned long sample_rate;
+	off_t pos;
+
 	assert (sec >= 0);
 
-	/* AAC will probably never be able to seek.  There is no way of
-	 * relating the time in the audio to the position in the file
-	 * short of pre-processing the file at open and building a seek
-	 * table.  Even then, seeking in the file causes audio glitches
-	 * (see aac_count_time()). */
+	/* There is no way of relating the time in the audio to the position
+	 * in the file other than the seek index filled while decoding, so
+	 * we can only seek to the part of the file which was played. */
+	pos = seek_index_find (data->index, sec);
+	if (pos == -1)
+		return -1;
+
+	if (io_seek (data->stream, pos, SEEK_SET) == -1) {
+		logit ("seek to %"PRId64" failed", pos);
+		return -1;
+	}
+
+	buffer_flush (data);
+	data->overflow_buf_len = 0;
+	data->samples = (uint64_t)sec * data->sample_rate;
+	data->indexing = 1;
+
+	/* Seeking corrupts the retained state of the decoder (see
+	 * aac_count_time()), so start with a fresh one. */
+	NeAACDecClose (data->decoder);
+	data->decoder = open_decoder ();
+	if (buffer_fill_frame (data) <= 0) {
+		decoder_error (&data->error, ERROR_FATAL, 0,
+				"No AAC frame after seeking");
+		return -1;
+	}
+	channels = (unsigned char)data->channels;
+	sample_rate = data->sample_rate;
+	if (NeAACDecInit (data->decoder, buffer_data (data),
+				buffer_length (data), &sample_rate, &channels) < 0) {
+		decoder_error (&data->error, ERROR_FATAL, 0,
+				"libfaad can't open this stream");
+		return -1;
+	}
+
+	debug ("Seeking to %d (byte %"PRId64" from the index)", sec, pos);
 
-	return -1;
+	return sec;
 }
 
 /* returns -1 on fatal errors
@@ -467,6 +536,10 @@ static int decode_one_frame (struct aac_data *data, void *buffer, int count)
 	if (rc <= 0)
 		return rc;
 
+	if (data->indexing)
+		seek_index_add (data->index, data->samples / data->sample_rate,
+				io_tell (data->stream) - buffer_length (data));
+
 	aac_data = buffer_data (data);
 	aac_data_size = buffer_length (data);
 
@@ -498,6 +571,8 @@ static int decode_one_frame (struct aac_data *data, void *buffer, int count)
 		return -2;
 	}
 
+	data->samples += frame_info.samples / frame_info.channels;
+
 	/* 16-bit samples */
 	bytes = frame_info.samples * 2;
 
@@ -545,6 +620,10 @@ static int aac_decode (void *prv_data, char *buf, int buf_len,
 		rc = decode_one_frame (data, buf, buf_len);
 	} while (rc == -2);
 
+	if (rc == 0 && data->indexing && io_eof (data->stream))
+		seek_index_finish (data->index,
+				data->samples / data->sample_rate);
+
 	return MAX(rc, 0);
 }
 
@@ -613,7 +692,8 @@ static struct decoder aac_decoder = {
 	aac_get_name,
 	NULL,
 	NULL,
-	aac_get_avg_bitrate
+	aac_get_avg_bitrate,
+	NULL
 };
 
 struct decoder *plugin_init ()
@@ -1310,7 +1310,8 @@ static struct decoder ffmpeg_decoder = {
 	NULL,
 	NULL,
 	ffmpeg_get_iostream,
-	ffmpeg_get_avg_bitrate
+	ffmpeg_get_avg_bitrate,
+	NULL
 };
 
 struct decoder *plugin_init ()
@@ -576,7 +576,8 @@ static struct decoder flac_decoder = {
 	flac_get_name,
 	NULL,
 	NULL,
-	flac_get_avg_bitrate
+	flac_get_avg_bitrate,
+	NULL
 };
 
 struct decoder *plugin_init ()
@@ -305,6 +305,7 @@ static struct decoder modplug_decoder =
   NULL,
   NULL,
   NULL,
+  NULL,
   NULL
 };
 
@@ -13,10 +13,6 @@
  * from xmms-mad (C) by Sam Clegg and winamp plugin for madlib (C) by
  * Robert Leslie. */
 
-/* FIXME: there can be a bit of silence in mp3 at the end or at the
- * beginning. If you hear gaps between files, it's the file's fault.
- * Can we strip this silence? */
-
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif
@@ -30,6 +26,7 @@
 #include <mad.h>
 #include <id3tag.h>
 #include <assert.h>
+#include <pthread.h>
 #ifdef HAVE_ICONV
 # include <iconv.h>
 #endif
@@ -46,11 +43,18 @@
 #include "files.h"
 #include "utf8.h"
 #include "rcc.h"
+#include "seek_index.h"
 
 #define INPUT_BUFFER	(32 * 1024)
 
+/* Delay of the decoder in samples, added to the LAME encoder delay. */
+#define DECODER_DELAY	529
+
 static iconv_t iconv_id3_fix;
 
+/* Tags can be read by several threads at once. */
+static pthread_mutex_t iconv_id3_fix_mtx = PTHREAD_MUTEX_INITIALIZER;
+
 struct mp3_data
 {
 	struct io_stream *io_stream;
@@ -64,6 +68,7 @@ struct mp3_data
 	off_t size;				/* Size of the file */
 
 	unsigned char in_buff[INPUT_BUFFER + MAD_BUFFER_GUARD];
+	off_t buff_start;	/* position of in_buff in the file */
 
 	struct mad_stream stream;
 	struct mad_frame frame;
@@ -71,6 +76,14 @@ struct mp3_data
 
 	int skip_frames; /* how many frames to skip (after seeking) */
 
+	struct seek_index *index;
+	int indexing; /* is the position exact, so we can fill the index? */
+	mad_timer_t position; /* time of the next frame */
+
+	int has_gapless_info; /* was the LAME tag found? */
+	unsigned int delay; /* samples to drop at the beginning */
+	unsigned int padding; /* samples to drop at the end */
+
 	int ok; /* was this stream successfully opened? */
 	struct decoder_error error;
 };
@@ -94,6 +107,7 @@ static size_t fill_buff (struct mp3_data *data)
 		remaining = 0;
 	}
 
+	data->buff_start = io_tell (data->io_stream) - remaining;
 	read_size = io_read (data->io_stream, read_start, read_size);
 	if (read_size < 0) {
 		decoder_error (&data->error, ERROR_FATAL, 0,
@@ -114,11 +128,24 @@ static size_t fill_buff (struct mp3_data *data)
 	return read_size;
 }
 
+/* Position in the file of the frame being decoded. */
+static off_t frame_position (const struct mp3_data *data)
+{
+	return data->buff_start + (data->stream.this_frame - data->in_buff);
+}
+
 static char *id3v1_fix (const char *str)
 {
-	if (iconv_id3_fix != (iconv_t)-1)
-		return iconv_str (iconv_id3_fix, str);
-	return xstrdup (str);
+	char *fixed;
+
+	if (iconv_id3_fix == (iconv_t)-1)
+		return xstrdup (str);
+
+	LOCK (iconv_id3_fix_mtx);
+	fixed = iconv_str (iconv_id3_fix, str);
+	UNLOCK (iconv_id3_fix_mtx);
+
+	return fixed;
 }
 
 int __unique_frame (struct id3_tag *tag, struct id3_frame *frame)
@@ -194,6 +221,8 @@ static int count_time_internal (struct mp3_data *data)
 	mad_timer_t duration = mad_timer_zero;
 	struct mad_header header;
 	int good_header = 0; /* Have we decoded any header? */
+	int from_index = 0; /* Is the time known from the seek index? */
+	int at_eof = 0;
 
 	mad_header_init (&header);
 	xing_init (&xing);
@@ -208,6 +237,7 @@ static int count_time_internal (struct mp3_data *data)
 	  3) All: Count up the frames and duration of each frame
 		 by decoding each one. We do this if we've no other
 		 choice, i.e. if it's a VBR file with no Xing tag.
+		 This also fills the seek index.
 	*/
 
 	while (1) {
@@ -215,8 +245,10 @@ static int count_time_internal (struct mp3_data *data)
 		/* Fill the input buffer if needed */
 		if (data->stream.buffer == NULL ||
 			data->stream.error == MAD_ERROR_BUFLEN) {
-			if (!fill_buff(data))
+			if (!fill_buff(data)) {
+				at_eof = io_eof (data->io_stream);
 				break;
+			}
 		}
 
 		if (mad_header_decode(&header, &data->stream) == -1) {
@@ -232,6 +264,9 @@ static int count_time_internal (struct mp3_data *data)
 		}
 
 		good_header = 1;
+		seek_index_add (data->index,
+				mad_timer_count (duration, MAD_UNITS_SECONDS),
+				frame_position (data));
 
 		/* Limit xing testing to the first frame header */
 		if (!num_frames++) {
@@ -242,6 +277,14 @@ static int count_time_internal (struct mp3_data *data)
 
 				debug ("Has XING header");
 
+				if (xing.lame) {
+					data->has_gapless_info = 1;
+					data->delay = 32 * MAD_NSBSAMPLES(&header)
+						+ xing.delay + DECODER_DELAY;
+					data->padding = xing.padding > DECODER_DELAY
+						? xing.padding - DECODER_DELAY : 0;
+				}
+
 				if (xing.flags & XING_FRAMES) {
 					has_xing = 1;
 					num_frames = xing.frames;
@@ -249,6 +292,12 @@ static int count_time_internal (struct mp3_data *data)
 				}
 				debug ("XING header doesn't contain number of frames.");
 			}
+
+			/* The whole file was indexed before. */
+			if (seek_index_duration (data->index) != -1) {
+				from_index = 1;
+				break;
+			}
 		}
 
 		/* Test the first n frames to see if this is a VBR file */
@@ -280,7 +329,12 @@ static int count_time_internal (struct mp3_data *data)
 		return -1;
 	}
 
-	if (!is_vbr) {
+	if (from_index) {
+		debug ("Got the duration from the seek index.");
+		mad_timer_set (&duration, seek_index_duration (data->index),
+				0, 1);
+	}
+	else if (!is_vbr) {
 		/* time in seconds */
 		double time = (data->size * 8.0) / (header.bitrate);
 
@@ -307,6 +361,9 @@ static int count_time_internal (struct mp3_data *data)
 		/* the durations have been added up, and the number of frames
 		   counted. We do nothing here. */
 		debug ("Counted duration by counting frames durations in VBR file.");
+		if (at_eof)
+			seek_index_finish (data->index,
+					mad_timer_count (duration, MAD_UNITS_SECONDS));
 	}
 
 	if (data->avg_bitrate == -1
@@ -337,6 +394,10 @@ static struct mp3_data *mp3_open_internal (const char *file,
 	data->skip_frames = 0;
 	data->bitrate = -1;
 	data->avg_bitrate = -1;
+	data->has_gapless_info = 0;
+	data->indexing = 1;
+	data->position = mad_timer_zero;
+	data->index = NULL;
 
 	/* Open the file */
 	data->io_stream = io_open (file, buffered);
@@ -344,6 +405,7 @@ static struct mp3_data *mp3_open_internal (const char *file,
 		data->ok = 1;
 
 		data->size = io_file_size (data->io_stream);
+		data->index = seek_index_open (file);
 
 		mad_stream_init (&data->stream);
 		mad_frame_init (&data->frame);
@@ -395,6 +457,9 @@ static void *mp3_open_stream (struct io_stream *stream)
 	data->channels = 0;
 	data->skip_frames = 0;
 	data->bitrate = -1;
+	data->has_gapless_info = 0;
+	data->index = NULL;
+	data->indexing = 0;
 	data->io_stream = stream;
 	data->duration = -1;
 	data->size = -1;
@@ -420,6 +485,7 @@ static void mp3_close (void *void_data)
 		mad_synth_finish (&data->synth);
 	}
 	io_close (data->io_stream);
+	seek_index_close (data->index);
 	decoder_error_clear (&data->error);
 	free (data);
 }
@@ -560,8 +626,13 @@ static int mp3_decode (void *void_data, char *buf, int buf_len,
 		/* Fill the input buffer if needed */
 		if (data->stream.buffer == NULL ||
 			data->stream.error == MAD_ERROR_BUFLEN) {
-			if (!fill_buff(data))
+			if (!fill_buff(data)) {
+				if (data->indexing && io_eof (data->io_stream))
+					seek_index_finish (data->index,
+							mad_timer_count (data->position,
+								MAD_UNITS_SECONDS));
 				return 0;
+			}
 		}
 
 		if (mad_frame_decode (&data->frame, &data->stream)) {
@@ -589,6 +660,13 @@ static int mp3_decode (void *void_data, char *buf, int buf_len,
 			}
 		}
 
+		if (data->indexing)
+			seek_index_add (data->index,
+					mad_timer_count (data->position,
+						MAD_UNITS_SECONDS),
+					frame_position (data));
+		mad_timer_add (&data->position, data->frame.header.duration);
+
 		if (data->skip_frames) {
 			data->skip_frames--;
 			continue;
@@ -636,21 +714,33 @@ static int mp3_seek (void *void_data, int sec)
 	if (sec >= data->duration)
 		return -1;
 
-	new_position = ((double) sec /
-			(double) data->duration) * data->size;
+	/* The seek index gives the exact position, so we can continue
+	 * filling it from there. */
+	new_position = seek_index_find (data->index, sec);
+	if (new_position != -1) {
+		debug ("Seeking to %d (byte %"PRId64" from the index)", sec,
+				new_position);
+	}
+	else {
+		new_position = ((double) sec /
+				(double) data->duration) * data->size;
 
-	debug ("Seeking to %d (byte %"PRId64")", sec, new_position);
+		debug ("Seeking to %d (byte %"PRId64")", sec, new_position);
 
-	if (new_position < 0)
-		new_position = 0;
-	else if (new_position >= data->size)
-		return -1;
+		if (new_position < 0)
+			new_position = 0;
+		else if (new_position >= data->size)
+			return -1;
+	}
 
 	if (io_seek(data->io_stream, new_position, SEEK_SET) == -1) {
 		logit ("seek to %"PRId64" failed", new_position);
 		return -1;
 	}
 
+	data->indexing = seek_index_find (data->index, sec) != -1;
+	mad_timer_set (&data->position, sec, 0, 1);
+
 	data->stream.error = MAD_ERROR_BUFLEN;
 
 	mad_frame_mute (&data->frame);
@@ -685,6 +775,20 @@ static int mp3_get_duration (void *void_data)
 	return data->duration;
 }
 
+static int mp3_get_gapless_info (void *void_data, unsigned int *delay,
+		unsigned int *padding)
+{
+	struct mp3_data *data = (struct mp3_data *)void_data;
+
+	if (!data->has_gapless_info)
+		return 0;
+
+	*delay = data->delay;
+	*padding = data->padding;
+
+	return 1;
+}
+
 static void mp3_get_name (const char *file, char buf[4])
 {
 	char *ext;
@@ -793,7 +897,8 @@ static struct decoder mp3_decoder = {
 	mp3_get_name,
 	NULL,
 	mp3_get_stream,
-	mp3_get_avg_bitrate
+	mp3_get_avg_bitrate,
+	mp3_get_gapless_info
 };
 
 struct decoder *plugin_init ()
@@ -28,6 +28,10 @@
 #include "xing.h"
 
 #define XING_MAGIC	(('X' << 24) | ('i' << 16) | ('n' << 8) | 'g')
+#define INFO_MAGIC	(('I' << 24) | ('n' << 16) | ('f' << 8) | 'o')
+#define LAME_MAGIC	(('L' << 24) | ('A' << 16) | ('M' << 8) | 'E')
+#define LAVC_MAGIC	(('L' << 24) | ('a' << 16) | ('v' << 8) | 'c')
+#define LAVF_MAGIC	(('L' << 24) | ('a' << 16) | ('v' << 8) | 'f')
 
 /*
  * NAME:	xing->init()
@@ -36,6 +40,7 @@
 void xing_init(struct xing *xing)
 {
   xing->flags = 0;
+  xing->lame = 0;
 }
 
 /*
@@ -44,7 +49,13 @@ void xing_init(struct xing *xing)
  */
 int xing_parse(struct xing *xing, struct mad_bitptr ptr, unsigned int bitlen)
 {
-  if (bitlen < 64 || mad_bit_read(&ptr, 32) != XING_MAGIC)
+  unsigned long magic;
+
+  if (bitlen < 64)
+    goto fail;
+
+  magic = mad_bit_read(&ptr, 32);
+  if (magic != XING_MAGIC && magic != INFO_MAGIC)
     goto fail;
 
   xing->flags = mad_bit_read(&ptr, 32);
@@ -86,9 +97,23 @@ int xing_parse(struct xing *xing, struct mad_bitptr ptr, unsigned int bitlen)
     bitlen -= 32;
   }
 
+  /* LAME extension: 9 bytes of the encoder version followed by 12 bytes
+   * we don't need and the 12-bit encoder delay and padding. */
+  xing->lame = 0;
+  if (bitlen >= 192) {
+    magic = mad_bit_read(&ptr, 32);
+    if (magic == LAME_MAGIC || magic == LAVC_MAGIC || magic == LAVF_MAGIC) {
+      mad_bit_skip(&ptr, 136);
+      xing->delay = mad_bit_read(&ptr, 12);
+      xing->padding = mad_bit_read(&ptr, 12);
+      xing->lame = 1;
+    }
+  }
+
   return 0;
 
 fail:
   xing->flags = 0;
+  xing->lame = 0;
   return -1;
 }
@@ -30,6 +30,9 @@ struct xing
   unsigned long bytes;		/* total number of bytes */
   unsigned char toc[100];	/* 100-point seek table */
   long scale;			/* ?? */
+  int lame;			/* is there the LAME extension? */
+  unsigned int delay;		/* encoder delay in samples */
+  unsigned int padding;		/* encoder padding in samples */
 };
 
 enum
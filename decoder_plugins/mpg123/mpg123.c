@@ -490,7 +490,8 @@ static struct decoder mpg123_decoderX = {
 	mpg123_get_name,
 	mpg123_current_tags,
 	mpg123_get_stream,
-	mpg123_get_avg_bitrate
+	mpg123_get_avg_bitrate,
+	NULL
 };
 
 struct decoder *plugin_init ()
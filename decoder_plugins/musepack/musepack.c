@@ -488,7 +488,8 @@ static struct decoder musepack_decoder = {
 	musepack_get_name,
 	NULL /* musepack_current_tags */,
 	musepack_get_stream,
-	musepack_get_avg_bitrate
+	musepack_get_avg_bitrate,
+	NULL
 };
 
 struct decoder *plugin_init ()
@@ -425,7 +425,8 @@ static struct decoder opus_decoder = {
 	opus_get_name,
 	opus_current_tags,
 	opus_get_stream,
-	opus_get_avg_bitrate
+	opus_get_avg_bitrate,
+	NULL
 };
 
 struct decoder *plugin_init ()
@@ -556,6 +556,7 @@ static struct decoder sidplay2_decoder =
   NULL,
   NULL,
   NULL,
+  NULL,
   NULL
 };
 
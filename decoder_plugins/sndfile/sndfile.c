@@ -371,6 +371,7 @@ static struct decoder sndfile_decoder = {
 	sndfile_get_name,
 	NULL,
 	NULL,
+	NULL,
 	NULL
 };
 
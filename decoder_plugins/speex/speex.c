@@ -702,6 +702,7 @@ static struct decoder spx_decoder = {
 	spx_get_name,
 	NULL /*spx_current_tags*/,
 	spx_get_stream,
+	NULL,
 	NULL
 };
 
@@ -204,6 +204,7 @@ static struct decoder timidity_decoder =
   timidity_get_name,
   NULL,
   NULL,
+  NULL,
   NULL
 };
 
@@ -505,7 +505,8 @@ static struct decoder vorbis_decoder = {
 	vorbis_get_name,
 	vorbis_current_tags,
 	vorbis_get_stream,
-	vorbis_get_avg_bitrate
+	vorbis_get_avg_bitrate,
+	NULL
 };
 
 struct decoder *plugin_init ()
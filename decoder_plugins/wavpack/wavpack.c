@@ -295,7 +295,8 @@ static struct decoder wv_decoder = {
         wav_get_name,
         NULL,//wav_current_tags,
         NULL,//wav_get_stream
-        wav_get_avg_bitrate
+        wav_get_avg_bitrate,
+        NULL
 };
 
 struct decoder *plugin_init ()
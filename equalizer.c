@@ -47,6 +47,7 @@
 #include "log.h"
 #include "files.h"
 #include "equalizer.h"
+#include "simd.h"
 
 #define TWOPI (2.0 * M_PI)
 
@@ -63,12 +64,21 @@
 #define EQUALIZER_SAVE_FILE "equalizer"
 #define EQUALIZER_SAVE_OPTION "Equalizer_SaveState"
 
+/* Size of the block of float samples processed at once. */
+#define EQU_BLOCK_SAMPLES 4096
+
+/* Filter state below this is flushed to zero. */
+#define EQU_DENORMAL_LIMIT 1e-15f
+
+/* Largest floats which still fit in 32 bit integers. */
+#define EQU_FLOAT_S32_MAX 2147483520.0f
+#define EQU_FLOAT_U32_MAX 4294967040.0f
+
 typedef struct t_biquad t_biquad;
 
 struct t_biquad
 {
   float a0, a1, a2, a3, a4;
-  float x1, x2, y1, y2;
   float cf, bw, gain, srate;
   int israte;
 };
@@ -94,6 +104,7 @@ struct t_eq_set
   float preamp;
   int bcount;
   t_biquad *b;
+  float *state;
 };
 
 typedef struct t_eq_set_list t_eq_set_list;
@@ -132,7 +143,7 @@ static void equalizer_read_config();
 static void equalizer_write_config();
 
 /* biquad application */
-static inline void apply_biquads(float *src, float *dst, int channels, int len, t_biquad *b, int blen);
+static void apply_biquads(float *blk, size_t frames, const t_biquad *b, float *state, int bcount);
 
 /* biquad filter creation */
 static t_biquad *mk_biquad(float dbgain, float cf, float srate, float bw, t_biquad *b);
@@ -140,17 +151,19 @@ static t_biquad *mk_biquad(float dbgain, float cf, float srate, float bw, t_biqu
 /* equalizer list processing */
 static t_eq_set_list *append_eq_set(t_eq_set *eqs, t_eq_set_list *l);
 static void clear_eq_set(t_eq_set_list *l);
+static void equalizer_select_kernels();
 
 /* sound processing */
-static void equ_process_buffer_u8(uint8_t *buf, size_t samples);
-static void equ_process_buffer_s8(int8_t *buf, size_t samples);
-static void equ_process_buffer_u16(uint16_t *buf, size_t samples);
-static void equ_process_buffer_s16(int16_t *buf, size_t samples);
-static void equ_process_buffer_u24(uint32_t *buf, size_t samples);
-static void equ_process_buffer_s24(int32_t *buf, size_t samples);
-static void equ_process_buffer_u32(uint32_t *buf, size_t samples);
-static void equ_process_buffer_s32(int32_t *buf, size_t samples);
-static void equ_process_buffer_float(float *buf, size_t samples);
+static void equ_process_buffer_u8(uint8_t *buf, size_t samples, float gain);
+static void equ_process_buffer_s8(int8_t *buf, size_t samples, float gain);
+static void equ_process_buffer_u16(uint16_t *buf, size_t samples, float gain);
+static void equ_process_buffer_s16(int16_t *buf, size_t samples, float gain);
+static void equ_process_buffer_u24(uint32_t *buf, size_t samples, float gain);
+static void equ_process_buffer_s24(int32_t *buf, size_t samples, float gain);
+static void equ_process_buffer_u32(uint32_t *buf, size_t samples, float gain);
+static void equ_process_buffer_s32(int32_t *buf, size_t samples, float gain);
+static void equ_process_buffer_float(float *buf, size_t samples, float gain);
+static void equ_filter_block(size_t samples);
 
 /* static global variables */
 static t_eq_set_list equ_list, *current_equ;
@@ -158,6 +171,14 @@ static t_eq_set_list equ_list, *current_equ;
 static int sample_rate, equ_active, equ_channels;
 
 static float mixin_rate, r_mixin_rate;
+
+/* Samples being equalized, frames are equ_stride (equ_channels rounded up
+ * to a multiple of 4) floats apart. */
+static float equ_block[EQU_BLOCK_SAMPLES];
+static int equ_stride;
+static size_t equ_block_samples; /* samples of a full block */
+
+static void (*equ_filter)(float *blk, size_t frames, const t_biquad *b, float *state, int bcount) = apply_biquads;
 static float preamp, preampf;
 
 static char *eqsetdir;
@@ -258,11 +279,6 @@ static t_biquad *mk_biquad(float dbgain, float cf, float srate, float bw, t_biqu
   b->a3 = a1 / a0;
   b->a4 = a2 / a0;
 
-  b->x1 = 0.0f;
-  b->x2 = 0.0f;
-  b->y1 = 0.0f;
-  b->y2 = 0.0f;
-
   b->cf = cf;
   b->bw = bw;
   b->srate = srate;
@@ -272,61 +288,149 @@ static t_biquad *mk_biquad(float dbgain, float cf, float srate, float bw, t_biqu
   return b;
 }
 
-/*
- * not used but keep as example use for biquad filter
-static inline void biquad(float *src, float *dst, int len, t_biquad *b)
+/* Applies the filters of a set to a block of floating point samples in
+ * equ_block layout (frames equ_stride floats apart, channels beyond
+ * equ_channels are padding).  The filters are run one after another over
+ * the whole block, so the state of a filter stays in registers.
+ *
+ * The state holds x1, x2, y1 and y2 (in this order) of 4 channels for
+ * each group of 4 channels of each filter.
+ */
+static void apply_biquads(float *blk, size_t frames, const t_biquad *b, float *state, int bcount)
 {
-  while(len-->0)
+  int bi, c;
+  size_t i;
+
+  for(bi=0; bi<bcount; bi++)
   {
-    float s = *src++;
-    float f = s * b->a0 + b->a1 * b->x1 + b->a2 * b->x2 - b->a3 * b->y1 - b->a4 * b->y2;
-    *dst++=f;
-    b->x2 = b->x1;
-    b->x1 = s;
-    b->y2 = b->y1;
-    b->y1 = f;
+    for(c=0; c<equ_channels; c++)
+    {
+      float *st = state + (bi*equ_stride + (c & ~3)) * 4 + (c & 3);
+      float x1 = st[0], x2 = st[4], y1 = st[8], y2 = st[12];
+      float *p = blk + c;
+
+      for(i=0; i<frames; i++, p+=equ_stride)
+      {
+        float s = *p;
+        float f = s * b[bi].a0 + b[bi].a1 * x1 + b[bi].a2 * x2 - b[bi].a3 * y1 - b[bi].a4 * y2;
+        x2 = x1;
+        x1 = s;
+        y2 = y1;
+        y1 = f;
+        *p = f;
+      }
+
+      st[0] = x1;
+      st[4] = x2;
+      st[8] = y1;
+      st[12] = y2;
+    }
   }
 }
-*/
 
-/* Applies a set of biquadratic filters to a buffer of floating point
- * samples.
- * It is safe to have the same input and output buffer.
- *
- * blen is the sample-count ignoring channels (samples per channel * channels)
- */
-static inline void apply_biquads(float *src, float *dst, int channels, int len, t_biquad *b, int blen)
+#ifdef HAVE_SIMD_X86
+
+/* Same as apply_biquads(), 4 channels at a time. */
+ATTR_SSE2
+static void apply_biquads_sse2(float *blk, size_t frames, const t_biquad *b, float *state, int bcount)
 {
-  int bi, ci, boffs, idx;
-  while(len>0)
+  int bi, g;
+  size_t i;
+
+  for(bi=0; bi<bcount; bi++)
   {
-    boffs = 0;
-    for(ci=0; ci<channels; ci++)
+    const __m128 a0 = _mm_set1_ps(b[bi].a0);
+    const __m128 a1 = _mm_set1_ps(b[bi].a1);
+    const __m128 a2 = _mm_set1_ps(b[bi].a2);
+    const __m128 a3 = _mm_set1_ps(b[bi].a3);
+    const __m128 a4 = _mm_set1_ps(b[bi].a4);
+
+    for(g=0; g<equ_stride; g+=4)
     {
-      float s = *src++;
-      float f = s;
-      for(bi=0; bi<blen; bi++)
+      float *st = state + (bi*equ_stride + g) * 4;
+      __m128 x1 = _mm_loadu_ps(st);
+      __m128 x2 = _mm_loadu_ps(st + 4);
+      __m128 y1 = _mm_loadu_ps(st + 8);
+      __m128 y2 = _mm_loadu_ps(st + 12);
+      float *p = blk + g;
+
+      for(i=0; i<frames; i++, p+=equ_stride)
       {
-        idx = boffs + bi;
-        f =
-          s * b[idx].a0 \
-          + b[idx].a1 * b[idx].x1 \
-          + b[idx].a2 * b[idx].x2 \
-          - b[idx].a3 * b[idx].y1 \
-          - b[idx].a4 * b[idx].y2;
-        b[idx].x2 = b[idx].x1;
-        b[idx].x1 = s;
-        b[idx].y2 = b[idx].y1;
-        b[idx].y1 = f;
-        s = f;
+        __m128 s = _mm_loadu_ps(p);
+        __m128 f = _mm_mul_ps(s, a0);
+
+        f = _mm_add_ps(f, _mm_mul_ps(a1, x1));
+        f = _mm_add_ps(f, _mm_mul_ps(a2, x2));
+        f = _mm_sub_ps(f, _mm_mul_ps(a3, y1));
+        f = _mm_sub_ps(f, _mm_mul_ps(a4, y2));
+        x2 = x1;
+        x1 = s;
+        y2 = y1;
+        y1 = f;
+        _mm_storeu_ps(p, f);
       }
-      *dst++=f;
-      boffs += blen;
-      len--;
+
+      _mm_storeu_ps(st, x1);
+      _mm_storeu_ps(st + 4, x2);
+      _mm_storeu_ps(st + 8, y1);
+      _mm_storeu_ps(st + 12, y2);
     }
   }
 }
 
+#endif /* HAVE_SIMD_X86 */
+
+#ifdef HAVE_NEON
+
+/* Same as apply_biquads(), 4 channels at a time. */
+static void apply_biquads_neon(float *blk, size_t frames, const t_biquad *b, float *state, int bcount)
+{
+  int bi, g;
+  size_t i;
+
+  for(bi=0; bi<bcount; bi++)
+  {
+    const float32x4_t a0 = vdupq_n_f32(b[bi].a0);
+    const float32x4_t a1 = vdupq_n_f32(b[bi].a1);
+    const float32x4_t a2 = vdupq_n_f32(b[bi].a2);
+    const float32x4_t a3 = vdupq_n_f32(b[bi].a3);
+    const float32x4_t a4 = vdupq_n_f32(b[bi].a4);
+
+    for(g=0; g<equ_stride; g+=4)
+    {
+      float *st = state + (bi*equ_stride + g) * 4;
+      float32x4_t x1 = vld1q_f32(st);
+      float32x4_t x2 = vld1q_f32(st + 4);
+      float32x4_t y1 = vld1q_f32(st + 8);
+      float32x4_t y2 = vld1q_f32(st + 12);
+      float *p = blk + g;
+
+      for(i=0; i<frames; i++, p+=equ_stride)
+      {
+        float32x4_t s = vld1q_f32(p);
+        float32x4_t f = vmulq_f32(s, a0);
+
+        f = vaddq_f32(f, vmulq_f32(a1, x1));
+        f = vaddq_f32(f, vmulq_f32(a2, x2));
+        f = vsubq_f32(f, vmulq_f32(a3, y1));
+        f = vsubq_f32(f, vmulq_f32(a4, y2));
+        x2 = x1;
+        x1 = s;
+        y2 = y1;
+        y1 = f;
+        vst1q_f32(p, f);
+      }
+
+      vst1q_f32(st, x1);
+      vst1q_f32(st + 4, x2);
+      vst1q_f32(st + 8, y1);
+      vst1q_f32(st + 12, y2);
+    }
+  }
+}
+
+#endif /* HAVE_NEON */
+
 /*
  preamping
  XMMS / Beep Media Player / Audacious use all the same code but
@@ -492,6 +596,8 @@ void equalizer_init()
 
   equ_channels = 2;
 
+  equalizer_select_kernels();
+
   preamp = 0.0f;
 
   preampf = powf(10.0f, preamp / 20.0f);
@@ -542,6 +648,10 @@ void equalizer_refresh()
 
   current_equ = NULL;
 
+  equ_stride = (equ_channels + 3) & ~3;
+  equ_block_samples = (size_t)(EQU_BLOCK_SAMPLES / equ_stride) * equ_channels;
+  memset(equ_block, 0, sizeof(equ_block));
+
   DIR *d = opendir(eqsetdir);
 
   if(!d)
@@ -591,9 +701,10 @@ void equalizer_refresh()
 
         if(r==0)
         {
-          int i, channel;
+          int i;
           t_eq_set *eqset = (t_eq_set *)xmalloc(sizeof(t_eq_set));
-          eqset->b = (t_biquad *)xmalloc(sizeof(t_biquad)*eqs->bcount*equ_channels);
+          eqset->b = (t_biquad *)xmalloc(sizeof(t_biquad)*eqs->bcount);
+          eqset->state = (float *)xcalloc(eqs->bcount*equ_stride*4, sizeof(float));
 
           eqset->name = xstrdup(eqs->name);
           eqset->preamp = eqs->preamp;
@@ -603,11 +714,6 @@ void equalizer_refresh()
           for(i=0; i<eqs->bcount; i++)
           {
             mk_biquad(eqs->dg[i], eqs->cf[i], sample_rate, eqs->bw[i], &eqset->b[i]);
-
-            for(channel=1; channel<equ_channels; channel++)
-            {
-              eqset->b[channel*eqset->bcount + i] = eqset->b[i];
-            }
           }
 
           last_elem = append_eq_set(eqset, last_elem);
@@ -692,12 +798,12 @@ void equalizer_refresh()
 }
 
 /* sound processing code */
-void equalizer_process_buffer(char *buf, size_t size, const struct sound_params *sound_params)
+int equalizer_process_buffer(char *buf, size_t size, const struct sound_params *sound_params, float gain)
 {
   debug ("EQ Processing %zu bytes...", size);
 
   if(!equ_active || !current_equ || !current_equ->set)
-    return;
+    return 0;
 
   if(sound_params->rate != current_equ->set->b->israte || sound_params->channels != equ_channels)
   {
@@ -706,6 +812,9 @@ void equalizer_process_buffer(char *buf, size_t size, const struct sound_params
     equ_channels = sound_params->channels;
 
     equalizer_refresh();
+
+    if(!current_equ || !current_equ->set)
+      return 0;
   }
 
   long sound_format = sound_params->fmt & SFMT_MASK_FORMAT;
@@ -717,250 +826,314 @@ void equalizer_process_buffer(char *buf, size_t size, const struct sound_params
   switch(sound_format)
   {
     case SFMT_U8:
-      equ_process_buffer_u8((uint8_t *)buf, size);
+      equ_process_buffer_u8((uint8_t *)buf, size, gain);
       break;
     case SFMT_S8:
-      equ_process_buffer_s8((int8_t *)buf, size);
+      equ_process_buffer_s8((int8_t *)buf, size, gain);
       break;
     case SFMT_U16:
-      equ_process_buffer_u16((uint16_t *)buf, size / sizeof(uint16_t));
+      equ_process_buffer_u16((uint16_t *)buf, size / sizeof(uint16_t), gain);
       break;
     case SFMT_S16:
-      equ_process_buffer_s16((int16_t *)buf, size / sizeof(int16_t));
+      equ_process_buffer_s16((int16_t *)buf, size / sizeof(int16_t), gain);
       break;
     case SFMT_U24:
-      equ_process_buffer_u24((uint32_t *)buf, size / sizeof(uint32_t));
+      equ_process_buffer_u24((uint32_t *)buf, size / sizeof(uint32_t), gain);
       break;
     case SFMT_S24:
-      equ_process_buffer_s24((int32_t *)buf, size / sizeof(int32_t));
+      equ_process_buffer_s24((int32_t *)buf, size / sizeof(int32_t), gain);
       break;
     case SFMT_U32:
-      equ_process_buffer_u32((uint32_t *)buf, size / sizeof(uint32_t));
+      equ_process_buffer_u32((uint32_t *)buf, size / sizeof(uint32_t), gain);
       break;
     case SFMT_S32:
-      equ_process_buffer_s32((int32_t *)buf, size / sizeof(int32_t));
+      equ_process_buffer_s32((int32_t *)buf, size / sizeof(int32_t), gain);
       break;
     case SFMT_FLOAT:
-      equ_process_buffer_float((float *)buf, size / sizeof(float));
+      equ_process_buffer_float((float *)buf, size / sizeof(float), gain);
       break;
+    default:
+      return 0;
   }
+
+  return 1;
 }
 
-static void equ_process_buffer_u8(uint8_t *buf, size_t samples)
+/* Runs the filters of the current set over the first samples of
+ * equ_block and flushes filter state which decayed to (almost) nothing,
+ * so silence does not end up in slow denormal arithmetic. */
+static void equ_filter_block(size_t samples)
 {
-  size_t i;
-  float *tmp;
+  t_eq_set *set = current_equ->set;
+  size_t i, state_len = (size_t)set->bcount * equ_stride * 4;
 
-  debug ("equalizing");
+  equ_filter(equ_block, samples / equ_channels, set->b, set->state, set->bcount);
+
+  for(i=0; i<state_len; i++)
+  {
+    if(fabsf(set->state[i]) < EQU_DENORMAL_LIMIT)
+      set->state[i] = 0.0f;
+  }
+}
 
-  tmp = (float *)xmalloc (samples * sizeof (float));
+/* Each of the functions below equalizes the buffer block by block: the
+ * samples are converted to float into equ_block, filtered there and
+ * mixed back while still in the cache, applying the softmixer gain on
+ * the way so the softmixer does not need a second pass. */
 
-  for(i=0; i<samples; i++)
-    tmp[i] = preampf * (float)buf[i];
+static void equ_process_buffer_u8(uint8_t *buf, size_t samples, float gain)
+{
+  const float offs = 128.0f * (1.0f - gain);
+  size_t i, n;
+  int c;
+  float *blk;
 
-  apply_biquads(tmp, tmp, equ_channels, samples, current_equ->set->b, current_equ->set->bcount);
+  debug ("equalizing");
 
-  for(i=0; i<samples; i++)
+  for(; samples > 0; buf += n, samples -= n)
   {
-    tmp[i] = r_mixin_rate * tmp[i] + mixin_rate * buf[i];
-    tmp[i] = CLAMP(0, tmp[i], UINT8_MAX);
-    buf[i] = (uint8_t)tmp[i];
-  }
+    n = MIN(samples, equ_block_samples);
 
-  free(tmp);
+    for(i=0, blk=equ_block; i<n; i+=equ_channels, blk+=equ_stride)
+      for(c=0; c<equ_channels; c++)
+        blk[c] = preampf * (float)buf[i+c];
+
+    equ_filter_block(n);
+
+    for(i=0, blk=equ_block; i<n; i+=equ_channels, blk+=equ_stride)
+      for(c=0; c<equ_channels; c++)
+      {
+        float f = r_mixin_rate * blk[c] + mixin_rate * buf[i+c];
+        f = CLAMP(0, f * gain + offs, UINT8_MAX);
+        buf[i+c] = (uint8_t)f;
+      }
+  }
 }
 
-static void equ_process_buffer_s8(int8_t *buf, size_t samples)
+static void equ_process_buffer_s8(int8_t *buf, size_t samples, float gain)
 {
-  size_t i;
-  float *tmp;
+  size_t i, n;
+  int c;
+  float *blk;
 
   debug ("equalizing");
 
-  tmp = (float *)xmalloc (samples * sizeof (float));
+  for(; samples > 0; buf += n, samples -= n)
+  {
+    n = MIN(samples, equ_block_samples);
 
-  for(i=0; i<samples; i++)
-    tmp[i] = preampf * (float)buf[i];
+    for(i=0, blk=equ_block; i<n; i+=equ_channels, blk+=equ_stride)
+      for(c=0; c<equ_channels; c++)
+        blk[c] = preampf * (float)buf[i+c];
 
-  apply_biquads(tmp, tmp, equ_channels, samples, current_equ->set->b, current_equ->set->bcount);
+    equ_filter_block(n);
 
-  for(i=0; i<samples; i++)
-  {
-    tmp[i] = r_mixin_rate * tmp[i] + mixin_rate * buf[i];
-    tmp[i] = CLAMP(INT8_MIN, tmp[i], INT8_MAX);
-    buf[i] = (int8_t)tmp[i];
+    for(i=0, blk=equ_block; i<n; i+=equ_channels, blk+=equ_stride)
+      for(c=0; c<equ_channels; c++)
+      {
+        float f = r_mixin_rate * blk[c] + mixin_rate * buf[i+c];
+        f = CLAMP(INT8_MIN, f * gain, INT8_MAX);
+        buf[i+c] = (int8_t)f;
+      }
   }
-
-  free(tmp);
 }
 
-static void equ_process_buffer_u16(uint16_t *buf, size_t samples)
+static void equ_process_buffer_u16(uint16_t *buf, size_t samples, float gain)
 {
-  size_t i;
-  float *tmp;
+  const float offs = 32768.0f * (1.0f - gain);
+  size_t i, n;
+  int c;
+  float *blk;
 
   debug ("equalizing");
 
-  tmp = (float *)xmalloc (samples * sizeof (float));
+  for(; samples > 0; buf += n, samples -= n)
+  {
+    n = MIN(samples, equ_block_samples);
 
-  for(i=0; i<samples; i++)
-    tmp[i] = preampf * (float)buf[i];
+    for(i=0, blk=equ_block; i<n; i+=equ_channels, blk+=equ_stride)
+      for(c=0; c<equ_channels; c++)
+        blk[c] = preampf * (float)buf[i+c];
 
-  apply_biquads(tmp, tmp, equ_channels, samples, current_equ->set->b, current_equ->set->bcount);
+    equ_filter_block(n);
 
-  for(i=0; i<samples; i++)
-  {
-    tmp[i] = r_mixin_rate * tmp[i] + mixin_rate * buf[i];
-    tmp[i] = CLAMP(0, tmp[i], UINT16_MAX);
-    buf[i] = (uint16_t)tmp[i];
+    for(i=0, blk=equ_block; i<n; i+=equ_channels, blk+=equ_stride)
+      for(c=0; c<equ_channels; c++)
+      {
+        float f = r_mixin_rate * blk[c] + mixin_rate * buf[i+c];
+        f = CLAMP(0, f * gain + offs, UINT16_MAX);
+        buf[i+c] = (uint16_t)f;
+      }
   }
-
-  free(tmp);
 }
 
-static void equ_process_buffer_s16(int16_t *buf, size_t samples)
+static void equ_process_buffer_s16(int16_t *buf, size_t samples, float gain)
 {
-  size_t i;
-  float *tmp;
+  size_t i, n;
+  int c;
+  float *blk;
 
   debug ("equalizing");
 
-  tmp = (float *)xmalloc (samples * sizeof (float));
+  for(; samples > 0; buf += n, samples -= n)
+  {
+    n = MIN(samples, equ_block_samples);
 
-  for(i=0; i<samples; i++)
-    tmp[i] = preampf * (float)buf[i];
+    for(i=0, blk=equ_block; i<n; i+=equ_channels, blk+=equ_stride)
+      for(c=0; c<equ_channels; c++)
+        blk[c] = preampf * (float)buf[i+c];
 
-  apply_biquads(tmp, tmp, equ_channels, samples, current_equ->set->b, current_equ->set->bcount);
+    equ_filter_block(n);
 
-  for(i=0; i<samples; i++)
-  {
-    tmp[i] = r_mixin_rate * tmp[i] + mixin_rate * buf[i];
-    tmp[i] = CLAMP(INT16_MIN, tmp[i], INT16_MAX);
-    buf[i] = (int16_t)tmp[i];
+    for(i=0, blk=equ_block; i<n; i+=equ_channels, blk+=equ_stride)
+      for(c=0; c<equ_channels; c++)
+      {
+        float f = r_mixin_rate * blk[c] + mixin_rate * buf[i+c];
+        f = CLAMP(INT16_MIN, f * gain, INT16_MAX);
+        buf[i+c] = (int16_t)f;
+      }
   }
-
-  free(tmp);
 }
 
-static void equ_process_buffer_u24(uint32_t *buf, size_t samples)
+static void equ_process_buffer_u24(uint32_t *buf, size_t samples, float gain)
 {
-  size_t i;
-  float *tmp;
+  const float offs = 8388608.0f * (1.0f - gain);
+  size_t i, n;
+  int c;
+  float *blk;
 
   debug ("equalizing");
 
-  tmp = (float *)xmalloc (samples * sizeof (float));
+  for(; samples > 0; buf += n, samples -= n)
+  {
+    n = MIN(samples, equ_block_samples);
 
-  for(i=0; i<samples; i++)
-    tmp[i] = preampf * (float)buf[i];
+    for(i=0, blk=equ_block; i<n; i+=equ_channels, blk+=equ_stride)
+      for(c=0; c<equ_channels; c++)
+        blk[c] = preampf * (float)buf[i+c];
 
-  apply_biquads(tmp, tmp, equ_channels, samples, current_equ->set->b, current_equ->set->bcount);
+    equ_filter_block(n);
 
-  for(i=0; i<samples; i++)
-  {
-    tmp[i] = r_mixin_rate * tmp[i] + mixin_rate * buf[i];
-    tmp[i] = CLAMP(0, tmp[i], U24_MAX);
-    buf[i] = (uint32_t)tmp[i];
+    for(i=0, blk=equ_block; i<n; i+=equ_channels, blk+=equ_stride)
+      for(c=0; c<equ_channels; c++)
+      {
+        float f = r_mixin_rate * blk[c] + mixin_rate * buf[i+c];
+        f = CLAMP(0, f * gain + offs, U24_MAX);
+        buf[i+c] = (uint32_t)f;
+      }
   }
-
-  free(tmp);
 }
 
-static void equ_process_buffer_s24(int32_t *buf, size_t samples)
+static void equ_process_buffer_s24(int32_t *buf, size_t samples, float gain)
 {
-  size_t i;
-  float *tmp;
+  size_t i, n;
+  int c;
+  float *blk;
 
   debug ("equalizing");
 
-  tmp = (float *)xmalloc (samples * sizeof (float));
+  for(; samples > 0; buf += n, samples -= n)
+  {
+    n = MIN(samples, equ_block_samples);
 
-  for(i=0; i<samples; i++)
-    tmp[i] = preampf * (float)buf[i];
+    for(i=0, blk=equ_block; i<n; i+=equ_channels, blk+=equ_stride)
+      for(c=0; c<equ_channels; c++)
+        blk[c] = preampf * (float)buf[i+c];
 
-  apply_biquads(tmp, tmp, equ_channels, samples, current_equ->set->b, current_equ->set->bcount);
+    equ_filter_block(n);
 
-  for(i=0; i<samples; i++)
-  {
-    tmp[i] = r_mixin_rate * tmp[i] + mixin_rate * buf[i];
-    tmp[i] = CLAMP(S24_MIN, tmp[i], S24_MAX);
-    buf[i] = (int32_t)tmp[i];
+    for(i=0, blk=equ_block; i<n; i+=equ_channels, blk+=equ_stride)
+      for(c=0; c<equ_channels; c++)
+      {
+        float f = r_mixin_rate * blk[c] + mixin_rate * buf[i+c];
+        f = CLAMP(S24_MIN, f * gain, S24_MAX);
+        buf[i+c] = (int32_t)f;
+      }
   }
-
-  free(tmp);
 }
 
-
-static void equ_process_buffer_u32(uint32_t *buf, size_t samples)
+static void equ_process_buffer_u32(uint32_t *buf, size_t samples, float gain)
 {
-  size_t i;
-  float *tmp;
+  const float offs = 2147483648.0f * (1.0f - gain);
+  size_t i, n;
+  int c;
+  float *blk;
 
   debug ("equalizing");
 
-  tmp = (float *)xmalloc (samples * sizeof (float));
+  for(; samples > 0; buf += n, samples -= n)
+  {
+    n = MIN(samples, equ_block_samples);
 
-  for(i=0; i<samples; i++)
-    tmp[i] = preampf * (float)buf[i];
+    for(i=0, blk=equ_block; i<n; i+=equ_channels, blk+=equ_stride)
+      for(c=0; c<equ_channels; c++)
+        blk[c] = preampf * (float)buf[i+c];
 
-  apply_biquads(tmp, tmp, equ_channels, samples, current_equ->set->b, current_equ->set->bcount);
+    equ_filter_block(n);
 
-  for(i=0; i<samples; i++)
-  {
-    tmp[i] = r_mixin_rate * tmp[i] + mixin_rate * buf[i];
-    tmp[i] = CLAMP(0, tmp[i], UINT32_MAX);
-    buf[i] = (uint32_t)tmp[i];
+    for(i=0, blk=equ_block; i<n; i+=equ_channels, blk+=equ_stride)
+      for(c=0; c<equ_channels; c++)
+      {
+        float f = r_mixin_rate * blk[c] + mixin_rate * buf[i+c];
+        f = CLAMP(0, f * gain + offs, EQU_FLOAT_U32_MAX);
+        buf[i+c] = (uint32_t)f;
+      }
   }
-
-  free(tmp);
 }
 
-static void equ_process_buffer_s32(int32_t *buf, size_t samples)
+static void equ_process_buffer_s32(int32_t *buf, size_t samples, float gain)
 {
-  size_t i;
-  float *tmp;
+  size_t i, n;
+  int c;
+  float *blk;
 
   debug ("equalizing");
 
-  tmp = (float *)xmalloc (samples * sizeof (float));
+  for(; samples > 0; buf += n, samples -= n)
+  {
+    n = MIN(samples, equ_block_samples);
 
-  for(i=0; i<samples; i++)
-    tmp[i] = preampf * (float)buf[i];
+    for(i=0, blk=equ_block; i<n; i+=equ_channels, blk+=equ_stride)
+      for(c=0; c<equ_channels; c++)
+        blk[c] = preampf * (float)buf[i+c];
 
-  apply_biquads(tmp, tmp, equ_channels, samples, current_equ->set->b, current_equ->set->bcount);
+    equ_filter_block(n);
 
-  for(i=0; i<samples; i++)
-  {
-    tmp[i] = r_mixin_rate * tmp[i] + mixin_rate * buf[i];
-    tmp[i] = CLAMP(INT32_MIN, tmp[i], INT32_MAX);
-    buf[i] = (int32_t)tmp[i];
+    for(i=0, blk=equ_block; i<n; i+=equ_channels, blk+=equ_stride)
+      for(c=0; c<equ_channels; c++)
+      {
+        float f = r_mixin_rate * blk[c] + mixin_rate * buf[i+c];
+        f = CLAMP(INT32_MIN, f * gain, EQU_FLOAT_S32_MAX);
+        buf[i+c] = (int32_t)f;
+      }
   }
-
-  free(tmp);
 }
 
-static void equ_process_buffer_float(float *buf, size_t samples)
+static void equ_process_buffer_float(float *buf, size_t samples, float gain)
 {
-  size_t i;
-  float *tmp;
+  size_t i, n;
+  int c;
+  float *blk;
 
   debug ("equalizing");
 
-  tmp = (float *)xmalloc (samples * sizeof (float));
+  for(; samples > 0; buf += n, samples -= n)
+  {
+    n = MIN(samples, equ_block_samples);
 
-  for(i=0; i<samples; i++)
-    tmp[i] = preampf * (float)buf[i];
+    for(i=0, blk=equ_block; i<n; i+=equ_channels, blk+=equ_stride)
+      for(c=0; c<equ_channels; c++)
+        blk[c] = preampf * buf[i+c];
 
-  apply_biquads(tmp, tmp, equ_channels, samples, current_equ->set->b, current_equ->set->bcount);
+    equ_filter_block(n);
 
-  for(i=0; i<samples; i++)
-  {
-    tmp[i] = r_mixin_rate * tmp[i] + mixin_rate * buf[i];
-    tmp[i] = CLAMP(-1.0f, tmp[i], 1.0f);
-    buf[i] = tmp[i];
+    for(i=0, blk=equ_block; i<n; i+=equ_channels, blk+=equ_stride)
+      for(c=0; c<equ_channels; c++)
+      {
+        float f = r_mixin_rate * blk[c] + mixin_rate * buf[i+c];
+        buf[i+c] = CLAMP(-1.0f, f * gain, 1.0f);
+      }
   }
-
-  free(tmp);
 }
 
 /* equalizer list maintenance */
@@ -995,6 +1168,7 @@ static void clear_eq_set(t_eq_set_list *l)
   {
     free(l->set->name);
     free(l->set->b);
+    free(l->set->state);
     free(l->set);
     l->set = NULL;
   }
@@ -1188,3 +1362,21 @@ static int read_float(char *s, float *f, char **endp)
 
   return 0;
 }
+
+/* Use the SIMD filter functions if the CPU supports them. */
+static void equalizer_select_kernels()
+{
+#if defined(HAVE_SIMD_X86) || defined(HAVE_NEON)
+  int features = simd_features();
+#endif
+
+#ifdef HAVE_SIMD_X86
+  if(features & SIMD_SSE2)
+    equ_filter = apply_biquads_sse2;
+#endif
+
+#ifdef HAVE_NEON
+  if(features & SIMD_NEON)
+    equ_filter = apply_biquads_neon;
+#endif
+}
@@ -7,7 +7,7 @@ extern "C" {
 
 void equalizer_init();
 void equalizer_shutdown();
-void equalizer_process_buffer(char *buf, size_t size, const struct sound_params *sound_params);
+int equalizer_process_buffer(char *buf, size_t size, const struct sound_params *sound_params, float gain);
 void equalizer_refresh();
 int equalizer_is_active();
 int equalizer_set_active(int active);
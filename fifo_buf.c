@@ -9,6 +9,32 @@
  *
  */
 
+/* The buffer can be used without locking by one producer (fifo_buf_put())
+ * and one consumer (fifo_buf_get(), fifo_buf_peek(), fifo_buf_clear())
+ * running in different threads.  Both positions run from 0 to 2 * size - 1
+ * so a full buffer can be told from an empty one; each is written only by
+ * its owner and published with release semantics.
+ *
+ * A thread which has to wait for the other side does:
+ *
+ *	seq = fifo_buf_wait_prepare (b);
+ *	if (still nothing to do)
+ *		fifo_buf_wait (b, seq);
+ *
+ * fifo_buf_put() and fifo_buf_get() wake it up, but only pay for that
+ * when somebody is waiting.  Other state changes which a waiting thread
+ * must notice have to be followed by fifo_buf_wake().
+ *
+ * Where possible the buffer memory is mapped twice, one copy right after
+ * the other, so any region of the buffer is contiguous in memory and
+ * fifo_buf_reserve_write() and fifo_buf_peek_read() can always give
+ * access to all the free space or all the data. */
+
+/* For memfd_create(). */
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE
+#endif
+
 #ifdef HAVE_CONFIG_H
 # include "config.h"
 #endif
@@ -17,30 +43,129 @@
 #include <sys/types.h>
 #include <assert.h>
 #include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+
+#ifdef HAVE_MEMFD_CREATE
+# include <sys/mman.h>
+#endif
+
+#ifdef HAVE_LINUX_FUTEX_H
+# include <sys/syscall.h>
+# include <linux/futex.h>
+#else
+# include <pthread.h>
+#endif
 
 #include "common.h"
+#include "log.h"
 #include "fifo_buf.h"
+#include "realtime.h"
 
 struct fifo_buf
 {
-	int size;                           /* Size of the buffer */
-	int pos;                            /* Current position */
-	int fill;                           /* Current fill */
-	char buf[];                         /* The buffer content */
+	size_t size;                        /* Size of the buffer */
+	size_t head;                        /* Write position (producer) */
+	size_t tail;                        /* Read position (consumer) */
+	int waiting;                        /* Is somebody about to wait? */
+	int wake_seq;                       /* Bumped on each wake up */
+#ifndef HAVE_LINUX_FUTEX_H
+	pthread_mutex_t wait_mtx;
+	pthread_cond_t wait_cond;
+#endif
+	int mirrored;                       /* Is the content mapped twice? */
+	int prefaulted;                     /* Passed to realtime_prefault()? */
+	char *buf;                          /* The buffer content */
 };
 
-/* Initialize and return a new fifo_buf structure of the size requested. */
+#ifdef HAVE_MEMFD_CREATE
+/* Map size bytes of memory twice in a row.  Return NULL on failure. */
+static char *map_mirrored (const size_t size)
+{
+	int fd;
+	char *addr;
+
+	fd = memfd_create ("moc-fifo", MFD_CLOEXEC);
+	if (fd == -1) {
+		log_errno ("memfd_create() failed", errno);
+		return NULL;
+	}
+
+	if (ftruncate (fd, size) == -1) {
+		log_errno ("ftruncate() failed", errno);
+		close (fd);
+		return NULL;
+	}
+
+	/* Reserve the address space, then put the two views into it. */
+	addr = mmap (NULL, 2 * size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS,
+			-1, 0);
+	if (addr == MAP_FAILED) {
+		log_errno ("mmap() failed", errno);
+		close (fd);
+		return NULL;
+	}
+
+	if (mmap (addr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+				fd, 0) == MAP_FAILED
+			|| mmap (addr + size, size, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+		log_errno ("mmap() failed", errno);
+		munmap (addr, 2 * size);
+		close (fd);
+		return NULL;
+	}
+
+	close (fd);
+
+	return addr;
+}
+#endif
+
+/* Initialize and return a new fifo_buf structure of the size requested.
+ * The buffer may be made a bit bigger if it can be mapped twice. */
 struct fifo_buf *fifo_buf_new (const size_t size)
 {
 	struct fifo_buf *b;
 
 	assert (size > 0);
 
-	b = xmalloc (offsetof (struct fifo_buf, buf) + size);
+	b = xmalloc (sizeof (struct fifo_buf));
 
 	b->size = size;
-	b->pos = 0;
-	b->fill = 0;
+	b->buf = NULL;
+	b->mirrored = 0;
+	b->prefaulted = 0;
+
+#ifdef HAVE_MEMFD_CREATE
+	{
+		long page = sysconf (_SC_PAGESIZE);
+
+		if (page > 0) {
+			size_t mapped = (size + page - 1) / page * page;
+
+			b->buf = map_mirrored (mapped);
+			if (b->buf) {
+				b->size = mapped;
+				b->mirrored = 1;
+			}
+		}
+	}
+#endif
+
+	if (!b->buf)
+		b->buf = xmalloc (size);
+
+	b->head = 0;
+	b->tail = 0;
+	b->waiting = 0;
+	b->wake_seq = 0;
+
+#ifndef HAVE_LINUX_FUTEX_H
+	pthread_mutex_init (&b->wait_mtx, NULL);
+	pthread_cond_init (&b->wait_cond, NULL);
+#endif
 
 	return b;
 }
@@ -50,115 +175,207 @@ void fifo_buf_free (struct fifo_buf *b)
 {
 	assert (b != NULL);
 
+#ifndef HAVE_LINUX_FUTEX_H
+	pthread_mutex_destroy (&b->wait_mtx);
+	pthread_cond_destroy (&b->wait_cond);
+#endif
+
+	if (b->prefaulted)
+		realtime_release (b->buf, b->size);
+
+#ifdef HAVE_MEMFD_CREATE
+	if (b->mirrored)
+		munmap (b->buf, 2 * b->size);
+	else
+#endif
+		free (b->buf);
+
 	free (b);
 }
 
-/* Put data into the buffer. Returns number of bytes actually put. */
-size_t fifo_buf_put (struct fifo_buf *b, const char *data, size_t size)
+/* Make the buffer memory resident for the realtime mode, it's released
+ * by fifo_buf_free(). */
+void fifo_buf_prefault (struct fifo_buf *b)
 {
-	size_t written = 0;
+	assert (b != NULL);
+
+	realtime_prefault (b->buf, b->size);
+	b->prefaulted = 1;
+}
+
+/* Number of bytes between the tail and head positions. */
+static size_t fill_between (const struct fifo_buf *b, const size_t tail,
+		const size_t head)
+{
+	return head >= tail ? head - tail : head + 2 * b->size - tail;
+}
+
+/* Advance a position by len bytes. */
+static size_t advance (const struct fifo_buf *b, size_t pos, const size_t len)
+{
+	pos += len;
+	if (pos >= 2 * b->size)
+		pos -= 2 * b->size;
+
+	return pos;
+}
+
+/* Wake up the other side if it waits for us.  The full barriers make sure
+ * that either the waiting thread sees our position update or we see its
+ * waiting flag. */
+static void wake_waiting (struct fifo_buf *b)
+{
+	if (__atomic_load_n (&b->waiting, __ATOMIC_SEQ_CST))
+		fifo_buf_wake (b);
+}
+
+/* Return the address of the free space at the end of the buffer and set
+ * len to the number of bytes which can be written there.  The data become
+ * visible for the consumer after fifo_buf_commit_write().  Without the
+ * mirrored mapping the region ends at the end of the memory block, so
+ * there may be more free space after committing it. */
+char *fifo_buf_reserve_write (struct fifo_buf *b, size_t *len)
+{
+	size_t tail, pos;
 
 	assert (b != NULL);
-	assert (b->buf != NULL);
+	assert (len != NULL);
 
-	while (b->fill < b->size && written < size) {
-		size_t write_from;
-		size_t to_write;
+	tail = __atomic_load_n (&b->tail, __ATOMIC_ACQUIRE);
+	pos = b->head >= b->size ? b->head - b->size : b->head;
 
-		if (b->pos + b->fill < b->size) {
-			write_from = b->pos + b->fill;
-			to_write = b->size - (b->pos + b->fill);
-		}
-		else {
-			write_from = b->fill - b->size + b->pos;
-			to_write = b->size - b->fill;
-		}
+	*len = b->size - fill_between (b, tail, b->head);
+	if (!b->mirrored)
+		*len = MIN(*len, b->size - pos);
 
-		if (to_write > size - written)
-			to_write = size - written;
+	return b->buf + pos;
+}
 
-		memcpy (b->buf + write_from, data + written, to_write);
-		b->fill += to_write;
-		written += to_write;
-	}
+/* Make len bytes written to the region returned by fifo_buf_reserve_write()
+ * available to the consumer. */
+void fifo_buf_commit_write (struct fifo_buf *b, const size_t len)
+{
+	assert (b != NULL);
+	assert (len <= fifo_buf_get_space (b));
 
-	return written;
+	if (len == 0)
+		return;
+
+	__atomic_store_n (&b->head, advance (b, b->head, len),
+			__ATOMIC_SEQ_CST);
+	wake_waiting (b);
 }
 
-/* Copy data from the beginning of the buffer to the user buffer. Returns the
- * number of bytes copied. */
-size_t fifo_buf_peek (struct fifo_buf *b, char *user_buf, size_t user_buf_size)
+/* Return the address of the data at the beginning of the buffer and set
+ * len to the number of bytes available there.  The data stay in the buffer
+ * until fifo_buf_consume() is called.  Without the mirrored mapping the
+ * region ends at the end of the memory block. */
+const char *fifo_buf_peek_read (struct fifo_buf *b, size_t *len)
 {
-	size_t user_buf_pos = 0, written = 0;
-	ssize_t left, pos;
+	size_t head, pos;
 
 	assert (b != NULL);
-	assert (b->buf != NULL);
+	assert (len != NULL);
 
-	left = b->fill;
-	pos = b->pos;
+	head = __atomic_load_n (&b->head, __ATOMIC_ACQUIRE);
+	pos = b->tail >= b->size ? b->tail - b->size : b->tail;
 
-	while (left && written < user_buf_size) {
-		size_t to_copy = pos + left <= b->size
-			? left : b->size - pos;
+	*len = fill_between (b, b->tail, head);
+	if (!b->mirrored)
+		*len = MIN(*len, b->size - pos);
 
-		if (to_copy > user_buf_size - written)
-			to_copy = user_buf_size - written;
+	return b->buf + pos;
+}
 
-		memcpy (user_buf + user_buf_pos, b->buf + pos, to_copy);
-		user_buf_pos += to_copy;
-		written += to_copy;
+/* Remove len bytes from the beginning of the buffer. */
+void fifo_buf_consume (struct fifo_buf *b, const size_t len)
+{
+	assert (b != NULL);
+	assert (len <= fifo_buf_get_fill (b));
 
-		left -= to_copy;
-		pos += to_copy;
-		if (pos == b->size)
-			pos = 0;
+	if (len == 0)
+		return;
+
+	__atomic_store_n (&b->tail, advance (b, b->tail, len),
+			__ATOMIC_SEQ_CST);
+	wake_waiting (b);
+}
+
+/* Put data into the buffer. Returns number of bytes actually put. */
+size_t fifo_buf_put (struct fifo_buf *b, const char *data, size_t size)
+{
+	size_t written = 0;
+
+	assert (b != NULL);
+
+	while (written < size) {
+		size_t len;
+		char *dest = fifo_buf_reserve_write (b, &len);
+
+		if (len == 0)
+			break;
+
+		len = MIN(len, size - written);
+		memcpy (dest, data + written, len);
+		fifo_buf_commit_write (b, len);
+		written += len;
 	}
 
 	return written;
 }
 
-size_t fifo_buf_get (struct fifo_buf *b, char *user_buf, size_t user_buf_size)
+/* Copy data from the beginning of the buffer to the user buffer. Returns the
+ * number of bytes copied. */
+size_t fifo_buf_peek (struct fifo_buf *b, char *user_buf, size_t user_buf_size)
 {
-	size_t user_buf_pos = 0, written = 0;
+	size_t head, to_copy, pos, first;
 
 	assert (b != NULL);
-	assert (b->buf != NULL);
 
-	while (b->fill && written < user_buf_size) {
-		size_t to_copy = b->pos + b->fill <= b->size
-			? b->fill : b->size - b->pos;
+	head = __atomic_load_n (&b->head, __ATOMIC_ACQUIRE);
+	to_copy = MIN(user_buf_size, fill_between (b, b->tail, head));
 
-		if (to_copy > user_buf_size - written)
-			to_copy = user_buf_size - written;
+	pos = b->tail >= b->size ? b->tail - b->size : b->tail;
+	first = MIN(to_copy, b->size - pos);
+	memcpy (user_buf, b->buf + pos, first);
+	memcpy (user_buf + first, b->buf, to_copy - first);
 
-		memcpy (user_buf + user_buf_pos, b->buf + b->pos, to_copy);
-		user_buf_pos += to_copy;
-		written += to_copy;
+	return to_copy;
+}
 
-		b->fill -= to_copy;
-		b->pos += to_copy;
-		if (b->pos == b->size)
-			b->pos = 0;
-	}
+size_t fifo_buf_get (struct fifo_buf *b, char *user_buf, size_t user_buf_size)
+{
+	size_t to_copy;
 
-	return written;
+	assert (b != NULL);
+
+	to_copy = fifo_buf_peek (b, user_buf, user_buf_size);
+	fifo_buf_consume (b, to_copy);
+
+	return to_copy;
 }
 
 /* Get the amount of free space in the buffer. */
 size_t fifo_buf_get_space (const struct fifo_buf *b)
 {
 	assert (b != NULL);
-	assert (b->buf != NULL);
-
-	return b->size - b->fill;
 
+	return b->size - fifo_buf_get_fill (b);
 }
 
 size_t fifo_buf_get_fill (const struct fifo_buf *b)
 {
+	size_t head, tail;
+
 	assert (b != NULL);
-	return b->fill;
+
+	tail = __atomic_load_n (&b->tail, __ATOMIC_SEQ_CST);
+	head = __atomic_load_n (&b->head, __ATOMIC_SEQ_CST);
+
+	/* In a thread other than the producer and the consumer both can move
+	 * between the loads, so the head may be more than size ahead of the
+	 * tail we have seen. */
+	return MIN(fill_between (b, tail, head), b->size);
 }
 
 size_t fifo_buf_get_size (const struct fifo_buf *b)
@@ -167,8 +384,62 @@ size_t fifo_buf_get_size (const struct fifo_buf *b)
 	return b->size;
 }
 
+/* Drop the buffer content.  This is a consumer's operation. */
 void fifo_buf_clear (struct fifo_buf *b)
 {
 	assert (b != NULL);
-	b->fill = 0;
+
+	__atomic_store_n (&b->tail, __atomic_load_n (&b->head, __ATOMIC_ACQUIRE),
+			__ATOMIC_SEQ_CST);
+	wake_waiting (b);
+}
+
+/* Announce that the calling thread is going to wait.  Returns the value to
+ * pass to fifo_buf_wait() after checking the condition waited for. */
+int fifo_buf_wait_prepare (struct fifo_buf *b)
+{
+	int seq;
+
+	assert (b != NULL);
+
+	seq = __atomic_load_n (&b->wake_seq, __ATOMIC_SEQ_CST);
+	__atomic_store_n (&b->waiting, 1, __ATOMIC_SEQ_CST);
+
+	return seq;
+}
+
+/* Sleep until fifo_buf_wake() is called, unless it already was called
+ * after fifo_buf_wait_prepare() returned seq.  May return spuriously. */
+void fifo_buf_wait (struct fifo_buf *b, const int seq)
+{
+	assert (b != NULL);
+
+#ifdef HAVE_LINUX_FUTEX_H
+	syscall (SYS_futex, &b->wake_seq, FUTEX_WAIT_PRIVATE, seq,
+			NULL, NULL, 0);
+#else
+	LOCK (b->wait_mtx);
+	while (__atomic_load_n (&b->wake_seq, __ATOMIC_SEQ_CST) == seq)
+		pthread_cond_wait (&b->wait_cond, &b->wait_mtx);
+	UNLOCK (b->wait_mtx);
+#endif
+}
+
+/* Wake up all threads waiting in fifo_buf_wait(). */
+void fifo_buf_wake (struct fifo_buf *b)
+{
+	assert (b != NULL);
+
+	__atomic_store_n (&b->waiting, 0, __ATOMIC_SEQ_CST);
+
+#ifdef HAVE_LINUX_FUTEX_H
+	__atomic_add_fetch (&b->wake_seq, 1, __ATOMIC_SEQ_CST);
+	syscall (SYS_futex, &b->wake_seq, FUTEX_WAKE_PRIVATE, INT_MAX,
+			NULL, NULL, 0);
+#else
+	LOCK (b->wait_mtx);
+	__atomic_add_fetch (&b->wake_seq, 1, __ATOMIC_SEQ_CST);
+	pthread_cond_broadcast (&b->wait_cond);
+	UNLOCK (b->wait_mtx);
+#endif
 }
@@ -9,13 +9,21 @@ struct fifo_buf;
 
 struct fifo_buf *fifo_buf_new (const size_t size);
 void fifo_buf_free (struct fifo_buf *b);
+void fifo_buf_prefault (struct fifo_buf *b);
 size_t fifo_buf_put (struct fifo_buf *b, const char *data, size_t size);
 size_t fifo_buf_get (struct fifo_buf *b, char *user_buf, size_t user_buf_size);
 size_t fifo_buf_peek (struct fifo_buf *b, char *user_buf, size_t user_buf_size);
+char *fifo_buf_reserve_write (struct fifo_buf *b, size_t *len);
+void fifo_buf_commit_write (struct fifo_buf *b, const size_t len);
+const char *fifo_buf_peek_read (struct fifo_buf *b, size_t *len);
+void fifo_buf_consume (struct fifo_buf *b, const size_t len);
 size_t fifo_buf_get_space (const struct fifo_buf *b);
 void fifo_buf_clear (struct fifo_buf *b);
 size_t fifo_buf_get_fill (const struct fifo_buf *b);
 size_t fifo_buf_get_size (const struct fifo_buf *b);
+int fifo_buf_wait_prepare (struct fifo_buf *b);
+void fifo_buf_wait (struct fifo_buf *b, const int seq);
+void fifo_buf_wake (struct fifo_buf *b);
 
 #ifdef __cplusplus
 }
@@ -52,6 +52,7 @@
 #include "themes.h"
 #include "softmixer.h"
 #include "utf8.h"
+#include "status_page.h"
 
 #define INTERFACE_LOG	"mocp_client_log"
 #define PLAYLIST_FILE	"playlist.m3u"
@@ -61,6 +62,10 @@
 /* Socket of the server connection. */
 static int srv_sock = -1;
 
+/* Status read from the status page instead of asking the server, used by
+ * the command line functions. */
+static const struct status_page *srv_status = NULL;
+
 static struct plist *playlist = NULL; /* our playlist */
 static struct plist *queue = NULL; /* our queue */
 static struct plist *dir_plist = NULL; /* contents of the current directory */
@@ -101,6 +106,22 @@ static time_t last_menu_move_time = (time_t)0;
 #ifdef HAVE_SYS_INOTIFY_H
 static int inotify_fd = -1;
 static int inotify_wd = -1;
+
+/* Changes in the current directory reported by inotify are collected and
+ * applied at once when no new event came for DIR_CHANGES_DELAY ms (but not
+ * later than DIR_CHANGES_MAX_DELAY ms after the first one). */
+#define DIR_CHANGES_DELAY	300
+#define DIR_CHANGES_MAX_DELAY	2000
+
+static lists_t_strs *dir_changes = NULL; /* names of changed entries */
+static bool dir_changes_reread = false;	/* the whole directory must be read */
+static bool dir_changes_pending = false;
+static struct timespec dir_changes_first;
+static struct timespec dir_changes_last;
+
+/* Subdirectories and playlists of the current directory. */
+static lists_t_strs *cwd_dirs = NULL;
+static lists_t_strs *cwd_playlists = NULL;
 #endif
 
 static void sig_quit (int sig LOGIT_ONLY)
@@ -157,6 +178,13 @@ static void send_item_to_srv (const struct plist_item *item)
 		fatal ("Can't send() item to the server!");
 }
 
+/* Send what was collected since send_cork(srv_sock). */
+static void uncork_srv ()
+{
+	if (!send_uncork(srv_sock))
+		fatal ("Can't send() data to the server!");
+}
+
 static int get_int_from_srv ()
 {
 	int num;
@@ -232,6 +260,16 @@ static struct tag_ev_response *recv_tags_data_from_srv ()
 	return r;
 }
 
+static struct tag_ev_bulk *recv_tags_bulk_data_from_srv ()
+{
+	struct tag_ev_bulk *b;
+
+	if (!(b = recv_tag_bulk_ev_data(srv_sock)))
+		fatal ("Can't receive tags event's data from the server!");
+
+	return b;
+}
+
 static struct move_ev_data *recv_move_ev_data_from_srv ()
 {
 	struct move_ev_data *d;
@@ -254,9 +292,12 @@ static void *get_event_data (const int type)
 		case EV_QUEUE_DEL:
 		case EV_STATUS_MSG:
 		case EV_SRV_ERROR:
+		case EV_FILE_CHANGED:
 			return get_str_from_srv ();
 		case EV_FILE_TAGS:
 			return recv_tags_data_from_srv ();
+		case EV_FILE_TAGS_BULK:
+			return recv_tags_bulk_data_from_srv ();
 		case EV_PLIST_MOVE:
 		case EV_QUEUE_MOVE:
 			return recv_move_ev_data_from_srv ();
@@ -312,9 +353,11 @@ static int send_tags_request (const char *file, const int tags_sel)
 	assert (tags_sel != 0);
 
 	if (file_type(file) == F_SOUND) {
+		send_cork (srv_sock);
 		send_int_to_srv (CMD_GET_FILE_TAGS);
 		send_str_to_srv (file);
 		send_int_to_srv (tags_sel);
+		uncork_srv ();
 		debug ("Asking for tags for %s", file);
 
 		return 1;
@@ -330,11 +373,13 @@ static void send_items_to_clients (const struct plist *plist)
 {
 	int i;
 
+	send_cork (srv_sock);
 	for (i = 0; i < plist->num; i++)
 		if (!plist_deleted(plist, i)) {
 			send_int_to_srv (CMD_CLI_PLIST_ADD);
 			send_item_to_srv (&plist->items[i]);
 		}
+	uncork_srv ();
 }
 
 static void init_playlists ()
@@ -347,8 +392,10 @@ static void init_playlists ()
 	plist_init (queue);
 
 	/* set serial numbers for the playlist */
-	send_int_to_srv (CMD_GET_SERIAL);
-	plist_set_serial (playlist, get_data_int());
+	if (!srv_status) {
+		send_int_to_srv (CMD_GET_SERIAL);
+		plist_set_serial (playlist, get_data_int());
+	}
 }
 
 static void file_info_reset (struct file_info *f)
@@ -443,42 +490,63 @@ static int get_mixer_value ()
 
 static int get_state ()
 {
+	if (srv_status)
+		return srv_status->state;
+
 	send_int_to_srv (CMD_GET_STATE);
 	return get_data_int ();
 }
 
 static int get_channels ()
 {
+	if (srv_status)
+		return srv_status->channels;
+
 	send_int_to_srv (CMD_GET_CHANNELS);
 	return get_data_int ();
 }
 
 static int get_rate ()
 {
+	if (srv_status)
+		return srv_status->rate;
+
 	send_int_to_srv (CMD_GET_RATE);
 	return get_data_int ();
 }
 
 static int get_bitrate ()
 {
+	if (srv_status)
+		return srv_status->bitrate;
+
 	send_int_to_srv (CMD_GET_BITRATE);
 	return get_data_int ();
 }
 
 static int get_avg_bitrate ()
 {
+	if (srv_status)
+		return srv_status->avg_bitrate;
+
 	send_int_to_srv (CMD_GET_AVG_BITRATE);
 	return get_data_int ();
 }
 
 static int get_curr_time ()
 {
+	if (srv_status)
+		return srv_status->ctime;
+
 	send_int_to_srv (CMD_GET_CTIME);
 	return get_data_int ();
 }
 
 static char *get_curr_file ()
 {
+	if (srv_status)
+		return xstrdup (srv_status->file);
+
 	send_int_to_srv (CMD_GET_SNAME);
 	return get_data_str ();
 }
@@ -587,29 +655,95 @@ static int get_tags_setting ()
 	return needed_tags;
 }
 
+/* Return != 0 if the item is a sound file missing any of the tags. */
+static int needs_tags (const struct plist *plist, const int num,
+		const int tags_sel)
+{
+	return !plist_deleted(plist, num)
+		&& (!plist->items[num].tags
+			|| ~plist->items[num].tags->filled & tags_sel)
+		&& file_type(plist->items[num].file) == F_SOUND;
+}
+
+/* Send CMD_GET_FILE_TAGS_BULK for the files (the first urgent of them are
+ * visible in the menu) and clear the list. */
+static void send_tags_bulk_request (lists_t_strs *files, const int tags_sel,
+		const int urgent)
+{
+	send_cork (srv_sock);
+	send_int_to_srv (CMD_GET_FILE_TAGS_BULK);
+	send_int_to_srv (tags_sel);
+	send_int_to_srv (urgent);
+	if (!send_strs(srv_sock, files))
+		fatal ("Can't send() files to the server!");
+	uncork_srv ();
+	debug ("Asking for tags for %d files", lists_strs_size (files));
+
+	lists_strs_clear (files);
+}
+
 /* For each file in the playlist, send a request for all the given tags if
- * the file is missing any of those tags.  Return the number of requests. */
+ * the file is missing any of those tags.  Files visible in the menu are
+ * requested first.  Return the number of requests. */
 static int ask_for_tags (const struct plist *plist, const int tags_sel)
 {
 	int i;
-	int req = 0;
+	int req = 0, urgent = 0;
+	char *requested;
+	lists_t_strs *files;
 
 	assert (plist != NULL);
 
-	if (tags_sel != 0) {
-		for (i = 0; i < plist->num; i++) {
-			if (!plist_deleted(plist, i) &&
-			    (!plist->items[i].tags ||
-			     ~plist->items[i].tags->filled & tags_sel)) {
-				char *file;
+	if (tags_sel == 0 || plist->num == 0)
+		return 0;
 
-				file = plist_get_file (plist, i);
-				req += send_tags_request (file, tags_sel);
-				free (file);
+	requested = (char *)xcalloc (plist->num, sizeof (char));
+	files = lists_strs_new (TAGS_BULK_MAX);
+
+	if (plist == dir_plist || plist == playlist) {
+		struct plist *shown = plist == dir_plist ? dir_plist : playlist;
+		lists_t_strs *visible = lists_strs_new (64);
+
+		iface_get_visible_files (plist == dir_plist ? IFACE_MENU_DIR
+				: IFACE_MENU_PLIST, visible);
+
+		for (i = 0; i < lists_strs_size (visible)
+				&& urgent < TAGS_BULK_MAX; i++) {
+			int n = plist_find_fname (shown,
+					lists_strs_at (visible, i));
+
+			if (n != -1 && !requested[n]
+					&& needs_tags (plist, n, tags_sel)) {
+				lists_strs_append (files, plist->items[n].file);
+				requested[n] = 1;
+				urgent++;
 			}
 		}
+
+		lists_strs_free (visible);
 	}
 
+	for (i = 0; i < plist->num; i++) {
+		if (requested[i] || !needs_tags (plist, i, tags_sel))
+			continue;
+
+		if (lists_strs_size (files) == TAGS_BULK_MAX) {
+			req += lists_strs_size (files);
+			send_tags_bulk_request (files, tags_sel, urgent);
+			urgent = 0;
+		}
+
+		lists_strs_append (files, plist->items[i].file);
+	}
+
+	if (!lists_strs_empty (files)) {
+		req += lists_strs_size (files);
+		send_tags_bulk_request (files, tags_sel, urgent);
+	}
+
+	lists_strs_free (files);
+	free (requested);
+
 	return req;
 }
 
@@ -730,6 +864,37 @@ static void ev_file_tags (const struct tag_ev_response *data)
 	}
 }
 
+/* Handle EV_FILE_TAGS_BULK. */
+static void ev_file_tags_bulk (const struct tag_ev_bulk *data)
+{
+	int i;
+
+	assert (data != NULL);
+
+	for (i = 0; i < data->num; i++)
+		ev_file_tags (&data->items[i]);
+}
+
+/* Handle EV_FILE_CHANGED: ask again for the tags of the file if it's in one
+ * of our menus. */
+static void ev_file_changed (const char *file)
+{
+	int tags_sel = get_tags_setting ();
+	int watched = 0;
+
+	assert (file != NULL);
+
+#ifdef HAVE_SYS_INOTIFY_H
+	/* Our own inotify watch takes care of the current directory. */
+	watched = inotify_wd >= 0;
+#endif
+
+	if (tags_sel && (plist_find_fname (playlist, file) != -1
+				|| (!watched
+					&& plist_find_fname (dir_plist, file) != -1)))
+		send_tags_request (file, tags_sel);
+}
+
 /* Update the current time. */
 static void update_ctime ()
 {
@@ -950,6 +1115,7 @@ static void forward_playlist ()
 
 	debug ("Forwarding the playlist...");
 
+	send_cork (srv_sock);
 	send_int_to_srv (CMD_SEND_PLIST);
 	send_int_to_srv (plist_get_serial(playlist));
 
@@ -958,6 +1124,7 @@ static void forward_playlist ()
 			send_item_to_srv (&playlist->items[i]);
 
 	send_item_to_srv (NULL);
+	uncork_srv ();
 }
 
 static int recv_server_plist (struct plist *plist)
@@ -1186,6 +1353,12 @@ static void server_event (const int event, void *data)
 		case EV_FILE_TAGS:
 			ev_file_tags ((struct tag_ev_response *)data);
 			break;
+		case EV_FILE_TAGS_BULK:
+			ev_file_tags_bulk ((struct tag_ev_bulk *)data);
+			break;
+		case EV_FILE_CHANGED:
+			ev_file_changed ((char *)data);
+			break;
 		case EV_AVG_BITRATE:
 			curr_file.avg_bitrate = get_avg_bitrate ();
 			break;
@@ -1246,7 +1419,21 @@ static void fill_tags (struct plist *plist, const int tags_sel,
 			data = get_event_data (type);
 		}
 
-		if (type == EV_FILE_TAGS) {
+		if (type == EV_FILE_TAGS_BULK) {
+			struct tag_ev_bulk *b = (struct tag_ev_bulk *)data;
+			int i, n;
+
+			for (i = 0; i < b->num; i++) {
+				struct tag_ev_response *ev = &b->items[i];
+
+				if ((n = plist_find_fname(plist, ev->file)) != -1) {
+					if ((ev->tags->filled & tags_sel))
+						files--;
+					update_item_tags (plist, n, ev->tags);
+				}
+			}
+		}
+		else if (type == EV_FILE_TAGS) {
 			struct tag_ev_response *ev
 				= (struct tag_ev_response *)data;
 			int n;
@@ -1335,13 +1522,30 @@ static int go_to_dir (const char *dir, const int reload)
 		iface_set_dir_content (IFACE_MENU_DIR, dir_plist, dirs, playlists);
 #ifdef HAVE_SYS_INOTIFY_H
 		if (inotify_fd >=0) {
-			inotify_wd = inotify_add_watch(inotify_fd, new_dir, IN_MODIFY | IN_CREATE | IN_DELETE);
+			inotify_wd = inotify_add_watch(inotify_fd, new_dir,
+					IN_CLOSE_WRITE | IN_CREATE | IN_DELETE
+					| IN_MOVED_FROM | IN_MOVED_TO
+					| IN_DELETE_SELF | IN_MOVE_SELF);
 			debug("TG: adding watch for dir %s: %s", new_dir, (inotify_wd == -1) ? xstrerror (errno) : "OK");
 		}
 #endif
 	}
+#ifdef HAVE_SYS_INOTIFY_H
+	/* Keep the lists, inotify changes are applied to them. */
+	if (cwd_dirs) {
+		lists_strs_free (cwd_dirs);
+		lists_strs_free (cwd_playlists);
+	}
+	cwd_dirs = dirs;
+	cwd_playlists = playlists;
+	if (dir_changes)
+		lists_strs_clear (dir_changes);
+	dir_changes_reread = false;
+	dir_changes_pending = false;
+#else
 	lists_strs_free (dirs);
 	lists_strs_free (playlists);
+#endif
 	if (going_up)
 		iface_set_curr_item_title (last_dir);
 
@@ -2086,6 +2290,212 @@ static void reread_dir ()
 		go_dir_up();
 }
 
+#ifdef HAVE_SYS_INOTIFY_H
+/* Return the number of milliseconds since the time. */
+static long ms_since (const struct timespec *t)
+{
+	struct timespec now;
+
+	clock_gettime (CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - t->tv_sec) * 1000L
+		+ (now.tv_nsec - t->tv_nsec) / 1000000L;
+}
+
+/* Read the pending inotify events and remember which entries of the
+ * current directory changed. */
+static void read_inotify_events ()
+{
+	char buf[4096]
+		__attribute__ ((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	ssize_t len;
+	char *p;
+
+	len = read (inotify_fd, buf, sizeof(buf));
+	if (len <= 0) {
+		if (len == -1 && errno != EINTR && errno != EAGAIN)
+			log_errno ("Can't read inotify events", errno);
+		return;
+	}
+
+	if (!dir_changes)
+		dir_changes = lists_strs_new (16);
+
+	for (p = buf; p < buf + len; p += sizeof(struct inotify_event) + ev->len) {
+		ev = (const struct inotify_event *)p;
+
+		if (ev->mask & IN_Q_OVERFLOW)
+			dir_changes_reread = true;
+		else if (ev->wd != inotify_wd)
+			continue;
+		else if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF))
+			dir_changes_reread = true;
+		else if (ev->len > 0 && !lists_strs_exists (dir_changes, ev->name))
+			lists_strs_append (dir_changes, ev->name);
+	}
+
+	clock_gettime (CLOCK_MONOTONIC, &dir_changes_last);
+	if (!dir_changes_pending) {
+		dir_changes_first = dir_changes_last;
+		dir_changes_pending = true;
+	}
+}
+
+/* Return the number of milliseconds left until the directory changes
+ * should be applied. */
+static long dir_changes_wait ()
+{
+	long wait;
+
+	wait = MIN(DIR_CHANGES_DELAY - ms_since (&dir_changes_last),
+	           DIR_CHANGES_MAX_DELAY - ms_since (&dir_changes_first));
+
+	return MAX(wait, 0);
+}
+
+/* Add the path to the list if present is true, remove it otherwise.
+ * Return true if the list was changed. */
+static bool update_dir_list (lists_t_strs *list, const char *path,
+		const bool present)
+{
+	int i;
+
+	for (i = 0; i < lists_strs_size (list); i++) {
+		if (!strcmp (lists_strs_at (list, i), path))
+			break;
+	}
+
+	if (present && i == lists_strs_size (list)) {
+		lists_strs_append (list, path);
+		return true;
+	}
+
+	if (!present && i < lists_strs_size (list)) {
+		char *last = lists_strs_pop (list);
+
+		if (i < lists_strs_size (list))
+			free (lists_strs_swap (list, i, last));
+		else
+			free (last);
+		return true;
+	}
+
+	return false;
+}
+
+/* Apply the collected inotify changes to the directory menu: add, remove
+ * and update only the changed entries. */
+static void apply_dir_changes ()
+{
+	bool show_hidden = options_get_bool ("ShowHiddenFiles");
+	bool dirs_changed = false;
+	bool plist_changed = false;
+	lists_t_strs *added, *modified;
+	char *removed;
+	int i;
+
+	dir_changes_pending = false;
+
+	if (dir_changes_reread) {
+		debug ("Directory changed too much, rereading");
+		reread_dir ();
+		return;
+	}
+
+	debug ("Applying %d directory changes", lists_strs_size (dir_changes));
+
+	added = lists_strs_new (lists_strs_size (dir_changes));
+	modified = lists_strs_new (lists_strs_size (dir_changes));
+	removed = (char *)xcalloc (dir_plist->num + 1, sizeof(char));
+
+	for (i = 0; i < lists_strs_size (dir_changes); i++) {
+		const char *name = lists_strs_at (dir_changes, i);
+		char path[PATH_MAX];
+		enum file_type type;
+		int n;
+
+		if (!show_hidden && name[0] == '.')
+			continue;
+
+		if (snprintf (path, sizeof(path), "%s/%s",
+		              strcmp (cwd, "/") ? cwd : "", name) >= ssizeof(path))
+			continue;
+
+		type = file_type (path);
+		n = plist_find_fname (dir_plist, path);
+
+		if (n != -1) {
+			if (type != F_SOUND) {
+				removed[n] = 1;
+				plist_changed = true;
+			}
+			else {
+				time_t mtime = get_mtime (path);
+
+				if (mtime != dir_plist->items[n].mtime) {
+					dir_plist->items[n].mtime = mtime;
+					lists_strs_append (modified, path);
+				}
+			}
+		}
+		else if (type == F_SOUND) {
+			lists_strs_append (added, path);
+			plist_changed = true;
+		}
+
+		if (update_dir_list (cwd_dirs, path, type == F_DIR))
+			dirs_changed = true;
+		if (update_dir_list (cwd_playlists, path, type == F_PLAYLIST))
+			dirs_changed = true;
+	}
+
+	lists_strs_clear (dir_changes);
+
+	if (plist_changed) {
+		struct plist *new_plist;
+
+		new_plist = (struct plist *)xmalloc (sizeof(struct plist));
+		plist_init (new_plist);
+
+		for (i = 0; i < dir_plist->num; i++) {
+			if (!plist_deleted (dir_plist, i) && !removed[i])
+				plist_add_from_item (new_plist, &dir_plist->items[i]);
+		}
+		for (i = 0; i < lists_strs_size (added); i++)
+			plist_add (new_plist, lists_strs_at (added, i));
+
+		plist_free (dir_plist);
+		free (dir_plist);
+		dir_plist = new_plist;
+
+		switch_titles_file (dir_plist);
+		plist_sort_fname (dir_plist);
+	}
+
+	if (dirs_changed) {
+		lists_strs_sort (cwd_dirs, sort_dirs_func);
+		lists_strs_sort (cwd_playlists, sort_strcmp_func);
+	}
+
+	if (plist_changed || dirs_changed) {
+		iface_update_dir_content (IFACE_MENU_DIR, dir_plist, cwd_dirs,
+				cwd_playlists);
+		iface_update_queue_positions (queue, NULL, dir_plist, NULL);
+	}
+
+	/* The server rereads tags of modified files (their mtime changed). */
+	if (!lists_strs_empty (modified) && get_tags_setting ())
+		send_tags_bulk_request (modified, get_tags_setting (), 0);
+	if (plist_changed)
+		ask_for_tags (dir_plist, get_tags_setting ());
+
+	lists_strs_free (added);
+	lists_strs_free (modified);
+	free (removed);
+}
+#endif
+
 /* Clear the playlist on user request. */
 static void cmd_clear_playlist ()
 {
@@ -3529,12 +3939,16 @@ static void get_and_handle_event ()
 {
 	int type;
 
-	if (!get_int_from_srv_noblock(&type)) {
-		debug ("Getting event would block.");
-		return;
-	}
+	/* Handle also the events which were received together with this
+	 * one. */
+	do {
+		if (!get_int_from_srv_noblock(&type)) {
+			debug ("Getting event would block.");
+			return;
+		}
 
-	server_event (type, get_event_data(type));
+		server_event (type, get_event_data(type));
+	} while (!want_quit && recv_buffered(srv_sock) >= ssizeof(int));
 }
 
 /* Handle events from the queue. */
@@ -3681,9 +4095,18 @@ void interface_loop ()
 #ifdef HAVE_SYS_INOTIFY_H
 		if (inotify_fd >= 0)
 			FD_SET (inotify_fd, &fds);
+		if (dir_changes_pending) {
+			long wait = dir_changes_wait ();
 
+			timeout.tv_sec = wait / 1000;
+			timeout.tv_nsec = (wait % 1000) * 1000000L;
+		}
 #endif
 
+		/* Events already received don't wake pselect() up. */
+		if (recv_buffered(srv_sock) >= ssizeof(int))
+			get_and_handle_event ();
+
 		dequeue_events ();
 #ifdef HAVE_SYS_INOTIFY_H
 		ret = pselect (MAX(srv_sock,inotify_fd) + 1, &fds, NULL, NULL, &timeout, NULL);
@@ -3718,20 +4141,19 @@ void interface_loop ()
 					get_and_handle_event ();
 				do_silent_seek ();
 #ifdef HAVE_SYS_INOTIFY_H
-				if (FD_ISSET(inotify_fd, &fds)) {
-//					char buffer[1024];
-					debug("TG: inotify event, refreshing");
-					ret = read(inotify_fd, NULL, 100 * sizeof (struct inotify_event)); // only needed to empty the event queue
-//					lseek(inotify_fd,0,SEEK_END);
-					reread_dir();
-				}
+				if (inotify_fd >= 0 && FD_ISSET(inotify_fd, &fds))
+					read_inotify_events ();
 #endif
-
 			}
 		}
 		else if (user_wants_interrupt())
 			handle_interrupt ();
 
+#ifdef HAVE_SYS_INOTIFY_H
+		if (!want_quit && dir_changes_pending && dir_changes_wait () == 0)
+			apply_dir_changes ();
+#endif
+
 		if (!want_quit)
 			update_mixer_value ();
 	}
@@ -3781,6 +4203,12 @@ void interface_end ()
 		inotify_rm_watch(inotify_fd, inotify_wd);
 	if (inotify_fd >= 0)
 		close(inotify_fd);
+	if (dir_changes)
+		lists_strs_free (dir_changes);
+	if (cwd_dirs) {
+		lists_strs_free (cwd_dirs);
+		lists_strs_free (cwd_playlists);
+	}
 #endif
 
 	windows_end ();
@@ -4032,10 +4460,39 @@ static struct file_tags *get_tags_no_iface (const char *file,
 	return tags;
 }
 
-void interface_cmdline_file_info (const int server_sock)
+/* Get tags of the currently played file without the interface. */
+static struct file_tags *get_curr_file_tags (const char *file)
+{
+	struct file_tags *tags;
+
+	if (!srv_status) {
+		if (file_type(file) == F_URL) {
+			send_int_to_srv (CMD_GET_TAGS);
+			return get_data_tags ();
+		}
+		return get_tags_no_iface (file, TAGS_COMMENTS | TAGS_TIME);
+	}
+
+	tags = tags_new ();
+	if (srv_status->title[0])
+		tags->title = xstrdup (srv_status->title);
+	if (srv_status->artist[0])
+		tags->artist = xstrdup (srv_status->artist);
+	if (srv_status->album[0])
+		tags->album = xstrdup (srv_status->album);
+	tags->track = srv_status->track;
+	tags->time = srv_status->time;
+	tags->filled = TAGS_COMMENTS | TAGS_TIME;
+
+	return tags;
+}
+
+void interface_cmdline_file_info (const int server_sock,
+		const struct status_page *status)
 {
 	srv_sock = server_sock;	/* the interface is not initialized, so set it
 				   here */
+	srv_status = status;
 	init_playlists ();
 	file_info_reset (&curr_file);
 	file_info_block_init (&curr_file);
@@ -4060,15 +4517,7 @@ void interface_cmdline_file_info (const int server_sock)
 
 		if (curr_file.file[0]) {
 
-			/* get tags */
-			if (file_type(curr_file.file) == F_URL) {
-				send_int_to_srv (CMD_GET_TAGS);
-				curr_file.tags = get_data_tags ();
-			}
-			else
-				curr_file.tags = get_tags_no_iface (
-						curr_file.file,
-						TAGS_COMMENTS | TAGS_TIME);
+			curr_file.tags = get_curr_file_tags (curr_file.file);
 
 			/* get the title */
 			if (curr_file.tags->title)
@@ -4316,7 +4765,7 @@ Bitrate     %b
 Rate        %r
 */
 void interface_cmdline_formatted_info (const int server_sock,
-		const char *format_str)
+		const char *format_str, const struct status_page *status)
 {
 	typedef struct {
 		char *state;
@@ -4347,6 +4796,7 @@ void interface_cmdline_formatted_info (const int server_sock,
 
 	srv_sock = server_sock;	/* the interface is not initialized, so set it
 				   here */
+	srv_status = status;
 	init_playlists ();
 	file_info_reset (&curr_file);
 	file_info_block_init (&curr_file);
@@ -4381,15 +4831,7 @@ void interface_cmdline_formatted_info (const int server_sock,
 
 		if (curr_file.file[0]) {
 
-			/* get tags */
-			if (file_type(curr_file.file) == F_URL) {
-				send_int_to_srv (CMD_GET_TAGS);
-				curr_file.tags = get_data_tags ();
-			}
-			else
-				curr_file.tags = get_tags_no_iface (
-						curr_file.file,
-						TAGS_COMMENTS | TAGS_TIME);
+			curr_file.tags = get_curr_file_tags (curr_file.file);
 
 			/* get the title */
 			if (curr_file.tags->title)
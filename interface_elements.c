@@ -4369,6 +4369,19 @@ void iface_make_visible (const enum iface_menu menu, const char *file)
 	iface_refresh_screen ();
 }
 
+/* Add the sound files currently visible in the menu to the list. */
+void iface_get_visible_files (const enum iface_menu menu,
+		lists_t_strs *files)
+{
+	struct side_menu *m;
+
+	assert (files != NULL);
+
+	m = find_side_menu (&main_win,
+			menu == IFACE_MENU_DIR ? MENU_DIR : MENU_PLAYLIST);
+	menu_get_visible_files (m->menu.list.main, files);
+}
+
 void iface_switch_to_theme_menu ()
 {
 	main_win_create_themes_menu (&main_win);
@@ -134,6 +134,8 @@ void iface_toggle_layout ();
 void iface_toggle_percent ();
 void iface_swap_plist_items (const char *file1, const char *file2);
 void iface_make_visible (const enum iface_menu menu, const char *file);
+void iface_get_visible_files (const enum iface_menu menu,
+		lists_t_strs *files);
 void iface_switch_to_theme_menu ();
 void iface_add_file (const char *file, const char *title,
 		const enum file_type type);
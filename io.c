@@ -205,10 +205,10 @@ static off_t io_seek_buffered (struct io_stream *s, const off_t where)
 
 	LOCK (s->buf_mtx);
 	fifo_buf_clear (s->buf);
-	pthread_cond_signal (&s->buf_free_cond);
 	s->after_seek = 1;
 	s->eof = 0;
 	UNLOCK (s->buf_mtx);
+	fifo_buf_wake (s->buf);
 
 	return res;
 }
@@ -298,9 +298,8 @@ void io_abort (struct io_stream *s)
 		LOCK (s->buf_mtx);
 		s->stop_read_thread = 1;
 		io_wake_up (s);
-		pthread_cond_broadcast (&s->buf_fill_cond);
-		pthread_cond_broadcast (&s->buf_free_cond);
 		UNLOCK (s->buf_mtx);
+		fifo_buf_wake (s->buf);
 		logit ("done");
 	}
 }
@@ -348,12 +347,6 @@ void io_close (struct io_stream *s)
 		if (s->buffered) {
 			fifo_buf_free (s->buf);
 			s->buf = NULL;
-			rc = pthread_cond_destroy (&s->buf_free_cond);
-			if (rc != 0)
-				log_errno ("Destroying buf_free_cond failed", rc);
-			rc = pthread_cond_destroy (&s->buf_fill_cond);
-			if (rc != 0)
-				log_errno ("Destroying buf_fill_cond failed", rc);
 		}
 
 		if (s->metadata.title)
@@ -379,6 +372,9 @@ void io_close (struct io_stream *s)
 	logit ("done");
 }
 
+/* The read thread is the only producer of the stream buffer.  It puts the
+ * data holding io_mtx, so a seek (which clears the buffer holding io_mtx)
+ * can't leave data read from the old position in the buffer. */
 static void *io_read_thread (void *data)
 {
 	struct io_stream *s = (struct io_stream *)data;
@@ -389,6 +385,7 @@ static void *io_read_thread (void *data)
 		char read_buf[8096];
 		int read_buf_fill = 0;
 		int read_buf_pos = 0;
+		int seq;
 
 		LOCK (s->io_mtx);
 		debug ("Reading...");
@@ -398,7 +395,6 @@ static void *io_read_thread (void *data)
 		UNLOCK (s->buf_mtx);
 
 		read_buf_fill = io_internal_read (s, 0, read_buf, sizeof(read_buf));
-		UNLOCK (s->io_mtx);
 		if (read_buf_fill > 0)
 			debug ("Read %d bytes", read_buf_fill);
 
@@ -406,6 +402,7 @@ static void *io_read_thread (void *data)
 
 		if (s->stop_read_thread) {
 			UNLOCK (s->buf_mtx);
+			UNLOCK (s->io_mtx);
 			break;
 		}
 
@@ -413,22 +410,33 @@ static void *io_read_thread (void *data)
 			s->errno_val = errno;
 			s->read_error = 1;
 			logit ("Exiting due to read error.");
-			pthread_cond_broadcast (&s->buf_fill_cond);
 			UNLOCK (s->buf_mtx);
+			UNLOCK (s->io_mtx);
+			fifo_buf_wake (s->buf);
 			break;
 		}
 
 		if (read_buf_fill == 0) {
 			s->eof = 1;
+			UNLOCK (s->buf_mtx);
+			UNLOCK (s->io_mtx);
 			debug ("EOF, waiting");
-			pthread_cond_broadcast (&s->buf_fill_cond);
-			pthread_cond_wait (&s->buf_free_cond, &s->buf_mtx);
+			fifo_buf_wake (s->buf);
+
+			seq = fifo_buf_wait_prepare (s->buf);
+			LOCK (s->buf_mtx);
+			if (s->eof && !s->stop_read_thread) {
+				UNLOCK (s->buf_mtx);
+				fifo_buf_wait (s->buf, seq);
+			}
+			else
+				UNLOCK (s->buf_mtx);
 			debug ("Got signal");
-			UNLOCK (s->buf_mtx);
 			continue;
 		}
 
 		s->eof = 0;
+		UNLOCK (s->buf_mtx);
 
 		while (read_buf_pos < read_buf_fill && !s->after_seek) {
 			size_t put;
@@ -445,24 +453,27 @@ static void *io_read_thread (void *data)
 			if (put > 0) {
 				debug ("Put %zu bytes into the buffer", put);
 				if (s->buf_fill_callback) {
-					UNLOCK (s->buf_mtx);
 					s->buf_fill_callback (s,
 						fifo_buf_get_fill (s->buf),
 						fifo_buf_get_size (s->buf),
 						s->buf_fill_callback_data);
-					LOCK (s->buf_mtx);
 				}
-				pthread_cond_broadcast (&s->buf_fill_cond);
 				read_buf_pos += put;
 				continue;
 			}
 
 			debug ("The buffer is full, waiting.");
-			pthread_cond_wait (&s->buf_free_cond, &s->buf_mtx);
+			seq = fifo_buf_wait_prepare (s->buf);
+			if (fifo_buf_get_space (s->buf) == 0
+					&& !s->stop_read_thread) {
+				UNLOCK (s->io_mtx);
+				fifo_buf_wait (s->buf, seq);
+				LOCK (s->io_mtx);
+			}
 			debug ("Some space in the buffer was freed");
 		}
 
-		UNLOCK (s->buf_mtx);
+		UNLOCK (s->io_mtx);
 	}
 
 	if (s->stop_read_thread)
@@ -552,11 +563,9 @@ struct io_stream *io_open (const char *file, const int buffered)
 
 	if (buffered) {
 		s->buf = fifo_buf_new (options_get_int("InputBuffer") * 1024);
+		fifo_buf_prefault (s->buf);
 		s->prebuffer = options_get_int("Prebuffering") * 1024;
 
-		pthread_cond_init (&s->buf_free_cond, NULL);
-		pthread_cond_init (&s->buf_fill_cond, NULL);
-
 		rc = pthread_create (&s->read_thread, NULL, io_read_thread, s);
 		if (rc != 0)
 			fatal ("Can't create read thread: %s", xstrerror (errno));
@@ -591,22 +600,29 @@ static ssize_t io_peek_internal (struct io_stream *s, void *buf, size_t count)
 
 	debug ("Peeking data...");
 
-	LOCK (s->buf_mtx);
-
 	/* Wait until enough data will be available */
-	while (io_ok_nolock(s) && !s->stop_read_thread
+	while (count > fifo_buf_get_fill (s->buf)
+			&& fifo_buf_get_space (s->buf)) {
+		int seq, wait;
+
+		seq = fifo_buf_wait_prepare (s->buf);
+		LOCK (s->buf_mtx);
+		wait = io_ok_nolock(s) && !s->stop_read_thread
 			&& count > fifo_buf_get_fill (s->buf)
 			&& fifo_buf_get_space (s->buf)
-			&& !s->eof) {
+			&& !s->eof;
+		UNLOCK (s->buf_mtx);
+
+		if (!wait)
+			break;
+
 		debug ("waiting...");
-		pthread_cond_wait (&s->buf_fill_cond, &s->buf_mtx);
+		fifo_buf_wait (s->buf, seq);
 	}
 
 	received = fifo_buf_peek (s->buf, buf, count);
 	debug ("Read %zd bytes", received);
 
-	UNLOCK (s->buf_mtx);
-
 	return io_ok(s) ? received : -1;
 }
 
@@ -616,44 +632,66 @@ void io_prebuffer (struct io_stream *s, const size_t to_fill)
 {
 	logit ("prebuffering to %zu bytes...", to_fill);
 
-	LOCK (s->buf_mtx);
-	while (io_ok_nolock(s) && !s->stop_read_thread && !s->eof
-	                       && to_fill > fifo_buf_get_fill(s->buf)) {
+	while (to_fill > fifo_buf_get_fill(s->buf)) {
+		int seq, wait;
+
+		seq = fifo_buf_wait_prepare (s->buf);
+		LOCK (s->buf_mtx);
+		wait = io_ok_nolock(s) && !s->stop_read_thread && !s->eof
+		                       && to_fill > fifo_buf_get_fill(s->buf);
+		UNLOCK (s->buf_mtx);
+
+		if (!wait)
+			break;
+
 		debug ("waiting (buffer %zu bytes full)", fifo_buf_get_fill (s->buf));
-		pthread_cond_wait (&s->buf_fill_cond, &s->buf_mtx);
+		fifo_buf_wait (s->buf, seq);
 	}
-	UNLOCK (s->buf_mtx);
 
 	logit ("done");
 }
 
+/* The data are taken from the buffer without locking, buf_mtx is only
+ * needed to check the stream state when the buffer is empty. */
 static ssize_t io_read_buffered (struct io_stream *s, void *buf, size_t count)
 {
 	ssize_t received = 0;
+	int read_error;
 
-	LOCK (s->buf_mtx);
+	while (received < (ssize_t)count) {
+		size_t got;
+		int seq, done;
 
-	while (received < (ssize_t)count && !s->stop_read_thread
-			&& ((!s->eof && !s->read_error)
-				|| fifo_buf_get_fill(s->buf))) {
-		if (fifo_buf_get_fill(s->buf)) {
-			received += fifo_buf_get (s->buf, (char *)buf + received,
-					count - received);
+		got = fifo_buf_get (s->buf, (char *)buf + received,
+				count - received);
+		if (got) {
+			received += got;
 			debug ("Read %zd bytes so far", received);
-			pthread_cond_signal (&s->buf_free_cond);
 			continue;
 		}
 
+		seq = fifo_buf_wait_prepare (s->buf);
+		LOCK (s->buf_mtx);
+		done = s->stop_read_thread
+			|| ((s->eof || s->read_error)
+				&& !fifo_buf_get_fill(s->buf));
+		UNLOCK (s->buf_mtx);
+
+		if (done)
+			break;
+
 		debug ("Buffer empty, waiting...");
-		pthread_cond_wait (&s->buf_fill_cond, &s->buf_mtx);
+		fifo_buf_wait (s->buf, seq);
 	}
 
 	debug ("done");
-	s->pos += received;
 
+	LOCK (s->buf_mtx);
+	s->pos += received;
+	read_error = s->read_error;
 	UNLOCK (s->buf_mtx);
 
-	return received ? received : (s->read_error ? -1 : 0);
+	return received ? received : (read_error ? -1 : 0);
 }
 
 /* Read data from the stream without buffering. If dont_move was set, the
@@ -78,11 +78,9 @@ struct io_stream
 	struct io_stream_curl curl;
 #endif
 
-	struct fifo_buf *buf;
-	pthread_mutex_t buf_mtx;
-	pthread_cond_t buf_free_cond; /* some space became available in the
-					 buffer */
-	pthread_cond_t buf_fill_cond; /* the buffer was filled with some data */
+	struct fifo_buf *buf;	/* read-ahead buffer, filled by the read
+				   thread without locking */
+	pthread_mutex_t buf_mtx; /* protects the state flags */
 	pthread_t read_thread;
 	int stop_read_thread;		/* request for stopping the read
 					   thread */
@@ -9,6 +9,7 @@
 
 #include <unistd.h>
 #include <stdio.h>
+#include <pthread.h>
 #include <jack/jack.h>
 #include <jack/types.h>
 #include <jack/ringbuffer.h>
@@ -39,11 +40,42 @@ static int volume_integer = 100;
 static int play;
 /* current sample rate */
 static int rate;
-/* flag set if xrun occurred that was our fault (the ringbuffer doesn't
- * contain enough data in the process callback) */
-static volatile int our_xrun = 0;
+/* number of times the ringbuffer didn't contain enough data in the
+ * process callback (our fault) */
+static int underruns = 0;
+/* number of xruns reported by the JACK server */
+static int server_xruns = 0;
+/* the counters already logged */
+static int logged_underruns = 0;
+static int logged_server_xruns = 0;
+/* set in the process callback when the ringbuffer ran dry, so one
+ * underrun is counted once */
+static int underrun = 1;
 /* set to 1 if jack client thread exits */
 static volatile int jack_shutdown = 0;
+/* signalled by the process callback when it made space in the
+ * ringbuffers */
+static pthread_mutex_t space_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t space_cond = PTHREAD_COND_INITIALIZER;
+
+/* Number of frames which can be read from both ringbuffers.  The first one
+ * is written first. */
+static size_t read_space_frames ()
+{
+	return MIN(jack_ringbuffer_read_space(ringbuffer[0]),
+			jack_ringbuffer_read_space(ringbuffer[1]))
+		/ sizeof(jack_default_audio_sample_t);
+}
+
+/* Wake up moc_jack_play() waiting for space.  Don't block in the realtime
+ * thread, the producer waits with a timeout if it misses the signal. */
+static void signal_space ()
+{
+	if (pthread_mutex_trylock(&space_mtx) == 0) {
+		pthread_cond_signal (&space_cond);
+		pthread_mutex_unlock (&space_mtx);
+	}
+}
 
 /* this is the function that jack calls to get audio samples from us */
 static int process_cb(jack_nframes_t nframes, void *unused ATTR_UNUSED)
@@ -59,51 +91,57 @@ static int process_cb(jack_nframes_t nframes, void *unused ATTR_UNUSED)
 	out[1] = (jack_default_audio_sample_t *) jack_port_get_buffer (
 			output_port[1], nframes);
 
+	/* The sound is already deinterleaved and converted by
+	 * moc_jack_play(), only copy it here. */
 	if (play) {
-		size_t i;
-
-		/* ringbuffer[1] is filled later, so we only need to check
-		 * it's space. */
-		size_t avail_data = jack_ringbuffer_read_space(ringbuffer[1]);
-		size_t avail_frames = avail_data
-			/ sizeof(jack_default_audio_sample_t);
-
-		if (avail_frames > nframes) {
-			avail_frames = nframes;
-			avail_data = nframes
-				* sizeof(jack_default_audio_sample_t);
-		}
+		size_t avail_frames = MIN(read_space_frames(), nframes);
+		size_t avail_data = avail_frames
+			* sizeof(jack_default_audio_sample_t);
 
 		jack_ringbuffer_read (ringbuffer[0], (char *)out[0],
 				avail_data);
 		jack_ringbuffer_read (ringbuffer[1], (char *)out[1],
 				avail_data);
 
-
 		/* we must provide nframes data, so fill with silence
 		 * the remaining space. */
 		if (avail_frames < nframes) {
-			our_xrun = 1;
+			if (!underrun) {
+				__atomic_add_fetch (&underruns, 1,
+						__ATOMIC_RELAXED);
+				underrun = 1;
+			}
 
-			for (i = avail_frames; i < nframes; i++)
-				out[0][i] = out[1][i] = 0.0;
+			memset (out[0] + avail_frames, 0, (nframes - avail_frames)
+					* sizeof(jack_default_audio_sample_t));
+			memset (out[1] + avail_frames, 0, (nframes - avail_frames)
+					* sizeof(jack_default_audio_sample_t));
 		}
+		else
+			underrun = 0;
 	}
 	else {
-		size_t i;
 		size_t size;
 
 		/* consume the input */
-		size = jack_ringbuffer_read_space(ringbuffer[1]);
+		size = read_space_frames() * sizeof(jack_default_audio_sample_t);
 		jack_ringbuffer_read_advance (ringbuffer[0], size);
 		jack_ringbuffer_read_advance (ringbuffer[1], size);
+		underrun = 1;
 
-		for (i = 0; i < nframes; i++) {
-			out[0][i] = 0.0;
-			out[1][i] = 0.0;
-		}
+		memset (out[0], 0, nframes * sizeof(jack_default_audio_sample_t));
+		memset (out[1], 0, nframes * sizeof(jack_default_audio_sample_t));
 	}
 
+	signal_space ();
+
+	return 0;
+}
+
+/* this is called by jack when an xrun occurs anywhere in the graph */
+static int xrun_cb (void *unused ATTR_UNUSED)
+{
+	__atomic_add_fetch (&server_xruns, 1, __ATOMIC_RELAXED);
 	return 0;
 }
 
@@ -180,6 +218,7 @@ static int moc_jack_init (struct output_driver_caps *caps)
 	/* set the call back functions, activate the client */
 	jack_set_process_callback (client, process_cb, NULL);
 	jack_set_sample_rate_callback(client, update_sample_rate_cb, NULL);
+	jack_set_xrun_callback (client, xrun_cb, NULL);
 	if (jack_activate (client)) {
 		error ("cannot activate client");
 		return 0;
@@ -232,10 +271,90 @@ static void moc_jack_close ()
 	play = 0;
 }
 
+/* Number of frames which can be written to both ringbuffers.  The second
+ * one is read last. */
+static size_t write_space_frames ()
+{
+	return MIN(jack_ringbuffer_write_space(ringbuffer[0]),
+			jack_ringbuffer_write_space(ringbuffer[1]))
+		/ sizeof(jack_default_audio_sample_t);
+}
+
+/* Deinterleave the frames straight into the ringbuffers applying the
+ * volume.  The frames must fit in them. */
+static void write_frames (const jack_default_audio_sample_t *in,
+		const size_t frames)
+{
+	int c;
+
+	for (c = 0; c < 2; c++) {
+		jack_ringbuffer_data_t vec[2];
+		size_t i = 0;
+		int v;
+
+		jack_ringbuffer_get_write_vector (ringbuffer[c], vec);
+		for (v = 0; v < 2 && i < frames; v++) {
+			jack_default_audio_sample_t *out
+				= (jack_default_audio_sample_t *)vec[v].buf;
+			size_t n = MIN(vec[v].len
+					/ sizeof(jack_default_audio_sample_t),
+					frames - i);
+			size_t j;
+
+			for (j = 0; j < n; j++, i++)
+				out[j] = in[2 * i + c] * volume;
+		}
+
+		assert (i == frames);
+		jack_ringbuffer_write_advance (ringbuffer[c],
+				frames * sizeof(jack_default_audio_sample_t));
+	}
+}
+
+/* Wait until there is space for the given number of frames in the
+ * ringbuffers. */
+static void wait_for_space (const size_t frames)
+{
+	LOCK (space_mtx);
+	while (write_space_frames() < frames && !jack_shutdown) {
+		struct timespec ts;
+
+		/* The process callback doesn't wait for the mutex, so it
+		 * can miss us, check again after a while. */
+		get_realtime (&ts);
+		ts.tv_nsec += 100000000L;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+
+		pthread_cond_timedwait (&space_cond, &space_mtx, &ts);
+	}
+	UNLOCK (space_mtx);
+}
+
+/* Log xruns which occurred since the last call. */
+static void log_xruns ()
+{
+	int ours = __atomic_load_n (&underruns, __ATOMIC_RELAXED);
+	int server = __atomic_load_n (&server_xruns, __ATOMIC_RELAXED);
+
+	if (ours != logged_underruns) {
+		logit ("xrun: the ringbuffer ran dry (%d times so far)", ours);
+		logged_underruns = ours;
+	}
+
+	if (server != logged_server_xruns) {
+		logit ("xrun reported by JACK (%d times so far)", server);
+		logged_server_xruns = server;
+	}
+}
+
 static int moc_jack_play (const char *buff, const size_t size)
 {
-	size_t remain = size;
-	size_t pos = 0;
+	const jack_default_audio_sample_t *in
+		= (const jack_default_audio_sample_t *)buff;
+	size_t remain = size / (sizeof(jack_default_audio_sample_t) * 2);
 
 	if (jack_shutdown) {
 		logit ("Refusing to play, because there is no client thread.");
@@ -244,49 +363,21 @@ static int moc_jack_play (const char *buff, const size_t size)
 
 	debug ("Playing %zu bytes", size);
 
-	if (our_xrun) {
-		logit ("xrun");
-		our_xrun = 0;
-	}
+	log_xruns ();
 
 	while (remain && !jack_shutdown) {
-		size_t space;
-
-		/* check if some space is available only in the second
-		 * ringbuffer, because it is read later than the first. */
-		if ((space = jack_ringbuffer_write_space(ringbuffer[1]))
-				> sizeof(jack_default_audio_sample_t)) {
-			size_t to_write;
-
-			space *= 2; /* we have 2 channels */
-			debug ("Space in the ringbuffer: %zu bytes", space);
-
-			to_write = MIN (space, remain);
-
-			to_write /= sizeof(jack_default_audio_sample_t) * 2;
-			remain -= to_write * sizeof(float) * 2;
-			while (to_write--) {
-				jack_default_audio_sample_t sample;
-
-				sample = *(jack_default_audio_sample_t *)
-					(buff + pos) * volume;
-				pos += sizeof (jack_default_audio_sample_t);
-				jack_ringbuffer_write (ringbuffer[0],
-						(char *)&sample,
-						sizeof(sample));
-
-				sample = *(jack_default_audio_sample_t *)
-					(buff + pos) * volume;
-				pos += sizeof (jack_default_audio_sample_t);
-				jack_ringbuffer_write (ringbuffer[1],
-						(char *)&sample,
-						sizeof(sample));
-			}
+		size_t to_write = MIN(write_space_frames(), remain);
+
+		if (to_write) {
+			write_frames (in, to_write);
+			in += to_write * 2;
+			remain -= to_write;
 		}
 		else {
-			debug ("Sleeping for %uus", (unsigned int)(RINGBUF_SZ
-					/ (float)(audio_get_bps()) * 100000.0));
-			xsleep (RINGBUF_SZ, audio_get_bps ());
+			/* Don't wake up on each period if the periods are
+			 * small. */
+			wait_for_space (MIN(remain, RINGBUF_SZ / 4
+					/ sizeof(jack_default_audio_sample_t)));
 		}
 	}
 
@@ -316,6 +407,12 @@ static int moc_jack_get_buff_fill ()
 		/ sizeof(jack_default_audio_sample_t);
 }
 
+static int moc_jack_get_xruns ()
+{
+	return __atomic_load_n (&underruns, __ATOMIC_RELAXED)
+		+ __atomic_load_n (&server_xruns, __ATOMIC_RELAXED);
+}
+
 static int moc_jack_reset ()
 {
 	//jack_ringbuffer_reset(ringbuffer); /*this is not threadsafe!*/
@@ -355,6 +452,7 @@ void moc_jack_funcs (struct hw_funcs *funcs)
 	funcs->read_mixer = moc_jack_read_mixer;
 	funcs->set_mixer = moc_jack_set_mixer;
 	funcs->get_buff_fill = moc_jack_get_buff_fill;
+	funcs->get_xruns = moc_jack_get_xruns;
 	funcs->reset = moc_jack_reset;
 	funcs->shutdown = moc_jack_shutdown;
 	funcs->get_rate = moc_jack_get_rate;
@@ -0,0 +1,592 @@
+/*
+ * MOC - music on console
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+/* Library indexer: a low priority thread in the server which walks the
+ * music directory and reads tags of the files which are not in the tags
+ * cache or were modified, so directories are displayed quickly when they
+ * are visited for the first time.  Then it watches the directory with
+ * inotify, updates the cache when files change and tells the clients. */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#ifdef HAVE_SYS_INOTIFY_H
+# include <sys/inotify.h>
+# include <poll.h>
+#endif
+#ifdef __linux__
+# include <sys/syscall.h>
+#endif
+
+#define DEBUG
+
+#include "common.h"
+#include "log.h"
+#include "lists.h"
+#include "options.h"
+#include "playlist.h"
+#include "protocol.h"
+#include "decoder.h"
+#include "files.h"
+#include "audio.h"
+#include "server.h"
+#include "tags_cache.h"
+#include "library_indexer.h"
+
+/* How often to report the progress (in seconds). */
+#define PROGRESS_INTERVAL	10
+
+/* How long to wait before checking again whether the playing stopped
+ * (in seconds). */
+#define PAUSE_CHECK_INTERVAL	2
+
+/* Arguments of ioprio_set(2), there is no header for them in libc. */
+#define IOPRIO_CLASS_SHIFT	13
+#define IOPRIO_CLASS_IDLE	3
+#define IOPRIO_WHO_PROCESS	1
+
+static pthread_t indexer_tid;
+static pthread_mutex_t indexer_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t indexer_cond = PTHREAD_COND_INITIALIZER;
+static int indexer_running = 0;
+static int stop_indexer = 0;	/* protected by indexer_mtx */
+
+static struct tags_cache *tags_cache = NULL;
+static char *music_dir = NULL;
+static int pause_when_playing;	/* pause while playing from the same disk */
+
+static int files_checked;	/* number of sound files found */
+static int files_read;		/* number of files whose tags were read */
+static time_t last_report;
+
+#ifdef HAVE_SYS_INOTIFY_H
+static int inotify_fd = -1;
+static int wake_pipe[2] = { -1, -1 }; /* wakes the watcher to stop it */
+static char **watched_dirs = NULL; /* directory paths indexed by the watch
+				      descriptor */
+static int watched_dirs_num = 0;
+static int watch_limit_reported = 0;
+#endif
+
+/* Use the idle I/O class and the lowest CPU priority for the calling
+ * thread only. */
+static void lower_priority ()
+{
+#if defined(__linux__) && defined(SYS_gettid)
+	pid_t tid = syscall (SYS_gettid);
+
+	if (setpriority (PRIO_PROCESS, tid, 19) == -1)
+		log_errno ("Can't lower the indexer's priority", errno);
+
+# ifdef SYS_ioprio_set
+	if (syscall (SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid,
+	             IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) == -1)
+		log_errno ("Can't set the indexer's I/O class", errno);
+# endif
+#endif
+}
+
+static int should_stop ()
+{
+	int stop;
+
+	LOCK (indexer_mtx);
+	stop = stop_indexer;
+	UNLOCK (indexer_mtx);
+
+	return stop;
+}
+
+/* Wait the given time or until we are stopped.  Return 1 if stopped. */
+static int wait_or_stop (const int seconds)
+{
+	struct timespec ts;
+	int stop;
+
+	clock_gettime (CLOCK_REALTIME, &ts);
+	ts.tv_sec += seconds;
+
+	LOCK (indexer_mtx);
+	if (!stop_indexer)
+		pthread_cond_timedwait (&indexer_cond, &indexer_mtx, &ts);
+	stop = stop_indexer;
+	UNLOCK (indexer_mtx);
+
+	return stop;
+}
+
+/* Return 1 if a file from the given device is being played. */
+static int playing_from (const dev_t dev)
+{
+	struct stat st;
+	char *file;
+	int res = 0;
+
+	if (audio_get_state () != STATE_PLAY)
+		return 0;
+
+	file = audio_get_sname ();
+	if (file && stat (file, &st) == 0 && st.st_dev == dev)
+		res = 1;
+	free (file);
+
+	return res;
+}
+
+static void report_progress (const int done)
+{
+	char msg[128];
+
+	if (done)
+		snprintf (msg, sizeof (msg),
+		          "Library indexed: %d files, tags of %d read",
+		          files_checked, files_read);
+	else
+		snprintf (msg, sizeof (msg),
+		          "Indexing library: %d files, tags of %d read",
+		          files_checked, files_read);
+
+	logit ("%s", msg);
+	status_msg (msg);
+	last_report = time (NULL);
+}
+
+#ifdef HAVE_SYS_INOTIFY_H
+/* Add an inotify watch for the directory. */
+static void watch_dir (const char *path)
+{
+	int wd;
+
+	wd = inotify_add_watch (inotify_fd, path,
+	                        IN_CLOSE_WRITE | IN_CREATE | IN_DELETE
+	                        | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR);
+	if (wd == -1) {
+		if (errno == ENOSPC) {
+			if (!watch_limit_reported) {
+				logit ("Too many directories to watch, increase "
+				       "fs.inotify.max_user_watches");
+				watch_limit_reported = 1;
+			}
+		}
+		else {
+			char *err = xstrerror (errno);
+			logit ("Can't watch directory %s: %s", path, err);
+			free (err);
+		}
+		return;
+	}
+
+	if (wd >= watched_dirs_num) {
+		int i, num = MAX(wd + 1, watched_dirs_num * 2);
+
+		watched_dirs = (char **)xrealloc (watched_dirs,
+		                                  num * sizeof (char *));
+		for (i = watched_dirs_num; i < num; i++)
+			watched_dirs[i] = NULL;
+		watched_dirs_num = num;
+	}
+
+	free (watched_dirs[wd]);
+	watched_dirs[wd] = xstrdup (path);
+}
+
+/* Remove the watches of the directory and its subdirectories (it was moved
+ * away). */
+static void unwatch_tree (const char *path)
+{
+	size_t len = strlen (path);
+	int wd;
+
+	for (wd = 0; wd < watched_dirs_num; wd++) {
+		const char *dir = watched_dirs[wd];
+
+		if (dir && !strncmp (dir, path, len)
+				&& (dir[len] == '\0' || dir[len] == '/')) {
+			inotify_rm_watch (inotify_fd, wd);
+			free (watched_dirs[wd]);
+			watched_dirs[wd] = NULL;
+		}
+	}
+}
+
+static void unwatch_all ()
+{
+	int wd;
+
+	for (wd = 0; wd < watched_dirs_num; wd++)
+		free (watched_dirs[wd]);
+	free (watched_dirs);
+	watched_dirs = NULL;
+	watched_dirs_num = 0;
+}
+#endif
+
+/* Index the sound file.  Return 0 if indexing must stop. */
+static int index_file (const char *path, const struct stat *st)
+{
+	int res;
+
+	if (pause_when_playing && playing_from (st->st_dev)) {
+		debug ("Playing from the same disk, indexing paused");
+		do {
+			if (wait_or_stop (PAUSE_CHECK_INTERVAL))
+				return 0;
+		} while (playing_from (st->st_dev));
+		debug ("Indexing resumed");
+	}
+
+	res = tags_cache_index_file (tags_cache, path,
+	                             TAGS_COMMENTS | TAGS_TIME);
+	if (res == -1) {
+		logit ("Tags cache is full or disabled, library indexing stopped");
+		status_msg ("Tags cache is full, library indexing stopped");
+		return 0;
+	}
+
+	files_checked++;
+	files_read += res;
+
+	if (time (NULL) - last_report >= PROGRESS_INTERVAL)
+		report_progress (0);
+
+	return 1;
+}
+
+/* Index the directory, put its subdirectories on the stack.  Return 0 if
+ * indexing must stop. */
+static int index_dir (const char *dir_path, lists_t_strs *dirs)
+{
+	DIR *dir;
+	struct dirent *d;
+	int res = 1;
+
+	dir = opendir (dir_path);
+	if (!dir) {
+		char *err = xstrerror (errno);
+		logit ("Can't open directory %s: %s", dir_path, err);
+		free (err);
+		return 1;
+	}
+
+#ifdef HAVE_SYS_INOTIFY_H
+	if (inotify_fd != -1)
+		watch_dir (dir_path);
+#endif
+
+	while (res && (d = readdir (dir))) {
+		struct stat st;
+		char *path;
+		int is_link;
+
+		if (should_stop ()) {
+			res = 0;
+			break;
+		}
+
+		if (d->d_name[0] == '.')
+			continue;
+
+		path = (char *)xmalloc (strlen (dir_path) + strlen (d->d_name) + 2);
+		sprintf (path, "%s/%s", dir_path, d->d_name);
+
+		if (lstat (path, &st) == -1) {
+			free (path);
+			continue;
+		}
+
+		is_link = S_ISLNK(st.st_mode);
+		if (is_link && stat (path, &st) == -1) {
+			free (path);
+			continue;
+		}
+
+		/* Don't follow symlinks to directories to avoid loops. */
+		if (S_ISDIR(st.st_mode)) {
+			if (!is_link) {
+				lists_strs_push (dirs, path);
+				path = NULL;
+			}
+		}
+		else if (S_ISREG(st.st_mode) && is_sound_file (path))
+			res = index_file (path, &st);
+
+		free (path);
+	}
+
+	closedir (dir);
+
+	return res;
+}
+
+/* Index the directory tree.  Return 0 if indexing must stop. */
+static int index_tree (const char *root)
+{
+	lists_t_strs *dirs;
+	char *dir;
+	int res = 1;
+
+	dirs = lists_strs_new (64);
+	lists_strs_append (dirs, root);
+
+	while (res && (dir = lists_strs_pop (dirs))) {
+		res = index_dir (dir, dirs);
+		free (dir);
+	}
+
+	lists_strs_free (dirs);
+
+	return res;
+}
+
+#ifdef HAVE_SYS_INOTIFY_H
+/* Handle the file change reported by inotify. */
+static void file_event (const struct inotify_event *ev, const char *path)
+{
+	struct stat st;
+
+	if (ev->mask & IN_ISDIR) {
+		if (ev->mask & IN_MOVED_FROM)
+			unwatch_tree (path);
+		else if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+			debug ("New directory %s", path);
+			index_tree (path);
+		}
+		return;
+	}
+
+	if (!is_sound_file (path))
+		return;
+
+	if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+		debug ("File %s removed", path);
+		tags_cache_remove (tags_cache, path);
+		file_changed (path);
+	}
+	else if (ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+		if (stat (path, &st) == -1 || !S_ISREG(st.st_mode))
+			return;
+
+		/* The cache rereads the tags because the mtime changed. */
+		debug ("File %s changed", path);
+		tags_cache_index_file (tags_cache, path, TAGS_COMMENTS | TAGS_TIME);
+		file_changed (path);
+	}
+}
+
+/* Read and handle the inotify events.  Return 0 if watching must stop. */
+static int read_events ()
+{
+	char buf[4096]
+		__attribute__ ((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	ssize_t len;
+	char *p;
+	int rescan = 0;
+
+	len = read (inotify_fd, buf, sizeof (buf));
+	if (len == -1) {
+		if (errno == EAGAIN || errno == EINTR)
+			return 1;
+		log_errno ("Can't read inotify events", errno);
+		return 0;
+	}
+
+	for (p = buf; p < buf + len; p += sizeof (struct inotify_event) + ev->len) {
+		const char *dir;
+		char *path;
+
+		ev = (const struct inotify_event *)p;
+
+		if (ev->mask & IN_Q_OVERFLOW) {
+			rescan = 1;
+			continue;
+		}
+
+		if (ev->wd < 0 || ev->wd >= watched_dirs_num
+				|| !(dir = watched_dirs[ev->wd]))
+			continue;
+
+		if (ev->mask & IN_IGNORED) {
+			free (watched_dirs[ev->wd]);
+			watched_dirs[ev->wd] = NULL;
+			continue;
+		}
+
+		if (ev->len == 0 || ev->name[0] == '.')
+			continue;
+
+		path = (char *)xmalloc (strlen (dir) + strlen (ev->name) + 2);
+		sprintf (path, "%s/%s", dir, ev->name);
+		file_event (ev, path);
+		free (path);
+	}
+
+	if (rescan) {
+		logit ("Too many changes in the library, indexing it again");
+		index_tree (music_dir);
+	}
+
+	return 1;
+}
+
+/* Watch the library for changes until we are stopped. */
+static void watch_library ()
+{
+	struct pollfd fds[2];
+
+	logit ("Watching the library for changes");
+
+	fds[0].fd = inotify_fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = wake_pipe[0];
+	fds[1].events = POLLIN;
+
+	while (!should_stop ()) {
+		if (poll (fds, 2, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			log_errno ("poll() failed", errno);
+			break;
+		}
+
+		if ((fds[0].revents & POLLIN) && !read_events ())
+			break;
+	}
+}
+#endif
+
+static void *indexer_thread (void *unused ATTR_UNUSED)
+{
+	lower_priority ();
+	logit ("Library indexer started for %s", music_dir);
+
+	last_report = time (NULL);
+
+	if (!index_tree (music_dir)) {
+		logit ("Library indexer stopped");
+		return NULL;
+	}
+
+	report_progress (1);
+
+#ifdef HAVE_SYS_INOTIFY_H
+	if (inotify_fd != -1)
+		watch_library ();
+#endif
+
+	return NULL;
+}
+
+#ifdef HAVE_SYS_INOTIFY_H
+static void close_watcher ()
+{
+	if (inotify_fd == -1)
+		return;
+
+	close (inotify_fd);
+	close (wake_pipe[0]);
+	close (wake_pipe[1]);
+	inotify_fd = -1;
+	unwatch_all ();
+}
+#endif
+
+/* Start indexing the directory in the background. */
+void library_indexer_start (struct tags_cache *c, const char *dir)
+{
+	int rc;
+
+	assert (c != NULL);
+	assert (dir != NULL);
+	assert (!indexer_running);
+
+	if (is_dir (dir) != 1) {
+		logit ("Library indexer: %s is not a directory", dir);
+		return;
+	}
+
+	tags_cache = c;
+	music_dir = xstrdup (dir);
+	pause_when_playing = options_get_bool ("LibraryIndexerPause");
+	stop_indexer = 0;
+	files_checked = 0;
+	files_read = 0;
+
+#ifdef HAVE_SYS_INOTIFY_H
+	if (options_get_bool ("LibraryIndexerWatch")) {
+		if (pipe (wake_pipe) == -1)
+			log_errno ("pipe() failed", errno);
+		else if ((inotify_fd = inotify_init1 (IN_NONBLOCK)) == -1) {
+			log_errno ("Can't initialise inotify", errno);
+			close (wake_pipe[0]);
+			close (wake_pipe[1]);
+		}
+	}
+#endif
+
+	rc = pthread_create (&indexer_tid, NULL, indexer_thread, NULL);
+	if (rc != 0) {
+		log_errno ("Can't create library indexer thread", rc);
+		free (music_dir);
+		music_dir = NULL;
+#ifdef HAVE_SYS_INOTIFY_H
+		close_watcher ();
+#endif
+		return;
+	}
+
+	indexer_running = 1;
+}
+
+/* Stop the indexer and wait for it.  It must be done before freeing the
+ * tags cache. */
+void library_indexer_stop ()
+{
+	int rc;
+
+	if (!indexer_running)
+		return;
+
+	LOCK (indexer_mtx);
+	stop_indexer = 1;
+	pthread_cond_signal (&indexer_cond);
+	UNLOCK (indexer_mtx);
+
+#ifdef HAVE_SYS_INOTIFY_H
+	if (inotify_fd != -1 && write (wake_pipe[1], "", 1) == -1)
+		log_errno ("Can't wake up the library watcher", errno);
+#endif
+
+	rc = pthread_join (indexer_tid, NULL);
+	if (rc != 0)
+		log_errno ("pthread_join() on library indexer thread failed", rc);
+
+#ifdef HAVE_SYS_INOTIFY_H
+	close_watcher ();
+#endif
+
+	free (music_dir);
+	music_dir = NULL;
+	indexer_running = 0;
+}
@@ -0,0 +1,17 @@
+#ifndef LIBRARY_INDEXER_H
+#define LIBRARY_INDEXER_H
+
+#include "tags_cache.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void library_indexer_start (struct tags_cache *c, const char *dir);
+void library_indexer_stop ();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -42,6 +42,7 @@
 #include "lists.h"
 #include "files.h"
 #include "rcc.h"
+#include "status_page.h"
 
 static int mocp_argc;
 static const char **mocp_argv;
@@ -229,17 +230,44 @@ static void start_moc (const struct parameters *params, lists_t_strs *args)
 	close (server_sock);
 }
 
+/* Return != 0 if only the information which the server publishes in the
+ * status page was requested. */
+static int info_only (const struct parameters *params)
+{
+	return (params->get_file_info || params->get_formatted_info)
+		&& !params->playit && !params->clear && !params->append
+		&& !params->enqueue && !params->play && !params->seek_by
+		&& !params->jump_type && !params->adj_volume
+		&& !params->toggle && !params->on && !params->off
+		&& !params->exit && !params->stop && !params->pause
+		&& !params->unpause && !params->next && !params->previous
+		&& !params->toggle_pause;
+}
+
 /* Send commands requested in params to the server. */
 static void server_command (struct parameters *params, lists_t_strs *args)
 {
-	int sock;
+	int sock = -1;
+	struct status_page *status = NULL;
+
+	/* Read the status without waking up the server if we can. */
+	if (info_only (params)) {
+		status = (struct status_page *)xmalloc (
+				sizeof(struct status_page));
+		if (!status_page_read (status)) {
+			free (status);
+			status = NULL;
+		}
+	}
 
-	if ((sock = server_connect()) == -1)
-		fatal ("The server is not running!");
+	if (!status) {
+		if ((sock = server_connect()) == -1)
+			fatal ("The server is not running!");
 
-	xsignal (SIGPIPE, SIG_IGN);
-	if (!ping_server (sock))
-		fatal ("Can't connect to the server!");
+		xsignal (SIGPIPE, SIG_IGN);
+		if (!ping_server (sock))
+			fatal ("Can't connect to the server!");
+	}
 
 	if (params->playit)
 		interface_cmdline_playit (sock, args);
@@ -252,7 +280,7 @@ static void server_command (struct parameters *params, lists_t_strs *args)
 	if (params->play)
 		interface_cmdline_play_first (sock);
 	if (params->get_file_info)
-		interface_cmdline_file_info (sock);
+		interface_cmdline_file_info (sock, status);
 	if (params->seek_by)
 		interface_cmdline_seek_by (sock, params->seek_by);
 	if (params->jump_type=='%')
@@ -260,7 +288,8 @@ static void server_command (struct parameters *params, lists_t_strs *args)
 	if (params->jump_type=='s')
 		interface_cmdline_jump_to (sock,params->jump_to);
 	if (params->get_formatted_info)
-		interface_cmdline_formatted_info (sock, params->formatted_info_param);
+		interface_cmdline_formatted_info (sock, params->formatted_info_param,
+		                                  status);
 	if (params->adj_volume)
 		interface_cmdline_adj_volume (sock, params->adj_volume);
 	if (params->toggle)
@@ -312,7 +341,9 @@ static void server_command (struct parameters *params, lists_t_strs *args)
 			fatal ("Can't send commands!");
 	}
 
-	close (sock);
+	if (sock != -1)
+		close (sock);
+	free (status);
 }
 
 static void show_version ()
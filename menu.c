@@ -903,3 +903,17 @@ void menu_make_visible (struct menu *menu, const char *file)
 	if ((mi = menu_find(menu, file)))
 		make_item_visible (menu, mi);
 }
+
+/* Add the sound files visible in the menu to the list. */
+void menu_get_visible_files (const struct menu *menu, lists_t_strs *files)
+{
+	struct menu_item *mi;
+
+	assert (menu != NULL);
+	assert (files != NULL);
+
+	for (mi = menu->top; mi && mi->num - menu->top->num < menu->height;
+			mi = mi->next)
+		if (mi->type == F_SOUND)
+			lists_strs_append (files, mi->file);
+}
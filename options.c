@@ -644,10 +644,12 @@ void options_init ()
 
 #ifdef OPENBSD
 	add_list ("SoundDriver", "SNDIO:JACK:OSS",
-	          CHECK_DISCRETE(5), "SNDIO", "Jack", "ALSA", "OSS", "null");
+	          CHECK_DISCRETE(6), "SNDIO", "Jack", "ALSA", "OSS",
+	          "PipeWire", "null");
 #else
-	add_list ("SoundDriver", "Jack:ALSA:OSS",
-	          CHECK_DISCRETE(5), "SNDIO", "Jack", "ALSA", "OSS", "null");
+	add_list ("SoundDriver", "Jack:ALSA:PipeWire:OSS",
+	          CHECK_DISCRETE(6), "SNDIO", "Jack", "ALSA", "OSS",
+	          "PipeWire", "null");
 #endif
 
 	add_str  ("JackClientName", "moc", CHECK_NONE);
@@ -655,6 +657,9 @@ void options_init ()
 	add_str  ("JackOutLeft", "system:playback_1", CHECK_NONE);
 	add_str  ("JackOutRight", "system:playback_2", CHECK_NONE);
 
+	add_str  ("PipeWireTarget", NULL, CHECK_NONE);
+	add_int  ("PipeWireLatency", 0, CHECK_RANGE(1), 0, 10000);
+
 	add_str  ("OSSDevice", "/dev/dsp", CHECK_NONE);
 	add_str  ("OSSMixerDevice", "/dev/mixer", CHECK_NONE);
 	add_symb ("OSSMixerChannel1", "pcm",
@@ -665,6 +670,10 @@ void options_init ()
 	add_str  ("ALSADevice", "default", CHECK_NONE);
 	add_str  ("ALSAMixer1", "PCM", CHECK_NONE);
 	add_str  ("ALSAMixer2", "Master", CHECK_NONE);
+	add_bool ("ALSAMmap", true);
+	add_int  ("ALSABufferTime", 300, CHECK_RANGE(1), 10, 10000);
+	add_int  ("ALSAPeriodTime", 0, CHECK_RANGE(1), 0, 5000);
+	add_int  ("ALSAWakeupPeriods", 1, CHECK_RANGE(1), 1, 64);
 
 	add_bool ("Softmixer_SaveState", true);
 	add_bool ("Equalizer_SaveState", true);
@@ -699,6 +708,10 @@ void options_init ()
 	add_bool ("FileNamesIconv", false);
 	add_bool ("NonUTFXterm", false);
 	add_bool ("Precache", true);
+	add_int  ("PrecacheFiles", 0, CHECK_RANGE(1), 0, 100);
+	add_int  ("PrecacheMemory", 256, CHECK_RANGE(1), 1, 65536);
+	add_bool ("Gapless", false);
+	add_int  ("Crossfade", 0, CHECK_RANGE(1), 0, 30);
 	add_bool ("SavePlaylist", true);
 	add_bool ("SyncPlaylist", true);
 	add_str  ("Keymap", NULL, CHECK_NONE);
@@ -741,7 +754,17 @@ void options_init ()
 	add_int  ("MaxChannels", 0, CHECK_RANGE(1), 0, 500000);
 	add_list ("MaskOutputFormats","",CHECK_NONE);
 	add_bool ("UseRealtimePriority", false);
+	add_bool ("RealtimeMode", false);
+	add_int  ("RealtimeCPU", -1, CHECK_RANGE(1), -1, 1023);
 	add_int  ("TagsCacheSize", 256, CHECK_RANGE(1), 0, INT_MAX);
+	add_int  ("TagsReaders", 0, CHECK_RANGE(1), 0, 64);
+	add_symb ("TagsCacheBackend", "Native",
+	                 CHECK_SYMBOL(2), "Native", "BerkeleyDB");
+	add_bool ("SeekIndex", true);
+	add_int  ("SeekIndexSize", 1000, CHECK_RANGE(1), 1, INT_MAX);
+	add_bool ("LibraryIndexer", false);
+	add_bool ("LibraryIndexerPause", true);
+	add_bool ("LibraryIndexerWatch", true);
 	add_bool ("PlaylistNumbering", true);
 
 	add_list ("Layout1", "directory(0,0,50%,100%):playlist(50%,0,FILL,100%)",
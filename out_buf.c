@@ -21,6 +21,7 @@
 #include <pthread.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
 
 #ifdef OUT_TEST
 #include <unistd.h>
@@ -37,16 +38,19 @@
 #include "fifo_buf.h"
 #include "out_buf.h"
 #include "options.h"
+#include "realtime.h"
 
 struct out_buf
 {
-	struct fifo_buf *buf;
+	struct fifo_buf *buf;	/* Used without locking by out_buf_put() and
+				   the reading thread. */
 	pthread_mutex_t	mutex;
 	pthread_t tid;	/* Thread id of the reading thread. */
 
-	/* Signals. */
-	pthread_cond_t play_cond;	/* Something was written to the buffer. */
-	pthread_cond_t ready_cond;	/* There is some space in the buffer. */
+	/* The reading thread went through its loop.  Waiting for data and
+	 * for free space is done on the fifo_buf and changes of the flags
+	 * below are signalled with fifo_buf_wake(). */
+	pthread_cond_t ready_cond;
 
 	/* Optional callback called when there is some free space in
 	 * the buffer. */
@@ -55,7 +59,7 @@ struct out_buf
 	/* State flags of the buffer. */
 	int pause;
 	int exit;	/* Exit when the buffer is empty. */
-	int stop;	/* Don't play anything. */
+	int stop;	/* Don't play anything, read also without the mutex. */
 
 	int reset_dev;	/* Request to the reading thread to reset the audio
 			   device. */
@@ -80,7 +84,8 @@ static void set_realtime_prio ()
 #ifdef HAVE_SCHED_GET_PRIORITY_MAX
 	int rc;
 
-	if (options_get_bool("UseRealtimePriority")) {
+	if (options_get_bool("UseRealtimePriority")
+			|| options_get_bool("RealtimeMode")) {
 		struct sched_param param;
 
 		param.sched_priority = sched_get_priority_max(SCHED_RR);
@@ -94,27 +99,122 @@ static void set_realtime_prio ()
 #endif
 }
 
+/* What the reading thread observed in the realtime mode. */
+struct rt_stats
+{
+	int faults_counted;	/* Can we count page faults? */
+	long minor, major;	/* Page faults before playing the chunk. */
+	long faults;		/* Page faults while playing. */
+	long misses;		/* Deadline misses. */
+	int has_deadline;
+	struct timespec deadline;	/* When the device runs out of sound. */
+};
+
+static void rt_stats_init (struct rt_stats *stats)
+{
+	long minor, major;
+
+	stats->faults_counted = realtime_thread_faults (&minor, &major);
+	if (!stats->faults_counted)
+		logit ("Page faults of the thread can't be counted");
+	stats->faults = 0;
+	stats->misses = 0;
+	stats->has_deadline = 0;
+}
+
+static void rt_faults_start (struct rt_stats *stats)
+{
+	if (stats->faults_counted)
+		realtime_thread_faults (&stats->minor, &stats->major);
+}
+
+static void rt_faults_end (struct rt_stats *stats)
+{
+	long minor, major;
+
+	if (!stats->faults_counted
+			|| !realtime_thread_faults (&minor, &major))
+		return;
+
+	minor -= stats->minor;
+	major -= stats->major;
+	if (minor || major) {
+		stats->faults += minor + major;
+		logit ("Page faults while playing: %ld minor, %ld major",
+				minor, major);
+	}
+}
+
+/* Check if the sound was sent before the device played everything it
+ * had, that is, before the deadline set after sending the previous
+ * chunk. */
+static void rt_check_deadline (struct rt_stats *stats)
+{
+	struct timespec now;
+	long late;
+
+	if (!stats->has_deadline)
+		return;
+
+	clock_gettime (CLOCK_MONOTONIC, &now);
+	late = (now.tv_sec - stats->deadline.tv_sec) * 1000000L
+		+ (now.tv_nsec - stats->deadline.tv_nsec) / 1000L;
+	if (late > 0) {
+		stats->misses++;
+		logit ("Deadline missed by %ld us", late);
+	}
+}
+
+static void rt_set_deadline (struct rt_stats *stats)
+{
+	int bps = audio_get_bps ();
+	long usec;
+
+	if (bps <= 0) {
+		stats->has_deadline = 0;
+		return;
+	}
+
+	usec = (long)(audio_get_buf_fill () / (double)bps * 1000000.0);
+	clock_gettime (CLOCK_MONOTONIC, &stats->deadline);
+	stats->deadline.tv_sec += usec / 1000000L;
+	stats->deadline.tv_nsec += (usec % 1000000L) * 1000L;
+	if (stats->deadline.tv_nsec >= 1000000000L) {
+		stats->deadline.tv_sec++;
+		stats->deadline.tv_nsec -= 1000000000L;
+	}
+	stats->has_deadline = 1;
+}
+
 /* Reading thread of the buffer. */
 static void *read_thread (void *arg)
 {
 	struct out_buf *buf = (struct out_buf *)arg;
 	int audio_dev_closed = 0;
+	int realtime = realtime_mode ();
+	struct rt_stats stats;
 
 	logit ("entering output buffer thread");
 
 	set_realtime_prio ();
+	realtime_thread_init ();
+	if (realtime)
+		rt_stats_init (&stats);
 
 	LOCK (buf->mutex);
 
 	while (1) {
 		int played = 0;
 		char play_buf[AUDIO_MAX_PLAY_BYTES];
-		int play_buf_fill;
-		int play_buf_pos = 0;
+		const char *play_data;
+		size_t play_buf_fill;
+		size_t play_buf_pos = 0;
+		int seq;
 
 		if (buf->reset_dev && !audio_dev_closed) {
 			audio_reset ();
 			buf->reset_dev = 0;
+			stats.has_deadline = 0;
 		}
 
 		if (buf->stop)
@@ -139,9 +239,19 @@ static void *read_thread (void *arg)
 				audio_dev_closed = 1;
 			}
 
+			/* The device can run out of sound now, it's not
+			 * a miss of this thread. */
+			stats.has_deadline = 0;
+
 			debug ("waiting for something in the buffer");
 			buf->read_thread_waiting = 1;
-			pthread_cond_wait (&buf->play_cond, &buf->mutex);
+			seq = fifo_buf_wait_prepare (buf->buf);
+			if (fifo_buf_get_fill(buf->buf) == 0 || buf->pause
+					|| buf->stop) {
+				UNLOCK (buf->mutex);
+				fifo_buf_wait (buf->buf, seq);
+				LOCK (buf->mutex);
+			}
 			debug ("something appeared in the buffer");
 		}
 
@@ -184,19 +294,40 @@ static void *read_thread (void *arg)
 			audio_bpf = audio_get_bpf();
 			play_buf_frames = MIN(audio_get_bps() * AUDIO_MAX_PLAY,
 			                      AUDIO_MAX_PLAY_BYTES) / audio_bpf;
-			play_buf_fill = fifo_buf_get(buf->buf, play_buf,
-			                             play_buf_frames * audio_bpf);
+
+			/* Play straight from the buffer, it's consumed only
+			 * after the data were sent.  Copy only if the data
+			 * wrap around the end of the buffer memory. */
+			play_data = fifo_buf_peek_read (buf->buf,
+			                                &play_buf_fill);
+			if (play_buf_fill < play_buf_frames * audio_bpf
+			    && play_buf_fill < fifo_buf_get_fill (buf->buf)) {
+				play_buf_fill = fifo_buf_peek (buf->buf,
+						play_buf, play_buf_frames * audio_bpf);
+				play_data = play_buf;
+			}
+			play_buf_fill = MIN(play_buf_fill,
+			                    play_buf_frames * audio_bpf);
 			UNLOCK (buf->mutex);
 
-			debug ("playing %d bytes", play_buf_fill);
+			debug ("playing %zu bytes", play_buf_fill);
+
+			if (realtime)
+				rt_faults_start (&stats);
 
 			while (play_buf_pos < play_buf_fill) {
+				if (realtime)
+					rt_check_deadline (&stats);
+
 				played = audio_send_pcm (
-						play_buf + play_buf_pos,
+						play_data + play_buf_pos,
 						play_buf_fill - play_buf_pos);
 
+				if (realtime)
+					rt_set_deadline (&stats);
+
 #ifdef OUT_TEST
-				write (fd, play_buf + play_buf_pos, played);
+				write (fd, play_data + play_buf_pos, played);
 #endif
 
 				play_buf_pos += played;
@@ -204,7 +335,11 @@ static void *read_thread (void *arg)
 
 			/*logit ("done sending PCM");*/
 
+			if (realtime)
+				rt_faults_end (&stats);
+
 			LOCK (buf->mutex);
+			fifo_buf_consume (buf->buf, play_buf_fill);
 
 			/* Update time */
 			if (play_buf_fill && audio_get_bps())
@@ -215,6 +350,10 @@ static void *read_thread (void *arg)
 
 	UNLOCK (buf->mutex);
 
+	if (realtime)
+		logit ("%ld page faults and %ld deadline misses while playing",
+				stats.faults, stats.misses);
+
 	logit ("exiting");
 
 	return NULL;
@@ -231,6 +370,7 @@ struct out_buf *out_buf_new (int size)
 	buf = xmalloc (sizeof (struct out_buf));
 
 	buf->buf = fifo_buf_new (size);
+	fifo_buf_prefault (buf->buf);
 	buf->exit = 0;
 	buf->pause = 0;
 	buf->stop = 0;
@@ -241,7 +381,6 @@ struct out_buf *out_buf_new (int size)
 	buf->free_callback = NULL;
 
 	pthread_mutex_init (&buf->mutex, NULL);
-	pthread_cond_init (&buf->play_cond, NULL);
 	pthread_cond_init (&buf->ready_cond, NULL);
 
 #ifdef OUT_TEST
@@ -265,7 +404,7 @@ void out_buf_free (struct out_buf *buf)
 
 	LOCK (buf->mutex);
 	buf->exit = 1;
-	pthread_cond_signal (&buf->play_cond);
+	fifo_buf_wake (buf->buf);
 	UNLOCK (buf->mutex);
 
 	pthread_join (buf->tid, NULL);
@@ -282,9 +421,6 @@ void out_buf_free (struct out_buf *buf)
 	rc = pthread_mutex_destroy (&buf->mutex);
 	if (rc != 0)
 		log_errno ("Destroying buffer mutex failed", rc);
-	rc = pthread_cond_destroy (&buf->play_cond);
-	if (rc != 0)
-		log_errno ("Destroying buffer play condition failed", rc);
 	rc = pthread_cond_destroy (&buf->ready_cond);
 	if (rc != 0)
 		log_errno ("Destroying buffer ready condition failed", rc);
@@ -298,7 +434,8 @@ void out_buf_free (struct out_buf *buf)
 #endif
 }
 
-/* Put data at the end of the buffer, return 0 if nothing was put. */
+/* Put data at the end of the buffer, return 0 if nothing was put.  This
+ * doesn't take the mutex, so only one thread may put data. */
 int out_buf_put (struct out_buf *buf, const char *data, int size)
 {
 	int pos = 0;
@@ -306,31 +443,27 @@ int out_buf_put (struct out_buf *buf, const char *data, int size)
 	/*logit ("got %d bytes to play", size);*/
 
 	while (size) {
-		int written;
-
-		LOCK (buf->mutex);
-
-		if (fifo_buf_get_space(buf->buf) == 0 && !buf->stop) {
-			/*logit ("buffer full, waiting for the signal");*/
-			pthread_cond_wait (&buf->ready_cond, &buf->mutex);
-			/*logit ("buffer ready");*/
-		}
+		int written, seq;
 
-		if (buf->stop) {
+		if (__atomic_load_n (&buf->stop, __ATOMIC_ACQUIRE)) {
 			logit ("the buffer is stopped, refusing to write to the buffer");
-			UNLOCK (buf->mutex);
 			return 0;
 		}
 
 		written = fifo_buf_put (buf->buf, data + pos, size);
 
 		if (written) {
-			pthread_cond_signal (&buf->play_cond);
 			size -= written;
 			pos += written;
+			continue;
 		}
 
-		UNLOCK (buf->mutex);
+		/*logit ("buffer full, waiting for the signal");*/
+		seq = fifo_buf_wait_prepare (buf->buf);
+		if (fifo_buf_get_space(buf->buf) == 0
+				&& !__atomic_load_n (&buf->stop, __ATOMIC_ACQUIRE))
+			fifo_buf_wait (buf->buf, seq);
+		/*logit ("buffer ready");*/
 	}
 
 	return 1;
@@ -348,7 +481,7 @@ void out_buf_unpause (struct out_buf *buf)
 {
 	LOCK (buf->mutex);
 	buf->pause = 0;
-	pthread_cond_signal (&buf->play_cond);
+	fifo_buf_wake (buf->buf);
 	UNLOCK (buf->mutex);
 }
 
@@ -358,11 +491,11 @@ void out_buf_stop (struct out_buf *buf)
 {
 	logit ("stopping the buffer");
 	LOCK (buf->mutex);
-	buf->stop = 1;
+	__atomic_store_n (&buf->stop, 1, __ATOMIC_RELEASE);
 	buf->pause = 0;
 	buf->reset_dev = 1;
 	logit ("sending signal");
-	pthread_cond_signal (&buf->play_cond);
+	fifo_buf_wake (buf->buf);
 	logit ("waiting for signal");
 	pthread_cond_wait (&buf->ready_cond, &buf->mutex);
 	logit ("done");
@@ -377,7 +510,7 @@ void out_buf_reset (struct out_buf *buf)
 
 	LOCK (buf->mutex);
 	fifo_buf_clear (buf->buf);
-	buf->stop = 0;
+	__atomic_store_n (&buf->stop, 0, __ATOMIC_RELEASE);
 	buf->pause = 0;
 	buf->reset_dev = 0;
 	buf->hardware_buf_fill = 0;
@@ -420,28 +553,16 @@ void out_buf_set_free_callback (struct out_buf *buf,
 
 int out_buf_get_free (struct out_buf *buf)
 {
-	int space;
-
 	assert (buf != NULL);
 
-	LOCK (buf->mutex);
-	space = fifo_buf_get_space (buf->buf);
-	UNLOCK (buf->mutex);
-
-	return space;
+	return fifo_buf_get_space (buf->buf);
 }
 
 int out_buf_get_fill (struct out_buf *buf)
 {
-	int fill;
-
 	assert (buf != NULL);
 
-	LOCK (buf->mutex);
-	fill = fifo_buf_get_fill (buf->buf);
-	UNLOCK (buf->mutex);
-
-	return fill;
+	return fifo_buf_get_fill (buf->buf);
 }
 
 /* Wait until the read thread will stop and wait for data to come.
@@ -0,0 +1,659 @@
+/*
+ * MOC - music on console
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+/* Cache of decoded sound.  A thread decodes the files which are going to
+ * be played next, as a whole, so they can be played without touching the
+ * disk.  The cache is limited in size, the least recently used files are
+ * removed first.  Files which are being played can't be removed.  The
+ * cached sound is played by the decoder returned by pcm_cache_decoder(). */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <assert.h>
+
+#define DEBUG
+
+#include "common.h"
+#include "log.h"
+#include "files.h"
+#include "pcm_cache.h"
+#include "realtime.h"
+
+/* Size of the memory blocks holding the sound. */
+#define CHUNK_SIZE	(256 * 1024)
+
+/* Size of the buffer for the decoder. */
+#define DECODE_BUF_SIZE	(36 * 1024)
+
+struct cache_entry
+{
+	char *file;
+	time_t mtime; /* of the file when it was decoded */
+	struct sound_params sound_params;
+	char **chunks;
+	int chunks_num;
+	size_t size; /* number of bytes of sound */
+	int complete; /* was the whole file decoded? */
+	int refs; /* number of users, the entry can't be removed if > 0 */
+	int duration;
+	int avg_bitrate;
+	int has_gapless_info;
+	unsigned int delay;
+	unsigned int padding;
+	struct cache_entry *prev; /* more recently used */
+	struct cache_entry *next; /* less recently used */
+};
+
+/* A wanted file which can't be decoded. */
+struct failed_file
+{
+	char *file;
+	time_t mtime; /* of the file when decoding failed */
+};
+
+/* Private data of the cache decoder. */
+struct cache_data
+{
+	struct cache_entry *entry;
+	size_t pos;
+	struct decoder_error error;
+};
+
+static struct
+{
+	struct cache_entry *head; /* the most recently used entry */
+	struct cache_entry *tail;
+	size_t size; /* number of bytes of sound in all entries */
+	size_t max_size;
+	lists_t_strs *wanted; /* files to decode, in order */
+	struct failed_file *failed; /* wanted files which can't be decoded */
+	int failed_num;
+	int want_serial; /* bumped when the wanted files change */
+	int exit;
+	int running;
+	pthread_t tid;
+	pthread_mutex_t mtx;
+	pthread_cond_t cond;
+} cache;
+
+static void entry_unlink (struct cache_entry *e)
+{
+	if (e->prev)
+		e->prev->next = e->next;
+	else
+		cache.head = e->next;
+
+	if (e->next)
+		e->next->prev = e->prev;
+	else
+		cache.tail = e->prev;
+
+	e->prev = e->next = NULL;
+}
+
+static void entry_push_head (struct cache_entry *e)
+{
+	e->prev = NULL;
+	e->next = cache.head;
+	if (cache.head)
+		cache.head->prev = e;
+	else
+		cache.tail = e;
+	cache.head = e;
+}
+
+static void entry_free (struct cache_entry *e)
+{
+	int i;
+
+	for (i = 0; i < e->chunks_num; i++) {
+		realtime_release (e->chunks[i], CHUNK_SIZE);
+		free (e->chunks[i]);
+	}
+	free (e->chunks);
+	free (e->file);
+	free (e);
+}
+
+/* Remove the entry from the cache, it must not be used. */
+static void entry_remove (struct cache_entry *e)
+{
+	assert (e->refs == 0);
+
+	debug ("Removing %s from the cache", e->file);
+
+	entry_unlink (e);
+	cache.size -= e->size;
+	entry_free (e);
+}
+
+/* Find the complete entry for the file, remove it if the file was modified
+ * (its mtime, got before locking, is different).  Must be called with the
+ * mutex locked. */
+static struct cache_entry *entry_find (const char *file, const time_t mtime)
+{
+	struct cache_entry *e;
+
+	for (e = cache.head; e; e = e->next) {
+		if (e->complete && !strcmp (e->file, file))
+			break;
+	}
+
+	if (e && mtime != e->mtime) {
+		logit ("%s was modified, removing it from the cache", file);
+		if (!e->refs)
+			entry_remove (e);
+		e = NULL;
+	}
+
+	return e;
+}
+
+static void failed_remove (const int i)
+{
+	free (cache.failed[i].file);
+	cache.failed[i] = cache.failed[--cache.failed_num];
+}
+
+/* Did decoding of the file fail?  The failure is forgotten if the file was
+ * modified since.  Must be called with the mutex locked. */
+static int failed_find (const char *file, const time_t mtime)
+{
+	int i;
+
+	for (i = 0; i < cache.failed_num; i++) {
+		if (!strcmp (cache.failed[i].file, file)) {
+			if (cache.failed[i].mtime == mtime)
+				return 1;
+
+			failed_remove (i);
+			return 0;
+		}
+	}
+
+	return 0;
+}
+
+/* Must be called with the mutex locked. */
+static void failed_add (const char *file, const time_t mtime)
+{
+	cache.failed = (struct failed_file *)xrealloc (cache.failed,
+			(cache.failed_num + 1) * sizeof (struct failed_file));
+	cache.failed[cache.failed_num].file = xstrdup (file);
+	cache.failed[cache.failed_num].mtime = mtime;
+	cache.failed_num++;
+}
+
+/* Remove the least recently used entries until there is room for size
+ * more bytes.  Files being used and the wanted ones, which are decoded in
+ * order, are not removed.  Return 0 if it's not possible. */
+static int make_room (const size_t size)
+{
+	struct cache_entry *e = cache.tail;
+
+	while (cache.size + size > cache.max_size) {
+		struct cache_entry *victim;
+
+		while (e && (e->refs || lists_strs_exists (cache.wanted,
+						e->file)))
+			e = e->prev;
+		if (!e)
+			return 0;
+
+		victim = e;
+		e = e->prev;
+		entry_remove (victim);
+	}
+
+	return 1;
+}
+
+/* Append the sound to the entry.  Must be called with the mutex locked. */
+static void entry_append (struct cache_entry *e, const char *buf,
+		size_t size)
+{
+	while (size) {
+		size_t offs = e->size % CHUNK_SIZE;
+		size_t len = MIN(size, CHUNK_SIZE - offs);
+
+		if (!offs) {
+			e->chunks = (char **)xrealloc (e->chunks,
+					(e->chunks_num + 1) * sizeof (char *));
+			e->chunks[e->chunks_num++] = (char *)xmalloc (CHUNK_SIZE);
+			realtime_prefault (e->chunks[e->chunks_num - 1],
+					CHUNK_SIZE);
+		}
+
+		memcpy (e->chunks[e->chunks_num - 1] + offs, buf, len);
+		e->size += len;
+		cache.size += len;
+		buf += len;
+		size -= len;
+	}
+}
+
+/* Decode the whole file into a new entry.  Return 0 on failure. */
+static int cache_file (const char *file)
+{
+	struct decoder *f;
+	void *decoder_data;
+	struct decoder_error err;
+	struct cache_entry *e;
+	char buf[DECODE_BUF_SIZE];
+	int ok = 0;
+
+	f = get_decoder (file);
+	if (!f)
+		return 0;
+
+	decoder_data = f->open (file);
+	f->get_error (decoder_data, &err);
+	if (err.type != ERROR_OK) {
+		logit ("Can't open %s for caching: %s", file, err.err);
+		decoder_error_clear (&err);
+		f->close (decoder_data);
+		return 0;
+	}
+
+	logit ("Caching %s", file);
+
+	e = (struct cache_entry *)xcalloc (1, sizeof (struct cache_entry));
+	e->file = xstrdup (file);
+	e->mtime = get_mtime (file);
+	e->refs = 1;
+
+	LOCK (cache.mtx);
+	entry_push_head (e);
+	UNLOCK (cache.mtx);
+
+	while (1) {
+		struct sound_params sound_params;
+		int decoded;
+
+		decoded = f->decode (decoder_data, buf, sizeof (buf),
+				&sound_params);
+		f->get_error (decoder_data, &err);
+		if (err.type == ERROR_FATAL) {
+			logit ("Error decoding %s for caching: %s", file,
+					err.err);
+			decoder_error_clear (&err);
+			break;
+		}
+		decoder_error_clear (&err);
+
+		if (!decoded) {
+			ok = e->size > 0;
+			break;
+		}
+
+		if (!e->sound_params.channels)
+			e->sound_params = sound_params;
+		else if (!sound_params_eq (e->sound_params, sound_params)) {
+			logit ("Sound parameters have changed when caching.");
+			break;
+		}
+
+		LOCK (cache.mtx);
+		if (cache.exit || !lists_strs_exists (cache.wanted, file)) {
+			debug ("%s is not wanted any more", file);
+			UNLOCK (cache.mtx);
+			break;
+		}
+		if (!make_room (decoded)) {
+			logit ("%s doesn't fit in the cache", file);
+			UNLOCK (cache.mtx);
+			break;
+		}
+		entry_append (e, buf, decoded);
+		UNLOCK (cache.mtx);
+	}
+
+	if (ok) {
+		e->duration = f->get_duration (decoder_data);
+		if (f->get_avg_bitrate)
+			e->avg_bitrate = f->get_avg_bitrate (decoder_data);
+		else
+			e->avg_bitrate = f->get_bitrate (decoder_data);
+		if (f->get_gapless_info)
+			e->has_gapless_info = f->get_gapless_info (
+					decoder_data, &e->delay, &e->padding);
+	}
+
+	f->close (decoder_data);
+
+	LOCK (cache.mtx);
+	e->refs = 0;
+	if (ok) {
+		e->complete = 1;
+		logit ("Cached %s (%zu bytes, %zu in the cache)", file, e->size,
+				cache.size);
+	}
+	else
+		entry_remove (e);
+	UNLOCK (cache.mtx);
+
+	return ok;
+}
+
+/* Return the first wanted file which is not cached and set *mtime to its
+ * modification time.  Must be called with the mutex locked, which is
+ * released while getting the modification times. */
+static char *next_wanted (time_t *mtime)
+{
+	int i, serial;
+
+	do {
+		serial = cache.want_serial;
+
+		for (i = 0; i < lists_strs_size (cache.wanted); i++) {
+			char *file = xstrdup (lists_strs_at (cache.wanted, i));
+			struct cache_entry *e;
+
+			UNLOCK (cache.mtx);
+			*mtime = get_mtime (file);
+			LOCK (cache.mtx);
+
+			if (serial != cache.want_serial || cache.exit) {
+				free (file);
+				break;
+			}
+
+			if (failed_find (file, *mtime)) {
+				free (file);
+				continue;
+			}
+
+			e = entry_find (file, *mtime);
+			if (e) {
+				/* Keep the wanted files from being removed
+				 * before the others. */
+				entry_unlink (e);
+				entry_push_head (e);
+				free (file);
+				continue;
+			}
+
+			return file;
+		}
+	} while (serial != cache.want_serial && !cache.exit);
+
+	return NULL;
+}
+
+static void *cache_thread (void *unused ATTR_UNUSED)
+{
+	LOCK (cache.mtx);
+	while (!cache.exit) {
+		time_t mtime;
+		char *file = next_wanted (&mtime);
+
+		if (!file) {
+			if (!cache.exit)
+				pthread_cond_wait (&cache.cond, &cache.mtx);
+			continue;
+		}
+
+		UNLOCK (cache.mtx);
+		if (!cache_file (file)) {
+			LOCK (cache.mtx);
+			failed_add (file, mtime);
+		}
+		else
+			LOCK (cache.mtx);
+		free (file);
+	}
+	UNLOCK (cache.mtx);
+
+	return NULL;
+}
+
+/* Start the cache with the memory limit of max_size bytes. */
+void pcm_cache_init (const size_t max_size)
+{
+	int rc;
+
+	memset (&cache, 0, sizeof (cache));
+	cache.max_size = max_size;
+	cache.wanted = lists_strs_new (8);
+	pthread_mutex_init (&cache.mtx, NULL);
+	pthread_cond_init (&cache.cond, NULL);
+
+	if (!max_size)
+		return;
+
+	rc = pthread_create (&cache.tid, NULL, cache_thread, NULL);
+	if (rc != 0)
+		log_errno ("Can't create the PCM cache thread", rc);
+	else
+		cache.running = 1;
+}
+
+void pcm_cache_cleanup ()
+{
+	int rc;
+
+	if (cache.running) {
+		LOCK (cache.mtx);
+		cache.exit = 1;
+		pthread_cond_signal (&cache.cond);
+		UNLOCK (cache.mtx);
+
+		rc = pthread_join (cache.tid, NULL);
+		if (rc != 0)
+			log_errno ("pthread_join() on the PCM cache thread failed",
+					rc);
+		cache.running = 0;
+	}
+
+	while (cache.head) {
+		struct cache_entry *e = cache.head;
+
+		entry_unlink (e);
+		entry_free (e);
+	}
+
+	lists_strs_free (cache.wanted);
+	while (cache.failed_num)
+		failed_remove (0);
+	free (cache.failed);
+
+	rc = pthread_mutex_destroy (&cache.mtx);
+	if (rc != 0)
+		log_errno ("Can't destroy the PCM cache mutex", rc);
+	rc = pthread_cond_destroy (&cache.cond);
+	if (rc != 0)
+		log_errno ("Can't destroy the PCM cache condition", rc);
+}
+
+/* Set the files to be decoded into the cache, the most wanted first.  The
+ * list is taken over by the cache. */
+void pcm_cache_want (lists_t_strs *files)
+{
+	int i = 0;
+
+	LOCK (cache.mtx);
+	lists_strs_free (cache.wanted);
+	cache.wanted = files;
+	cache.want_serial++;
+
+	/* Failures are kept for the files which are still wanted. */
+	while (i < cache.failed_num) {
+		if (lists_strs_exists (files, cache.failed[i].file))
+			i++;
+		else
+			failed_remove (i);
+	}
+
+	pthread_cond_signal (&cache.cond);
+	UNLOCK (cache.mtx);
+}
+
+/* Is the whole file in the cache? */
+int pcm_cache_has (const char *file)
+{
+	time_t mtime = get_mtime (file);
+	int res;
+
+	LOCK (cache.mtx);
+	res = entry_find (file, mtime) != NULL;
+	UNLOCK (cache.mtx);
+
+	return res;
+}
+
+static void *cache_open (const char *file)
+{
+	struct cache_data *data;
+	time_t mtime = get_mtime (file);
+
+	data = (struct cache_data *)xmalloc (sizeof (struct cache_data));
+	data->pos = 0;
+	decoder_error_init (&data->error);
+
+	LOCK (cache.mtx);
+	data->entry = entry_find (file, mtime);
+	if (data->entry) {
+		data->entry->refs++;
+		entry_unlink (data->entry);
+		entry_push_head (data->entry);
+	}
+	UNLOCK (cache.mtx);
+
+	if (!data->entry)
+		decoder_error (&data->error, ERROR_FATAL, 0,
+				"%s is not in the cache", file);
+
+	return data;
+}
+
+static void cache_close (void *prv_data)
+{
+	struct cache_data *data = (struct cache_data *)prv_data;
+
+	if (data->entry) {
+		LOCK (cache.mtx);
+		data->entry->refs--;
+		UNLOCK (cache.mtx);
+	}
+
+	decoder_error_clear (&data->error);
+	free (data);
+}
+
+static int cache_decode (void *prv_data, char *buf, int buf_len,
+		struct sound_params *sound_params)
+{
+	struct cache_data *data = (struct cache_data *)prv_data;
+	struct cache_entry *e = data->entry;
+	size_t bpf, len, done = 0;
+
+	*sound_params = e->sound_params;
+	bpf = sfmt_Bps (e->sound_params.fmt) * e->sound_params.channels;
+	len = MIN((size_t)buf_len, e->size - data->pos);
+	len -= len % bpf;
+
+	while (done < len) {
+		size_t offs = data->pos % CHUNK_SIZE;
+		size_t n = MIN(len - done, CHUNK_SIZE - offs);
+
+		memcpy (buf + done, e->chunks[data->pos / CHUNK_SIZE] + offs, n);
+		data->pos += n;
+		done += n;
+	}
+
+	return done;
+}
+
+static int cache_seek (void *prv_data, int sec)
+{
+	struct cache_data *data = (struct cache_data *)prv_data;
+	struct cache_entry *e = data->entry;
+	size_t pos;
+
+	assert (sec >= 0);
+
+	pos = (size_t)sec * e->sound_params.rate * e->sound_params.channels
+		* sfmt_Bps (e->sound_params.fmt);
+	if (pos >= e->size)
+		return -1;
+
+	data->pos = pos;
+
+	return sec;
+}
+
+static int cache_get_bitrate (void *prv_data)
+{
+	struct cache_data *data = (struct cache_data *)prv_data;
+
+	return data->entry->avg_bitrate;
+}
+
+static int cache_get_duration (void *prv_data)
+{
+	struct cache_data *data = (struct cache_data *)prv_data;
+
+	return data->entry->duration;
+}
+
+static void cache_get_error (void *prv_data, struct decoder_error *error)
+{
+	struct cache_data *data = (struct cache_data *)prv_data;
+
+	decoder_error_copy (error, &data->error);
+}
+
+static int cache_get_gapless_info (void *prv_data, unsigned int *delay,
+		unsigned int *padding)
+{
+	struct cache_data *data = (struct cache_data *)prv_data;
+
+	if (!data->entry->has_gapless_info)
+		return 0;
+
+	*delay = data->entry->delay;
+	*padding = data->entry->padding;
+
+	return 1;
+}
+
+static struct decoder cache_decoder = {
+	DECODER_API_VERSION,
+	NULL,
+	NULL,
+	cache_open,
+	NULL,
+	NULL,
+	cache_close,
+	cache_decode,
+	cache_seek,
+	NULL,
+	cache_get_bitrate,
+	cache_get_duration,
+	cache_get_error,
+	NULL,
+	NULL,
+	NULL,
+	NULL,
+	NULL,
+	cache_get_bitrate,
+	cache_get_gapless_info
+};
+
+/* Return the decoder playing files from the cache. */
+struct decoder *pcm_cache_decoder ()
+{
+	return &cache_decoder;
+}
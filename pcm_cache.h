@@ -0,0 +1,21 @@
+#ifndef PCM_CACHE_H
+#define PCM_CACHE_H
+
+#include "decoder.h"
+#include "lists.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void pcm_cache_init (const size_t max_size);
+void pcm_cache_cleanup ();
+void pcm_cache_want (lists_t_strs *files);
+int pcm_cache_has (const char *file);
+struct decoder *pcm_cache_decoder ();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
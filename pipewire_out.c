@@ -0,0 +1,600 @@
+/*
+ * MOC - music on console
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+/* PipeWire output driver.  The stream is opened with the sample format,
+ * the number of channels and the rate of the sound, so no conversion is
+ * done by MOC, and the graph is asked to run at that rate.  The sound is
+ * put straight into the buffers dequeued from the stream's pool (see
+ * get_buf() in hw_funcs), the stream's process callback only wakes up the
+ * output thread. */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <assert.h>
+#include <pipewire/pipewire.h>
+#include <spa/param/audio/format-utils.h>
+#include <spa/param/props.h>
+
+#define DEBUG
+
+#include "common.h"
+#include "audio.h"
+#include "log.h"
+#include "options.h"
+#include "pipewire_out.h"
+
+/* How long to wait for the stream before logging that it doesn't take the
+ * sound, in seconds. */
+#define WAIT_TIMEOUT	2
+
+static struct pw_thread_loop *loop = NULL;
+static struct pw_context *context = NULL;
+static struct pw_core *core = NULL;
+static struct pw_stream *stream = NULL;
+static struct spa_hook stream_listener;
+
+/* The buffer returned by pipewire_get_buf(), not yet queued. */
+static struct pw_buffer *curr_buf = NULL;
+
+static struct sound_params params = { 0, 0, 0 };
+static int bytes_per_frame;
+
+/* Volume in percent, set by MOC or by other PipeWire clients from the
+ * loop thread, so it's accessed atomically. */
+static int volume = 100;
+
+/* Underruns: the stream found no sound queued after it had been fed since
+ * it was opened or reset.  Like the ALSA driver does on the next write,
+ * they are counted when the next buffer is queued.  fed and starved are
+ * protected by the loop lock. */
+static int xruns = 0;
+static int fed = 0;
+static int starved = 0;
+
+static enum spa_audio_format spa_format (const long fmt)
+{
+	switch (fmt & SFMT_MASK_FORMAT) {
+		case SFMT_S8:
+			return SPA_AUDIO_FORMAT_S8;
+		case SFMT_U8:
+			return SPA_AUDIO_FORMAT_U8;
+		case SFMT_S16:
+			return SPA_AUDIO_FORMAT_S16;
+		case SFMT_U16:
+			return SPA_AUDIO_FORMAT_U16;
+		case SFMT_S24:
+			return SPA_AUDIO_FORMAT_S24_32;
+		case SFMT_U24:
+			return SPA_AUDIO_FORMAT_U24_32;
+		case SFMT_S32:
+			return SPA_AUDIO_FORMAT_S32;
+		case SFMT_U32:
+			return SPA_AUDIO_FORMAT_U32;
+		case SFMT_S24_3:
+			return SPA_AUDIO_FORMAT_S24;
+		case SFMT_U24_3:
+			return SPA_AUDIO_FORMAT_U24;
+		case SFMT_FLOAT:
+			return SPA_AUDIO_FORMAT_F32;
+	}
+
+	return SPA_AUDIO_FORMAT_UNKNOWN;
+}
+
+/* Set the channel positions in the WAVE order used by the decoders. */
+static void set_positions (struct spa_audio_info_raw *info)
+{
+	static const uint32_t layouts[8][8] = {
+		{ SPA_AUDIO_CHANNEL_MONO },
+		{ SPA_AUDIO_CHANNEL_FL, SPA_AUDIO_CHANNEL_FR },
+		{ SPA_AUDIO_CHANNEL_FL, SPA_AUDIO_CHANNEL_FR,
+		  SPA_AUDIO_CHANNEL_FC },
+		{ SPA_AUDIO_CHANNEL_FL, SPA_AUDIO_CHANNEL_FR,
+		  SPA_AUDIO_CHANNEL_RL, SPA_AUDIO_CHANNEL_RR },
+		{ SPA_AUDIO_CHANNEL_FL, SPA_AUDIO_CHANNEL_FR,
+		  SPA_AUDIO_CHANNEL_FC, SPA_AUDIO_CHANNEL_RL,
+		  SPA_AUDIO_CHANNEL_RR },
+		{ SPA_AUDIO_CHANNEL_FL, SPA_AUDIO_CHANNEL_FR,
+		  SPA_AUDIO_CHANNEL_FC, SPA_AUDIO_CHANNEL_LFE,
+		  SPA_AUDIO_CHANNEL_RL, SPA_AUDIO_CHANNEL_RR },
+		{ SPA_AUDIO_CHANNEL_FL, SPA_AUDIO_CHANNEL_FR,
+		  SPA_AUDIO_CHANNEL_FC, SPA_AUDIO_CHANNEL_LFE,
+		  SPA_AUDIO_CHANNEL_RC, SPA_AUDIO_CHANNEL_SL,
+		  SPA_AUDIO_CHANNEL_SR },
+		{ SPA_AUDIO_CHANNEL_FL, SPA_AUDIO_CHANNEL_FR,
+		  SPA_AUDIO_CHANNEL_FC, SPA_AUDIO_CHANNEL_LFE,
+		  SPA_AUDIO_CHANNEL_RL, SPA_AUDIO_CHANNEL_RR,
+		  SPA_AUDIO_CHANNEL_SL, SPA_AUDIO_CHANNEL_SR }
+	};
+
+	if (info->channels > 8) {
+		info->flags |= SPA_AUDIO_FLAG_UNPOSITIONED;
+		return;
+	}
+
+	memcpy (info->position, layouts[info->channels - 1],
+			info->channels * sizeof(uint32_t));
+}
+
+static void on_state_changed (void *unused ATTR_UNUSED,
+		enum pw_stream_state old ATTR_UNUSED,
+		enum pw_stream_state state, const char *err)
+{
+	if (state == PW_STREAM_STATE_ERROR)
+		logit ("PipeWire stream error: %s", err ? err : "unknown");
+	else
+		debug ("PipeWire stream %s", pw_stream_state_as_string (state));
+
+	pw_thread_loop_signal (loop, false);
+}
+
+/* Follow the volume changed by other clients. */
+static void on_control_info (void *unused ATTR_UNUSED, uint32_t id,
+		const struct pw_stream_control *control)
+{
+	if (id == SPA_PROP_channelVolumes && control->n_values > 0)
+		__atomic_store_n (&volume,
+				(int)(cbrt (control->values[0]) * 100.0 + 0.5),
+				__ATOMIC_RELAXED);
+}
+
+/* There is a free buffer. */
+static void on_process (void *unused ATTR_UNUSED)
+{
+	struct pw_time time;
+
+	if (fed && pw_stream_get_time_n (stream, &time, sizeof(time)) == 0
+			&& time.queued == 0)
+		starved = 1;
+
+	pw_thread_loop_signal (loop, false);
+}
+
+static const struct pw_stream_events stream_events = {
+	PW_VERSION_STREAM_EVENTS,
+	.state_changed = on_state_changed,
+	.control_info = on_control_info,
+	.process = on_process
+};
+
+/* Set the stream volume, the loop must be locked. */
+static void apply_volume ()
+{
+	float values[SPA_AUDIO_MAX_CHANNELS];
+	float vol = __atomic_load_n (&volume, __ATOMIC_RELAXED) / 100.0;
+	int i;
+
+	for (i = 0; i < params.channels; i++)
+		values[i] = vol * vol * vol;
+
+	pw_stream_set_control (stream, SPA_PROP_channelVolumes,
+			params.channels, values, 0);
+}
+
+static void pipewire_shutdown ()
+{
+	if (loop)
+		pw_thread_loop_stop (loop);
+	if (core)
+		pw_core_disconnect (core);
+	if (context)
+		pw_context_destroy (context);
+	if (loop)
+		pw_thread_loop_destroy (loop);
+
+	core = NULL;
+	context = NULL;
+	loop = NULL;
+
+	pw_deinit ();
+}
+
+static int pipewire_init (struct output_driver_caps *caps)
+{
+	pw_init (NULL, NULL);
+
+	loop = pw_thread_loop_new ("moc-pipewire", NULL);
+	if (!loop) {
+		error_errno ("Can't create PipeWire loop", errno);
+		goto err;
+	}
+
+	context = pw_context_new (pw_thread_loop_get_loop (loop), NULL, 0);
+	if (!context) {
+		error_errno ("Can't create PipeWire context", errno);
+		goto err;
+	}
+
+	if (pw_thread_loop_start (loop) < 0) {
+		error ("Can't start PipeWire loop");
+		goto err;
+	}
+
+	pw_thread_loop_lock (loop);
+	core = pw_context_connect (context, NULL, 0);
+	pw_thread_loop_unlock (loop);
+	if (!core) {
+		error_errno ("Can't connect to PipeWire", errno);
+		goto err;
+	}
+
+	caps->formats = SFMT_S8 | SFMT_U8 | SFMT_S16 | SFMT_U16 | SFMT_S24
+		| SFMT_U24 | SFMT_S32 | SFMT_U32 | SFMT_S24_3 | SFMT_U24_3
+		| SFMT_FLOAT | SFMT_NE;
+	caps->min_channels = 1;
+	caps->max_channels = SPA_AUDIO_MAX_CHANNELS;
+	caps->min_rate = 8000;
+	caps->max_rate = 768000;
+
+	logit ("Connected to PipeWire %s (library %s)",
+			pw_get_headers_version (), pw_get_library_version ());
+
+	return 1;
+
+err:
+	pipewire_shutdown ();
+	return 0;
+}
+
+/* Give back a dequeued buffer without sound, the loop must be locked. */
+static void queue_empty (struct pw_buffer *buf)
+{
+	buf->buffer->datas[0].chunk->size = 0;
+	buf->size = 0;
+	pw_stream_queue_buffer (stream, buf);
+}
+
+/* Destroy the stream, the loop must be locked. */
+static void destroy_stream ()
+{
+	spa_hook_remove (&stream_listener);
+	pw_stream_destroy (stream);
+	stream = NULL;
+	curr_buf = NULL;
+}
+
+static int pipewire_open (struct sound_params *sound_params)
+{
+	struct spa_audio_info_raw info;
+	uint8_t pod_buf[1024];
+	struct spa_pod_builder b = SPA_POD_BUILDER_INIT (pod_buf,
+			sizeof(pod_buf));
+	const struct spa_pod *format;
+	struct pw_properties *props;
+	enum pw_stream_state state;
+	const char *err = NULL;
+	const char *target;
+	int latency, rc;
+
+	assert (stream == NULL);
+
+	memset (&info, 0, sizeof(info));
+	info.format = spa_format (sound_params->fmt);
+	info.rate = sound_params->rate;
+	info.channels = sound_params->channels;
+	set_positions (&info);
+	if (info.format == SPA_AUDIO_FORMAT_UNKNOWN) {
+		error ("Unsupported sound format");
+		return 0;
+	}
+
+	format = spa_format_audio_raw_build (&b, SPA_PARAM_EnumFormat, &info);
+
+	props = pw_properties_new (PW_KEY_MEDIA_TYPE, "Audio",
+			PW_KEY_MEDIA_CATEGORY, "Playback",
+			PW_KEY_MEDIA_ROLE, "Music",
+			PW_KEY_APP_NAME, "MOC",
+			PW_KEY_NODE_NAME, "moc",
+			NULL);
+
+	/* Let the graph switch to the rate of the sound if it's allowed to,
+	 * so it's not resampled. */
+	pw_properties_setf (props, PW_KEY_NODE_RATE, "1/%d",
+			sound_params->rate);
+
+	latency = options_get_int ("PipeWireLatency");
+	if (latency > 0)
+		pw_properties_setf (props, PW_KEY_NODE_LATENCY, "%d/%d",
+				MAX(sound_params->rate * latency / 1000, 1),
+				sound_params->rate);
+
+	target = options_get_str ("PipeWireTarget");
+	if (target && target[0]) {
+#ifdef PW_KEY_TARGET_OBJECT
+		pw_properties_set (props, PW_KEY_TARGET_OBJECT, target);
+#else
+		pw_properties_set (props, PW_KEY_NODE_TARGET, target);
+#endif
+	}
+
+	params = *sound_params;
+	bytes_per_frame = sfmt_Bps (params.fmt) * params.channels;
+
+	pw_thread_loop_lock (loop);
+
+	fed = 0;
+	starved = 0;
+	stream = pw_stream_new (core, "Music", props);
+	if (!stream) {
+		pw_thread_loop_unlock (loop);
+		error_errno ("Can't create PipeWire stream", errno);
+		return 0;
+	}
+
+	pw_stream_add_listener (stream, &stream_listener, &stream_events,
+			NULL);
+
+	rc = pw_stream_connect (stream, PW_DIRECTION_OUTPUT, PW_ID_ANY,
+			PW_STREAM_FLAG_AUTOCONNECT | PW_STREAM_FLAG_MAP_BUFFERS,
+			&format, 1);
+	if (rc < 0) {
+		destroy_stream ();
+		pw_thread_loop_unlock (loop);
+		error_errno ("Can't connect PipeWire stream", -rc);
+		return 0;
+	}
+
+	while ((state = pw_stream_get_state (stream, &err))
+			== PW_STREAM_STATE_CONNECTING)
+		pw_thread_loop_wait (loop);
+
+	if (state == PW_STREAM_STATE_ERROR
+			|| state == PW_STREAM_STATE_UNCONNECTED) {
+		destroy_stream ();
+		pw_thread_loop_unlock (loop);
+		error ("Can't connect PipeWire stream: %s",
+				err ? err : "unknown error");
+		return 0;
+	}
+
+	apply_volume ();
+
+	pw_thread_loop_unlock (loop);
+
+	logit ("PipeWire stream opened");
+
+	return 1;
+}
+
+/* Get the number of frames queued in the stream and not yet played. */
+static int64_t queued_frames ()
+{
+	struct pw_time time;
+	int64_t frames;
+
+	if (pw_stream_get_time_n (stream, &time, sizeof(time)) < 0)
+		return 0;
+
+	/* The size of the queued buffers is in frames, see
+	 * pipewire_commit_buf(). */
+	frames = time.queued + time.buffered;
+	if (time.rate.denom > 0)
+		frames += time.delay * params.rate * time.rate.num
+			/ time.rate.denom;
+
+	return MAX(frames, 0);
+}
+
+static void pipewire_close ()
+{
+	int64_t frames;
+
+	assert (stream != NULL);
+
+	/* Let the queued sound be played like the ALSA driver does. */
+	pw_thread_loop_lock (loop);
+	frames = queued_frames ();
+	pw_thread_loop_unlock (loop);
+	if (frames > 0)
+		xsleep (frames, params.rate);
+
+	pw_thread_loop_lock (loop);
+	if (curr_buf)
+		queue_empty (curr_buf);
+	destroy_stream ();
+	pw_thread_loop_unlock (loop);
+
+	params.fmt = 0;
+	params.rate = 0;
+	params.channels = 0;
+
+	logit ("PipeWire stream closed");
+}
+
+/* Dequeue a buffer from the stream's pool, wait for one if all of them
+ * are queued. */
+static char *pipewire_get_buf (const size_t size, size_t *avail)
+{
+	struct pw_buffer *buf;
+	struct spa_data *d;
+	size_t len;
+
+	assert (stream != NULL);
+	assert (curr_buf == NULL);
+
+	pw_thread_loop_lock (loop);
+	while (!(buf = pw_stream_dequeue_buffer (stream))) {
+		const char *err = NULL;
+		enum pw_stream_state state;
+
+		state = pw_stream_get_state (stream, &err);
+		if (state == PW_STREAM_STATE_ERROR
+				|| state == PW_STREAM_STATE_UNCONNECTED) {
+			pw_thread_loop_unlock (loop);
+			error ("PipeWire stream failed: %s",
+					err ? err : "disconnected");
+			return NULL;
+		}
+
+		if (pw_thread_loop_timed_wait (loop, WAIT_TIMEOUT) != 0)
+			logit ("The PipeWire stream doesn't take the sound (%s)",
+					pw_stream_state_as_string (state));
+	}
+	pw_thread_loop_unlock (loop);
+
+	d = &buf->buffer->datas[0];
+	if (!d->data) {
+		error ("PipeWire buffer is not mapped");
+		pw_thread_loop_lock (loop);
+		queue_empty (buf);
+		pw_thread_loop_unlock (loop);
+		return NULL;
+	}
+
+	/* Give the graph what it asked for to keep the latency. */
+	len = MIN(size, d->maxsize);
+	if (buf->requested)
+		len = MIN(len, buf->requested * bytes_per_frame);
+	len -= len % bytes_per_frame;
+
+	curr_buf = buf;
+	*avail = len;
+
+	return (char *)d->data;
+}
+
+static int pipewire_commit_buf (const size_t size)
+{
+	struct spa_data *d;
+
+	assert (curr_buf != NULL);
+
+	d = &curr_buf->buffer->datas[0];
+	d->chunk->offset = 0;
+	d->chunk->stride = bytes_per_frame;
+	d->chunk->size = size;
+	curr_buf->size = size / bytes_per_frame;
+
+	pw_thread_loop_lock (loop);
+	if (starved) {
+		__atomic_add_fetch (&xruns, 1, __ATOMIC_RELAXED);
+		starved = 0;
+	}
+	fed = 1;
+	pw_stream_queue_buffer (stream, curr_buf);
+	pw_thread_loop_unlock (loop);
+
+	curr_buf = NULL;
+
+	return 1;
+}
+
+/* Return the number of bytes played, or -1 on error. */
+static int pipewire_play (const char *buff, const size_t size)
+{
+	size_t pos = 0;
+
+	while (pos < size) {
+		size_t len;
+		char *dst;
+
+		dst = pipewire_get_buf (size - pos, &len);
+		if (!dst)
+			return -1;
+
+		memcpy (dst, buff + pos, len);
+		if (!pipewire_commit_buf (len))
+			return -1;
+
+		pos += len;
+	}
+
+	return size;
+}
+
+static int pipewire_read_mixer ()
+{
+	return __atomic_load_n (&volume, __ATOMIC_RELAXED);
+}
+
+static void pipewire_set_mixer (int vol)
+{
+	__atomic_store_n (&volume, vol, __ATOMIC_RELAXED);
+
+	/* The stream can be destroyed by pipewire_close() meanwhile, so
+	 * check it with the loop locked. */
+	pw_thread_loop_lock (loop);
+	if (stream)
+		apply_volume ();
+	pw_thread_loop_unlock (loop);
+}
+
+static int pipewire_get_buff_fill ()
+{
+	int64_t frames = 0;
+
+	pw_thread_loop_lock (loop);
+	if (stream)
+		frames = queued_frames ();
+	pw_thread_loop_unlock (loop);
+
+	return frames * bytes_per_frame;
+}
+
+static int pipewire_reset ()
+{
+	if (!stream) {
+		logit ("pipewire_reset() when the stream is not opened.");
+		return 0;
+	}
+
+	pw_thread_loop_lock (loop);
+	pw_stream_flush (stream, false);
+	fed = 0;
+	starved = 0;
+	pw_thread_loop_unlock (loop);
+
+	return 1;
+}
+
+static int pipewire_get_rate ()
+{
+	return params.rate;
+}
+
+/* The stream volume is the only mixer channel: the device volume belongs
+ * to the PipeWire session manager. */
+static void pipewire_toggle_mixer_channel ()
+{
+}
+
+static int pipewire_get_xruns ()
+{
+	return __atomic_load_n (&xruns, __ATOMIC_RELAXED);
+}
+
+static char *pipewire_get_mixer_channel_name ()
+{
+	return xstrdup ("PipeWire stream");
+}
+
+void pipewire_funcs (struct hw_funcs *funcs)
+{
+	funcs->init = pipewire_init;
+	funcs->shutdown = pipewire_shutdown;
+	funcs->open = pipewire_open;
+	funcs->close = pipewire_close;
+	funcs->play = pipewire_play;
+	funcs->get_buf = pipewire_get_buf;
+	funcs->commit_buf = pipewire_commit_buf;
+	funcs->read_mixer = pipewire_read_mixer;
+	funcs->set_mixer = pipewire_set_mixer;
+	funcs->get_buff_fill = pipewire_get_buff_fill;
+	funcs->reset = pipewire_reset;
+	funcs->get_rate = pipewire_get_rate;
+	funcs->toggle_mixer_channel = pipewire_toggle_mixer_channel;
+	funcs->get_mixer_channel_name = pipewire_get_mixer_channel_name;
+	funcs->get_xruns = pipewire_get_xruns;
+}
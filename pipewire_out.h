@@ -0,0 +1,16 @@
+#ifndef PIPEWIRE_OUT_H
+#define PIPEWIRE_OUT_H
+
+#include "audio.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void pipewire_funcs (struct hw_funcs *funcs);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -18,6 +18,7 @@
 #include <string.h>
 #include <stdint.h>
 #include <errno.h>
+#include <math.h>
 #include <assert.h>
 
 #define DEBUG
@@ -33,6 +34,10 @@
 #include "files.h"
 #include "playlist.h"
 #include "md5.h"
+#include "fifo_buf.h"
+#include "audio_conversion.h"
+#include "pcm_cache.h"
+#include "realtime.h"
 
 #define PCM_BUF_SIZE		(36 * 1024)
 #define PREBUFFER_THRESHOLD	(18 * 1024)
@@ -69,6 +74,31 @@ struct md5_data {
 	struct md5_ctx ctx;
 };
 
+/* Encoder delay and padding trimming of the decoded sound. */
+struct gapless_trim
+{
+	unsigned int delay; /* frames to drop at the beginning */
+	unsigned int padding; /* frames to drop at the end */
+	size_t skip; /* bytes still to drop at the beginning */
+	size_t pad; /* bytes held back until we know it's not the end */
+	char *hold; /* held back sound, pad + PCM_BUF_SIZE bytes */
+	size_t hold_fill;
+};
+
+/* Crossfade between files: the end of the playing file is held back and
+ * mixed with the beginning of the next one. */
+struct crossfade
+{
+	int seconds; /* length of the crossfade, 0 if disabled */
+	struct fifo_buf *hold; /* the last len bytes of the playing file */
+	size_t len; /* length of the crossfade in bytes */
+	struct fifo_buf *tail; /* the end of the previous file to mix in */
+	size_t tail_len; /* size of the whole tail in bytes */
+	size_t tail_pos; /* bytes of the tail already mixed */
+	float *mix[2]; /* float samples of the new and the old sound */
+	char *mix_buf; /* the old sound taken from the tail */
+};
+
 struct precache
 {
 	char *file; /* the file to precache */
@@ -79,9 +109,11 @@ struct precache
 	struct decoder *f; /* decoder functions for precached file */
 	void *decoder_data;
 	int running; /* if the precache thread is running */
+	int finished; /* if the precache thread has finished its work */
 	pthread_t tid; /* tid of the precache thread */
 	struct bitrate_list bitrate_list;
 	int decoded_time; /* how much sound we decoded in seconds */
+	struct gapless_trim trim;
 };
 
 struct precache precache;
@@ -112,6 +144,12 @@ static pthread_mutex_t decoder_stream_mtx = PTHREAD_MUTEX_INITIALIZER;
 
 static int prebuffering = 0; /* are we prebuffering now? */
 
+/* Set when decode_loop() finished without draining the output buffer
+ * because the precached next file continues the sound. */
+static bool gapless_next = false;
+
+static struct crossfade crossfade;
+
 static struct bitrate_list bitrate_list;
 
 static void bitrate_list_init (struct bitrate_list *b)
@@ -233,9 +271,297 @@ static void update_time ()
 	}
 }
 
-static void *precache_thread (void *data)
+static void gapless_trim_init (struct gapless_trim *trim,
+		const struct decoder *f, void *decoder_data)
+{
+	memset (trim, 0, sizeof (*trim));
+
+	if (options_get_bool ("Gapless") && f->get_gapless_info
+			&& f->get_gapless_info (decoder_data, &trim->delay,
+			                        &trim->padding))
+		logit ("Gapless: delay %u, padding %u frames", trim->delay,
+				trim->padding);
+}
+
+static void gapless_trim_destroy (struct gapless_trim *trim)
+{
+	free (trim->hold);
+	trim->hold = NULL;
+}
+
+/* Drop the encoder delay from the decoded sound and hold back as much as
+ * the padding is, so that it's never played at the end of the file.
+ * Return the number of bytes left in buf. */
+static int gapless_trim (struct gapless_trim *trim, char *buf, int decoded,
+		const struct sound_params *sound_params)
+{
+	size_t out;
+
+	if (!trim->delay && !trim->padding)
+		return decoded;
+
+	if (!trim->hold) {
+		size_t bpf = sfmt_Bps (sound_params->fmt)
+			* sound_params->channels;
+
+		trim->skip = trim->delay * bpf;
+		trim->pad = trim->padding * bpf;
+		trim->hold = xmalloc (trim->pad + PCM_BUF_SIZE);
+		trim->hold_fill = 0;
+	}
+
+	if (trim->skip) {
+		size_t skip = MIN((size_t)decoded, trim->skip);
+
+		memmove (buf, buf + skip, decoded - skip);
+		decoded -= skip;
+		trim->skip -= skip;
+	}
+
+	if (!trim->pad)
+		return decoded;
+
+	assert (decoded <= PCM_BUF_SIZE);
+	memcpy (trim->hold + trim->hold_fill, buf, decoded);
+	trim->hold_fill += decoded;
+
+	if (trim->hold_fill <= trim->pad)
+		return 0;
+
+	out = trim->hold_fill - trim->pad;
+	memcpy (buf, trim->hold, out);
+	memmove (trim->hold, trim->hold + out, trim->pad);
+	trim->hold_fill = trim->pad;
+
+	return out;
+}
+
+/* After seeking there is no delay to drop and the held back sound is
+ * from before the seek. */
+static void gapless_trim_seek (struct gapless_trim *trim)
+{
+	trim->delay = 0;
+	trim->skip = 0;
+	trim->hold_fill = 0;
+}
+
+/* Start the crossfade stage for a new file. */
+static void crossfade_start (struct crossfade *cf, const int seconds)
+{
+	assert (!cf->hold || !fifo_buf_get_fill (cf->hold));
+
+	cf->seconds = seconds;
+}
+
+/* Is there anything held back at the end of the file? */
+static bool crossfade_held (const struct crossfade *cf)
+{
+	return cf->hold && fifo_buf_get_fill (cf->hold);
+}
+
+static void crossfade_alloc (struct crossfade *cf)
+{
+	if (!cf->mix_buf) {
+		cf->mix[0] = (float *)xmalloc (PCM_BUF_SIZE * sizeof (float));
+		cf->mix[1] = (float *)xmalloc (PCM_BUF_SIZE * sizeof (float));
+		cf->mix_buf = (char *)xmalloc (PCM_BUF_SIZE);
+	}
+}
+
+/* Mix the tail of the previous file into the sound with an equal-power
+ * curve. */
+static void crossfade_mix (struct crossfade *cf, char *buf, const size_t size,
+		const struct sound_params *sound_params)
+{
+	size_t bpf = sfmt_Bps (sound_params->fmt) * sound_params->channels;
+	size_t samples, frames, first, total, i;
+	int ch;
+	float *mix_new, *mix_old;
+
+	crossfade_alloc (cf);
+	assert (size <= PCM_BUF_SIZE);
+
+	frames = fifo_buf_get (cf->tail, cf->mix_buf,
+			MIN(size, cf->tail_len - cf->tail_pos)) / bpf;
+	samples = frames * sound_params->channels;
+	first = cf->tail_pos / bpf;
+	total = cf->tail_len / bpf;
+	mix_new = cf->mix[0];
+	mix_old = cf->mix[1];
+
+	audio_conv_to_float (buf, frames * bpf, sound_params->fmt, mix_new);
+	audio_conv_to_float (cf->mix_buf, frames * bpf, sound_params->fmt,
+			mix_old);
+
+	for (i = 0; i < frames; i++) {
+		float t = (first + i + 0.5f) * (float)M_PI_2 / total;
+		float fade_in = sinf (t);
+		float fade_out = cosf (t);
+
+		for (ch = 0; ch < sound_params->channels; ch++) {
+			*mix_new = *mix_new * fade_in + *mix_old * fade_out;
+			mix_new++;
+			mix_old++;
+		}
+	}
+
+	audio_conv_from_float (cf->mix[0], samples, sound_params->fmt, buf);
+
+	cf->tail_pos += frames * bpf;
+	if (cf->tail_pos == cf->tail_len) {
+		debug ("Crossfade finished");
+		cf->tail_len = 0;
+		cf->tail_pos = 0;
+	}
+}
+
+/* Pass the decoded sound through the crossfade stage.  Return the number of
+ * bytes in buf which can be played now. */
+static size_t crossfade_process (struct crossfade *cf, char *buf,
+		const size_t size, const struct sound_params *sound_params)
+{
+	size_t fill;
+
+	if (cf->tail_len)
+		crossfade_mix (cf, buf, size, sound_params);
+
+	if (!cf->seconds)
+		return size;
+
+	if (!cf->hold) {
+		cf->len = cf->seconds * sound_params->rate
+			* sound_params->channels * sfmt_Bps (sound_params->fmt);
+		cf->hold = fifo_buf_new (cf->len + PCM_BUF_SIZE);
+	}
+
+	fifo_buf_put (cf->hold, buf, size);
+	fill = fifo_buf_get_fill (cf->hold);
+	if (fill <= cf->len)
+		return 0;
+
+	return fifo_buf_get (cf->hold, buf, fill - cf->len);
+}
+
+/* Fade out the rest of the tail, which the file that just ended was too
+ * short to be mixed with, and put it after the held back sound. */
+static void crossfade_fade_tail (struct crossfade *cf,
+		const struct sound_params *sound_params)
+{
+	size_t bpf = sfmt_Bps (sound_params->fmt) * sound_params->channels;
+	size_t total = cf->tail_len / bpf;
+
+	crossfade_alloc (cf);
+
+	while (cf->tail_pos < cf->tail_len) {
+		size_t first = cf->tail_pos / bpf;
+		size_t frames, i;
+		float *sample = cf->mix[1];
+		int ch;
+
+		frames = fifo_buf_get (cf->tail, cf->mix_buf,
+				MIN(PCM_BUF_SIZE / bpf * bpf,
+				    cf->tail_len - cf->tail_pos)) / bpf;
+		if (!frames)
+			break;
+
+		audio_conv_to_float (cf->mix_buf, frames * bpf,
+				sound_params->fmt, cf->mix[1]);
+
+		for (i = 0; i < frames; i++) {
+			float fade_out = cosf ((first + i + 0.5f)
+					* (float)M_PI_2 / total);
+
+			for (ch = 0; ch < sound_params->channels; ch++)
+				*sample++ *= fade_out;
+		}
+
+		audio_conv_from_float (cf->mix[1],
+				frames * sound_params->channels,
+				sound_params->fmt, cf->mix_buf);
+		fifo_buf_put (cf->hold, cf->mix_buf, frames * bpf);
+		cf->tail_pos += frames * bpf;
+	}
+}
+
+/* The end of the playing file becomes the tail mixed into the next one.
+ * If the file was shorter than the crossfade, the end of the previous one
+ * is still fading out and goes into the new tail. */
+static void crossfade_handover (struct crossfade *cf,
+		const struct sound_params *sound_params)
+{
+	if (cf->tail_len) {
+		logit ("Carrying %zu bytes of the fade out over",
+				cf->tail_len - cf->tail_pos);
+		crossfade_fade_tail (cf, sound_params);
+	}
+
+	if (cf->tail)
+		fifo_buf_free (cf->tail);
+
+	cf->tail = cf->hold;
+	cf->tail_len = fifo_buf_get_fill (cf->tail);
+	cf->tail_pos = 0;
+	cf->hold = NULL;
+
+	logit ("Crossfading %zu bytes", cf->tail_len);
+}
+
+/* Forget the held back sound. */
+static void crossfade_clear (struct crossfade *cf)
+{
+	if (cf->hold) {
+		fifo_buf_free (cf->hold);
+		cf->hold = NULL;
+	}
+
+	if (cf->tail)
+		fifo_buf_clear (cf->tail);
+	cf->tail_len = 0;
+	cf->tail_pos = 0;
+}
+
+static void crossfade_destroy (struct crossfade *cf)
+{
+	crossfade_clear (cf);
+
+	if (cf->tail) {
+		fifo_buf_free (cf->tail);
+		cf->tail = NULL;
+	}
+
+	free (cf->mix[0]);
+	free (cf->mix[1]);
+	free (cf->mix_buf);
+	cf->mix[0] = cf->mix[1] = NULL;
+	cf->mix_buf = NULL;
+}
+
+/* Open the file with the decoder f, or with the cache decoder if the file
+ * is in the PCM cache; f is changed then. */
+static void *open_decoder (struct decoder **f, const char *file)
+{
+	if (pcm_cache_has (file)) {
+		struct decoder *cache_f = pcm_cache_decoder ();
+		struct decoder_error err;
+		void *data;
+
+		data = cache_f->open (file);
+		cache_f->get_error (data, &err);
+		if (err.type == ERROR_OK) {
+			logit ("Using the cached sound of %s", file);
+			*f = cache_f;
+			return data;
+		}
+
+		decoder_error_clear (&err);
+		cache_f->close (data);
+	}
+
+	return (*f)->open (file);
+}
+
+static void precache_decode (struct precache *precache)
 {
-	struct precache *precache = (struct precache *)data;
 	int decoded;
 	struct sound_params new_sound_params;
 	struct decoder_error err;
@@ -247,17 +573,19 @@ static void *precache_thread (void *data)
 	precache->f = get_decoder (precache->file);
 	assert (precache->f != NULL);
 
-	precache->decoder_data = precache->f->open(precache->file);
+	precache->decoder_data = open_decoder (&precache->f, precache->file);
 	precache->f->get_error(precache->decoder_data, &err);
 	if (err.type != ERROR_OK) {
 		logit ("Failed to open the file for precache: %s", err.err);
 		decoder_error_clear (&err);
 		precache->f->close (precache->decoder_data);
-		return NULL;
+		return;
 	}
 
 	audio_plist_set_time (precache->file,
 			precache->f->get_duration(precache->decoder_data));
+	gapless_trim_init (&precache->trim, precache->f,
+			precache->decoder_data);
 
 	/* Stop at PCM_BUF_SIZE, because when we decode too much, there is no
 	 * place where we can put the data that doesn't fit into the buffer. */
@@ -271,8 +599,9 @@ static void *precache_thread (void *data)
 			/* EOF so fast? We can't pass this information
 			 * in precache, so give up. */
 			logit ("EOF when precaching.");
+			gapless_trim_destroy (&precache->trim);
 			precache->f->close (precache->decoder_data);
-			return NULL;
+			return;
 		}
 
 		precache->f->get_error (precache->decoder_data, &err);
@@ -280,8 +609,9 @@ static void *precache_thread (void *data)
 		if (err.type == ERROR_FATAL) {
 			logit ("Error reading file for precache: %s", err.err);
 			decoder_error_clear (&err);
+			gapless_trim_destroy (&precache->trim);
 			precache->f->close (precache->decoder_data);
-			return NULL;
+			return;
 		}
 
 		if (!precache->sound_params.channels)
@@ -294,8 +624,9 @@ static void *precache_thread (void *data)
 			 * precaching. (this should never happen). */
 			logit ("Sound parameters have changed when precaching.");
 			decoder_error_clear (&err);
+			gapless_trim_destroy (&precache->trim);
 			precache->f->close (precache->decoder_data);
-			return NULL;
+			return;
 		}
 
 		bitrate_list_add (&precache->bitrate_list,
@@ -303,11 +634,13 @@ static void *precache_thread (void *data)
 				precache->f->get_bitrate(
 					precache->decoder_data));
 
-		precache->buf_fill += decoded;
 		precache->decoded_time += decoded / (float)(sfmt_Bps(
 					new_sound_params.fmt) *
 				new_sound_params.rate *
 				new_sound_params.channels);
+		precache->buf_fill += gapless_trim (&precache->trim,
+				precache->buf + precache->buf_fill, decoded,
+				&new_sound_params);
 
 		if (err.type != ERROR_OK) {
 			decoder_error_clear (&err);
@@ -317,6 +650,20 @@ static void *precache_thread (void *data)
 
 	precache->ok = 1;
 	logit ("Successfully precached file (%d bytes)", precache->buf_fill);
+}
+
+static void *precache_thread (void *data)
+{
+	struct precache *precache = (struct precache *)data;
+
+	precache_decode (precache);
+
+	/* Wake up decode_loop() waiting for us to continue gaplessly. */
+	LOCK (request_cond_mtx);
+	precache->finished = 1;
+	pthread_cond_broadcast (&request_cond);
+	UNLOCK (request_cond_mtx);
+
 	return NULL;
 }
 
@@ -331,6 +678,7 @@ static void start_precache (struct precache *precache, const char *file)
 	bitrate_list_init (&precache->bitrate_list);
 	logit ("Precaching file %s", file);
 	precache->ok = 0;
+	precache->finished = 0;
 	rc = pthread_create (&precache->tid, NULL, precache_thread, precache);
 	if (rc != 0)
 		log_errno ("Could not run precache thread", rc);
@@ -359,6 +707,7 @@ static void precache_reset (struct precache *precache)
 {
 	assert (!precache->running);
 	precache->ok = 0;
+	gapless_trim_destroy (&precache->trim);
 	if (precache->file) {
 		free (precache->file);
 		precache->file = NULL;
@@ -370,7 +719,13 @@ void player_init ()
 {
 	precache.file = NULL;
 	precache.running = 0;
+	precache.finished = 0;
 	precache.ok = 0;
+	realtime_prefault (precache.buf, sizeof (precache.buf));
+
+	pcm_cache_init (options_get_int ("PrecacheFiles")
+			? (size_t)options_get_int ("PrecacheMemory") * 1024 * 1024
+			: 0);
 }
 
 static void show_tags (const struct file_tags *tags DEBUG_ONLY)
@@ -435,12 +790,85 @@ static void buf_free_cb ()
 	update_time ();
 }
 
+/* Can the precached next file continue the sound without draining the
+ * output buffer?  Not at low byte rates, where audio_open() would reopen
+ * the device and drop the end of this file.  Must be called with
+ * request_cond_mtx locked. */
+static bool gapless_ready (const char *next_file,
+		const struct sound_params *sound_params)
+{
+	return next_file && precache.file && precache.finished && precache.ok
+		&& !strcmp (precache.file, next_file)
+		&& request == REQ_NOTHING
+		&& sound_params_eq (precache.sound_params, *sound_params)
+		&& audio_get_bps () >= AUDIO_REOPEN_BPS;
+}
+
+/* Put the sound held back by the crossfade stage into the output buffer
+ * unmixed, until a request arrives. */
+static void crossfade_drain (struct crossfade *cf, struct out_buf *out_buf)
+{
+	char buf[PCM_BUF_SIZE];
+
+	LOCK (request_cond_mtx);
+	while (request == REQ_NOTHING && (cf->tail_len || crossfade_held (cf))) {
+		struct fifo_buf *fifo = cf->tail_len ? cf->tail : cf->hold;
+		size_t size = MIN(sizeof (buf), fifo_buf_get_fill (fifo));
+
+		if (size > (size_t)out_buf_get_free (out_buf)) {
+			pthread_cond_wait (&request_cond, &request_cond_mtx);
+			continue;
+		}
+
+		UNLOCK (request_cond_mtx);
+		size = fifo_buf_get (fifo, buf, size);
+		audio_send_buf (buf, size);
+		if (fifo == cf->tail) {
+			cf->tail_pos += size;
+			if (cf->tail_pos == cf->tail_len)
+				cf->tail_len = cf->tail_pos = 0;
+		}
+		LOCK (request_cond_mtx);
+	}
+	UNLOCK (request_cond_mtx);
+
+	if (cf->hold && !fifo_buf_get_fill (cf->hold)) {
+		fifo_buf_free (cf->hold);
+		cf->hold = NULL;
+	}
+}
+
+/* Play what was left in the output buffer by decode_loop() for the gapless
+ * transition if the next file can't continue it. */
+void player_gapless_flush (struct out_buf *out_buf)
+{
+	if (!gapless_next)
+		return;
+
+	gapless_next = false;
+	logit ("Draining the output buffer");
+
+	crossfade_drain (&crossfade, out_buf);
+	crossfade_clear (&crossfade);
+
+	LOCK (request_cond_mtx);
+	while (out_buf_get_fill (out_buf) && request == REQ_NOTHING)
+		pthread_cond_wait (&request_cond, &request_cond_mtx);
+	UNLOCK (request_cond_mtx);
+
+	if (request == REQ_STOP)
+		out_buf_stop (out_buf);
+	out_buf_wait (out_buf);
+
+	bitrate_list_destroy (&bitrate_list);
+}
+
 /* Decoder loop for already opened and probably running for some time decoder.
  * next_file will be precached at eof. */
 static void decode_loop (const struct decoder *f, void *decoder_data,
 		const char *next_file, struct out_buf *out_buf,
 		struct sound_params *sound_params, struct md5_data *md5,
-		const float already_decoded_sec)
+		struct gapless_trim *trim, const float already_decoded_sec)
 {
 	bool eof = false;
 	bool stopped = false;
@@ -516,7 +944,44 @@ static void decode_loop (const struct decoder *f, void *decoder_data,
 				bitrate_list_add (&bitrate_list, decode_time,
 						f->get_bitrate(decoder_data));
 				update_tags (f, decoder_data, decoder_stream);
+				decoded = gapless_trim (trim, buf, decoded,
+						&new_sound_params);
+			}
+		}
+
+		/* The end of the file is held back: mix it with the next file
+		 * or play it if it can't be done. */
+		else if (eof && crossfade_held (&crossfade)) {
+			bool ready;
+
+			UNLOCK (request_cond_mtx);
+			if (!precache.file && next_file
+					&& file_type(next_file) == F_SOUND
+					&& options_get_bool("Precache")
+					&& options_get_bool("AutoNext"))
+				start_precache (&precache, next_file);
+			precache_wait (&precache);
+
+			LOCK (request_cond_mtx);
+			ready = gapless_ready (next_file, sound_params);
+			UNLOCK (request_cond_mtx);
+
+			if (ready) {
+				crossfade_handover (&crossfade, sound_params);
+				gapless_next = true;
+				break;
 			}
+
+			crossfade_drain (&crossfade, out_buf);
+		}
+
+		/* The next file is ready to be put right after this one. */
+		else if (eof && options_get_bool ("Gapless")
+				&& gapless_ready (next_file, sound_params)) {
+			UNLOCK (request_cond_mtx);
+			logit ("Gapless transition to the next file");
+			gapless_next = true;
+			break;
 		}
 
 		/* Wait, if there is no space in the buffer to put the decoded
@@ -564,6 +1029,8 @@ static void decode_loop (const struct decoder *f, void *decoder_data,
 				out_buf_reset (out_buf);
 				out_buf_time_set (out_buf, decoder_seek);
 				bitrate_list_empty (&bitrate_list);
+				gapless_trim_seek (trim);
+				crossfade_clear (&crossfade);
 				decode_time = decoder_seek;
 				eof = false;
 				decoded = 0;
@@ -584,9 +1051,15 @@ static void decode_loop (const struct decoder *f, void *decoder_data,
 				md5_process_bytes (buf, decoded, &md5->ctx);
 			}
 #endif
-			audio_send_buf (buf, decoded);
+			decoded = crossfade_process (&crossfade, buf, decoded,
+					sound_params);
+			if (decoded)
+				audio_send_buf (buf, decoded);
 			decoded = 0;
 		}
+		else if (!eof && sound_params_change
+				&& (crossfade.tail_len || crossfade_held (&crossfade)))
+			crossfade_drain (&crossfade, out_buf);
 		else if (!eof && sound_params_change
 				&& out_buf_get_fill(out_buf) == 0) {
 			logit ("Sound parameters have changed.");
@@ -613,7 +1086,17 @@ static void decode_loop (const struct decoder *f, void *decoder_data,
 	f->close (decoder_data);
 	UNLOCK (decoder_stream_mtx);
 
-	bitrate_list_destroy (&bitrate_list);
+	/* Going gapless, the output buffer's callback keeps reading the list
+	 * while the end of this file plays, and the next file reuses it
+	 * without bitrate_list_init(), so keep the mutex and only drop this
+	 * file's entries. */
+	if (gapless_next)
+		bitrate_list_empty (&bitrate_list);
+	else {
+		bitrate_list_destroy (&bitrate_list);
+		crossfade_clear (&crossfade);
+	}
+	gapless_trim_destroy (trim);
 
 	LOCK (curr_tags_mtx);
 	if (curr_tags) {
@@ -622,7 +1105,8 @@ static void decode_loop (const struct decoder *f, void *decoder_data,
 	}
 	UNLOCK (curr_tags_mtx);
 
-	out_buf_wait (out_buf);
+	if (!gapless_next)
+		out_buf_wait (out_buf);
 
 	if (precache.ok && (stopped || !options_get_bool ("AutoNext"))) {
 		precache_wait (&precache);
@@ -684,13 +1168,15 @@ static void log_md5_sum (const char *file, struct sound_params sound_params,
 #endif
 
 /* Play a file (disk file) using the given decoder. next_file is precached. */
-static void play_file (const char *file, const struct decoder *f,
+static void play_file (const char *file, struct decoder *f,
 		const char *next_file, struct out_buf *out_buf)
 {
 	void *decoder_data;
 	struct sound_params sound_params = { 0, 0, 0 };
 	float already_decoded_time;
 	struct md5_data md5;
+	struct gapless_trim trim;
+	bool gapless = false;
 
 #if !defined(NDEBUG) && defined(DEBUG)
 	md5.okay = true;
@@ -698,10 +1184,26 @@ static void play_file (const char *file, const struct decoder *f,
 	md5_init_ctx (&md5.ctx);
 #endif
 
-	out_buf_reset (out_buf);
-
 	precache_wait (&precache);
 
+	/* Keep playing the end of the previous file, the user will hear this
+	 * one when the buffered sound is played. */
+	if (gapless_next && precache.ok && !strcmp(precache.file, file)) {
+		int bps = audio_get_bps ();
+
+		gapless = true;
+		gapless_next = false;
+		if (bps)
+			out_buf_time_set (out_buf,
+					-out_buf_get_fill (out_buf) / (float)bps);
+	}
+	else {
+		player_gapless_flush (out_buf);
+		out_buf_reset (out_buf);
+	}
+
+	crossfade_start (&crossfade, options_get_int ("Crossfade"));
+
 	if (precache.ok && strcmp(precache.file, file)) {
 		logit ("The precached file is not the file we want.");
 		precache.f->close (precache.decoder_data);
@@ -710,10 +1212,11 @@ static void play_file (const char *file, const struct decoder *f,
 
 	if (precache.ok && !strcmp(precache.file, file)) {
 		struct decoder_error err;
+		int pos;
 
 		logit ("Using precached file");
 
-		assert (f == precache.f);
+		f = precache.f;
 
 		sound_params = precache.sound_params;
 		decoder_data = precache.decoder_data;
@@ -724,6 +1227,7 @@ static void play_file (const char *file, const struct decoder *f,
 			md5.okay = false;
 			precache.f->close (precache.decoder_data);
 			precache_reset (&precache);
+			crossfade_clear (&crossfade);
 			return;
 		}
 
@@ -732,7 +1236,14 @@ static void play_file (const char *file, const struct decoder *f,
 		md5_process_bytes (precache.buf, precache.buf_fill, &md5.ctx);
 #endif
 
-		audio_send_buf (precache.buf, precache.buf_fill);
+		for (pos = 0; pos < precache.buf_fill; pos += PCM_BUF_SIZE) {
+			size_t size = MIN(PCM_BUF_SIZE, precache.buf_fill - pos);
+
+			size = crossfade_process (&crossfade, precache.buf + pos,
+					size, &sound_params);
+			if (size)
+				audio_send_buf (precache.buf + pos, size);
+		}
 
 		precache.f->get_error (precache.decoder_data, &err);
 		if (err.type != ERROR_OK) {
@@ -745,14 +1256,20 @@ static void play_file (const char *file, const struct decoder *f,
 
 		already_decoded_time = precache.decoded_time;
 
+		trim = precache.trim;
+		precache.trim.hold = NULL;
+
 		if(f->get_avg_bitrate)
 			set_info_avg_bitrate (f->get_avg_bitrate(decoder_data));
 		else
 			set_info_avg_bitrate (0);
 
-		bitrate_list_init (&bitrate_list);
+		if (!gapless)
+			bitrate_list_init (&bitrate_list);
+		LOCK (bitrate_list.mtx);
 		bitrate_list.head = precache.bitrate_list.head;
 		bitrate_list.tail = precache.bitrate_list.tail;
+		UNLOCK (bitrate_list.mtx);
 
 		/* don't free list elements when resetting precache */
 		precache.bitrate_list.head = NULL;
@@ -762,7 +1279,7 @@ static void play_file (const char *file, const struct decoder *f,
 		struct decoder_error err;
 
 		status_msg ("Opening...");
-		decoder_data = f->open(file);
+		decoder_data = open_decoder (&f, file);
 		f->get_error (decoder_data, &err);
 		if (err.type != ERROR_OK) {
 			f->close (decoder_data);
@@ -777,14 +1294,19 @@ static void play_file (const char *file, const struct decoder *f,
 		if (f->get_avg_bitrate)
 			set_info_avg_bitrate (f->get_avg_bitrate(decoder_data));
 		bitrate_list_init (&bitrate_list);
+		gapless_trim_init (&trim, f, decoder_data);
 	}
 
+	/* The MD5 sum is for checking decoders. */
+	if (f == pcm_cache_decoder ())
+		md5.okay = false;
+
 	audio_plist_set_time (file, f->get_duration(decoder_data));
 	audio_state_started_playing ();
 	precache_reset (&precache);
 
 	decode_loop (f, decoder_data, next_file, out_buf, &sound_params,
-			&md5, already_decoded_time);
+			&md5, &trim, already_decoded_time);
 
 #if !defined(NDEBUG) && defined(DEBUG)
 	if (md5.okay) {
@@ -803,9 +1325,13 @@ static void play_stream (const struct decoder *f, struct out_buf *out_buf)
 	struct sound_params sound_params = { 0, 0, 0 };
 	struct decoder_error err;
 	struct md5_data null_md5;
+	struct gapless_trim null_trim;
 
 	null_md5.okay = false;
+	memset (&null_trim, 0, sizeof (null_trim));
+	player_gapless_flush (out_buf);
 	out_buf_reset (out_buf);
+	crossfade_start (&crossfade, 0);
 
 	assert (f->open_stream != NULL);
 
@@ -826,7 +1352,7 @@ static void play_stream (const struct decoder *f, struct out_buf *out_buf)
 		audio_state_started_playing ();
 		bitrate_list_init (&bitrate_list);
 		decode_loop (f, decoder_data, NULL, out_buf, &sound_params,
-				&null_md5, 0.0);
+				&null_md5, &null_trim, 0.0);
 	}
 }
 
@@ -924,6 +1450,8 @@ void player_cleanup ()
 
 	precache_wait (&precache);
 	precache_reset (&precache);
+	crossfade_destroy (&crossfade);
+	pcm_cache_cleanup ();
 }
 
 void player_reset ()
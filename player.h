@@ -19,6 +19,7 @@ void player_init ();
 struct file_tags *player_get_curr_tags ();
 void player_pause ();
 void player_unpause ();
+void player_gapless_flush (struct out_buf *out_buf);
 
 #ifdef __cplusplus
 }
@@ -18,6 +18,7 @@
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <assert.h>
 #include <unistd.h>
@@ -33,22 +34,23 @@
 #define UNIX_PATH_MAX	108
 #define SOCKET_NAME	"socket2"
 
-#define nonblocking(fn, result, sock, buf, len) \
-	do { \
-		long flags = fcntl (sock, F_GETFL); \
-		if (flags == -1) \
-			fatal ("Getting flags for socket failed: %s", \
-			        xstrerror (errno)); \
-		flags |= O_NONBLOCK; \
-		if (fcntl (sock, F_SETFL, O_NONBLOCK) == -1) \
-			fatal ("Setting O_NONBLOCK for the socket failed: %s", \
-			        xstrerror (errno)); \
-		result = fn (sock, buf, len, 0); \
-		flags &= ~O_NONBLOCK; \
-		if (fcntl (sock, F_SETFL, flags) == -1) \
-			fatal ("Restoring flags for socket failed: %s", \
-			        xstrerror (errno)); \
-	} while (0)
+/* Initial size of the receive buffer of a socket. */
+#define RECV_BUF_SIZE	65536
+
+/* Maximum size of a message received from a non-blocking socket, the
+ * whole message must fit in the buffer. */
+#define RECV_BUF_LIMIT	(32 * 1024 * 1024)
+
+/* Corked output is sent when it grows to this size. */
+#define SEND_BUF_MAX	65536
+
+/* Maximum size of the output waiting for a non-blocking socket, a peer
+ * which doesn't read it is disconnected. */
+#define SEND_BUF_LIMIT	(32 * 1024 * 1024)
+
+/* Longer strings are sent from the caller's memory instead of being copied
+ * to the output buffer (if the socket is not corked). */
+#define SEND_COPY_MAX	1024
 
 /* Buffer used to send data in one bigger chunk instead of sending sigle
  * integer, string etc. values. */
@@ -59,6 +61,29 @@ struct packet_buf
 	size_t len;
 };
 
+/* Buffers of a connection: data are received in big chunks and values are
+ * taken from the input buffer, output is collected in the output buffer
+ * and sent with one sendmsg() call. */
+struct sock_buf
+{
+	char *in;
+	size_t in_size;		/* size of the input buffer */
+	size_t in_len;		/* bytes in the input buffer */
+	size_t in_pos;		/* bytes already taken from it */
+	struct packet_buf *out;
+	int corked;		/* send_cork() nesting level */
+
+	/* State of recv_complete() for the message at in_pos. */
+	size_t scan_off;	/* offset of the first unchecked byte */
+	int scan_step;		/* position in the layout */
+	int scan_count;		/* strings left in 'S' or -1 */
+};
+
+/* Buffers indexed by the socket descriptor.  Sockets are used only from one
+ * thread (the server's main loop or the client), so there is no lock. */
+static struct sock_buf **sock_bufs = NULL;
+static int sock_bufs_num = 0;
+
 /* Create a socket name, return NULL if the name could not be created. */
 char *socket_name ()
 {
@@ -70,217 +95,657 @@ char *socket_name ()
 	return socket_name;
 }
 
-/* Get an integer value from the socket, return == 0 on error. */
-int get_int (int sock, int *i)
+static struct packet_buf *packet_buf_new ()
 {
-	ssize_t res;
+	struct packet_buf *b;
 
-	res = recv (sock, i, sizeof(int), 0);
-	if (res == -1)
-		log_errno ("recv() failed when getting int", errno);
+	b = (struct packet_buf *)xmalloc (sizeof(struct packet_buf));
+	b->buf = (char *)xmalloc (1024);
+	b->allocated = 1024;
+	b->len = 0;
 
-	return res == ssizeof(int) ? 1 : 0;
+	return b;
 }
 
-/* Get an integer value from the socket without blocking. */
-enum noblock_io_status get_int_noblock (int sock, int *i)
+static void packet_buf_free (struct packet_buf *b)
 {
-	ssize_t res;
-	char *err;
+	assert (b != NULL);
+
+	free (b->buf);
+	free (b);
+}
 
-	nonblocking (recv, res, sock, i, sizeof (int));
+/* Make sure that there is at least len bytes free. */
+static void packet_buf_add_space (struct packet_buf *b, const size_t len)
+{
+	assert (b != NULL);
 
-	if (res == ssizeof (int))
-		return NB_IO_OK;
-	if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
-		return NB_IO_BLOCK;
+	if (b->allocated < b->len + len) {
+		b->allocated = MAX(b->allocated * 2, b->len + len);
+		b->buf = (char *)xrealloc (b->buf, b->allocated);
+	}
+}
 
-	err = xstrerror (errno);
-	logit ("recv() failed when getting int (res %zd): %s", res, err);
-	free (err);
+/* Add an integer value to the buffer */
+static void packet_buf_add_int (struct packet_buf *b, const int n)
+{
+	assert (b != NULL);
 
-	return NB_IO_ERR;
+	packet_buf_add_space (b, sizeof(n));
+	memcpy (b->buf + b->len, &n, sizeof(n));
+	b->len += sizeof(n);
 }
 
-/* Send an integer value to the socket, return == 0 on error */
-int send_int (int sock, int i)
+/* Add a string value to the buffer. */
+static void packet_buf_add_str (struct packet_buf *b, const char *str)
 {
-	ssize_t res;
+	int str_len;
 
-	res = send (sock, &i, sizeof(int), 0);
-	if (res == -1)
-		log_errno ("send() failed", errno);
+	assert (b != NULL);
+	assert (str != NULL);
+
+	str_len = strlen (str);
 
-	return res == ssizeof(int) ? 1 : 0;
+	packet_buf_add_int (b, str_len);
+	packet_buf_add_space (b, str_len * sizeof(char));
+	memcpy (b->buf + b->len, str, str_len * sizeof(char));
+	b->len += str_len * sizeof(char);
 }
 
-#if 0
-/* Get a long value from the socket, return == 0 on error. */
-static int get_long (int sock, long *i)
+/* Add a time_t value to the buffer. */
+static void packet_buf_add_time (struct packet_buf *b, const time_t n)
 {
-	ssize_t res;
+	assert (b != NULL);
 
-	res = recv (sock, i, sizeof(long), 0);
-	if (res == -1)
-		log_errno ("recv() failed when getting int", errno);
+	packet_buf_add_space (b, sizeof(n));
+	memcpy (b->buf + b->len, &n, sizeof(n));
+	b->len += sizeof(n);
+}
+
+/* Return the buffers of the socket, create them if needed. */
+static struct sock_buf *get_sock_buf (int sock)
+{
+	struct sock_buf *sb;
+
+	assert (sock >= 0);
+
+	if (sock >= sock_bufs_num) {
+		int i, num = MAX(sock + 1, sock_bufs_num * 2);
+
+		sock_bufs = (struct sock_buf **)xrealloc (sock_bufs,
+				num * sizeof(struct sock_buf *));
+		for (i = sock_bufs_num; i < num; i++)
+			sock_bufs[i] = NULL;
+		sock_bufs_num = num;
+	}
+
+	if (!(sb = sock_bufs[sock])) {
+		sb = (struct sock_buf *)xmalloc (sizeof(struct sock_buf));
+		sb->in = (char *)xmalloc (RECV_BUF_SIZE);
+		sb->in_size = RECV_BUF_SIZE;
+		sb->in_len = 0;
+		sb->in_pos = 0;
+		sb->out = packet_buf_new ();
+		sb->corked = 0;
+		sb->scan_off = 0;
+		sb->scan_step = 0;
+		sb->scan_count = -1;
+		sock_bufs[sock] = sb;
+	}
 
-	return res == ssizeof(long) ? 1 : 0;
+	return sb;
 }
-#endif
 
-#if 0
-/* Send a long value to the socket, return == 0 on error */
-static int send_long (int sock, long i)
+/* Free the buffers of the socket, must be called when it's closed. */
+void sock_buf_free (int sock)
 {
-	ssize_t res;
+	struct sock_buf *sb;
 
-	res = send (sock, &i, sizeof(long), 0);
-	if (res == -1)
-		log_errno ("send() failed", errno);
+	if (sock < 0 || sock >= sock_bufs_num || !(sb = sock_bufs[sock]))
+		return;
 
-	return res == ssizeof(long) ? 1 : 0;
+	free (sb->in);
+	packet_buf_free (sb->out);
+	free (sb);
+	sock_bufs[sock] = NULL;
 }
-#endif
 
-/* Get the string from socket, return NULL on error. The memory is malloced. */
-char *get_str (int sock)
+/* Send the output buffer followed by len bytes of data using as few
+ * sendmsg() calls as possible.  With flags == MSG_DONTWAIT or if the socket
+ * is non-blocking, stop when the socket is full and keep the rest in the
+ * output buffer.  Return 0 on error. */
+static int sock_write (int sock, struct sock_buf *sb, const char *data,
+		size_t len, const int flags)
 {
-	int len, nread = 0;
-	char *str;
+	size_t out_pos = 0;
 
-	if (!get_int(sock, &len))
-		return NULL;
+	while (out_pos < sb->out->len || len > 0) {
+		struct iovec iov[2];
+		struct msghdr msg;
+		size_t from_out;
+		ssize_t sent;
 
-	if (!RANGE(0, len, MAX_SEND_STRING)) {
-		logit ("Bad string length.");
-		return NULL;
+		memset (&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+
+		if (out_pos < sb->out->len) {
+			iov[msg.msg_iovlen].iov_base = sb->out->buf + out_pos;
+			iov[msg.msg_iovlen].iov_len = sb->out->len - out_pos;
+			msg.msg_iovlen++;
+		}
+		if (len > 0) {
+			iov[msg.msg_iovlen].iov_base = (void *)data;
+			iov[msg.msg_iovlen].iov_len = len;
+			msg.msg_iovlen++;
+		}
+
+		sent = sendmsg (sock, &msg, flags);
+		if (sent == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			log_errno ("Error while sending data", errno);
+			sb->out->len = 0;
+			return 0;
+		}
+
+		from_out = MIN((size_t)sent, sb->out->len - out_pos);
+		out_pos += from_out;
+		data += sent - from_out;
+		len -= sent - from_out;
 	}
 
-	str = (char *)xmalloc (sizeof(char) * (len + 1));
-	while (nread < len) {
+	/* Keep what was not sent. */
+	memmove (sb->out->buf, sb->out->buf + out_pos, sb->out->len - out_pos);
+	sb->out->len -= out_pos;
+	if (len > 0) {
+		packet_buf_add_space (sb->out, len);
+		memcpy (sb->out->buf + sb->out->len, data, len);
+		sb->out->len += len;
+	}
+
+	if (sb->out->len > SEND_BUF_LIMIT) {
+		logit ("The peer doesn't read the data we send");
+		sb->out->len = 0;
+		return 0;
+	}
+
+	return 1;
+}
+
+/* Send the output buffer unless the socket is corked and the buffer is not
+ * full yet.  Return 0 on error. */
+static int send_buffered (int sock, struct sock_buf *sb)
+{
+	if (sb->corked && sb->out->len < SEND_BUF_MAX)
+		return 1;
+
+	return sock_write (sock, sb, NULL, 0, 0);
+}
+
+/* Collect the data sent to the socket until send_uncork() is called, so a
+ * series of values is sent with one system call.  Can be nested. */
+void send_cork (int sock)
+{
+	get_sock_buf(sock)->corked++;
+}
+
+/* Send the data collected since send_cork().  Return 0 on error. */
+int send_uncork (int sock)
+{
+	struct sock_buf *sb = get_sock_buf (sock);
+
+	assert (sb->corked > 0);
+
+	if (--sb->corked > 0)
+		return 1;
+
+	return send_buffered (sock, sb);
+}
+
+/* Send what is left in the output buffer without blocking. */
+enum noblock_io_status send_flush_noblock (int sock)
+{
+	struct sock_buf *sb = get_sock_buf (sock);
+
+	if (!sock_write (sock, sb, NULL, 0, MSG_DONTWAIT))
+		return NB_IO_ERR;
+
+	return sb->out->len ? NB_IO_BLOCK : NB_IO_OK;
+}
+
+/* Return != 0 if there are data waiting to be sent to the socket. */
+int send_pending (int sock)
+{
+	if (sock < 0 || sock >= sock_bufs_num || !sock_bufs[sock])
+		return 0;
+
+	return sock_bufs[sock]->out->len > 0;
+}
+
+/* Return the number of bytes already received from the socket but not yet
+ * used.  select() doesn't report them, so they must be checked before
+ * waiting for the socket. */
+int recv_buffered (int sock)
+{
+	struct sock_buf *sb;
+
+	if (sock < 0 || sock >= sock_bufs_num || !(sb = sock_bufs[sock]))
+		return 0;
+
+	return sb->in_len - sb->in_pos;
+}
+
+/* Get len bytes from the socket, read as much as is available at once to
+ * avoid a recv() call for every value.  Return 0 on error. */
+static int recv_all (int sock, void *buf, size_t len)
+{
+	struct sock_buf *sb = get_sock_buf (sock);
+	char *dst = (char *)buf;
+
+	/* We are going to wait for the peer, it must get our request. */
+	if (sb->out->len && !sock_write (sock, sb, NULL, 0, 0))
+		return 0;
+
+	while (len > 0) {
 		ssize_t res;
 
-		res = recv (sock, str + nread, len - nread, 0);
+		if (sb->in_pos < sb->in_len) {
+			size_t n = MIN(len, sb->in_len - sb->in_pos);
+
+			memcpy (dst, sb->in + sb->in_pos, n);
+			sb->in_pos += n;
+			dst += n;
+			len -= n;
+			continue;
+		}
+
+		/* Big chunks go directly to the caller's memory. */
+		if (len >= sb->in_size)
+			res = recv (sock, dst, len, 0);
+		else {
+			res = recv (sock, sb->in, sb->in_size, 0);
+			if (res > 0) {
+				sb->in_pos = 0;
+				sb->in_len = res;
+				continue;
+			}
+		}
+
 		if (res == -1) {
-			log_errno ("recv() failed when getting string", errno);
-			free (str);
-			return NULL;
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				logit ("Incomplete message on a non-blocking socket");
+			else
+				log_errno ("recv() failed", errno);
+			return 0;
 		}
-		if (res == 0) {
-			logit ("Unexpected EOF when getting string");
-			free (str);
-			return NULL;
+		if (res == 0)
+			return 0;
+
+		dst += res;
+		len -= res;
+	}
+
+	return 1;
+}
+
+/* Get an integer value from the socket, return == 0 on error. */
+int get_int (int sock, int *i)
+{
+	return recv_all (sock, i, sizeof(int));
+}
+
+/* Get an integer value from the socket without blocking. */
+enum noblock_io_status get_int_noblock (int sock, int *i)
+{
+	struct sock_buf *sb = get_sock_buf (sock);
+
+	if (sb->in_len - sb->in_pos < sizeof(int)) {
+		ssize_t res;
+		char *err;
+
+		memmove (sb->in, sb->in + sb->in_pos, sb->in_len - sb->in_pos);
+		sb->in_len -= sb->in_pos;
+		sb->in_pos = 0;
+
+		res = recv (sock, sb->in + sb->in_len,
+				sb->in_size - sb->in_len, MSG_DONTWAIT);
+		if (res > 0)
+			sb->in_len += res;
+		else if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return NB_IO_BLOCK;
+		else {
+			err = xstrerror (errno);
+			logit ("recv() failed when getting int (res %zd): %s",
+					res, err);
+			free (err);
+			return NB_IO_ERR;
 		}
-		nread += res;
+
+		if (sb->in_len < sizeof(int))
+			return NB_IO_BLOCK;
 	}
-	str[len] = 0;
 
-	return str;
+	memcpy (i, sb->in + sb->in_pos, sizeof(int));
+	sb->in_pos += sizeof(int);
+
+	return NB_IO_OK;
 }
 
-int send_str (int sock, const char *str)
+/* Read all data available on the non-blocking socket to its input buffer.
+ * Return NB_IO_ERR on error or end of file. */
+enum noblock_io_status recv_noblock (int sock)
 {
+	struct sock_buf *sb = get_sock_buf (sock);
+
+	/* Move the unused data to the beginning. */
+	if (sb->in_pos > 0) {
+		memmove (sb->in, sb->in + sb->in_pos, sb->in_len - sb->in_pos);
+		sb->in_len -= sb->in_pos;
+		sb->in_pos = 0;
+	}
+
+	while (1) {
+		ssize_t res;
+
+		if (sb->in_len == sb->in_size) {
+			if (sb->in_size >= RECV_BUF_LIMIT) {
+				logit ("Message from the peer is too long");
+				return NB_IO_ERR;
+			}
+			sb->in_size *= 2;
+			sb->in = (char *)xrealloc (sb->in, sb->in_size);
+		}
+
+		res = recv (sock, sb->in + sb->in_len, sb->in_size - sb->in_len,
+				MSG_DONTWAIT);
+		if (res > 0) {
+			sb->in_len += res;
+			continue;
+		}
+
+		if (res == 0)
+			return NB_IO_ERR;
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return NB_IO_OK;
+		if (errno != EINTR) {
+			log_errno ("recv() failed", errno);
+			return NB_IO_ERR;
+		}
+	}
+}
+
+/* Get an integer value from the input buffer without removing it.  Return
+ * 0 if it was not received yet. */
+int recv_peek_int (int sock, int *i)
+{
+	struct sock_buf *sb = get_sock_buf (sock);
+
+	if (sb->in_len - sb->in_pos < sizeof(int))
+		return 0;
+
+	memcpy (i, sb->in + sb->in_pos, sizeof(int));
+
+	return 1;
+}
+
+/* Skip len bytes at *pos of the input buffer, return 0 if there is less. */
+static int scan_bytes (const struct sock_buf *sb, size_t *pos,
+		const size_t len)
+{
+	if (sb->in_len - *pos < len)
+		return 0;
+
+	*pos += len;
+	return 1;
+}
+
+/* Skip a string at *pos, set *empty if it's empty.  Return 1 if the string
+ * is complete, 0 if it's not or -1 if it's invalid. */
+static int scan_str (const struct sock_buf *sb, size_t *pos, int *empty)
+{
+	size_t p = *pos;
 	int len;
 
-	len = strlen (str);
-	if (!send_int (sock, len))
+	if (sb->in_len - p < sizeof(int))
 		return 0;
 
-	if (send (sock, str, len, 0) != len)
+	memcpy (&len, sb->in + p, sizeof(int));
+	p += sizeof(int);
+
+	if (!RANGE(0, len, MAX_SEND_STRING))
+		return -1;
+	if (!scan_bytes(sb, &p, len))
 		return 0;
 
+	if (empty)
+		*empty = len == 0;
+	*pos = p;
+
 	return 1;
 }
 
-/* Get a time_t value from the socket, return == 0 on error. */
-int get_time (int sock, time_t *i)
+/* Skip a playlist item (see recv_item()), the return value is like for
+ * scan_str(). */
+static int scan_item (const struct sock_buf *sb, size_t *pos, int *empty)
 {
-	ssize_t res;
+	size_t p = *pos;
+	int res, i;
 
-	res = recv (sock, i, sizeof(time_t), 0);
-	if (res == -1)
-		log_errno ("recv() failed when getting time_t", errno);
+	if ((res = scan_str(sb, &p, empty)) != 1)
+		return res;
+
+	if (!*empty) {
+
+		/* title_tags, title, artist and album */
+		for (i = 0; i < 4; i++)
+			if ((res = scan_str(sb, &p, NULL)) != 1)
+				return res;
+
+		/* track, time, filled and mtime */
+		if (!scan_bytes(sb, &p, 3 * sizeof(int) + sizeof(time_t)))
+			return 0;
+	}
+
+	*pos = p;
 
-	return res == ssizeof(time_t) ? 1 : 0;
+	return 1;
 }
 
-/* Send a time_t value to the socket, return == 0 on error */
-int send_time (int sock, time_t i)
+/* Move the complete playlist items (see recv_item()) from the input buffer
+ * of the socket to the output buffer of dest without decoding them, dest
+ * can be -1 to drop them.  Set *end if the empty item ending the list was
+ * moved.  Return 0 if the data are invalid or -1 if the output of dest
+ * exceeded SEND_BUF_LIMIT, the items are dropped then and dest should be
+ * disconnected. */
+int recv_relay_items (int sock, int dest, int *end)
 {
-	ssize_t res;
+	struct sock_buf *sb = get_sock_buf (sock);
+	size_t pos = sb->in_pos;
+	int res, empty = 0, result = 1;
 
-	res = send (sock, &i, sizeof(time_t), 0);
+	assert (sb->scan_step == 0);
+
+	while ((res = scan_item(sb, &pos, &empty)) == 1 && !empty)
+		;
 	if (res == -1)
-		log_errno ("send() failed", errno);
+		return 0;
+
+	if (dest != -1 && pos > sb->in_pos) {
+		struct packet_buf *out = get_sock_buf(dest)->out;
 
-	return res == ssizeof(time_t) ? 1 : 0;
+		if (out->len + (pos - sb->in_pos) > SEND_BUF_LIMIT) {
+			logit ("The peer doesn't read the data we send");
+			out->len = 0;
+			result = -1;
+		}
+		else {
+			packet_buf_add_space (out, pos - sb->in_pos);
+			memcpy (out->buf + out->len, sb->in + sb->in_pos,
+					pos - sb->in_pos);
+			out->len += pos - sb->in_pos;
+		}
+	}
+
+	sb->in_pos = pos;
+	*end = res == 1 && empty;
+
+	return result;
 }
 
-static struct packet_buf *packet_buf_new ()
+/* Check if a complete message is in the input buffer, so reading it won't
+ * block.  The layout describes the message, one character for a value:
+ * i - int, t - time_t, s - string, I - playlist item, L - playlist items
+ * ending with an empty item, S - number of strings and the strings.  The
+ * check continues where the last one for this message stopped.  Return 1
+ * if the message is complete, 0 if more data are needed or -1 if the data
+ * are invalid. */
+int recv_complete (int sock, const char *layout)
 {
-	struct packet_buf *b;
+	struct sock_buf *sb = get_sock_buf (sock);
+	size_t pos = sb->in_pos + sb->scan_off;
+	int res = 1;
 
-	b = (struct packet_buf *)xmalloc (sizeof(struct packet_buf));
-	b->buf = (char *)xmalloc (1024);
-	b->allocated = 1024;
-	b->len = 0;
+	while (layout[sb->scan_step]) {
+		size_t p = pos;
+		int empty;
+
+		switch (layout[sb->scan_step]) {
+			case 'i':
+				res = scan_bytes (sb, &p, sizeof(int));
+				break;
+			case 't':
+				res = scan_bytes (sb, &p, sizeof(time_t));
+				break;
+			case 's':
+				res = scan_str (sb, &p, NULL);
+				break;
+			case 'I':
+				res = scan_item (sb, &p, &empty);
+				break;
+			case 'L':
+				res = scan_item (sb, &p, &empty);
+				if (res == 1 && !empty) {
+					pos = p;
+					sb->scan_off = pos - sb->in_pos;
+					continue;
+				}
+				break;
+			case 'S':
+				if (sb->scan_count == -1) {
+					if (!(res = scan_bytes(sb, &p, sizeof(int))))
+						break;
+					memcpy (&sb->scan_count, sb->in + pos,
+							sizeof(int));
+					if (sb->scan_count < 0) {
+						res = -1;
+						break;
+					}
+				}
+				else if (sb->scan_count > 0) {
+					if ((res = scan_str(sb, &p, NULL)) == 1)
+						sb->scan_count--;
+				}
+				if (res != 1)
+					break;
+				if (sb->scan_count > 0) {
+					pos = p;
+					sb->scan_off = pos - sb->in_pos;
+					continue;
+				}
+				sb->scan_count = -1;
+				break;
+			default:
+				abort (); /* BUG */
+		}
 
-	return b;
+		if (res != 1)
+			break;
+
+		pos = p;
+		sb->scan_step++;
+		sb->scan_off = pos - sb->in_pos;
+	}
+
+	if (res != 0) {
+		sb->scan_off = 0;
+		sb->scan_step = 0;
+		sb->scan_count = -1;
+	}
+
+	return res;
 }
 
-static void packet_buf_free (struct packet_buf *b)
+/* Send an integer value to the socket, return == 0 on error */
+int send_int (int sock, int i)
 {
-	assert (b != NULL);
+	struct sock_buf *sb = get_sock_buf (sock);
 
-	free (b->buf);
-	free (b);
+	packet_buf_add_int (sb->out, i);
+
+	return send_buffered (sock, sb);
 }
 
-/* Make sure that there is at least len bytes free. */
-static void packet_buf_add_space (struct packet_buf *b, const size_t len)
+/* Get the string from socket, return NULL on error. The memory is malloced. */
+char *get_str (int sock)
 {
-	assert (b != NULL);
+	int len;
+	char *str;
 
-	if (b->allocated < b->len + len) {
-		b->allocated += len + 256; /* put some more space */
-		b->buf = (char *)xrealloc (b->buf, b->allocated);
+	if (!get_int(sock, &len))
+		return NULL;
+
+	if (!RANGE(0, len, MAX_SEND_STRING)) {
+		logit ("Bad string length.");
+		return NULL;
 	}
-}
 
-/* Add an integer value to the buffer */
-static void packet_buf_add_int (struct packet_buf *b, const int n)
-{
-	assert (b != NULL);
+	str = (char *)xmalloc (sizeof(char) * (len + 1));
+	if (!recv_all(sock, str, len)) {
+		logit ("Error when getting string");
+		free (str);
+		return NULL;
+	}
+	str[len] = 0;
 
-	packet_buf_add_space (b, sizeof(n));
-	memcpy (b->buf + b->len, &n, sizeof(n));
-	b->len += sizeof(n);
+	return str;
 }
 
-/* Add a string value to the buffer. */
-static void packet_buf_add_str (struct packet_buf *b, const char *str)
+int send_str (int sock, const char *str)
 {
-	int str_len;
+	struct sock_buf *sb = get_sock_buf (sock);
+	int len;
 
-	assert (b != NULL);
-	assert (str != NULL);
+	len = strlen (str);
 
-	str_len = strlen (str);
+	/* Don't copy long strings if they are sent now. */
+	if (!sb->corked && len > SEND_COPY_MAX) {
+		packet_buf_add_int (sb->out, len);
+		return sock_write (sock, sb, str, len, 0);
+	}
 
-	packet_buf_add_int (b, str_len);
-	packet_buf_add_space (b, str_len * sizeof(char));
-	memcpy (b->buf + b->len, str, str_len * sizeof(char));
-	b->len += str_len * sizeof(char);
+	packet_buf_add_str (sb->out, str);
+
+	return send_buffered (sock, sb);
 }
 
-/* Add a time_t value to the buffer. */
-static void packet_buf_add_time (struct packet_buf *b, const time_t n)
+/* Get a time_t value from the socket, return == 0 on error. */
+int get_time (int sock, time_t *i)
 {
-	assert (b != NULL);
+	return recv_all (sock, i, sizeof(time_t));
+}
 
-	packet_buf_add_space (b, sizeof(n));
-	memcpy (b->buf + b->len, &n, sizeof(n));
-	b->len += sizeof(n);
+/* Send a time_t value to the socket, return == 0 on error */
+int send_time (int sock, time_t i)
+{
+	struct sock_buf *sb = get_sock_buf (sock);
+
+	packet_buf_add_time (sb->out, i);
+
+	return send_buffered (sock, sb);
 }
 
 /* Add tags to the buffer. If tags == NULL, add empty tags. */
@@ -317,30 +782,11 @@ void packet_buf_add_item (struct packet_buf *b, const struct plist_item *item)
 	packet_buf_add_time (b, item->mtime);
 }
 
-/* Send data to the socket. Return 0 on error. */
-static int send_all (int sock, const char *buf, const size_t size)
-{
-	ssize_t sent;
-	size_t send_pos = 0;
-
-	while (send_pos < size) {
-		sent = send (sock, buf + send_pos, size - send_pos, 0);
-		if (sent < 0) {
-			log_errno ("Error while sending data", errno);
-			return 0;
-		}
-		send_pos += sent;
-	}
-
-	return 1;
-}
-
 /* Send a playlist item to the socket. If item == NULL, send empty item mark
  * (end of playlist). Return 0 on error. */
 int send_item (int sock, const struct plist_item *item)
 {
-	int res = 1;
-	struct packet_buf *b;
+	struct sock_buf *sb;
 
 	if (!item) {
 		if (!send_str(sock, "")) {
@@ -350,15 +796,14 @@ int send_item (int sock, const struct plist_item *item)
 		return 1;
 	}
 
-	b = packet_buf_new ();
-	packet_buf_add_item (b, item);
-	if (!send_all(sock, b->buf, b->len)) {
+	sb = get_sock_buf (sock);
+	packet_buf_add_item (sb->out, item);
+	if (!send_buffered(sock, sb)) {
 		logit ("Error when sending item");
-		res = 0;
+		return 0;
 	}
 
-	packet_buf_free (b);
-	return res;
+	return 1;
 }
 
 struct file_tags *recv_tags (int sock)
@@ -421,17 +866,53 @@ struct file_tags *recv_tags (int sock)
 /* Send tags. If tags == NULL, send empty tags. Return 0 on error. */
 int send_tags (int sock, const struct file_tags *tags)
 {
-	int res = 1;
-	struct packet_buf *b;
+	struct sock_buf *sb = get_sock_buf (sock);
 
-	b = packet_buf_new ();
-	packet_buf_add_tags (b, tags);
+	packet_buf_add_tags (sb->out, tags);
 
-	if (!send_all(sock, b->buf, b->len))
-		res = 0;
+	return send_buffered (sock, sb);
+}
 
-	packet_buf_free (b);
-	return res;
+/* Get a list of at most max strings preceded by their number.  Return NULL
+ * on error. */
+lists_t_strs *recv_strs (int sock, const int max)
+{
+	int i, num;
+	lists_t_strs *strs;
+
+	if (!get_int(sock, &num))
+		return NULL;
+
+	if (!RANGE(0, num, max)) {
+		logit ("Bad number of strings: %d", num);
+		return NULL;
+	}
+
+	strs = lists_strs_new (num);
+	for (i = 0; i < num; i++) {
+		char *str;
+
+		if (!(str = get_str(sock))) {
+			lists_strs_free (strs);
+			return NULL;
+		}
+		lists_strs_push (strs, str);
+	}
+
+	return strs;
+}
+
+/* Send the number of strings and the strings.  Return 0 on error. */
+int send_strs (int sock, const lists_t_strs *strs)
+{
+	struct sock_buf *sb = get_sock_buf (sock);
+	int i;
+
+	packet_buf_add_int (sb->out, lists_strs_size (strs));
+	for (i = 0; i < lists_strs_size (strs); i++)
+		packet_buf_add_str (sb->out, lists_strs_at (strs, i));
+
+	return send_buffered (sock, sb);
 }
 
 /* Get a playlist item from the server.
@@ -569,6 +1050,91 @@ void free_tag_ev_data (struct tag_ev_response *d)
 	free (d);
 }
 
+struct tag_ev_bulk *tag_ev_bulk_new ()
+{
+	struct tag_ev_bulk *b;
+
+	b = (struct tag_ev_bulk *)xmalloc (sizeof(struct tag_ev_bulk));
+	b->num = 0;
+	b->allocated = 16;
+	b->items = (struct tag_ev_response *)xmalloc (
+			b->allocated * sizeof(struct tag_ev_response));
+
+	return b;
+}
+
+/* Add a copy of the file's tags to the bulk response. */
+void tag_ev_bulk_add (struct tag_ev_bulk *b, const char *file,
+		const struct file_tags *tags)
+{
+	assert (b != NULL);
+	assert (file != NULL);
+	assert (tags != NULL);
+
+	if (b->num == b->allocated) {
+		b->allocated *= 2;
+		b->items = (struct tag_ev_response *)xrealloc (b->items,
+				b->allocated * sizeof(struct tag_ev_response));
+	}
+
+	b->items[b->num].file = xstrdup (file);
+	b->items[b->num].tags = tags_dup (tags);
+	b->num++;
+}
+
+void free_tag_bulk_ev_data (struct tag_ev_bulk *b)
+{
+	int i;
+
+	assert (b != NULL);
+
+	for (i = 0; i < b->num; i++) {
+		free (b->items[i].file);
+		tags_free (b->items[i].tags);
+	}
+	free (b->items);
+	free (b);
+}
+
+struct tag_ev_bulk *recv_tag_bulk_ev_data (int sock)
+{
+	struct tag_ev_bulk *b;
+	int i, num;
+
+	if (!get_int(sock, &num))
+		return NULL;
+
+	if (!RANGE(0, num, TAGS_BULK_MAX)) {
+		logit ("Bad number of files in tags response: %d", num);
+		return NULL;
+	}
+
+	b = tag_ev_bulk_new ();
+	for (i = 0; i < num; i++) {
+		char *file;
+		struct file_tags *tags;
+
+		if (!(file = get_str(sock))) {
+			logit ("Error while receiving file name");
+			free_tag_bulk_ev_data (b);
+			return NULL;
+		}
+
+		if (!(tags = recv_tags(sock))) {
+			logit ("Error while receiving tags");
+			free (file);
+			free_tag_bulk_ev_data (b);
+			return NULL;
+		}
+
+		tag_ev_bulk_add (b, file, tags);
+		free (file);
+		tags_free (tags);
+	}
+
+	return b;
+}
+
 void free_move_ev_data (struct move_ev_data *m)
 {
 	assert (m != NULL);
@@ -604,8 +1170,11 @@ void free_event_data (const int type, void *data)
 	}
 	else if (type == EV_FILE_TAGS)
 		free_tag_ev_data ((struct tag_ev_response *)data);
+	else if (type == EV_FILE_TAGS_BULK)
+		free_tag_bulk_ev_data ((struct tag_ev_bulk *)data);
 	else if (type == EV_PLIST_DEL || type == EV_STATUS_MSG
-			|| type == EV_SRV_ERROR || type == EV_QUEUE_DEL)
+			|| type == EV_SRV_ERROR || type == EV_QUEUE_DEL
+			|| type == EV_FILE_CHANGED)
 		free (data);
 	else if (type == EV_PLIST_MOVE || type == EV_QUEUE_MOVE)
 		free_move_ev_data ((struct move_ev_data *)data);
@@ -661,21 +1230,18 @@ int event_queue_empty (const struct event_queue *q)
 	return q->head == NULL ? 1 : 0;
 }
 
-/* Make a packet buffer filled with the event (with data). */
-static struct packet_buf *make_event_packet (const struct event *e)
+/* Add the event (with data) to the packet buffer. */
+static void add_event_packet (struct packet_buf *b, const struct event *e)
 {
-	struct packet_buf *b;
-
 	assert (e != NULL);
 
-	b = packet_buf_new ();
-
 	packet_buf_add_int (b, e->type);
 
 	if (e->type == EV_PLIST_DEL
 			|| e->type == EV_QUEUE_DEL
 			|| e->type == EV_SRV_ERROR
-			|| e->type == EV_STATUS_MSG) {
+			|| e->type == EV_STATUS_MSG
+			|| e->type == EV_FILE_CHANGED) {
 		assert (e->data != NULL);
 		packet_buf_add_str (b, e->data);
 	}
@@ -692,6 +1258,19 @@ static struct packet_buf *make_event_packet (const struct event *e)
 		packet_buf_add_str (b, r->file);
 		packet_buf_add_tags (b, r->tags);
 	}
+	else if (e->type == EV_FILE_TAGS_BULK) {
+		struct tag_ev_bulk *r;
+		int i;
+
+		assert (e->data != NULL);
+		r = e->data;
+
+		packet_buf_add_int (b, r->num);
+		for (i = 0; i < r->num; i++) {
+			packet_buf_add_str (b, r->items[i].file);
+			packet_buf_add_tags (b, r->items[i].tags);
+		}
+	}
 	else if (e->type == EV_PLIST_MOVE || e->type == EV_QUEUE_MOVE) {
 		struct move_ev_data *m;
 
@@ -703,51 +1282,42 @@ static struct packet_buf *make_event_packet (const struct event *e)
 	}
 	else if (e->data)
 		abort (); /* BUG */
-
-	return b;
 }
 
 /* Send the first event from the queue and remove it on success.  If the
  * operation would block return NB_IO_BLOCK.  Return NB_IO_ERR on error
- * or NB_IO_OK on success. */
+ * or NB_IO_OK on success.  A part of the event which doesn't fit in the
+ * socket is kept in the output buffer and sent with the next event or by
+ * send_flush_noblock(). */
 enum noblock_io_status event_send_noblock (int sock, struct event_queue *q)
 {
-	ssize_t res;
-	char *err;
-	struct packet_buf *b;
-	enum noblock_io_status result;
+	struct sock_buf *sb;
+	struct event *e;
 
 	assert (q != NULL);
 	assert (!event_queue_empty(q));
 
-	b = make_event_packet (event_get_first(q));
-
-	/* We must do it in one send() call to be able to handle blocking. */
-	nonblocking (send, res, sock, b->buf, b->len);
-
-	if (res == (ssize_t)b->len) {
-		struct event *e;
-
-		e = event_get_first (q);
-		free_event_data (e->type, e->data);
-		event_pop (q);
+	sb = get_sock_buf (sock);
 
-		result = NB_IO_OK;
-		goto exit;
+	/* Send the rest of the previous event first. */
+	if (sb->out->len > 0) {
+		if (!sock_write(sock, sb, NULL, 0, MSG_DONTWAIT))
+			return NB_IO_ERR;
+		if (sb->out->len > 0) {
+			logit ("Sending event would block");
+			return NB_IO_BLOCK;
+		}
 	}
 
-	if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-		logit ("Sending event would block");
-		result = NB_IO_BLOCK;
-		goto exit;
-	}
+	e = event_get_first (q);
+	add_event_packet (sb->out, e);
+	free_event_data (e->type, e->data);
+	event_pop (q);
 
-	err = xstrerror (errno);
-	logit ("send()ing event failed (%zd): %s", res, err);
-	free (err);
-	result = NB_IO_ERR;
+	if (!sock_write(sock, sb, NULL, 0, MSG_DONTWAIT)) {
+		logit ("send()ing event failed");
+		return NB_IO_ERR;
+	}
 
-exit:
-	packet_buf_free (b);
-	return result;
+	return NB_IO_OK;
 }
@@ -2,6 +2,7 @@
 #define PROTOCOL_H
 
 #include "playlist.h"
+#include "lists.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -27,6 +28,14 @@ struct tag_ev_response
 	struct file_tags *tags;
 };
 
+/* Used as data field in the event queue for EV_FILE_TAGS_BULK. */
+struct tag_ev_bulk
+{
+	int num;
+	int allocated;
+	struct tag_ev_response *items;
+};
+
 /* Used as data field in the event queue for EV_PLIST_MOVE. */
 struct move_ev_data
 {
@@ -63,6 +72,14 @@ enum noblock_io_status
 #define EV_AVG_BITRATE  0x12 /* average bitrate has changed (new song) */
 #define EV_AUDIO_START	0x13 /* playing of audio has started */
 #define EV_AUDIO_STOP	0x14 /* playing of audio has stopped */
+#define EV_FILE_TAGS_BULK	0x15 /* tags for several files in a response
+					for CMD_GET_FILE_TAGS_BULK */
+#define EV_FILE_CHANGED	0x16 /* a file in MusicDir was modified or removed,
+				followed by its name */
+
+/* Maximum number of files in CMD_GET_FILE_TAGS_BULK and in
+ * EV_FILE_TAGS_BULK. */
+#define TAGS_BULK_MAX	512
 
 /* Events caused by a client that wants to modify the playlist (see
  * CMD_CLI_PLIST* commands). */
@@ -146,6 +163,7 @@ enum noblock_io_status
 #define CMD_QUEUE_MOVE	0x3d /* move an item in the queue */
 #define CMD_QUEUE_CLEAR	0x3e /* clear the queue */
 #define CMD_GET_QUEUE	0x3f /* request the queue from the server */
+#define CMD_GET_FILE_TAGS_BULK	0x40 /* get tags for a list of files */
 
 char *socket_name ();
 int get_int (int sock, int *i);
@@ -159,6 +177,18 @@ int send_item (int sock, const struct plist_item *item);
 struct plist_item *recv_item (int sock);
 struct file_tags *recv_tags (int sock);
 int send_tags (int sock, const struct file_tags *tags);
+lists_t_strs *recv_strs (int sock, const int max);
+int send_strs (int sock, const lists_t_strs *strs);
+void send_cork (int sock);
+int send_uncork (int sock);
+enum noblock_io_status send_flush_noblock (int sock);
+int send_pending (int sock);
+int recv_buffered (int sock);
+enum noblock_io_status recv_noblock (int sock);
+int recv_peek_int (int sock, int *i);
+int recv_complete (int sock, const char *layout);
+int recv_relay_items (int sock, int dest, int *end);
+void sock_buf_free (int sock);
 
 void event_queue_init (struct event_queue *q);
 void event_queue_free (struct event_queue *q);
@@ -169,6 +199,11 @@ void event_push (struct event_queue *q, const int event, void *data);
 int event_queue_empty (const struct event_queue *q);
 enum noblock_io_status event_send_noblock (int sock, struct event_queue *q);
 void free_tag_ev_data (struct tag_ev_response *d);
+struct tag_ev_bulk *tag_ev_bulk_new ();
+void tag_ev_bulk_add (struct tag_ev_bulk *b, const char *file,
+		const struct file_tags *tags);
+void free_tag_bulk_ev_data (struct tag_ev_bulk *b);
+struct tag_ev_bulk *recv_tag_bulk_ev_data (int sock);
 void free_move_ev_data (struct move_ev_data *m);
 struct move_ev_data *move_ev_data_dup (const struct move_ev_data *m);
 struct move_ev_data *recv_move_ev_data (int sock);
@@ -14,6 +14,7 @@
 #endif
 
 #include <stdlib.h>
+#include <pthread.h>
 
 #ifdef HAVE_RCC
 # include <librcc.h>
@@ -21,8 +22,14 @@
 
 #include <assert.h>
 
+#include "common.h"
 #include "rcc.h"
 
+#ifdef HAVE_RCC
+/* Tags can be read by several threads at once. */
+static pthread_mutex_t rcc_mtx = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
 char *rcc_reencode (char *str)
 {
 	char *result = str;
@@ -32,6 +39,7 @@ char *rcc_reencode (char *str)
 #ifdef HAVE_RCC
 	rcc_string rccstring;
 
+	LOCK (rcc_mtx);
 	rccstring = rccFrom (NULL, 0, str);
 	if (rccstring) {
 		if (*rccstring) {
@@ -46,6 +54,7 @@ char *rcc_reencode (char *str)
 
 		free (rccstring);
 	}
+	UNLOCK (rcc_mtx);
 #endif /* HAVE_RCC */
 
 	return result;
@@ -0,0 +1,221 @@
+/*
+ * MOC - music on console
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+/* Realtime mode: keep the memory used on the playback path resident, so
+ * the output thread doesn't page-fault after memory pressure.  If the
+ * whole server can be locked with mlockall(), all buffers (including the
+ * ones allocated later by decoders) are locked and faulted in when they
+ * are allocated.  Otherwise the buffers passed to realtime_prefault() are
+ * locked one by one or at least touched. */
+
+/* For pthread_setaffinity_np() and RUSAGE_THREAD. */
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE
+#endif
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+
+#define DEBUG
+
+#include "common.h"
+#include "log.h"
+#include "options.h"
+#include "realtime.h"
+
+/* How much of the stack to fault in for the realtime thread. */
+#define STACK_PREFAULT	(256 * 1024)
+
+static int enabled = 0;
+
+/* Is the whole memory of the process locked? */
+static int memory_locked = 0;
+
+/* Locking the future allocations can make them fail if the amount of
+ * locked memory is limited, so lock everything only without the limit. */
+static int can_lock_all ()
+{
+#ifdef HAVE_GETRLIMIT
+	struct rlimit limit;
+
+	if (geteuid () == 0)
+		return 1;
+
+	if (getrlimit (RLIMIT_MEMLOCK, &limit) == -1) {
+		log_errno ("getrlimit() failed", errno);
+		return 0;
+	}
+
+	return limit.rlim_cur == RLIM_INFINITY;
+#else
+	return 0;
+#endif
+}
+
+/* Lock the memory of the server if RealtimeMode is set.  Must be called
+ * before the playback threads are created. */
+void realtime_init ()
+{
+	enabled = options_get_bool ("RealtimeMode");
+	if (!enabled)
+		return;
+
+#ifdef HAVE_MLOCKALL
+	if (!can_lock_all ())
+		logit ("The amount of locked memory is limited, locking only "
+				"the playback buffers");
+	else if (mlockall (MCL_CURRENT | MCL_FUTURE) == -1)
+		log_errno ("Can't lock the memory", errno);
+	else {
+		memory_locked = 1;
+		logit ("Memory locked");
+	}
+#else
+	logit ("No mlockall() function: memory not locked.");
+#endif
+}
+
+int realtime_mode ()
+{
+	return enabled;
+}
+
+/* Make sure that the freshly allocated buffer is resident.  Its content
+ * is preserved. */
+void realtime_prefault (void *buf, const size_t size)
+{
+	volatile char *mem = (volatile char *)buf;
+	long page;
+	size_t i;
+
+	if (!enabled || memory_locked || size == 0)
+		return;
+
+#ifdef HAVE_MLOCKALL
+	if (mlock (buf, size) == 0)
+		return;
+	debug ("mlock() failed: %s", xstrerror (errno));
+#endif
+
+	page = sysconf (_SC_PAGESIZE);
+	if (page <= 0)
+		page = 4096;
+
+	for (i = 0; i < size; i += page)
+		mem[i] = mem[i];
+	mem[size - 1] = mem[size - 1];
+}
+
+/* Unlock a buffer passed to realtime_prefault() before it's freed.  Only
+ * the pages which lie wholly in the buffer are unlocked, the others may be
+ * shared with another locked buffer. */
+void realtime_release (void *buf, const size_t size)
+{
+#ifdef HAVE_MLOCKALL
+	uintptr_t start, end;
+	long page;
+
+	if (!enabled || memory_locked || size == 0)
+		return;
+
+	page = sysconf (_SC_PAGESIZE);
+	if (page <= 0)
+		page = 4096;
+
+	start = ((uintptr_t)buf + page - 1) / page * page;
+	end = ((uintptr_t)buf + size) / page * page;
+
+	if (end > start && munlock ((void *)start, end - start) == -1)
+		debug ("munlock() failed: %s", xstrerror (errno));
+#endif
+}
+
+/* Fault in the part of the stack the thread is going to use. */
+static void prefault_stack ()
+{
+	volatile char stack[STACK_PREFAULT];
+	size_t i;
+
+	for (i = 0; i < sizeof (stack); i += 1024)
+		stack[i] = 0;
+}
+
+/* Pin the calling thread to RealtimeCPU. */
+static void pin_thread ()
+{
+	int cpu = options_get_int ("RealtimeCPU");
+
+	if (cpu < 0)
+		return;
+
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+	{
+		cpu_set_t set;
+		int rc;
+
+		if (cpu >= CPU_SETSIZE) {
+			logit ("RealtimeCPU %d is out of range", cpu);
+			return;
+		}
+
+		CPU_ZERO (&set);
+		CPU_SET (cpu, &set);
+		rc = pthread_setaffinity_np (pthread_self (), sizeof (set), &set);
+		if (rc != 0)
+			log_errno ("Can't pin the thread to the CPU", rc);
+		else
+			logit ("Thread pinned to CPU %d", cpu);
+	}
+#else
+	logit ("No pthread_setaffinity_np() function: thread not pinned.");
+#endif
+}
+
+/* Prepare the calling thread for the realtime work. */
+void realtime_thread_init ()
+{
+	if (!enabled)
+		return;
+
+	pin_thread ();
+	prefault_stack ();
+}
+
+/* Get the number of page faults of the calling thread so far.  Return 0
+ * if they can't be counted. */
+int realtime_thread_faults (long *minor, long *major)
+{
+#ifdef RUSAGE_THREAD
+	struct rusage usage;
+
+	if (getrusage (RUSAGE_THREAD, &usage) == -1)
+		return 0;
+
+	*minor = usage.ru_minflt;
+	*major = usage.ru_majflt;
+
+	return 1;
+#else
+	*minor = *major = 0;
+
+	return 0;
+#endif
+}
@@ -0,0 +1,21 @@
+#ifndef REALTIME_H
+#define REALTIME_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void realtime_init ();
+int realtime_mode ();
+void realtime_prefault (void *buf, const size_t size);
+void realtime_release (void *buf, const size_t size);
+void realtime_thread_init ();
+int realtime_thread_faults (long *minor, long *major);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,433 @@
+/*
+ * MOC - music on console
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+/* Seek index: the position in the file of the first frame of every second
+ * of sound.  Decoders which can't seek precisely (VBR mp3 without a table,
+ * raw AAC) fill it while decoding the file from the beginning and use it
+ * for seeking.  It's saved in a directory next to the tags cache, one file
+ * per sound file named after the MD5 sum of its path, and is valid as long
+ * as the file's size and modification time don't change.  Indexes of files
+ * which are gone or changed are removed when the server starts, as are the
+ * least recently used ones above the limit. */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <assert.h>
+#include <limits.h>
+#include <dirent.h>
+#include <utime.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#define DEBUG
+
+#include "common.h"
+#include "log.h"
+#include "files.h"
+#include "md5.h"
+#include "seek_index.h"
+
+#define SEEK_INDEX_MAGIC	"MOCSEEK2"
+
+/* Don't save indexes of files shorter than this (in seconds), seeking in
+ * them is fast anyway. */
+#define SEEK_INDEX_MIN_LEN	60
+
+/* Upper limit for the number of entries in a saved index (a week). */
+#define SEEK_INDEX_MAX_LEN	(7 * 24 * 3600)
+
+/* The header is followed by the path of the indexed file (path_len bytes,
+ * not terminated) and count positions. */
+struct index_header
+{
+	char magic[8];
+	int64_t mtime;
+	int64_t size;
+	int32_t duration;
+	int32_t count;
+	int32_t path_len;
+};
+
+struct seek_index
+{
+	char *file;		/* the indexed file */
+	char *path;		/* file with the saved index */
+	time_t mtime;		/* of the indexed file */
+	off_t size;		/* of the indexed file */
+	int duration;		/* total time, -1 if not indexed to the end */
+	int64_t *pos;		/* pos[sec] - position of the first frame */
+	int count;		/* number of entries in pos */
+	int allocated;
+	int modified;
+};
+
+/* Directory with the indexes, NULL if disabled. */
+static char *index_dir = NULL;
+
+static char *index_path (const char *file)
+{
+	unsigned char md5[16];
+	char *path;
+	int i, len;
+
+	md5_buffer (file, strlen (file), md5);
+
+	len = strlen (index_dir);
+	path = (char *)xmalloc (len + 1 + 2 * sizeof (md5) + 1);
+	strcpy (path, index_dir);
+	path[len++] = '/';
+	for (i = 0; i < (int)sizeof (md5); i++)
+		len += sprintf (path + len, "%02x", md5[i]);
+
+	return path;
+}
+
+/* Read the header and the indexed file's path (malloc()ed) of a saved
+ * index.  Return 0 if it's not a valid index. */
+static int index_read_header (FILE *f, struct index_header *hdr, char **file)
+{
+	if (fread (hdr, sizeof (*hdr), 1, f) != 1
+			|| memcmp (hdr->magic, SEEK_INDEX_MAGIC, sizeof (hdr->magic))
+			|| hdr->count <= 0 || hdr->count > SEEK_INDEX_MAX_LEN
+			|| hdr->path_len <= 0 || hdr->path_len >= PATH_MAX)
+		return 0;
+
+	*file = (char *)xmalloc (hdr->path_len + 1);
+	if (fread (*file, hdr->path_len, 1, f) != 1) {
+		free (*file);
+		return 0;
+	}
+	(*file)[hdr->path_len] = 0;
+
+	return 1;
+}
+
+/* Read the saved index if it's valid for the file. */
+static void index_load (struct seek_index *idx)
+{
+	struct index_header hdr;
+	char *file = NULL;
+	FILE *f;
+
+	f = fopen (idx->path, "r");
+	if (!f)
+		return;
+
+	if (!index_read_header (f, &hdr, &file)
+			|| strcmp (file, idx->file)
+			|| hdr.mtime != idx->mtime || hdr.size != idx->size) {
+		debug ("Seek index %s is out of date", idx->path);
+		free (file);
+		fclose (f);
+		return;
+	}
+	free (file);
+
+	idx->pos = (int64_t *)xmalloc (hdr.count * sizeof (idx->pos[0]));
+	if (fread (idx->pos, sizeof (idx->pos[0]), hdr.count, f)
+			!= (size_t)hdr.count) {
+		logit ("Seek index %s is truncated", idx->path);
+		free (idx->pos);
+		idx->pos = NULL;
+	}
+	else {
+		idx->count = hdr.count;
+		idx->allocated = hdr.count;
+		idx->duration = hdr.duration;
+		debug ("Loaded seek index %s: %d entries", idx->path, idx->count);
+
+		/* The modification time tells which indexes were used
+		 * recently. */
+		utime (idx->path, NULL);
+	}
+
+	fclose (f);
+}
+
+/* Write the index to a temporary file and rename it, so other decoders
+ * reading it at the same time see the old or the new one. */
+static void index_save (const struct seek_index *idx)
+{
+	struct index_header hdr;
+	char *tmp;
+	int fd;
+	FILE *f;
+
+	memset (&hdr, 0, sizeof (hdr));
+	memcpy (hdr.magic, SEEK_INDEX_MAGIC, sizeof (hdr.magic));
+	hdr.mtime = idx->mtime;
+	hdr.size = idx->size;
+	hdr.duration = idx->duration;
+	hdr.count = idx->count;
+	hdr.path_len = strlen (idx->file);
+
+	tmp = (char *)xmalloc (strlen (idx->path) + sizeof (".XXXXXX"));
+	sprintf (tmp, "%s.XXXXXX", idx->path);
+
+	fd = mkstemp (tmp);
+	if (fd == -1) {
+		log_errno ("Can't create seek index file", errno);
+		free (tmp);
+		return;
+	}
+
+	f = fdopen (fd, "w");
+	if (!f) {
+		log_errno ("fdopen() failed", errno);
+		close (fd);
+		unlink (tmp);
+		free (tmp);
+		return;
+	}
+
+	if (fwrite (&hdr, sizeof (hdr), 1, f) != 1
+			|| fwrite (idx->file, hdr.path_len, 1, f) != 1
+			|| fwrite (idx->pos, sizeof (idx->pos[0]), idx->count, f)
+			!= (size_t)idx->count) {
+		log_errno ("Can't write seek index", errno);
+		fclose (f);
+		unlink (tmp);
+	}
+	else if (fclose (f) || rename (tmp, idx->path) == -1) {
+		log_errno ("Can't save seek index", errno);
+		unlink (tmp);
+	}
+	else
+		debug ("Saved seek index %s: %d entries", idx->path, idx->count);
+
+	free (tmp);
+}
+
+/* Is the saved index still valid for the file it was made for? */
+static int index_file_valid (const char *path)
+{
+	struct index_header hdr;
+	struct stat st;
+	char *file;
+	int valid;
+	FILE *f;
+
+	f = fopen (path, "r");
+	if (!f)
+		return 0;
+
+	valid = index_read_header (f, &hdr, &file);
+	fclose (f);
+
+	if (!valid)
+		return 0;
+
+	valid = stat (file, &st) == 0 && S_ISREG(st.st_mode)
+		&& hdr.mtime == st.st_mtime && hdr.size == st.st_size;
+	free (file);
+
+	return valid;
+}
+
+struct index_file
+{
+	char *path;
+	time_t mtime;
+};
+
+/* Most recently used first. */
+static int index_file_cmp (const void *a, const void *b)
+{
+	const struct index_file *fa = (const struct index_file *)a;
+	const struct index_file *fb = (const struct index_file *)b;
+
+	if (fa->mtime == fb->mtime)
+		return 0;
+
+	return fa->mtime > fb->mtime ? -1 : 1;
+}
+
+/* Remove indexes of files which were deleted, renamed or modified and
+ * temporary files left by an interrupted save, then the least recently
+ * used indexes above max_files. */
+static void index_dir_cleanup (const int max_files)
+{
+	struct index_file *files = NULL;
+	int count = 0, allocated = 0, removed = 0;
+	struct dirent *d;
+	DIR *dir;
+	int i;
+
+	dir = opendir (index_dir);
+	if (!dir) {
+		log_errno ("Can't open the seek index directory", errno);
+		return;
+	}
+
+	while ((d = readdir (dir))) {
+		struct stat st;
+		char *path;
+
+		if (d->d_name[0] == '.')
+			continue;
+
+		path = (char *)xmalloc (strlen (index_dir) + strlen (d->d_name)
+				+ 2);
+		sprintf (path, "%s/%s", index_dir, d->d_name);
+
+		if (stat (path, &st) == -1 || !S_ISREG(st.st_mode)) {
+			free (path);
+			continue;
+		}
+
+		if (strchr (d->d_name, '.') || !index_file_valid (path)) {
+			debug ("Removing seek index %s", path);
+			unlink (path);
+			removed++;
+			free (path);
+			continue;
+		}
+
+		if (count == allocated) {
+			allocated = allocated ? allocated * 2 : 64;
+			files = (struct index_file *)xrealloc (files,
+					allocated * sizeof (files[0]));
+		}
+
+		files[count].path = path;
+		files[count].mtime = st.st_mtime;
+		count++;
+	}
+
+	closedir (dir);
+
+	if (count > max_files) {
+		qsort (files, count, sizeof (files[0]), index_file_cmp);
+		for (i = max_files; i < count; i++)
+			unlink (files[i].path);
+		removed += count - max_files;
+	}
+
+	for (i = 0; i < count; i++)
+		free (files[i].path);
+	free (files);
+
+	if (removed)
+		logit ("Removed %d seek indexes", removed);
+}
+
+/* Enable the seek index stored in the given directory, keeping at most
+ * max_files indexes. */
+void seek_index_init (const char *dir, const int max_files)
+{
+	assert (dir != NULL);
+	assert (index_dir == NULL);
+
+	if (mkdir (dir, 0700) == -1 && errno != EEXIST) {
+		error_errno ("Can't create directory for seek indexes", errno);
+		return;
+	}
+
+	index_dir = xstrdup (dir);
+	index_dir_cleanup (max_files);
+}
+
+void seek_index_cleanup ()
+{
+	free (index_dir);
+	index_dir = NULL;
+}
+
+/* Return the seek index of the file, possibly empty.  Return NULL if the
+ * index is disabled or the file is not a regular file. */
+struct seek_index *seek_index_open (const char *file)
+{
+	struct seek_index *idx;
+	struct stat st;
+
+	assert (file != NULL);
+
+	if (!index_dir || stat (file, &st) == -1 || !S_ISREG(st.st_mode))
+		return NULL;
+
+	idx = (struct seek_index *)xcalloc (1, sizeof (struct seek_index));
+	idx->file = xstrdup (file);
+	idx->path = index_path (file);
+	idx->mtime = st.st_mtime;
+	idx->size = st.st_size;
+	idx->duration = -1;
+
+	index_load (idx);
+
+	return idx;
+}
+
+/* Save the index if it was extended and free it. */
+void seek_index_close (struct seek_index *idx)
+{
+	if (!idx)
+		return;
+
+	if (idx->modified && idx->count >= SEEK_INDEX_MIN_LEN
+			&& idx->count <= SEEK_INDEX_MAX_LEN)
+		index_save (idx);
+
+	free (idx->pos);
+	free (idx->file);
+	free (idx->path);
+	free (idx);
+}
+
+/* Record the position of the frame starting at the given second.  The
+ * index is filled in order; entries which are already known or would
+ * leave a gap are ignored. */
+void seek_index_add (struct seek_index *idx, const int sec, const off_t pos)
+{
+	if (!idx || sec != idx->count || idx->duration != -1)
+		return;
+
+	if (idx->count == idx->allocated) {
+		idx->allocated = idx->allocated ? idx->allocated * 2 : 1024;
+		idx->pos = (int64_t *)xrealloc (idx->pos,
+				idx->allocated * sizeof (idx->pos[0]));
+	}
+
+	idx->pos[idx->count++] = pos;
+	idx->modified = 1;
+}
+
+/* Mark the index as complete: the file was indexed to the end. */
+void seek_index_finish (struct seek_index *idx, const int duration)
+{
+	if (!idx || idx->duration != -1 || duration < idx->count - 1)
+		return;
+
+	idx->duration = duration;
+	idx->modified = 1;
+}
+
+/* Return the position of the first frame of the given second or -1 if
+ * it's not in the index. */
+off_t seek_index_find (const struct seek_index *idx, const int sec)
+{
+	if (!idx || sec < 0 || sec >= idx->count)
+		return -1;
+
+	return idx->pos[sec];
+}
+
+/* Return the total time of the file or -1 if it's not fully indexed. */
+int seek_index_duration (const struct seek_index *idx)
+{
+	return idx ? idx->duration : -1;
+}
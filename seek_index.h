@@ -0,0 +1,25 @@
+#ifndef SEEK_INDEX_H
+#define SEEK_INDEX_H
+
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct seek_index;
+
+void seek_index_init (const char *dir, const int max_files);
+void seek_index_cleanup ();
+struct seek_index *seek_index_open (const char *file);
+void seek_index_close (struct seek_index *idx);
+void seek_index_add (struct seek_index *idx, const int sec, const off_t pos);
+void seek_index_finish (struct seek_index *idx, const int duration);
+off_t seek_index_find (const struct seek_index *idx, const int sec);
+int seek_index_duration (const struct seek_index *idx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -18,13 +18,18 @@
 #include <sys/wait.h>
 #include <sys/socket.h>
 #include <sys/select.h>
+#ifdef HAVE_SYS_EPOLL_H
+# include <sys/epoll.h>
+#endif
 #ifdef HAVE_GETRLIMIT
 # include <sys/resource.h>
 #endif
 #include <sys/un.h>
 #include <time.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <string.h>
 #include <strings.h>
 #include <signal.h>
@@ -44,6 +49,10 @@
 #include "server.h"
 #include "playlist.h"
 #include "tags_cache.h"
+#include "seek_index.h"
+#include "library_indexer.h"
+#include "status_page.h"
+#include "realtime.h"
 #include "files.h"
 #include "softmixer.h"
 #include "equalizer.h"
@@ -51,6 +60,11 @@
 #define SERVER_LOG	"mocp_server_log"
 #define PID_FILE	"pid"
 
+/* Maximum number of files in one EV_FILE_TAGS_BULK event.  The client
+ * shows the tags when the whole event has arrived, so a smaller batch
+ * gets the first of them on the screen sooner. */
+#define TAGS_BULK_EVENT_MAX	64
+
 struct client
 {
 	int socket; 		/* -1 if inactive */
@@ -59,6 +73,8 @@ struct client
 	pthread_mutex_t events_mtx;
 	int requests_plist;	/* is the client waiting for the playlist? */
 	int can_send_plist;	/* can this client send a playlist? */
+	int sends_plist;	/* is the client sending the playlist? */
+	int plist_dest;		/* index of the client getting it or -1 */
 	int lock;		/* is this client locking us? */
 	int serial;		/* used for generating unique serial numbers */
 };
@@ -68,12 +84,39 @@ static struct client clients[CLIENTS_MAX];
 /* Thread ID of the server thread. */
 static pthread_t server_tid;
 
-/* Pipe used to wake up the server from select() from another thread. */
+/* Pipe used to wake up the server from select() or epoll_wait() from another
+ * thread. */
 static int wake_up_pipe[2];
 
+/* What in the status page needs an update by the server thread. */
+#define STATUS_STALE_STATE	1
+#define STATUS_STALE_TAGS	2
+static int status_page_stale = 0;
+
+/* Tags of a file read by the tags cache for the status page, so that the
+ * server thread never reads a file itself. */
+static char *status_tags_file = NULL;
+static struct file_tags *status_tags = NULL;
+static pthread_mutex_t status_tags_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+/* File whose tags were last requested for the status page (only used by
+ * the server thread). */
+static char *status_tags_requested = NULL;
+
 /* Socket used to accept incoming client connections. */
 static int server_sock = -1;
 
+#ifdef HAVE_SYS_EPOLL_H
+static int epoll_fd = -1;
+
+/* epoll event identifiers other than client indexes. */
+#define SERVER_SOCK_ID	CLIENTS_MAX
+#define WAKE_UP_ID	(CLIENTS_MAX + 1)
+
+/* Maximum number of events got from one epoll_wait() call. */
+#define EPOLL_EVENTS	32
+#endif
+
 /* Set to 1 when a signal arrived causing the program to exit. */
 static volatile int server_quit = 0;
 
@@ -155,6 +198,7 @@ static void clients_init ()
 
 	for (i = 0; i < CLIENTS_MAX; i++) {
 		clients[i].socket = -1;
+		clients[i].plist_dest = -1;
 		pthread_mutex_init (&clients[i].events_mtx, NULL);
 	}
 }
@@ -171,7 +215,8 @@ static void clients_cleanup ()
 	}
 }
 
-/* Add a client to the list, return 1 if ok, 0 on error (max clients exceeded) */
+/* Add a client to the list, return its index or -1 on error (max clients
+ * exceeded). */
 static int add_client (int sock)
 {
 	int i;
@@ -186,12 +231,14 @@ static int add_client (int sock)
 			clients[i].socket = sock;
 			clients[i].requests_plist = 0;
 			clients[i].can_send_plist = 0;
+			clients[i].sends_plist = 0;
+			clients[i].plist_dest = -1;
 			clients[i].lock = 0;
 			tags_cache_clear_queue (tags_cache, i);
-			return 1;
+			return i;
 		}
 
-	return 0;
+	return -1;
 }
 
 /* Return index of a client that has a lock acquired. Return -1 if there is no
@@ -253,6 +300,21 @@ static int client_index (const struct client *cli)
 
 static void del_client (struct client *cli)
 {
+	int i;
+
+	/* End the playlist being relayed from or to this client. */
+	if (cli->sends_plist && cli->plist_dest != -1) {
+		logit ("The client sending the playlist closed the connection");
+		send_item (clients[cli->plist_dest].socket, NULL);
+	}
+	for (i = 0; i < CLIENTS_MAX; i++)
+		if (clients[i].plist_dest == client_index(cli))
+			clients[i].plist_dest = -1;
+	cli->sends_plist = 0;
+	cli->plist_dest = -1;
+	cli->requests_plist = 0;
+
+	sock_buf_free (cli->socket);
 	cli->socket = -1;
 	LOCK (cli->events_mtx);
 	event_queue_free (&cli->events);
@@ -272,7 +334,8 @@ static void wake_up_server ()
 
 	debug ("Waking up the server");
 
-	if (write(wake_up_pipe[1], &w, sizeof(w)) < 0)
+	/* If the pipe is full, the server will wake up anyway. */
+	if (write(wake_up_pipe[1], &w, sizeof(w)) < 0 && errno != EAGAIN)
 		log_errno ("Can't wake up the server: (write() failed)", errno);
 }
 
@@ -356,6 +419,10 @@ void server_init (int debugging, int foreground)
 
 	if (pipe(wake_up_pipe) < 0)
 		fatal ("pipe() failed: %s", xstrerror (errno));
+	if (fcntl(wake_up_pipe[0], F_SETFL, O_NONBLOCK) == -1
+			|| fcntl(wake_up_pipe[1], F_SETFL, O_NONBLOCK) == -1)
+		fatal ("Can't make the wake up pipe non-blocking: %s",
+				xstrerror (errno));
 
 	unlink (socket_name());
 
@@ -372,17 +439,31 @@ void server_init (int debugging, int foreground)
 	if (bind(server_sock, (struct sockaddr *)&sock_name, SUN_LEN(&sock_name)) == -1)
 		fatal ("Can't bind() to the socket: %s", xstrerror (errno));
 
-	if (listen(server_sock, 1) == -1)
+	if (listen(server_sock, 16) == -1)
 		fatal ("listen() failed: %s", xstrerror (errno));
 
 	/* Log stack sizes so stack overflows can be debugged. */
 	log_process_stack_size ();
 	log_pthread_stack_size ();
 
+	realtime_init ();
 	clients_init ();
+	status_page_init ();
+	if (options_get_bool ("SeekIndex"))
+		seek_index_init (create_file_name ("seek_index"),
+		                 options_get_int ("SeekIndexSize"));
 	audio_initialize ();
-	tags_cache = tags_cache_new (options_get_int("TagsCacheSize"));
-	tags_cache_load (tags_cache, create_file_name("cache"));
+	tags_cache = tags_cache_new (options_get_int("TagsCacheSize"),
+	                             options_get_int("TagsReaders"));
+	tags_cache_load (tags_cache, create_file_name("cache"),
+	                 options_get_symb("TagsCacheBackend"));
+	if (options_get_bool ("LibraryIndexer")) {
+		if (options_get_str ("MusicDir"))
+			library_indexer_start (tags_cache,
+			                       options_get_str ("MusicDir"));
+		else
+			logit ("LibraryIndexer is set, but MusicDir is not");
+	}
 
 	server_tid = pthread_self ();
 	xsignal (SIGTERM, sig_exit);
@@ -407,31 +488,38 @@ void server_init (int debugging, int foreground)
 /* Send EV_DATA and the integer value. Return 0 on error. */
 static int send_data_int (const struct client *cli, const int data)
 {
+	int res;
+
 	assert (cli->socket != -1);
 
-	if (!send_int(cli->socket, EV_DATA) || !send_int(cli->socket, data))
-		return 0;
+	send_cork (cli->socket);
+	res = send_int(cli->socket, EV_DATA) && send_int(cli->socket, data);
 
-	return 1;
+	return send_uncork (cli->socket) && res;
 }
 
 /* Send EV_DATA and the boolean value. Return 0 on error. */
 static int send_data_bool (const struct client *cli, const bool data)
 {
+	int res;
+
 	assert (cli->socket != -1);
 
-	if (!send_int(cli->socket, EV_DATA) ||
-	    !send_int(cli->socket, data ? 1 : 0))
-		return 0;
+	send_cork (cli->socket);
+	res = send_int(cli->socket, EV_DATA) &&
+	      send_int(cli->socket, data ? 1 : 0);
 
-	return 1;
+	return send_uncork (cli->socket) && res;
 }
 
 /* Send EV_DATA and the string value. Return 0 on error. */
 static int send_data_str (const struct client *cli, const char *str) {
-	if (!send_int(cli->socket, EV_DATA) || !send_str(cli->socket, str))
-		return 0;
-	return 1;
+	int res;
+
+	send_cork (cli->socket);
+	res = send_int(cli->socket, EV_DATA) && send_str(cli->socket, str);
+
+	return send_uncork (cli->socket) && res;
 }
 
 /* Add event to the client's queue */
@@ -645,7 +733,8 @@ static void add_event_all (const int event, const void *data)
 			else if (event == EV_PLIST_DEL
 					|| event == EV_QUEUE_DEL
 					|| event == EV_STATUS_MSG
-					|| event == EV_SRV_ERROR) {
+					|| event == EV_SRV_ERROR
+					|| event == EV_FILE_CHANGED) {
 				data_copy = xstrdup (data);
 			}
 			else if (event == EV_PLIST_MOVE
@@ -667,13 +756,29 @@ static void add_event_all (const int event, const void *data)
 		debug ("No events have been added because there are no clients");
 }
 
+/* Return != 0 if the playlist is being relayed to the client. */
+static int receives_plist (const struct client *cli)
+{
+	int i;
+
+	for (i = 0; i < CLIENTS_MAX; i++)
+		if (clients[i].sends_plist
+				&& clients[i].plist_dest == client_index(cli))
+			return 1;
+	return 0;
+}
+
 /* Send events from the queue. Return 0 on error. */
 static int flush_events (struct client *cli)
 {
-	enum noblock_io_status st = NB_IO_OK;
+	enum noblock_io_status st;
 
 	LOCK (cli->events_mtx);
-	while (!event_queue_empty(&cli->events)
+	st = send_flush_noblock (cli->socket);
+
+	/* Events can't be put between the playlist items. */
+	while (st == NB_IO_OK && !receives_plist(cli)
+			&& !event_queue_empty(&cli->events)
 			&& (st = event_send_noblock(cli->socket, &cli->events))
 			== NB_IO_OK)
 		;
@@ -682,29 +787,22 @@ static int flush_events (struct client *cli)
 	return st != NB_IO_ERR ? 1 : 0;
 }
 
-/* Send events to clients whose sockets are ready to write. */
-static void send_events (fd_set *fds)
-{
-	int i;
-
-	for (i = 0; i < CLIENTS_MAX; i++)
-		if (clients[i].socket != -1
-				&& FD_ISSET(clients[i].socket, fds)) {
-			debug ("Flushing events for client %d", i);
-			if (!flush_events (&clients[i])) {
-				close (clients[i].socket);
-				del_client (&clients[i]);
-			}
-		}
-}
-
 /* End playing and cleanup. */
 static void server_shutdown ()
 {
 	logit ("Server exiting...");
+	library_indexer_stop ();
 	audio_exit ();
+	status_page_cleanup ();
 	tags_cache_free (tags_cache);
 	tags_cache = NULL;
+
+	/* The player and the tags readers use the seek index until here. */
+	seek_index_cleanup ();
+	free (status_tags_file);
+	if (status_tags)
+		tags_free (status_tags);
+	free (status_tags_requested);
 	unlink (socket_name());
 	unlink (create_file_name(PID_FILE));
 	close (wake_up_pipe[0]);
@@ -719,6 +817,7 @@ static void busy (int sock)
 	logit ("Closing connection due to maximum number of clients reached");
 	send_int (sock, EV_BUSY);
 	close (sock);
+	sock_buf_free (sock);
 }
 
 /* Handle CMD_LIST_ADD, return 1 if ok or 0 on error. */
@@ -1015,75 +1114,76 @@ static int find_cli_requesting_plist ()
 }
 
 /* Handle CMD_SEND_PLIST. Some client requested to get the playlist, so we asked
- * another client to send it (EV_SEND_PLIST). */
+ * another client to send it (EV_SEND_PLIST).  The items are relayed by
+ * relay_plist() as they arrive, so other clients are served meanwhile. */
 static int req_send_plist (struct client *cli)
 {
 	int requesting = find_cli_requesting_plist ();
 	int send_fd;
-	struct plist_item *item;
 	int serial;
 
 	debug ("Client with fd %d wants to send its playlists", cli->socket);
 
-	if (requesting == -1) {
-		logit ("No clients are requesting the playlist");
-		send_fd = -1;
-	}
-	else {
-		send_fd = clients[requesting].socket;
-		if (!send_int(send_fd, EV_DATA)) {
-			logit ("Error while sending response; disconnecting the client");
-			close (send_fd);
-			del_client (&clients[requesting]);
-			send_fd = -1;
-		}
-	}
-
 	if (!get_int(cli->socket, &serial)) {
 		logit ("Error while getting serial");
 		return 0;
 	}
 
-	if (send_fd != -1 && !send_int(send_fd, serial)) {
-		error ("Error while sending serial; disconnecting the client");
-		close (send_fd);
-		del_client (&clients[requesting]);
-		send_fd = -1;
-	}
-
 	/* Even if no clients are requesting the playlist, we must read it,
 	 * because there is no way to say that we don't need it. */
-	while ((item = recv_item(cli->socket)) && item->file[0]) {
-		if (send_fd != -1 && !send_item(send_fd, item)) {
-			logit ("Error while sending item; disconnecting the client");
-			close (send_fd);
-			del_client (&clients[requesting]);
-			send_fd = -1;
-		}
-		plist_free_item_fields (item);
-		free (item);
-	}
+	cli->sends_plist = 1;
+	cli->plist_dest = -1;
 
-	if (item) {
-		plist_free_item_fields (item);
-		free (item);
-		logit ("Playlist sent");
+	if (requesting == -1) {
+		logit ("No clients are requesting the playlist");
+		return 1;
 	}
-	else
-		logit ("Error while receiving item");
 
-	if (send_fd != -1 && !send_item (send_fd, NULL)) {
-		logit ("Error while sending end of playlist mark; "
-		       "disconnecting the client");
+	clients[requesting].requests_plist = 0;
+	send_fd = clients[requesting].socket;
+
+	send_cork (send_fd);
+	if (!send_int(send_fd, EV_DATA) || !send_int(send_fd, serial)
+			|| !send_uncork(send_fd)) {
+		logit ("Error while sending response; disconnecting the client");
 		close (send_fd);
 		del_client (&clients[requesting]);
+		return 1;
+	}
+
+	cli->plist_dest = requesting;
+
+	return 1;
+}
+
+/* Pass the playlist items received from the client to the client which
+ * requested the playlist.  Return 0 on error. */
+static int relay_plist (struct client *cli)
+{
+	int dest = cli->plist_dest;
+	int end, res;
+
+	res = recv_relay_items (cli->socket,
+			dest == -1 ? -1 : clients[dest].socket, &end);
+	if (!res) {
+		logit ("Error while receiving item");
 		return 0;
 	}
 
-	if (requesting != -1)
-		clients[requesting].requests_plist = 0;
+	if (res == -1) {
+		logit ("The client requesting the playlist doesn't read it; "
+				"disconnecting it");
+		close (clients[dest].socket);
+		del_client (&clients[dest]);
+	}
+
+	if (end) {
+		logit ("Playlist sent");
+		cli->sends_plist = 0;
+		cli->plist_dest = -1;
+	}
 
-	return item ? 1 : 0;
+	return 1;
 }
 
 /* Client requested we send the queue so we get it from audio.c and
@@ -1095,6 +1195,7 @@ static int req_send_queue (struct client *cli)
 
 	logit ("Client with fd %d wants queue... sending it", cli->socket);
 
+	send_cork (cli->socket);
 	if (!send_int(cli->socket, EV_DATA)) {
 		logit ("Error while sending response; disconnecting the client");
 		close (cli->socket);
@@ -1118,7 +1219,7 @@ static int req_send_queue (struct client *cli)
 	plist_free (queue);
 	free (queue);
 
-	if (!send_item (cli->socket, NULL)) {
+	if (!send_item (cli->socket, NULL) || !send_uncork (cli->socket)) {
 		logit ("Error while sending end of playlist mark; "
 		       "disconnecting the client");
 		close (cli->socket);
@@ -1250,13 +1351,14 @@ static int req_get_tags (struct client *cli)
 
 	debug ("Sending tags to client with fd %d...", cli->socket);
 
+	send_cork (cli->socket);
 	if (!send_int(cli->socket, EV_DATA)) {
 		logit ("Error when sending EV_DATA");
 		return 0;
 	}
 
 	tags = audio_get_curr_tags ();
-	if (!send_tags(cli->socket, tags)) {
+	if (!send_tags(cli->socket, tags) || !send_uncork(cli->socket)) {
 		logit ("Error when sending tags");
 		res = 0;
 	}
@@ -1383,6 +1485,27 @@ static int get_file_tags (const int cli_id)
 	return 1;
 }
 
+/* Handle CMD_GET_FILE_TAGS_BULK. Return 0 on error. */
+static int get_file_tags_bulk (const int cli_id)
+{
+	lists_t_strs *files;
+	int tags_sel, urgent, i;
+
+	if (!get_int(clients[cli_id].socket, &tags_sel))
+		return 0;
+	if (!get_int(clients[cli_id].socket, &urgent))
+		return 0;
+	if (!(files = recv_strs(clients[cli_id].socket, TAGS_BULK_MAX)))
+		return 0;
+
+	for (i = 0; i < lists_strs_size (files); i++)
+		tags_cache_add_bulk_request (tags_cache, lists_strs_at (files, i),
+				tags_sel, cli_id, i < urgent);
+	lists_strs_free (files);
+
+	return 1;
+}
+
 static int abort_tags_requests (const int cli_id)
 {
 	char *file;
@@ -1615,6 +1738,10 @@ static void handle_command (const int client_id)
 			if (!get_file_tags(client_id))
 				err = 1;
 			break;
+		case CMD_GET_FILE_TAGS_BULK:
+			if (!get_file_tags_bulk(client_id))
+				err = 1;
+			break;
 		case CMD_ABORT_TAGS_REQUESTS:
 			if (!abort_tags_requests(client_id))
 				err = 1;
@@ -1671,52 +1798,143 @@ static void handle_command (const int client_id)
 	}
 }
 
-/* Add clients file descriptors to fds. */
-static void add_clients_fds (fd_set *read, fd_set *write)
+/* Arguments of the command (with the command itself) in the format of
+ * recv_complete(). */
+static const char *command_layout (const int cmd)
 {
-	int i;
+	switch (cmd) {
+		case CMD_LIST_ADD:
+		case CMD_PLAY:
+		case CMD_GET_OPTION:
+		case CMD_DELETE:
+		case CMD_CLI_PLIST_DEL:
+		case CMD_ABORT_TAGS_REQUESTS:
+		case CMD_QUEUE_ADD:
+		case CMD_QUEUE_DEL:
+			return "is";
+		case CMD_SEEK:
+		case CMD_JUMP_TO:
+		case CMD_SET_MIXER:
+		case CMD_PLIST_SET_SERIAL:
+		case CMD_SEND_PLIST:
+			return "ii";
+		case CMD_SET_OPTION:
+		case CMD_GET_FILE_TAGS:
+			return "isi";
+		case CMD_GET_FILE_TAGS_BULK:
+			return "iiiS";
+		case CMD_CLI_PLIST_ADD:
+			return "iI";
+		case CMD_CLI_PLIST_MOVE:
+		case CMD_LIST_MOVE:
+		case CMD_QUEUE_MOVE:
+			return "iss";
+	}
 
-	for (i = 0; i < CLIENTS_MAX; i++)
-		if (clients[i].socket != -1) {
-			if (locking_client() == -1 || is_locking(&clients[i]))
-				FD_SET (clients[i].socket, read);
+	return "i";
+}
 
-			LOCK (clients[i].events_mtx);
-			if (!event_queue_empty(&clients[i].events))
-				FD_SET (clients[i].socket, write);
-			UNLOCK (clients[i].events_mtx);
+/* Handle the client's commands which were received completely, so the
+ * server never waits for a client.  Return the number of handled
+ * commands. */
+static int handle_commands (const int client_id)
+{
+	struct client *cli = &clients[client_id];
+	int handled = 0;
+
+	while (cli->socket != -1) {
+		int cmd, res;
+
+		/* The rest of CMD_SEND_PLIST, the lock doesn't stop it. */
+		if (cli->sends_plist) {
+			if (!relay_plist(cli)) {
+				close (cli->socket);
+				del_client (cli);
+				break;
+			}
+			if (cli->sends_plist)
+				break;
+			continue;
 		}
+
+		if (locking_client() != -1 && !is_locking(cli))
+			break;
+
+		if (!recv_peek_int(cli->socket, &cmd))
+			break;
+
+		res = recv_complete (cli->socket, command_layout(cmd));
+		if (res == 0)
+			break;
+		if (res == -1) {
+			logit ("Bad data from the client, closing connection");
+			close (cli->socket);
+			del_client (cli);
+			break;
+		}
+
+		handle_command (client_id);
+		handled++;
+	}
+
+	return handled;
 }
 
-/* Return the maximum fd from clients and the argument. */
-static int max_fd (int max)
+/* Handle commands of all clients.  Repeat it because a command can release
+ * the lock which stopped other clients. */
+static void handle_clients ()
 {
-	int i;
+	int i, handled;
 
-	if (wake_up_pipe[0] > max)
-		max = wake_up_pipe[0];
+	do {
+		handled = 0;
+		for (i = 0; i < CLIENTS_MAX; i++)
+			if (clients[i].socket != -1
+					&& recv_buffered(clients[i].socket))
+				handled += handle_commands (i);
+	} while (handled);
+}
 
-	for (i = 0; i < CLIENTS_MAX; i++)
-		if (clients[i].socket > max)
-			max = clients[i].socket;
-	return max;
+/* Read what the client has sent and handle the commands. */
+static void client_input (const int client_id)
+{
+	struct client *cli = &clients[client_id];
+	enum noblock_io_status st;
+
+	if (cli->socket == -1)
+		return;
+
+	st = recv_noblock (cli->socket);
+
+	/* Handle the commands sent before the connection was closed. */
+	handle_commands (client_id);
+
+	if (st == NB_IO_ERR && cli->socket != -1) {
+		logit ("Client with fd %d closed the connection", cli->socket);
+		close (cli->socket);
+		del_client (cli);
+	}
 }
 
-/* Handle clients whose fds are ready to read. */
-static void handle_clients (fd_set *fds)
+/* Send events and the buffered output to clients, it doesn't wait for
+ * the sockets. */
+static void send_events ()
 {
 	int i;
 
 	for (i = 0; i < CLIENTS_MAX; i++)
-		if (clients[i].socket != -1
-				&& FD_ISSET(clients[i].socket, fds)) {
-			if (locking_client() == -1
-					|| is_locking(&clients[i]))
-				handle_command (i);
-			else
-				debug ("Not getting a command from client with"
-						" fd %d because of lock",
-						clients[i].socket);
+		if (clients[i].socket != -1) {
+			int pending;
+
+			LOCK (clients[i].events_mtx);
+			pending = !event_queue_empty(&clients[i].events)
+				|| send_pending(clients[i].socket);
+			UNLOCK (clients[i].events_mtx);
+
+			if (pending && !flush_events(&clients[i])) {
+				close (clients[i].socket);
+				del_client (&clients[i]);
+			}
 		}
 }
 
@@ -1733,69 +1951,227 @@ static void close_clients ()
 		}
 }
 
-/* Handle incoming connections */
-void server_loop ()
+#ifdef HAVE_SYS_EPOLL_H
+static void epoll_add (const int fd, const uint32_t events, const uint32_t id)
+{
+	struct epoll_event ev;
+
+	memset (&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.u32 = id;
+
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1)
+		fatal ("epoll_ctl() failed: %s", xstrerror (errno));
+}
+#endif
+
+/* Accept an incoming connection. */
+static void accept_client ()
 {
 	struct sockaddr_un client_name;
 	socklen_t name_len = sizeof (client_name);
+	int client_sock, client_id;
 
-	logit ("MOC server started, pid: %d", getpid());
+	debug ("accept()ing connection...");
+	client_sock = accept (server_sock, (struct sockaddr *)&client_name,
+			&name_len);
 
-	assert (server_sock != -1);
+	if (client_sock == -1)
+		fatal ("accept() failed: %s", xstrerror (errno));
+	logit ("Incoming connection");
 
-	log_circular_start ();
+	client_id = add_client (client_sock);
+	if (client_id == -1) {
+		busy (client_sock);
+		return;
+	}
 
-	do {
-		int res;
-		fd_set fds_write, fds_read;
+	if (fcntl(client_sock, F_SETFL,
+				fcntl(client_sock, F_GETFL) | O_NONBLOCK) == -1)
+		fatal ("Can't make the client's socket non-blocking: %s",
+				xstrerror (errno));
 
-		FD_ZERO (&fds_read);
-		FD_ZERO (&fds_write);
-		FD_SET (server_sock, &fds_read);
-		FD_SET (wake_up_pipe[0], &fds_read);
-		add_clients_fds (&fds_read, &fds_write);
+#ifdef HAVE_SYS_EPOLL_H
+	epoll_add (client_sock, EPOLLIN | EPOLLOUT | EPOLLET, client_id);
+#endif
+}
 
-		res = 0;
-		if (!server_quit)
-			res = select (max_fd(server_sock)+1, &fds_read,
-					&fds_write, NULL, NULL);
+static void read_wake_up ()
+{
+	int w;
+
+	logit ("Got 'wake up'");
+
+	while (read(wake_up_pipe[0], &w, sizeof(w)) > 0)
+		;
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+/* Wait for the sockets and handle the incoming data. */
+static void wait_for_events ()
+{
+	struct epoll_event events[EPOLL_EVENTS];
+	int i, n;
+
+	n = epoll_wait (epoll_fd, events, EPOLL_EVENTS, -1);
+	if (n == -1) {
+		if (errno != EINTR && !server_quit)
+			fatal ("epoll_wait() failed: %s", xstrerror (errno));
+		return;
+	}
+
+	for (i = 0; i < n && !server_quit; i++) {
+		uint32_t id = events[i].data.u32;
+
+		if (id == SERVER_SOCK_ID)
+			accept_client ();
+		else if (id == WAKE_UP_ID)
+			read_wake_up ();
+		else if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+			client_input (id);
+	}
+}
+#else
+/* Wait for the sockets and handle the incoming data. */
+static void wait_for_events ()
+{
+	fd_set fds_read, fds_write;
+	int i, max;
+
+	FD_ZERO (&fds_read);
+	FD_ZERO (&fds_write);
+	FD_SET (server_sock, &fds_read);
+	FD_SET (wake_up_pipe[0], &fds_read);
+	max = MAX(server_sock, wake_up_pipe[0]);
+
+	for (i = 0; i < CLIENTS_MAX; i++)
+		if (clients[i].socket != -1) {
+			FD_SET (clients[i].socket, &fds_read);
+			if (send_pending(clients[i].socket))
+				FD_SET (clients[i].socket, &fds_write);
+			max = MAX(max, clients[i].socket);
+		}
 
-		if (res == -1 && errno != EINTR && !server_quit)
+	if (select(max + 1, &fds_read, &fds_write, NULL, NULL) == -1) {
+		if (errno != EINTR && !server_quit)
 			fatal ("select() failed: %s", xstrerror (errno));
+		return;
+	}
 
-		if (!server_quit && res >= 0) {
-			if (FD_ISSET(server_sock, &fds_read)) {
-				int client_sock;
+	if (server_quit)
+		return;
 
-				debug ("accept()ing connection...");
-				client_sock = accept (server_sock,
-					(struct sockaddr *)&client_name,
-					&name_len);
+	if (FD_ISSET(server_sock, &fds_read))
+		accept_client ();
+	if (FD_ISSET(wake_up_pipe[0], &fds_read))
+		read_wake_up ();
 
-				if (client_sock == -1)
-					fatal ("accept() failed: %s", xstrerror (errno));
-				logit ("Incoming connection");
-				if (!add_client(client_sock))
-					busy (client_sock);
-			}
+	for (i = 0; i < CLIENTS_MAX; i++)
+		if (clients[i].socket != -1
+				&& FD_ISSET(clients[i].socket, &fds_read))
+			client_input (i);
+}
+#endif
 
-			if (FD_ISSET(wake_up_pipe[0], &fds_read)) {
-				int w;
+/* Copy a string to a field of the status page. */
+static void status_str (char *field, const char *str)
+{
+	snprintf (field, STATUS_PAGE_STR, "%s", str ? str : "");
+}
 
-				logit ("Got 'wake up'");
+/* Return a copy of the tags of the file read for the status page or NULL
+ * if there are none yet. */
+static struct file_tags *get_status_tags (const char *file)
+{
+	struct file_tags *tags = NULL;
 
-				if (read(wake_up_pipe[0], &w, sizeof(w)) < 0)
-					fatal ("Can't read wake up signal: %s", xstrerror (errno));
-			}
+	LOCK (status_tags_mtx);
+	if (status_tags_file && !strcmp (status_tags_file, file))
+		tags = tags_dup (status_tags);
+	UNLOCK (status_tags_mtx);
+
+	return tags;
+}
+
+/* Put the player state, the current file and its tags in the status page
+ * in one update, so clients never see a state which doesn't match the
+ * file.  Tags which are not in the cache are requested from the tags
+ * cache readers, and the page is updated again when they arrive. */
+static void update_status_file (const int stale)
+{
+	struct status_page *page;
+	struct file_tags *tags = NULL;
+	char *sname;
+	int state;
+
+	sname = audio_get_sname ();
+	if (sname && file_type(sname) == F_URL)
+		tags = audio_get_curr_tags ();
+	else if (sname && sname[0]) {
+		tags = get_status_tags (sname);
+		if (!tags && (!status_tags_requested
+		              || strcmp (status_tags_requested, sname))) {
+			free (status_tags_requested);
+			status_tags_requested = xstrdup (sname);
 
-			send_events (&fds_write);
-			handle_clients (&fds_read);
+			/* Answered at once if the tags are cached. */
+			tags_cache_add_request (tags_cache, sname,
+			                        TAGS_COMMENTS | TAGS_TIME,
+			                        STATUS_CLIENT_ID);
+			tags = get_status_tags (sname);
 		}
+	}
+	state = audio_get_state ();
+
+	if ((page = status_page_begin())) {
+		if ((stale & STATUS_STALE_TAGS)
+				|| strncmp (page->file, sname ? sname : "",
+				            STATUS_PAGE_STR - 1))
+			page->tags_serial++;
+		page->state = state;
+		status_str (page->file, sname);
+		status_str (page->title, tags ? tags->title : NULL);
+		status_str (page->artist, tags ? tags->artist : NULL);
+		status_str (page->album, tags ? tags->album : NULL);
+		page->time = tags ? tags->time : -1;
+		page->track = tags ? tags->track : -1;
+		status_page_end ();
+	}
+
+	free (sname);
+	if (tags)
+		tags_free (tags);
+}
+
+void server_loop ()
+{
+	logit ("MOC server started, pid: %d", getpid());
 
-		if (server_quit)
-			logit ("Exiting...");
+	assert (server_sock != -1);
+
+	log_circular_start ();
 
-	} while (!server_quit);
+#ifdef HAVE_SYS_EPOLL_H
+	epoll_fd = epoll_create (CLIENTS_MAX + 2);
+	if (epoll_fd == -1)
+		fatal ("epoll_create() failed: %s", xstrerror (errno));
+	epoll_add (server_sock, EPOLLIN, SERVER_SOCK_ID);
+	epoll_add (wake_up_pipe[0], EPOLLIN, WAKE_UP_ID);
+#endif
+
+	while (!server_quit) {
+		int stale;
+
+		wait_for_events ();
+		stale = __atomic_exchange_n (&status_page_stale, 0,
+		                             __ATOMIC_ACQ_REL);
+		if (stale)
+			update_status_file (stale);
+		handle_clients ();
+		send_events ();
+	}
+
+	logit ("Exiting...");
 
 	log_circular_log ();
 	log_circular_stop ();
@@ -1804,46 +2180,80 @@ void server_loop ()
 	clients_cleanup ();
 	close (server_sock);
 	server_sock = -1;
+#ifdef HAVE_SYS_EPOLL_H
+	close (epoll_fd);
+	epoll_fd = -1;
+#endif
 	server_shutdown ();
 }
 
+/* Set an integer field of the status page. */
+static void status_set_int (const size_t field, const int value)
+{
+	struct status_page *page = status_page_begin ();
+
+	if (page) {
+		*(int32_t *)((char *)page + field) = value;
+		status_page_end ();
+	}
+}
+
+/* Mark the state, the file and the tags in the status page to be updated
+ * by the server thread, which can get them without a deadlock. */
+static void status_file_change (const int what)
+{
+	__atomic_or_fetch (&status_page_stale, what, __ATOMIC_RELEASE);
+	wake_up_server ();
+}
+
 void set_info_bitrate (const int bitrate)
 {
 	sound_info.bitrate = bitrate;
+	status_set_int (offsetof(struct status_page, bitrate), bitrate);
 	add_event_all (EV_BITRATE, NULL);
 }
 
 void set_info_channels (const int channels)
 {
 	sound_info.channels = channels;
+	status_set_int (offsetof(struct status_page, channels), channels);
 	add_event_all (EV_CHANNELS, NULL);
 }
 
 void set_info_rate (const int rate)
 {
 	sound_info.rate = rate;
+	status_set_int (offsetof(struct status_page, rate), rate);
 	add_event_all (EV_RATE, NULL);
 }
 
 void set_info_avg_bitrate (const int avg_bitrate)
 {
 	sound_info.avg_bitrate = avg_bitrate;
+	status_set_int (offsetof(struct status_page, avg_bitrate),
+			avg_bitrate);
 	add_event_all (EV_AVG_BITRATE, NULL);
 }
 
 /* Notify the client about change of the player state. */
 void state_change ()
 {
+	status_file_change (STATUS_STALE_STATE);
 	add_event_all (EV_STATE, NULL);
 }
 
 void ctime_change ()
 {
+	status_set_int (offsetof(struct status_page, ctime),
+			MAX(0, audio_get_time()));
+	status_set_int (offsetof(struct status_page, xruns),
+			audio_get_xruns());
 	add_event_all (EV_CTIME, NULL);
 }
 
 void tags_change ()
 {
+	status_file_change (STATUS_STALE_TAGS);
 	add_event_all (EV_TAGS, NULL);
 }
 
@@ -1852,11 +2262,31 @@ void status_msg (const char *msg)
 	add_event_all (EV_STATUS_MSG, msg);
 }
 
+/* Tell the clients that the file was modified or removed. */
+void file_changed (const char *file)
+{
+	add_event_all (EV_FILE_CHANGED, file);
+}
+
 void tags_response (const int client_id, const char *file,
 		const struct file_tags *tags)
 {
 	assert (file != NULL);
 	assert (tags != NULL);
+
+	if (client_id == STATUS_CLIENT_ID) {
+		LOCK (status_tags_mtx);
+		free (status_tags_file);
+		if (status_tags)
+			tags_free (status_tags);
+		status_tags_file = xstrdup (file);
+		status_tags = tags_dup (tags);
+		UNLOCK (status_tags_mtx);
+
+		status_file_change (STATUS_STALE_TAGS);
+		return;
+	}
+
 	assert (LIMIT(client_id, CLIENTS_MAX));
 
 	if (clients[client_id].socket != -1) {
@@ -1872,6 +2302,38 @@ void tags_response (const int client_id, const char *file,
 	}
 }
 
+/* Like tags_response(), but add the tags to the last EV_FILE_TAGS_BULK
+ * event waiting to be sent to the client if there is one, so responses
+ * which arrive faster than the client reads them go in one packet. */
+void tags_bulk_response (const int client_id, const char *file,
+		const struct file_tags *tags)
+{
+	struct client *cli;
+
+	assert (file != NULL);
+	assert (tags != NULL);
+	assert (LIMIT(client_id, CLIENTS_MAX));
+
+	cli = &clients[client_id];
+	if (cli->socket == -1)
+		return;
+
+	LOCK (cli->events_mtx);
+	if (cli->events.tail && cli->events.tail->type == EV_FILE_TAGS_BULK
+			&& ((struct tag_ev_bulk *)cli->events.tail->data)->num
+			< TAGS_BULK_EVENT_MAX)
+		tag_ev_bulk_add (cli->events.tail->data, file, tags);
+	else {
+		struct tag_ev_bulk *data = tag_ev_bulk_new ();
+
+		tag_ev_bulk_add (data, file, tags);
+		event_push (&cli->events, EV_FILE_TAGS_BULK, data);
+	}
+	UNLOCK (cli->events_mtx);
+
+	wake_up_server ();
+}
+
 void ev_audio_start ()
 {
 	add_event_all (EV_AUDIO_START, NULL);
@@ -7,7 +7,10 @@ extern "C" {
 
 #include "playlist.h"
 
-#define CLIENTS_MAX	10
+#define CLIENTS_MAX	256
+
+/* Client id of the server's own tags requests, for the status page. */
+#define STATUS_CLIENT_ID	CLIENTS_MAX
 
 void server_init (int debug, int foreground);
 void server_loop ();
@@ -21,8 +24,11 @@ void set_info_avg_bitrate (const int avg_bitrate);
 void tags_change ();
 void ctime_change ();
 void status_msg (const char *msg);
+void file_changed (const char *file);
 void tags_response (const int client_id, const char *file,
 		const struct file_tags *tags);
+void tags_bulk_response (const int client_id, const char *file,
+		const struct file_tags *tags);
 void ev_audio_start ();
 void ev_audio_stop ();
 void server_queue_pop (const char *filename);
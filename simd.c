@@ -0,0 +1,68 @@
+/*
+ * MOC - music on console
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+/* Detection of the SIMD instruction sets the sample processing code can
+ * use.  The x86 code is compiled for each instruction set and chosen at
+ * runtime; NEON code is used when the compiler targets it, there is no
+ * runtime check for it. */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <assert.h>
+#include <string.h>
+
+#include "simd.h"
+
+/* Return the mask of SIMD_* instruction sets usable on this CPU. */
+int simd_features ()
+{
+	int features = 0;
+
+#ifdef HAVE_SIMD_X86
+	__builtin_cpu_init ();
+
+	if (__builtin_cpu_supports ("sse2"))
+		features |= SIMD_SSE2;
+	if (__builtin_cpu_supports ("avx2"))
+		features |= SIMD_AVX2;
+#endif
+
+#ifdef HAVE_NEON
+	features |= SIMD_NEON;
+#endif
+
+	return features;
+}
+
+/* Put a human readable list of the instruction sets in features into buf
+ * and return it. */
+char *simd_str (const int features, char *buf, const size_t size)
+{
+	assert (buf != NULL);
+	assert (size > 0);
+
+	buf[0] = 0;
+
+	if (features & SIMD_SSE2)
+		strncat (buf, "SSE2 ", size - strlen (buf) - 1);
+	if (features & SIMD_AVX2)
+		strncat (buf, "AVX2 ", size - strlen (buf) - 1);
+	if (features & SIMD_NEON)
+		strncat (buf, "NEON ", size - strlen (buf) - 1);
+
+	if (buf[0])
+		buf[strlen (buf) - 1] = 0;
+	else
+		strncat (buf, "none", size - 1);
+
+	return buf;
+}
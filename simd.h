@@ -0,0 +1,35 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <stddef.h>
+
+#ifdef HAVE_SIMD_X86
+# include <immintrin.h>
+# define ATTR_SSE2 __attribute__((target ("sse2")))
+# define ATTR_AVX2 __attribute__((target ("avx2")))
+#endif
+
+#ifdef HAVE_NEON
+# include <arm_neon.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* SIMD instruction sets which can be used on this CPU. */
+#define SIMD_SSE2	0x01
+#define SIMD_AVX2	0x02
+#define SIMD_NEON	0x04
+
+/* Maximum length of the string returned by simd_str(). */
+#define SIMD_STR_MAX	16
+
+int simd_features ();
+char *simd_str (const int features, char *buf, const size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -34,14 +34,21 @@
 #include "options.h"
 #include "files.h"
 #include "log.h"
+#include "simd.h"
+
+/* Fraction bits of the fixed point gain. */
+#define SOFTMIXER_GAIN_SHIFT 14
 
 static int active;
 static int mix_mono;
 static int mixer_val, mixer_amp, mixer_real;
 static float mixer_realf;
+static double mixer_reald;
+static int mixer_gain; /* fits in int16_t for the SIMD code */
 
 static void softmixer_read_config();
 static void softmixer_write_config();
+static void softmixer_select_kernels();
 
 /* public code */
 
@@ -57,6 +64,7 @@ void softmixer_init()
   mixer_amp = 100;
   softmixer_set_value(100);
   softmixer_read_config();
+  softmixer_select_kernels();
   logit ("Softmixer initialized");
 }
 
@@ -76,6 +84,9 @@ void softmixer_set_value(const int val)
   }
   mixer_real = CLAMP(SOFTMIXER_MIN, mixer_real, SOFTMIXER_MAX);
   mixer_realf = ((float)mixer_real)/1000.0f;
+  mixer_reald = mixer_real/1000.0;
+  mixer_gain = ((mixer_real << SOFTMIXER_GAIN_SHIFT) + 500) / 1000;
+  mixer_gain = MIN(mixer_gain, INT16_MAX);
 
   debug ("Softmixer value: %d, gain: %d", mixer_val, mixer_real);
 }
@@ -85,6 +96,12 @@ int softmixer_get_value()
   return mixer_val;
 }
 
+/* Returns the amplification factor applied to the samples. */
+float softmixer_get_gain()
+{
+  return active ? mixer_realf : 1.0f;
+}
+
 void softmixer_set_active(int act)
 {
   if(act)
@@ -113,25 +130,44 @@ int softmixer_is_mono()
 
 /* private code */
 
-static void process_buffer_u8(uint8_t *buf, size_t samples);
 static void process_buffer_s8(int8_t *buf, size_t samples);
-static void process_buffer_u16(uint16_t *buf, size_t samples);
 static void process_buffer_s16(int16_t *buf, size_t samples);
-static void process_buffer_u24(uint32_t *buf, size_t samples);
 static void process_buffer_s24(int32_t *buf, size_t samples);
-static void process_buffer_u32(uint32_t *buf, size_t samples);
 static void process_buffer_s32(int32_t *buf, size_t samples);
 static void process_buffer_float(float *buf, size_t samples);
-static void mix_mono_u8(uint8_t *buf, int channels, size_t samples);
 static void mix_mono_s8(int8_t *buf, int channels, size_t samples);
-static void mix_mono_u16(uint16_t *buf, int channels, size_t samples);
 static void mix_mono_s16(int16_t *buf, int channels, size_t samples);
-static void mix_mono_u24(uint32_t *buf, int channels, size_t samples);
 static void mix_mono_s24(int32_t *buf, int channels, size_t samples);
-static void mix_mono_u32(uint32_t *buf, int channels, size_t samples);
 static void mix_mono_s32(int32_t *buf, int channels, size_t samples);
 static void mix_mono_float(float *buf, int channels, size_t samples);
 
+/* Functions doing the work for each (signed) format, replaced by SIMD
+ * versions in softmixer_init() if the CPU supports them. */
+static struct
+{
+  void (*gain_s8)(int8_t *buf, size_t samples);
+  void (*gain_s16)(int16_t *buf, size_t samples);
+  void (*gain_s24)(int32_t *buf, size_t samples);
+  void (*gain_s32)(int32_t *buf, size_t samples);
+  void (*gain_float)(float *buf, size_t samples);
+  void (*mono_s8)(int8_t *buf, int channels, size_t samples);
+  void (*mono_s16)(int16_t *buf, int channels, size_t samples);
+  void (*mono_s24)(int32_t *buf, int channels, size_t samples);
+  void (*mono_s32)(int32_t *buf, int channels, size_t samples);
+  void (*mono_float)(float *buf, int channels, size_t samples);
+} kernels = {
+  process_buffer_s8,
+  process_buffer_s16,
+  process_buffer_s24,
+  process_buffer_s32,
+  process_buffer_float,
+  mix_mono_s8,
+  mix_mono_s16,
+  mix_mono_s24,
+  mix_mono_s32,
+  mix_mono_float
+};
+
 static void softmixer_read_config()
 {
   char *cfname = create_file_name(SOFTMIXER_SAVE_FILE);
@@ -264,13 +300,31 @@ static void softmixer_write_config()
   logit ("Softmixer configuration written");
 }
 
-void softmixer_process_buffer(char *buf, size_t size, const struct sound_params *sound_params)
+/* After flipping the sign bit, 24 bit samples must be sign extended to be
+ * processed as S24, and masked back to 24 bits before flipping again. */
+static void sign_extend_24(int32_t *buf, size_t samples)
+{
+  size_t i;
+
+  for(i=0; i<samples; i++)
+    buf[i] = (int32_t)((uint32_t)buf[i] << 8) >> 8;
+}
+
+static void mask_24(int32_t *buf, size_t samples)
 {
-  int do_softmix, do_monomix;
+  size_t i;
+
+  for(i=0; i<samples; i++)
+    buf[i] &= 0xFFFFFF;
+}
+
+void softmixer_process_buffer(char *buf, size_t size, const struct sound_params *sound_params, const int apply_gain)
+{
+  int do_softmix, do_monomix, flipped = 0;
 
   debug ("Processing %zu bytes...", size);
 
-  do_softmix = active && (mixer_real != 100);
+  do_softmix = apply_gain && active && (mixer_real != 1000);
   do_monomix = mix_mono && (sound_params->channels > 1);
 
   if(!do_softmix && !do_monomix)
@@ -281,86 +335,66 @@ void softmixer_process_buffer(char *buf, size_t size, const struct sound_params
 
   assert (size % (samplewidth * sound_params->channels) == 0);
 
+  /* Unsigned samples are processed as signed ones with the sign bit
+   * flipped, so the midpoint becomes zero. */
+  if(sound_format & (SFMT_U8 | SFMT_U16 | SFMT_U24 | SFMT_U32))
+  {
+    audio_conv_change_sign(buf, size, &sound_format);
+    flipped = 1;
+
+    if(sound_format == SFMT_S24)
+      sign_extend_24((int32_t *)buf, size / sizeof(int32_t));
+  }
+
   switch(sound_format)
   {
-    case SFMT_U8:
-      if(do_softmix)
-        process_buffer_u8((uint8_t *)buf, size);
-      if(do_monomix)
-        mix_mono_u8((uint8_t *)buf, sound_params->channels, size);
-      break;
     case SFMT_S8:
       if(do_softmix)
-        process_buffer_s8((int8_t *)buf, size);
-      if(do_monomix)
-        mix_mono_s8((int8_t *)buf, sound_params->channels, size);
-      break;
-    case SFMT_U16:
-      if(do_softmix)
-        process_buffer_u16((uint16_t *)buf, size / sizeof(uint16_t));
+        kernels.gain_s8((int8_t *)buf, size);
       if(do_monomix)
-        mix_mono_u16((uint16_t *)buf, sound_params->channels, size / sizeof(uint16_t));
+        kernels.mono_s8((int8_t *)buf, sound_params->channels, size);
       break;
     case SFMT_S16:
       if(do_softmix)
-        process_buffer_s16((int16_t *)buf, size / sizeof(int16_t));
+        kernels.gain_s16((int16_t *)buf, size / sizeof(int16_t));
       if(do_monomix)
-        mix_mono_s16((int16_t *)buf, sound_params->channels, size / sizeof(int16_t));
-      break;
-    case SFMT_U24:
-      if(do_softmix)
-        process_buffer_u24((uint32_t *)buf, size / sizeof(uint32_t));
-      if(mix_mono)
-        mix_mono_u24((uint32_t *)buf, sound_params->channels, size / sizeof(uint32_t));
+        kernels.mono_s16((int16_t *)buf, sound_params->channels, size / sizeof(int16_t));
       break;
     case SFMT_S24:
       if(do_softmix)
-        process_buffer_s24((int32_t *)buf, size / sizeof(int32_t));
-      if(mix_mono)
-        mix_mono_s24((int32_t *)buf, sound_params->channels, size / sizeof(int32_t));
-      break;
-    case SFMT_U32:
-      if(do_softmix)
-        process_buffer_u32((uint32_t *)buf, size / sizeof(uint32_t));
+        kernels.gain_s24((int32_t *)buf, size / sizeof(int32_t));
       if(do_monomix)
-        mix_mono_u32((uint32_t *)buf, sound_params->channels, size / sizeof(uint32_t));
+        kernels.mono_s24((int32_t *)buf, sound_params->channels, size / sizeof(int32_t));
       break;
     case SFMT_S32:
       if(do_softmix)
-        process_buffer_s32((int32_t *)buf, size / sizeof(int32_t));
+        kernels.gain_s32((int32_t *)buf, size / sizeof(int32_t));
       if(do_monomix)
-        mix_mono_s32((int32_t *)buf, sound_params->channels, size / sizeof(int32_t));
+        kernels.mono_s32((int32_t *)buf, sound_params->channels, size / sizeof(int32_t));
       break;
     case SFMT_FLOAT:
       if(do_softmix)
-        process_buffer_float((float *)buf, size / sizeof(float));
+        kernels.gain_float((float *)buf, size / sizeof(float));
       if(do_monomix)
-        mix_mono_float((float *)buf, sound_params->channels, size / sizeof(float));
+        kernels.mono_float((float *)buf, sound_params->channels, size / sizeof(float));
       break;
     default:
       debug ("No softmixer/monomixer for chosen format.");
 
   }
-}
-
-static void process_buffer_u8(uint8_t *buf, size_t samples)
-{
-  size_t i;
 
-  debug ("mixing");
-
-  for(i=0; i<samples; i++)
+  if(flipped)
   {
-    int16_t tmp = buf[i];
-    tmp -= (UINT8_MAX>>1);
-    tmp *= mixer_real;
-    tmp /= 1000;
-    tmp += (UINT8_MAX>>1);
-    tmp = CLAMP(0, tmp, UINT8_MAX);
-    buf[i] = (uint8_t)tmp;
+    if(sound_format == SFMT_S24)
+      mask_24((int32_t *)buf, size / sizeof(int32_t));
+
+    audio_conv_change_sign(buf, size, &sound_format);
   }
 }
 
+/* 8 and 16 bit samples are multiplied by the fixed point gain, wider ones
+ * by the float or double gain so that the product doesn't overflow. */
+
 static void process_buffer_s8(int8_t *buf, size_t samples)
 {
   size_t i;
@@ -369,32 +403,13 @@ static void process_buffer_s8(int8_t *buf, size_t samples)
 
   for(i=0; i<samples; i++)
   {
-    int16_t tmp = buf[i];
-    tmp *= mixer_real;
-    tmp /= 1000;
+    int32_t tmp = buf[i];
+    tmp = (tmp * mixer_gain) >> SOFTMIXER_GAIN_SHIFT;
     tmp = CLAMP(INT8_MIN, tmp, INT8_MAX);
     buf[i] = (int8_t)tmp;
   }
 }
 
-static void process_buffer_u16(uint16_t *buf, size_t samples)
-{
-  size_t i;
-
-  debug ("mixing");
-
-  for(i=0; i<samples; i++)
-  {
-    int32_t tmp = buf[i];
-    tmp -= (UINT16_MAX>>1);
-    tmp *= mixer_real;
-    tmp /= 1000;
-    tmp += (UINT16_MAX>>1);
-    tmp = CLAMP(0, tmp, UINT16_MAX);
-    buf[i] = (uint16_t)tmp;
-  }
-}
-
 static void process_buffer_s16(int16_t *buf, size_t samples)
 {
   size_t i;
@@ -404,31 +419,12 @@ static void process_buffer_s16(int16_t *buf, size_t samples)
   for(i=0; i<samples; i++)
   {
     int32_t tmp = buf[i];
-    tmp *= mixer_real;
-    tmp /= 1000;
+    tmp = (tmp * mixer_gain) >> SOFTMIXER_GAIN_SHIFT;
     tmp = CLAMP(INT16_MIN, tmp, INT16_MAX);
     buf[i] = (int16_t)tmp;
   }
 }
 
-static void process_buffer_u24(uint32_t *buf, size_t samples)
-{
-  size_t i;
-
-  debug ("mixing");
-  
-  for(i=0; i<samples; i++)
-  {
-    int64_t tmp = buf[i];
-    tmp -= S24_MIN;
-    tmp *= mixer_real;
-    tmp /= 1000;
-    tmp += S24_MIN;
-    tmp = CLAMP(0, tmp, U24_MAX);
-    buf[i] = (uint32_t)tmp;
-  }
-}
-
 static void process_buffer_s24(int32_t *buf, size_t samples)
 {
   size_t i;
@@ -437,32 +433,13 @@ static void process_buffer_s24(int32_t *buf, size_t samples)
 
   for(i=0; i<samples; i++)
   {
-    int64_t tmp = buf[i];
-    tmp *= mixer_real;
-    tmp /= 1000;
+    float tmp = buf[i];
+    tmp *= mixer_realf;
     tmp = CLAMP(S24_MIN, tmp, S24_MAX);
     buf[i] = (int32_t)tmp;
   }
 }
 
-static void process_buffer_u32(uint32_t *buf, size_t samples)
-{
-  size_t i;
-
-  debug ("mixing");
-
-  for(i=0; i<samples; i++)
-  {
-    int64_t tmp = buf[i];
-    tmp -= (UINT32_MAX>>1);
-    tmp *= mixer_real;
-    tmp /= 1000;
-    tmp += (UINT32_MAX>>1);
-    tmp = CLAMP(0, tmp, UINT32_MAX);
-    buf[i] = (uint32_t)tmp;
-  }
-}
-
 static void process_buffer_s32(int32_t *buf, size_t samples)
 {
   size_t i;
@@ -471,9 +448,8 @@ static void process_buffer_s32(int32_t *buf, size_t samples)
 
   for(i=0; i<samples; i++)
   {
-    int64_t tmp = buf[i];
-    tmp *= mixer_real;
-    tmp /= 1000;
+    double tmp = buf[i];
+    tmp *= mixer_reald;
     tmp = CLAMP(INT32_MIN, tmp, INT32_MAX);
     buf[i] = (int32_t)tmp;
   }
@@ -495,7 +471,7 @@ static void process_buffer_float(float *buf, size_t samples)
 }
 
 // Mono-Mixing
-static void mix_mono_u8(uint8_t *buf, int channels, size_t samples)
+static void mix_mono_s8(int8_t *buf, int channels, size_t samples)
 {
   int c;
   size_t i = 0;
@@ -514,16 +490,16 @@ static void mix_mono_u8(uint8_t *buf, int channels, size_t samples)
     buf-=channels;
 
     mono /= channels;
-    mono = MIN(mono, UINT8_MAX);  // can't be negative
+    mono = CLAMP(INT8_MIN, mono, INT8_MAX);
 
     for(c=0; c<channels; c++)
-      *buf++ = (uint8_t)mono;
+      *buf++ = (int8_t)mono;
 
     i+=channels;
   }
 }
 
-static void mix_mono_s8(int8_t *buf, int channels, size_t samples)
+static void mix_mono_s16(int16_t *buf, int channels, size_t samples)
 {
   int c;
   size_t i = 0;
@@ -534,7 +510,7 @@ static void mix_mono_s8(int8_t *buf, int channels, size_t samples)
 
   while(i < samples)
   {
-    int16_t mono = 0;
+    int32_t mono = 0;
 
     for(c=0; c<channels; c++)
       mono += *buf++;
@@ -542,16 +518,16 @@ static void mix_mono_s8(int8_t *buf, int channels, size_t samples)
     buf-=channels;
 
     mono /= channels;
-    mono = CLAMP(INT8_MIN, mono, INT8_MAX);
+    mono = CLAMP(INT16_MIN, mono, INT16_MAX);
 
     for(c=0; c<channels; c++)
-      *buf++ = (int8_t)mono;
+      *buf++ = (int16_t)mono;
 
     i+=channels;
   }
 }
 
-static void mix_mono_u16(uint16_t *buf, int channels, size_t samples)
+static void mix_mono_s24(int32_t *buf, int channels, size_t samples)
 {
   int c;
   size_t i = 0;
@@ -562,7 +538,7 @@ static void mix_mono_u16(uint16_t *buf, int channels, size_t samples)
 
   while(i < samples)
   {
-    int32_t mono = 0;
+    int64_t mono = 0;
 
     for(c=0; c<channels; c++)
       mono += *buf++;
@@ -570,16 +546,16 @@ static void mix_mono_u16(uint16_t *buf, int channels, size_t samples)
     buf-=channels;
 
     mono /= channels;
-    mono = MIN(mono, UINT16_MAX);  // can't be negative
+    mono = CLAMP(S24_MIN, mono, S24_MAX);
 
     for(c=0; c<channels; c++)
-      *buf++ = (uint16_t)mono;
+      *buf++ = (int32_t)mono;
 
     i+=channels;
   }
 }
 
-static void mix_mono_s16(int16_t *buf, int channels, size_t samples)
+static void mix_mono_s32(int32_t *buf, int channels, size_t samples)
 {
   int c;
   size_t i = 0;
@@ -590,7 +566,7 @@ static void mix_mono_s16(int16_t *buf, int channels, size_t samples)
 
   while(i < samples)
   {
-    int32_t mono = 0;
+    int64_t mono = 0;
 
     for(c=0; c<channels; c++)
       mono += *buf++;
@@ -598,28 +574,27 @@ static void mix_mono_s16(int16_t *buf, int channels, size_t samples)
     buf-=channels;
 
     mono /= channels;
-    mono = CLAMP(INT16_MIN, mono, INT16_MAX);
+    mono = CLAMP(INT32_MIN, mono, INT32_MAX);
 
     for(c=0; c<channels; c++)
-      *buf++ = (int16_t)mono;
+      *buf++ = (int32_t)mono;
 
     i+=channels;
   }
 }
 
-static void mix_mono_u24(uint32_t *buf, int channels, size_t samples)
+static void mix_mono_float(float *buf, int channels, size_t samples)
 {
   int c;
   size_t i = 0;
 
   debug ("making mono");
 
-  if(channels < 2)
-    return;
+  assert (channels > 1);
 
   while(i < samples)
   {
-    int64_t mono = 0;
+    float mono = 0.0f;
 
     for(c=0; c<channels; c++)
       mono += *buf++;
@@ -627,124 +602,567 @@ static void mix_mono_u24(uint32_t *buf, int channels, size_t samples)
     buf-=channels;
 
     mono /= channels;
-    mono = MIN(mono, U24_MAX);  // can't be negative
+    mono = CLAMP(-1.0f, mono, 1.0f);
 
     for(c=0; c<channels; c++)
-      *buf++ = (uint32_t)mono;
+      *buf++ = mono;
 
     i+=channels;
   }
 }
 
-static void mix_mono_s24(int32_t *buf, int channels, size_t samples)
+/* SIMD versions of the above, giving the same results.  Mono mixing is
+ * only vectorized for stereo, other layouts use the plain code. */
+
+#ifdef HAVE_SIMD_X86
+
+/* Multiply 8 16-bit samples by the fixed point gain, saturating. */
+ATTR_SSE2
+static inline __m128i gain_epi16_sse2(__m128i v, __m128i gain)
 {
-  int c;
-  size_t i = 0;
+  __m128i lo = _mm_mullo_epi16(v, gain);
+  __m128i hi = _mm_mulhi_epi16(v, gain);
+  __m128i p0 = _mm_srai_epi32(_mm_unpacklo_epi16(lo, hi), SOFTMIXER_GAIN_SHIFT);
+  __m128i p1 = _mm_srai_epi32(_mm_unpackhi_epi16(lo, hi), SOFTMIXER_GAIN_SHIFT);
 
-  debug ("making mono");
+  return _mm_packs_epi32(p0, p1);
+}
+
+ATTR_SSE2
+static void process_buffer_s8_sse2(int8_t *buf, size_t samples)
+{
+  const __m128i gain = _mm_set1_epi16(mixer_gain);
+  size_t i;
+
+  for(i=0; i+16<=samples; i+=16)
+  {
+    __m128i v = _mm_loadu_si128((__m128i *)(buf + i));
+    __m128i lo = _mm_srai_epi16(_mm_unpacklo_epi8(v, v), 8);
+    __m128i hi = _mm_srai_epi16(_mm_unpackhi_epi8(v, v), 8);
+
+    lo = gain_epi16_sse2(lo, gain);
+    hi = gain_epi16_sse2(hi, gain);
+    _mm_storeu_si128((__m128i *)(buf + i), _mm_packs_epi16(lo, hi));
+  }
+
+  process_buffer_s8(buf + i, samples - i);
+}
+
+ATTR_SSE2
+static void process_buffer_s16_sse2(int16_t *buf, size_t samples)
+{
+  const __m128i gain = _mm_set1_epi16(mixer_gain);
+  size_t i;
+
+  for(i=0; i+8<=samples; i+=8)
+  {
+    __m128i v = _mm_loadu_si128((__m128i *)(buf + i));
+
+    _mm_storeu_si128((__m128i *)(buf + i), gain_epi16_sse2(v, gain));
+  }
+
+  process_buffer_s16(buf + i, samples - i);
+}
+
+ATTR_SSE2
+static void process_buffer_s24_sse2(int32_t *buf, size_t samples)
+{
+  const __m128 gain = _mm_set1_ps(mixer_realf);
+  const __m128 min = _mm_set1_ps(S24_MIN);
+  const __m128 max = _mm_set1_ps(S24_MAX);
+  size_t i;
+
+  for(i=0; i+4<=samples; i+=4)
+  {
+    __m128 f = _mm_cvtepi32_ps(_mm_loadu_si128((__m128i *)(buf + i)));
+
+    f = _mm_max_ps(_mm_min_ps(_mm_mul_ps(f, gain), max), min);
+    _mm_storeu_si128((__m128i *)(buf + i), _mm_cvttps_epi32(f));
+  }
+
+  process_buffer_s24(buf + i, samples - i);
+}
+
+ATTR_SSE2
+static inline __m128i gain_epi32_sse2(__m128i v, __m128d gain)
+{
+  const __m128d min = _mm_set1_pd(INT32_MIN);
+  const __m128d max = _mm_set1_pd(INT32_MAX);
+  __m128d lo = _mm_mul_pd(_mm_cvtepi32_pd(v), gain);
+  __m128d hi = _mm_mul_pd(_mm_cvtepi32_pd(_mm_unpackhi_epi64(v, v)), gain);
 
-  if(channels < 2)
+  lo = _mm_max_pd(_mm_min_pd(lo, max), min);
+  hi = _mm_max_pd(_mm_min_pd(hi, max), min);
+
+  return _mm_unpacklo_epi64(_mm_cvttpd_epi32(lo), _mm_cvttpd_epi32(hi));
+}
+
+ATTR_SSE2
+static void process_buffer_s32_sse2(int32_t *buf, size_t samples)
+{
+  const __m128d gain = _mm_set1_pd(mixer_reald);
+  size_t i;
+
+  for(i=0; i+4<=samples; i+=4)
+  {
+    __m128i v = _mm_loadu_si128((__m128i *)(buf + i));
+
+    _mm_storeu_si128((__m128i *)(buf + i), gain_epi32_sse2(v, gain));
+  }
+
+  process_buffer_s32(buf + i, samples - i);
+}
+
+ATTR_SSE2
+static void process_buffer_float_sse2(float *buf, size_t samples)
+{
+  const __m128 gain = _mm_set1_ps(mixer_realf);
+  const __m128 min = _mm_set1_ps(-1.0f);
+  const __m128 max = _mm_set1_ps(1.0f);
+  size_t i;
+
+  for(i=0; i+4<=samples; i+=4)
+  {
+    __m128 f = _mm_mul_ps(_mm_loadu_ps(buf + i), gain);
+
+    /* NaN is passed through like CLAMP() does */
+    _mm_storeu_ps(buf + i, _mm_max_ps(min, _mm_min_ps(max, f)));
+  }
+
+  process_buffer_float(buf + i, samples - i);
+}
+
+/* Halve 32-bit sums rounding towards zero, like the division does. */
+ATTR_SSE2
+static inline __m128i half_epi32_sse2(__m128i sum)
+{
+  return _mm_srai_epi32(_mm_add_epi32(sum, _mm_srli_epi32(sum, 31)), 1);
+}
+
+ATTR_SSE2
+static void mix_mono_s8_sse2(int8_t *buf, int channels, size_t samples)
+{
+  const __m128i ones = _mm_set1_epi16(1);
+  size_t i;
+
+  if(channels != 2)
+  {
+    mix_mono_s8(buf, channels, samples);
     return;
+  }
 
-  while(i < samples)
+  for(i=0; i+16<=samples; i+=16)
   {
-    int64_t mono = 0;
+    __m128i v = _mm_loadu_si128((__m128i *)(buf + i));
+    __m128i lo = _mm_srai_epi16(_mm_unpacklo_epi8(v, v), 8);
+    __m128i hi = _mm_srai_epi16(_mm_unpackhi_epi8(v, v), 8);
+
+    /* sum the channels of each frame */
+    lo = half_epi32_sse2(_mm_madd_epi16(lo, ones));
+    hi = half_epi32_sse2(_mm_madd_epi16(hi, ones));
+    v = _mm_packs_epi32(lo, hi);
+
+    /* and put the result in both bytes of the frame */
+    v = _mm_or_si128(_mm_and_si128(v, _mm_set1_epi16(0xff)),
+        _mm_slli_epi16(v, 8));
+    _mm_storeu_si128((__m128i *)(buf + i), v);
+  }
 
-    for(c=0; c<channels; c++)
-      mono += *buf++;
+  mix_mono_s8(buf + i, channels, samples - i);
+}
 
-    buf-=channels;
+ATTR_SSE2
+static void mix_mono_s16_sse2(int16_t *buf, int channels, size_t samples)
+{
+  const __m128i ones = _mm_set1_epi16(1);
+  size_t i;
 
-    mono /= channels;
-    mono = CLAMP(S24_MIN, mono, S24_MAX);
+  if(channels != 2)
+  {
+    mix_mono_s16(buf, channels, samples);
+    return;
+  }
 
-    for(c=0; c<channels; c++)
-      *buf++ = (int32_t)mono;
+  for(i=0; i+8<=samples; i+=8)
+  {
+    __m128i v = _mm_loadu_si128((__m128i *)(buf + i));
 
-    i+=channels;
+    v = half_epi32_sse2(_mm_madd_epi16(v, ones));
+    v = _mm_or_si128(_mm_and_si128(v, _mm_set1_epi32(0xffff)),
+        _mm_slli_epi32(v, 16));
+    _mm_storeu_si128((__m128i *)(buf + i), v);
   }
+
+  mix_mono_s16(buf + i, channels, samples - i);
 }
 
-static void mix_mono_u32(uint32_t *buf, int channels, size_t samples)
+/* Average of the two 32-bit samples of each frame without overflowing,
+ * rounded towards zero. */
+ATTR_SSE2
+static inline __m128i mono_epi32_sse2(__m128i v)
 {
-  int c;
-  size_t i = 0;
+  __m128i other = _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1));
+  __m128i diff = _mm_xor_si128(v, other);
+  __m128i avg = _mm_add_epi32(_mm_and_si128(v, other), _mm_srai_epi32(diff, 1));
+  __m128i odd = _mm_and_si128(diff, _mm_set1_epi32(1));
 
-  debug ("making mono");
+  return _mm_add_epi32(avg, _mm_and_si128(odd, _mm_srli_epi32(avg, 31)));
+}
 
-  assert (channels > 1);
+ATTR_SSE2
+static void mix_mono_s24_sse2(int32_t *buf, int channels, size_t samples)
+{
+  size_t i;
 
-  while(i < samples)
+  if(channels != 2)
   {
-    int64_t mono = 0;
+    mix_mono_s24(buf, channels, samples);
+    return;
+  }
 
-    for(c=0; c<channels; c++)
-      mono += *buf++;
+  for(i=0; i+4<=samples; i+=4)
+  {
+    __m128i v = _mm_loadu_si128((__m128i *)(buf + i));
 
-    buf-=channels;
+    _mm_storeu_si128((__m128i *)(buf + i), mono_epi32_sse2(v));
+  }
 
-    mono /= channels;
-    mono = MIN(mono, UINT32_MAX);  // can't be negative
+  mix_mono_s24(buf + i, channels, samples - i);
+}
 
-    for(c=0; c<channels; c++)
-      *buf++ = (uint32_t)mono;
+ATTR_SSE2
+static void mix_mono_s32_sse2(int32_t *buf, int channels, size_t samples)
+{
+  size_t i;
 
-    i+=channels;
+  if(channels != 2)
+  {
+    mix_mono_s32(buf, channels, samples);
+    return;
+  }
+
+  for(i=0; i+4<=samples; i+=4)
+  {
+    __m128i v = _mm_loadu_si128((__m128i *)(buf + i));
+
+    _mm_storeu_si128((__m128i *)(buf + i), mono_epi32_sse2(v));
   }
+
+  mix_mono_s32(buf + i, channels, samples - i);
 }
 
-static void mix_mono_s32(int32_t *buf, int channels, size_t samples)
+ATTR_SSE2
+static void mix_mono_float_sse2(float *buf, int channels, size_t samples)
 {
-  int c;
-  size_t i = 0;
+  const __m128 half = _mm_set1_ps(0.5f);
+  const __m128 min = _mm_set1_ps(-1.0f);
+  const __m128 max = _mm_set1_ps(1.0f);
+  size_t i;
 
-  debug ("making mono");
+  if(channels != 2)
+  {
+    mix_mono_float(buf, channels, samples);
+    return;
+  }
 
-  assert (channels > 1);
+  for(i=0; i+4<=samples; i+=4)
+  {
+    __m128 v = _mm_loadu_ps(buf + i);
 
-  while(i < samples)
+    v = _mm_add_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1)));
+    v = _mm_mul_ps(v, half);
+    _mm_storeu_ps(buf + i, _mm_max_ps(min, _mm_min_ps(max, v)));
+  }
+
+  mix_mono_float(buf + i, channels, samples - i);
+}
+
+#endif /* HAVE_SIMD_X86 */
+
+#ifdef HAVE_NEON
+
+/* Multiply 8 16-bit samples by the fixed point gain, saturating. */
+static inline int16x8_t gain_s16_neon(int16x8_t v, int16x4_t gain)
+{
+  int32x4_t lo = vmull_s16(vget_low_s16(v), gain);
+  int32x4_t hi = vmull_s16(vget_high_s16(v), gain);
+
+  return vcombine_s16(vqshrn_n_s32(lo, SOFTMIXER_GAIN_SHIFT),
+      vqshrn_n_s32(hi, SOFTMIXER_GAIN_SHIFT));
+}
+
+static void process_buffer_s8_neon(int8_t *buf, size_t samples)
+{
+  const int16x4_t gain = vdup_n_s16(mixer_gain);
+  size_t i;
+
+  for(i=0; i+16<=samples; i+=16)
   {
-    int64_t mono = 0;
+    int8x16_t v = vld1q_s8(buf + i);
+    int16x8_t lo = gain_s16_neon(vmovl_s8(vget_low_s8(v)), gain);
+    int16x8_t hi = gain_s16_neon(vmovl_s8(vget_high_s8(v)), gain);
 
-    for(c=0; c<channels; c++)
-      mono += *buf++;
+    vst1q_s8(buf + i, vcombine_s8(vqmovn_s16(lo), vqmovn_s16(hi)));
+  }
 
-    buf-=channels;
+  process_buffer_s8(buf + i, samples - i);
+}
 
-    mono /= channels;
-    mono = CLAMP(INT32_MIN, mono, INT32_MAX);
+static void process_buffer_s16_neon(int16_t *buf, size_t samples)
+{
+  const int16x4_t gain = vdup_n_s16(mixer_gain);
+  size_t i;
 
-    for(c=0; c<channels; c++)
-      *buf++ = (int32_t)mono;
+  for(i=0; i+8<=samples; i+=8)
+    vst1q_s16(buf + i, gain_s16_neon(vld1q_s16(buf + i), gain));
 
-    i+=channels;
+  process_buffer_s16(buf + i, samples - i);
+}
+
+static void process_buffer_s24_neon(int32_t *buf, size_t samples)
+{
+  const float32x4_t min = vdupq_n_f32(S24_MIN);
+  const float32x4_t max = vdupq_n_f32(S24_MAX);
+  size_t i;
+
+  for(i=0; i+4<=samples; i+=4)
+  {
+    float32x4_t f = vcvtq_f32_s32(vld1q_s32(buf + i));
+
+    f = vmaxq_f32(vminq_f32(vmulq_n_f32(f, mixer_realf), max), min);
+    vst1q_s32(buf + i, vcvtq_s32_f32(f));
   }
+
+  process_buffer_s24(buf + i, samples - i);
 }
 
-static void mix_mono_float(float *buf, int channels, size_t samples)
+/* Doubles are vectorized only in ARMv8. */
+#ifdef __aarch64__
+static inline int64x2_t gain_s64_neon(int64x2_t v)
 {
-  int c;
-  size_t i = 0;
+  const float64x2_t min = vdupq_n_f64(INT32_MIN);
+  const float64x2_t max = vdupq_n_f64(INT32_MAX);
+  float64x2_t d = vmulq_n_f64(vcvtq_f64_s64(v), mixer_reald);
 
-  debug ("making mono");
+  return vcvtq_s64_f64(vmaxq_f64(vminq_f64(d, max), min));
+}
 
-  assert (channels > 1);
+static void process_buffer_s32_neon(int32_t *buf, size_t samples)
+{
+  size_t i;
 
-  while(i < samples)
+  for(i=0; i+4<=samples; i+=4)
   {
-    float mono = 0.0f;
+    int32x4_t v = vld1q_s32(buf + i);
+    int64x2_t lo = gain_s64_neon(vmovl_s32(vget_low_s32(v)));
+    int64x2_t hi = gain_s64_neon(vmovl_s32(vget_high_s32(v)));
 
-    for(c=0; c<channels; c++)
-      mono += *buf++;
+    vst1q_s32(buf + i, vcombine_s32(vmovn_s64(lo), vmovn_s64(hi)));
+  }
 
-    buf-=channels;
+  process_buffer_s32(buf + i, samples - i);
+}
+#endif
 
-    mono /= channels;
-    mono = CLAMP(-1.0f, mono, 1.0f);
+static void process_buffer_float_neon(float *buf, size_t samples)
+{
+  const float32x4_t min = vdupq_n_f32(-1.0f);
+  const float32x4_t max = vdupq_n_f32(1.0f);
+  size_t i;
 
-    for(c=0; c<channels; c++)
-      *buf++ = mono;
+  for(i=0; i+4<=samples; i+=4)
+  {
+    float32x4_t f = vmulq_n_f32(vld1q_f32(buf + i), mixer_realf);
 
-    i+=channels;
+    vst1q_f32(buf + i, vmaxq_f32(vminq_f32(f, max), min));
   }
+
+  process_buffer_float(buf + i, samples - i);
+}
+
+/* Halve sums rounding towards zero, like the division does. */
+static inline int16x8_t half_s16_neon(int16x8_t sum)
+{
+  uint16x8_t neg = vshrq_n_u16(vreinterpretq_u16_s16(sum), 15);
+
+  return vshrq_n_s16(vaddq_s16(sum, vreinterpretq_s16_u16(neg)), 1);
+}
+
+static inline int32x4_t half_s32_neon(int32x4_t sum)
+{
+  uint32x4_t neg = vshrq_n_u32(vreinterpretq_u32_s32(sum), 31);
+
+  return vshrq_n_s32(vaddq_s32(sum, vreinterpretq_s32_u32(neg)), 1);
+}
+
+static inline int64x2_t half_s64_neon(int64x2_t sum)
+{
+  uint64x2_t neg = vshrq_n_u64(vreinterpretq_u64_s64(sum), 63);
+
+  return vshrq_n_s64(vaddq_s64(sum, vreinterpretq_s64_u64(neg)), 1);
+}
+
+static void mix_mono_s8_neon(int8_t *buf, int channels, size_t samples)
+{
+  size_t i;
+
+  if(channels != 2)
+  {
+    mix_mono_s8(buf, channels, samples);
+    return;
+  }
+
+  for(i=0; i+32<=samples; i+=32)
+  {
+    int8x16x2_t v = vld2q_s8(buf + i);
+    int16x8_t lo = vaddl_s8(vget_low_s8(v.val[0]), vget_low_s8(v.val[1]));
+    int16x8_t hi = vaddl_s8(vget_high_s8(v.val[0]), vget_high_s8(v.val[1]));
+
+    v.val[0] = vcombine_s8(vmovn_s16(half_s16_neon(lo)),
+        vmovn_s16(half_s16_neon(hi)));
+    v.val[1] = v.val[0];
+    vst2q_s8(buf + i, v);
+  }
+
+  mix_mono_s8(buf + i, channels, samples - i);
+}
+
+static void mix_mono_s16_neon(int16_t *buf, int channels, size_t samples)
+{
+  size_t i;
+
+  if(channels != 2)
+  {
+    mix_mono_s16(buf, channels, samples);
+    return;
+  }
+
+  for(i=0; i+16<=samples; i+=16)
+  {
+    int16x8x2_t v = vld2q_s16(buf + i);
+    int32x4_t lo = vaddl_s16(vget_low_s16(v.val[0]), vget_low_s16(v.val[1]));
+    int32x4_t hi = vaddl_s16(vget_high_s16(v.val[0]), vget_high_s16(v.val[1]));
+
+    v.val[0] = vcombine_s16(vmovn_s32(half_s32_neon(lo)),
+        vmovn_s32(half_s32_neon(hi)));
+    v.val[1] = v.val[0];
+    vst2q_s16(buf + i, v);
+  }
+
+  mix_mono_s16(buf + i, channels, samples - i);
+}
+
+/* Stereo to mono for 24 and 32-bit samples, the sums are 64-bit. */
+static void mix_mono_s32x2_neon(int32_t *buf, size_t samples)
+{
+  size_t i;
+
+  for(i=0; i+8<=samples; i+=8)
+  {
+    int32x4x2_t v = vld2q_s32(buf + i);
+    int64x2_t lo = vaddl_s32(vget_low_s32(v.val[0]), vget_low_s32(v.val[1]));
+    int64x2_t hi = vaddl_s32(vget_high_s32(v.val[0]), vget_high_s32(v.val[1]));
+
+    v.val[0] = vcombine_s32(vmovn_s64(half_s64_neon(lo)),
+        vmovn_s64(half_s64_neon(hi)));
+    v.val[1] = v.val[0];
+    vst2q_s32(buf + i, v);
+  }
+}
+
+static void mix_mono_s24_neon(int32_t *buf, int channels, size_t samples)
+{
+  size_t done = samples & ~(size_t)7;
+
+  if(channels != 2)
+  {
+    mix_mono_s24(buf, channels, samples);
+    return;
+  }
+
+  mix_mono_s32x2_neon(buf, done);
+  mix_mono_s24(buf + done, channels, samples - done);
+}
+
+static void mix_mono_s32_neon(int32_t *buf, int channels, size_t samples)
+{
+  size_t done = samples & ~(size_t)7;
+
+  if(channels != 2)
+  {
+    mix_mono_s32(buf, channels, samples);
+    return;
+  }
+
+  mix_mono_s32x2_neon(buf, done);
+  mix_mono_s32(buf + done, channels, samples - done);
+}
+
+static void mix_mono_float_neon(float *buf, int channels, size_t samples)
+{
+  const float32x4_t min = vdupq_n_f32(-1.0f);
+  const float32x4_t max = vdupq_n_f32(1.0f);
+  size_t i;
+
+  if(channels != 2)
+  {
+    mix_mono_float(buf, channels, samples);
+    return;
+  }
+
+  for(i=0; i+8<=samples; i+=8)
+  {
+    float32x4x2_t v = vld2q_f32(buf + i);
+    float32x4_t mono = vmulq_n_f32(vaddq_f32(v.val[0], v.val[1]), 0.5f);
+
+    v.val[0] = vmaxq_f32(vminq_f32(mono, max), min);
+    v.val[1] = v.val[0];
+    vst2q_f32(buf + i, v);
+  }
+
+  mix_mono_float(buf + i, channels, samples - i);
+}
+
+#endif /* HAVE_NEON */
+
+/* Use the SIMD functions if the CPU supports them. */
+static void softmixer_select_kernels()
+{
+#if defined(HAVE_SIMD_X86) || defined(HAVE_NEON)
+  int features = simd_features();
+#endif
+
+#ifdef HAVE_SIMD_X86
+  if(features & SIMD_SSE2)
+  {
+    kernels.gain_s8 = process_buffer_s8_sse2;
+    kernels.gain_s16 = process_buffer_s16_sse2;
+    kernels.gain_s24 = process_buffer_s24_sse2;
+    kernels.gain_s32 = process_buffer_s32_sse2;
+    kernels.gain_float = process_buffer_float_sse2;
+    kernels.mono_s8 = mix_mono_s8_sse2;
+    kernels.mono_s16 = mix_mono_s16_sse2;
+    kernels.mono_s24 = mix_mono_s24_sse2;
+    kernels.mono_s32 = mix_mono_s32_sse2;
+    kernels.mono_float = mix_mono_float_sse2;
+  }
+#endif
+
+#ifdef HAVE_NEON
+  if(features & SIMD_NEON)
+  {
+    kernels.gain_s8 = process_buffer_s8_neon;
+    kernels.gain_s16 = process_buffer_s16_neon;
+    kernels.gain_s24 = process_buffer_s24_neon;
+#ifdef __aarch64__
+    kernels.gain_s32 = process_buffer_s32_neon;
+#endif
+    kernels.gain_float = process_buffer_float_neon;
+    kernels.mono_s8 = mix_mono_s8_neon;
+    kernels.mono_s16 = mix_mono_s16_neon;
+    kernels.mono_s24 = mix_mono_s24_neon;
+    kernels.mono_s32 = mix_mono_s32_neon;
+    kernels.mono_float = mix_mono_float_neon;
+  }
+#endif
 }
@@ -27,6 +27,7 @@ void softmixer_shutdown();
 
 int softmixer_get_value();
 void softmixer_set_value(const int val);
+float softmixer_get_gain();
 
 int softmixer_is_active();
 void softmixer_set_active(int act);
@@ -34,7 +35,7 @@ void softmixer_set_active(int act);
 int softmixer_is_mono();
 void softmixer_set_mono(int mono);
 
-void softmixer_process_buffer(char *buf, const size_t size, const struct sound_params *sound_params);
+void softmixer_process_buffer(char *buf, const size_t size, const struct sound_params *sound_params, const int apply_gain);
 
 #ifdef __cplusplus
 }
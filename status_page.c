@@ -0,0 +1,209 @@
+/*
+ * MOC - music on console
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+/* Status page: the server keeps the player status in a memory-mapped file,
+ * so clients which only poll it (mocp -i, -Q, status bars) read it without
+ * connecting to the server.  Updates are protected by a sequence counter
+ * (seqlock), readers never block the server. */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <assert.h>
+#include <signal.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#define DEBUG
+
+#include "common.h"
+#include "log.h"
+#include "files.h"
+#include "protocol.h"
+#include "status_page.h"
+
+/* How many times to retry copying the page being updated. */
+#define READ_TRIES	1000
+
+static struct status_page *page = NULL;
+
+/* Serializes the writers. */
+static pthread_mutex_t page_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+/* Create the status page, on error the server works without it. */
+void status_page_init ()
+{
+	char *fname = create_file_name (STATUS_PAGE_NAME);
+	void *mem;
+	int fd;
+
+	assert (page == NULL);
+
+	/* Don't truncate the file, it can be mapped by a client. */
+	fd = open (fname, O_RDWR | O_CREAT, 0600);
+	if (fd == -1) {
+		log_errno ("Can't create the status page", errno);
+		return;
+	}
+
+	if (ftruncate(fd, sizeof(struct status_page)) == -1) {
+		log_errno ("Can't set the size of the status page", errno);
+		close (fd);
+		return;
+	}
+
+	mem = mmap (NULL, sizeof(struct status_page), PROT_READ | PROT_WRITE,
+			MAP_SHARED, fd, 0);
+	close (fd);
+	if (mem == MAP_FAILED) {
+		log_errno ("Can't map the status page", errno);
+		return;
+	}
+
+	page = (struct status_page *)mem;
+
+	/* The counter is left from the previous server, make it odd. */
+	__atomic_store_n (&page->seq, page->seq | 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence (__ATOMIC_RELEASE);
+
+	memset ((char *)page + offsetof(struct status_page, pid), 0,
+			sizeof(struct status_page)
+			- offsetof(struct status_page, pid));
+	page->magic = STATUS_PAGE_MAGIC;
+	page->version = STATUS_PAGE_VERSION;
+	page->pid = getpid ();
+	page->state = STATE_STOP;
+	page->time = -1;
+	page->track = -1;
+
+	__atomic_store_n (&page->seq, page->seq + 1, __ATOMIC_RELEASE);
+
+	logit ("Status page created");
+}
+
+void status_page_cleanup ()
+{
+	if (!page)
+		return;
+
+	LOCK (page_mtx);
+	__atomic_store_n (&page->magic, 0, __ATOMIC_RELEASE);
+	munmap (page, sizeof(struct status_page));
+	page = NULL;
+	UNLOCK (page_mtx);
+
+	unlink (create_file_name(STATUS_PAGE_NAME));
+}
+
+/* Start updating the page, return NULL if there is no page.  The fields
+ * can be changed until status_page_end() is called. */
+struct status_page *status_page_begin ()
+{
+	LOCK (page_mtx);
+
+	if (!page) {
+		UNLOCK (page_mtx);
+		return NULL;
+	}
+
+	__atomic_store_n (&page->seq, page->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence (__ATOMIC_RELEASE);
+
+	return page;
+}
+
+void status_page_end ()
+{
+	assert (page != NULL);
+
+	__atomic_store_n (&page->seq, page->seq + 1, __ATOMIC_RELEASE);
+	UNLOCK (page_mtx);
+}
+
+/* Copy the page the server is updating.  Return 0 if it's not available. */
+static int copy_page (const struct status_page *p, struct status_page *copy)
+{
+	int i;
+
+	for (i = 0; i < READ_TRIES; i++) {
+		uint32_t seq;
+
+		seq = __atomic_load_n (&p->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1) {
+			sched_yield ();
+			continue;
+		}
+
+		memcpy (copy, p, sizeof(struct status_page));
+		__atomic_thread_fence (__ATOMIC_ACQUIRE);
+
+		if (__atomic_load_n (&p->seq, __ATOMIC_RELAXED) == seq)
+			return 1;
+	}
+
+	logit ("The status page is being updated for too long");
+
+	return 0;
+}
+
+/* Read the status published by the server.  Return 0 if the server is not
+ * running or doesn't publish it. */
+int status_page_read (struct status_page *copy)
+{
+	const struct status_page *p;
+	struct stat st;
+	void *mem;
+	int fd, res;
+
+	fd = open (create_file_name(STATUS_PAGE_NAME), O_RDONLY);
+	if (fd == -1)
+		return 0;
+
+	if (fstat(fd, &st) == -1
+			|| st.st_size < (off_t)sizeof(struct status_page)) {
+		close (fd);
+		return 0;
+	}
+
+	mem = mmap (NULL, sizeof(struct status_page), PROT_READ, MAP_SHARED,
+			fd, 0);
+	close (fd);
+	if (mem == MAP_FAILED)
+		return 0;
+
+	p = (const struct status_page *)mem;
+	res = copy_page (p, copy);
+	munmap (mem, sizeof(struct status_page));
+
+	if (!res || copy->magic != STATUS_PAGE_MAGIC
+			|| copy->version != STATUS_PAGE_VERSION)
+		return 0;
+
+	/* The server could have been killed. */
+	if (kill(copy->pid, 0) == -1 && errno != EPERM)
+		return 0;
+
+	copy->file[STATUS_PAGE_STR - 1] = 0;
+	copy->title[STATUS_PAGE_STR - 1] = 0;
+	copy->artist[STATUS_PAGE_STR - 1] = 0;
+	copy->album[STATUS_PAGE_STR - 1] = 0;
+
+	return 1;
+}
@@ -0,0 +1,61 @@
+#ifndef STATUS_PAGE_H
+#define STATUS_PAGE_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Name of the status page file in the MOC directory. */
+#define STATUS_PAGE_NAME	"status"
+
+#define STATUS_PAGE_MAGIC	0x53434f4d	/* "MOCS" */
+#define STATUS_PAGE_VERSION	2
+
+/* Size of the string fields, longer strings are truncated. */
+#define STATUS_PAGE_STR		4096
+
+/* The player status published by the server for clients which only poll
+ * it.  Map the file read-only and copy the page: seq is odd while the
+ * server updates it, so the copy is valid if seq was even and the same
+ * before and after copying.  Strings are NUL-terminated, the empty string
+ * means no value. */
+struct status_page
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t seq;
+	int32_t pid;		/* PID of the server */
+	int32_t state;		/* STATE_PLAY, STATE_STOP or STATE_PAUSE */
+	int32_t ctime;		/* position in the file in seconds */
+	int32_t bitrate;	/* current bitrate in kbps */
+	int32_t avg_bitrate;	/* average bitrate in kbps */
+	int32_t rate;		/* sample rate in kHz */
+	int32_t channels;
+	int32_t tags_serial;	/* changed when the file or tags change */
+	int32_t xruns;		/* times the output ran out of sound */
+	char file[STATUS_PAGE_STR];
+
+	/* Tags of the current file or stream. */
+	int32_t time;		/* duration or -1 */
+	int32_t track;		/* track number or -1 */
+	char title[STATUS_PAGE_STR];
+	char artist[STATUS_PAGE_STR];
+	char album[STATUS_PAGE_STR];
+};
+
+/* Used by the server. */
+void status_page_init ();
+void status_page_cleanup ();
+struct status_page *status_page_begin ();
+void status_page_end ();
+
+/* Used by the client. */
+int status_page_read (struct status_page *copy);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -17,6 +17,7 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <stdio.h>
 #include <errno.h>
 #include <sys/types.h>
@@ -25,17 +26,6 @@
 #include <unistd.h>
 #include <dirent.h>
 
-#ifdef HAVE_DB_H
-# ifndef HAVE_U_INT
-typedef unsigned char u_char;
-typedef unsigned short u_short;
-typedef unsigned int u_int;
-typedef unsigned long int u_long;
-# endif
-# include <db.h>
-# define STRERROR_FN bdb_strerror
-#endif
-
 #define DEBUG
 
 #include "common.h"
@@ -44,18 +34,10 @@ typedef unsigned long int u_long;
 #include "rbtree.h"
 #include "files.h"
 #include "tags_cache.h"
+#include "tags_cache_backend.h"
 #include "log.h"
 #include "audio.h"
 
-#ifdef HAVE_DB_H
-# define DB_ONLY
-#else
-# define DB_ONLY ATTR_UNUSED
-#endif
-
-/* The name of the tags database in the cache directory. */
-#define TAGS_DB "tags.db"
-
 /* The name of the version tag file in the cache directory. */
 #define MOC_VERSION_TAG "moc_version_tag"
 
@@ -63,7 +45,7 @@ typedef unsigned long int u_long;
 #define VERSION_TAG_MAX 64
 
 /* Number used to create cache version tag to detect incompatibilities
- * between cache version stored on the disk and MOC/BerkeleyDB environment.
+ * between cache version stored on the disk and MOC/cache backend.
  *
  * If you modify the DB structure, increase this number.  You can also
  * temporarily set it to zero to disable cache activity during structural
@@ -75,12 +57,25 @@ typedef unsigned long int u_long;
  * disables flushing. */
 #define DB_SYNC_COUNT 5
 
+/* Number of locks for the records, a record is protected by the lock
+ * selected by its key's hash. */
+#define RECORD_LOCKS 64
+
+/* One request queue for each client and one for the server. */
+#define REQUEST_QUEUES	(CLIENTS_MAX + 1)
+
+/* When the cache is full, remove this fraction of it at once, so we don't
+ * have to do it on every addition. */
+#define GC_FRACTION 10
+
 /* Element of a requests queue. */
 struct request_queue_node
 {
 	struct request_queue_node *next;
 	char *file; /* file that this request is for (malloc()ed) */
 	int tags_sel; /* which tags to read (TAGS_*) */
+	int bulk; /* answer with tags_bulk_response() */
+	int urgent; /* visible to the user, read before other requests */
 };
 
 struct request_queue
@@ -89,25 +84,45 @@ struct request_queue
 	struct request_queue_node *tail;
 };
 
+/* Element of the list of files in the cache ordered by the access time,
+ * used to find the least recently used ones without reading the whole
+ * database. */
+struct lru_node
+{
+	struct lru_node *prev; /* more recently used */
+	struct lru_node *next; /* less recently used */
+	char *file;
+	time_t atime;
+};
+
 struct tags_cache
 {
-	/* BerkeleyDB's stuff for storing cache. */
-#ifdef HAVE_DB_H
-	DB_ENV *db_env;
-	DB *db;
-	u_int32_t locker;
-#endif
+	/* Storage of the cache, NULL if caching is disabled. */
+	const struct tags_cache_backend *backend;
+	void *store;
+	pthread_mutex_t record_locks[RECORD_LOCKS];
+
+	/* Files in the database, the most recently used first. */
+	struct lru_node *lru_head;
+	struct lru_node *lru_tail;
+	struct rb_tree *lru_tree; /* lru_node by the file name */
+	int nitems;
+	pthread_mutex_t lru_mutex; /* mutex for the LRU list */
 
 	int max_items;		/* maximum number of items in the cache. */
-	struct request_queue queues[CLIENTS_MAX]; /* requests queues for each
-						     client */
-	int stop_reader_thread; /* request for stopping read thread (if
+	struct request_queue queues[REQUEST_QUEUES]; /* requests queues for
+							 each client */
+	int curr_queue; /* index of the queue from where the next request
+			   will be taken */
+	int sync_count; /* updates since the last DB sync */
+	int stop_reader_thread; /* request for stopping read threads (if
 				   non-zero) */
 	pthread_cond_t request_cond; /* condition for signalizing new
 					requests */
-	pthread_mutex_t mutex; /* mutex for all above data (except db because
-				  it's thread-safe) */
-	pthread_t reader_thread; /* tid of the reading thread */
+	pthread_mutex_t mutex; /* mutex for all above data (except the store
+				  because it's thread-safe) */
+	pthread_t *reader_threads; /* tids of the reading threads */
+	int readers_num;
 };
 
 struct cache_record
@@ -117,21 +132,6 @@ struct cache_record
 	struct file_tags *tags;
 };
 
-/* BerkleyDB-provided error code to description function wrapper. */
-#ifdef HAVE_DB_H
-static inline char *bdb_strerror (int errnum)
-{
-	char *result;
-
-	if (errnum > 0)
-		result = xstrerror (errnum);
-	else
-		result = xstrdup (db_strerror (errnum));
-
-	return result;
-}
-#endif
-
 static void request_queue_init (struct request_queue *q)
 {
 	assert (q != NULL);
@@ -181,7 +181,7 @@ static void request_queue_clear_up_to (struct request_queue *q,
 }
 
 static void request_queue_add (struct request_queue *q, const char *file,
-                                                            int tags_sel)
+                               int tags_sel, int bulk)
 {
 	assert (q != NULL);
 
@@ -201,9 +201,43 @@ static void request_queue_add (struct request_queue *q, const char *file,
 
 	q->tail->file = xstrdup (file);
 	q->tail->tags_sel = tags_sel;
+	q->tail->bulk = bulk;
+	q->tail->urgent = 0;
 	q->tail->next = NULL;
 }
 
+/* Add the request after other urgent requests at the beginning of the
+ * queue. */
+static void request_queue_add_urgent (struct request_queue *q,
+                                      const char *file, int tags_sel)
+{
+	struct request_queue_node *n, *prev = NULL;
+
+	assert (q != NULL);
+
+	for (n = q->head; n && n->urgent; n = n->next)
+		prev = n;
+
+	n = (struct request_queue_node *)xmalloc (
+			sizeof(struct request_queue_node));
+	n->file = xstrdup (file);
+	n->tags_sel = tags_sel;
+	n->bulk = 1;
+	n->urgent = 1;
+
+	if (prev) {
+		n->next = prev->next;
+		prev->next = n;
+	}
+	else {
+		n->next = q->head;
+		q->head = n;
+	}
+
+	if (!n->next)
+		q->tail = n;
+}
+
 static int request_queue_empty (const struct request_queue *q)
 {
 	assert (q != NULL);
@@ -212,8 +246,10 @@ static int request_queue_empty (const struct request_queue *q)
 }
 
 /* Get the file name of the first element in the queue or NULL if the queue is
- * empty. Put tags to be read in *tags_sel. Returned memory is malloc()ed. */
-static char *request_queue_pop (struct request_queue *q, int *tags_sel)
+ * empty. Put tags to be read in *tags_sel and the way to answer in *bulk.
+ * Returned memory is malloc()ed. */
+static char *request_queue_pop (struct request_queue *q, int *tags_sel,
+                                int *bulk)
 {
 	struct request_queue_node *n;
 	char *file;
@@ -227,6 +263,7 @@ static char *request_queue_pop (struct request_queue *q, int *tags_sel)
 	q->head = n->next;
 	file = n->file;
 	*tags_sel = n->tags_sel;
+	*bulk = n->bulk;
 	free (n);
 
 	if (q->tail == n)
@@ -235,14 +272,11 @@ static char *request_queue_pop (struct request_queue *q, int *tags_sel)
 	return file;
 }
 
-#ifdef HAVE_DB_H
 static size_t strlen_null (const char *s)
 {
 	return s ? strlen (s) : 0;
 }
-#endif
 
-#ifdef HAVE_DB_H
 static char *cache_record_serialize (const struct cache_record *rec, int *len)
 {
 	char *buf;
@@ -301,9 +335,7 @@ static char *cache_record_serialize (const struct cache_record *rec, int *len)
 
 	return buf;
 }
-#endif
 
-#ifdef HAVE_DB_H
 static int cache_record_deserialize (struct cache_record *rec,
            const char *serialized, size_t size, int skip_tags)
 {
@@ -333,12 +365,14 @@ static int cache_record_deserialize (struct cache_record *rec,
 		if (bytes_left < sizeof(str_len)) \
 			goto err; \
 		memcpy (&str_len, p, sizeof(str_len)); \
+		bytes_left -= sizeof(str_len); \
 		p += sizeof(str_len); \
 		if (bytes_left < str_len) \
 			goto err; \
 		var = xmalloc (str_len + 1); \
 		memcpy (var, p, str_len); \
 		var[str_len] = '\0'; \
+		bytes_left -= str_len; \
 		p += str_len; \
 	} while (0)
 
@@ -376,203 +410,333 @@ err:
 	rec->tags = NULL;
 	return 0;
 }
-#endif
 
-/* Locked DB function prototype.
- * The function must not acquire or release DB locks. */
-#ifdef HAVE_DB_H
-typedef void *t_locked_fn (struct tags_cache *, const char *,
-                                      int, int, DBT *, DBT *);
-#endif
+/* Locked cache function prototype.
+ * The function must not acquire or release record locks. */
+typedef void *t_locked_fn (struct tags_cache *, const char *, int, int);
 
-/* This function ensures that a DB function takes place while holding a
- * database record lock.  It also provides an initialised database thang
- * for the key and record. */
-#ifdef HAVE_DB_H
-static void *with_db_lock (t_locked_fn fn, struct tags_cache *c,
-                           const char *file, int tags_sel, int client_id)
+/* Return the lock of the file's record. */
+static pthread_mutex_t *record_lock (struct tags_cache *c, const char *file)
 {
-	int rc;
-	void *result;
-	DB_LOCK lock;
-	DBT key, record;
+	unsigned int hash = 0;
+	const char *p;
 
-	assert (c->db_env != NULL);
+	for (p = file; *p; p++)
+		hash = hash * 31 + (unsigned char)*p;
 
-	memset (&key, 0, sizeof (key));
-	key.data = (void *) file;
-	key.size = strlen (file);
-
-	memset (&record, 0, sizeof (record));
-	record.flags = DB_DBT_MALLOC;
+	return &c->record_locks[hash % RECORD_LOCKS];
+}
 
-	rc = c->db_env->lock_get (c->db_env, c->locker, 0,
-			&key, DB_LOCK_WRITE, &lock);
-	if (rc)
-		fatal ("Can't get DB lock: %s", db_strerror (rc));
+/* This function ensures that a cache function takes place while holding
+ * the record's lock. */
+static void *with_record_lock (t_locked_fn fn, struct tags_cache *c,
+                               const char *file, int tags_sel, int client_id)
+{
+	pthread_mutex_t *lock;
+	void *result;
 
-	result = fn (c, file, tags_sel, client_id, &key, &record);
+	assert (c->store != NULL);
 
-	rc = c->db_env->lock_put (c->db_env, &lock);
-	if (rc)
-		fatal ("Can't release DB lock: %s", db_strerror (rc));
+	lock = record_lock (c, file);
 
-	if (record.data)
-		free (record.data);
+	LOCK (*lock);
+	result = fn (c, file, tags_sel, client_id);
+	UNLOCK (*lock);
 
 	return result;
 }
-#endif
 
-#ifdef HAVE_DB_H
 static void tags_cache_remove_rec (struct tags_cache *c, const char *fname)
 {
-	DBT key;
-	int ret;
-
 	assert (fname != NULL);
 
 	debug ("Removing %s from the cache...", fname);
 
-	memset (&key, 0, sizeof(key));
-	key.data = (void *)fname;
-	key.size = strlen (fname);
+	c->backend->del (c->store, fname);
+}
+
+static int lru_compare (const void *a, const void *b,
+                        const void *unused ATTR_UNUSED)
+{
+	const struct lru_node *na = (const struct lru_node *)a;
+	const struct lru_node *nb = (const struct lru_node *)b;
 
-	ret = c->db->del (c->db, NULL, &key, 0);
-	if (ret)
-		logit ("Can't remove item for %s from the cache: %s",
-				fname, db_strerror (ret));
+	return strcmp (na->file, nb->file);
 }
-#endif
 
-/* Remove the one element of the cache based on it's access time. */
-#ifdef HAVE_DB_H
-static void tags_cache_gc (struct tags_cache *c)
+static int lru_fname_compare (const void *key, const void *data,
+                              const void *unused ATTR_UNUSED)
 {
-	DBC *cur;
-	DBT key;
-	DBT serialized_cache_rec;
-	int ret;
-	char *last_referenced = NULL;
-	time_t last_referenced_atime = time (NULL) + 1;
-	int nitems = 0;
+	const char *fname = (const char *)key;
+	const struct lru_node *node = (const struct lru_node *)data;
 
-	c->db->cursor (c->db, NULL, &cur, 0);
+	return strcmp (fname, node->file);
+}
 
-	memset (&key, 0, sizeof(key));
-	memset (&serialized_cache_rec, 0, sizeof(serialized_cache_rec));
+static void lru_unlink (struct tags_cache *c, struct lru_node *node)
+{
+	if (node->prev)
+		node->prev->next = node->next;
+	else
+		c->lru_head = node->next;
 
-	key.flags = DB_DBT_MALLOC;
-	serialized_cache_rec.flags = DB_DBT_MALLOC;
+	if (node->next)
+		node->next->prev = node->prev;
+	else
+		c->lru_tail = node->prev;
 
-	while (true) {
-		struct cache_record rec;
+	node->prev = NULL;
+	node->next = NULL;
+}
 
-#if DB_VERSION_MAJOR == 4 && DB_VERSION_MINOR < 6
-		ret = cur->c_get (cur, &key, &serialized_cache_rec, DB_NEXT);
-#else
-		ret = cur->get (cur, &key, &serialized_cache_rec, DB_NEXT);
-#endif
+static void lru_push_head (struct tags_cache *c, struct lru_node *node)
+{
+	node->prev = NULL;
+	node->next = c->lru_head;
+	if (c->lru_head)
+		c->lru_head->prev = node;
+	else
+		c->lru_tail = node;
+	c->lru_head = node;
+}
 
-		if (ret != 0)
-			break;
+/* Mark the file as the most recently used, adding it to the list if it's
+ * not there. */
+static void lru_touch (struct tags_cache *c, const char *file)
+{
+	struct rb_node *x;
+	struct lru_node *node;
 
-		if (cache_record_deserialize (&rec, serialized_cache_rec.data,
-					serialized_cache_rec.size, 1)
-				&& rec.atime < last_referenced_atime) {
-			last_referenced_atime = rec.atime;
+	LOCK (c->lru_mutex);
 
-			if (last_referenced)
-				free (last_referenced);
-			last_referenced = (char *)xmalloc (key.size + 1);
-			memcpy (last_referenced, key.data, key.size);
-			last_referenced[key.size] = '\0';
-		}
+	x = rb_search (c->lru_tree, file);
+	if (!rb_is_null (x)) {
+		node = (struct lru_node *)rb_get_data (x);
+		lru_unlink (c, node);
+	}
+	else {
+		node = (struct lru_node *)xmalloc (sizeof (struct lru_node));
+		node->file = xstrdup (file);
+		rb_insert (c->lru_tree, node);
+		c->nitems += 1;
+	}
 
-		// TODO: remove objects with serialization error.
+	node->atime = time (NULL);
+	lru_push_head (c, node);
 
-		nitems++;
+	UNLOCK (c->lru_mutex);
+}
 
-		free (key.data);
-		free (serialized_cache_rec.data);
+/* Add the file to the list as the least recently used if it's not there,
+ * otherwise leave it in its place. */
+static void lru_add_unused (struct tags_cache *c, const char *file,
+                            const time_t atime)
+{
+	struct lru_node *node;
+
+	LOCK (c->lru_mutex);
+
+	if (rb_is_null (rb_search (c->lru_tree, file))) {
+		node = (struct lru_node *)xmalloc (sizeof (struct lru_node));
+		node->file = xstrdup (file);
+		node->atime = atime;
+		node->next = NULL;
+		node->prev = c->lru_tail;
+		if (c->lru_tail)
+			c->lru_tail->next = node;
+		else
+			c->lru_head = node;
+		c->lru_tail = node;
+		rb_insert (c->lru_tree, node);
+		c->nitems += 1;
 	}
 
-	if (ret != DB_NOTFOUND)
-		log_errno ("Searching for element to remove failed (cursor)", ret);
+	UNLOCK (c->lru_mutex);
+}
 
-#if DB_VERSION_MAJOR == 4 && DB_VERSION_MINOR < 6
-	cur->c_close (cur);
-#else
-	cur->close (cur);
-#endif
+static void lru_free (struct tags_cache *c)
+{
+	while (c->lru_head) {
+		struct lru_node *node = c->lru_head;
+
+		c->lru_head = node->next;
+		free (node->file);
+		free (node);
+	}
+
+	c->lru_tail = NULL;
+	c->nitems = 0;
+	rb_tree_clear (c->lru_tree);
+}
+
+static int lru_atime_cmp (const void *a, const void *b)
+{
+	const struct lru_node *na = *(const struct lru_node **)a;
+	const struct lru_node *nb = *(const struct lru_node **)b;
+
+	if (na->atime == nb->atime)
+		return 0;
+
+	return na->atime > nb->atime ? -1 : 1;
+}
+
+struct lru_load_state
+{
+	struct lru_node **nodes;
+	int nodes_num;
+	int allocated;
+};
 
-	debug ("Elements in cache: %d (limit %d)", nitems, c->max_items);
+static void lru_load_record (const char *file, size_t file_len,
+                             const char *data, size_t size, void *arg)
+{
+	struct lru_load_state *st = (struct lru_load_state *)arg;
+	struct cache_record rec;
+	struct lru_node *node;
+
+	// TODO: remove objects with serialization error.
+	if (!cache_record_deserialize (&rec, data, size, 1))
+		return;
+
+	node = (struct lru_node *)xmalloc (sizeof (struct lru_node));
+	node->file = (char *)xmalloc (file_len + 1);
+	memcpy (node->file, file, file_len);
+	node->file[file_len] = '\0';
+	node->atime = rec.atime;
 
-	if (last_referenced) {
-		if (nitems >= c->max_items)
-			tags_cache_remove_rec (c, last_referenced);
-		free (last_referenced);
+	if (st->nodes_num == st->allocated) {
+		st->allocated = st->allocated ? st->allocated * 2 : 1024;
+		st->nodes = (struct lru_node **)xrealloc (st->nodes,
+				st->allocated * sizeof (st->nodes[0]));
+	}
+	st->nodes[st->nodes_num++] = node;
+}
+
+/* Build the LRU list from the access times stored in the database. */
+static void lru_load (struct tags_cache *c)
+{
+	struct lru_load_state st;
+	int i;
+
+	st.nodes = NULL;
+	st.nodes_num = 0;
+	st.allocated = 0;
+
+	c->backend->foreach (c->store, lru_load_record, &st);
+
+	if (st.nodes_num)
+		qsort (st.nodes, st.nodes_num, sizeof (st.nodes[0]),
+		       lru_atime_cmp);
+
+	LOCK (c->lru_mutex);
+	for (i = st.nodes_num - 1; i >= 0; i--) {
+		rb_insert (c->lru_tree, st.nodes[i]);
+		lru_push_head (c, st.nodes[i]);
+	}
+	c->nitems = st.nodes_num;
+	UNLOCK (c->lru_mutex);
+
+	free (st.nodes);
+
+	debug ("Elements in cache: %d (limit %d)", st.nodes_num, c->max_items);
+}
+
+/* Remove the least recently used elements if the cache is over the limit,
+ * leaving some free space. */
+static void tags_cache_gc (struct tags_cache *c)
+{
+	struct lru_node *victims = NULL;
+	int low_water;
+
+	LOCK (c->lru_mutex);
+
+	if (c->nitems <= c->max_items) {
+		UNLOCK (c->lru_mutex);
+		return;
+	}
+
+	low_water = MAX(c->max_items - c->max_items / GC_FRACTION, 1);
+	debug ("Elements in cache: %d (limit %d), removing down to %d",
+			c->nitems, c->max_items, low_water);
+
+	while (c->nitems > low_water) {
+		struct lru_node *node = c->lru_tail;
+
+		lru_unlink (c, node);
+		rb_delete (c->lru_tree, node->file);
+		c->nitems -= 1;
+
+		node->next = victims;
+		victims = node;
+	}
+
+	UNLOCK (c->lru_mutex);
+
+	/* Don't hold the mutex while waiting for the database. */
+	while (victims) {
+		struct lru_node *node = victims;
+
+		victims = node->next;
+		tags_cache_remove_rec (c, node->file);
+		free (node->file);
+		free (node);
 	}
-	else
-		debug ("Cache empty");
 }
-#endif
 
 /* Synchronize cache every DB_SYNC_COUNT updates. */
-#ifdef HAVE_DB_H
 static void tags_cache_sync (struct tags_cache *c)
 {
-	static int sync_count = 0;
+	int sync;
 
 	if (DB_SYNC_COUNT == 0)
 		return;
 
-	sync_count += 1;
-	if (sync_count >= DB_SYNC_COUNT) {
-		sync_count = 0;
-		c->db->sync (c->db, 0);
-	}
+	LOCK (c->mutex);
+	c->sync_count += 1;
+	sync = c->sync_count >= DB_SYNC_COUNT;
+	if (sync)
+		c->sync_count = 0;
+	UNLOCK (c->mutex);
+
+	if (sync)
+		c->backend->sync (c->store);
 }
-#endif
 
-/* Add this tags object for the file to the cache. */
-#ifdef HAVE_DB_H
+/* Add this tags object for the file to the cache.  If touch is not set,
+ * the file isn't marked as recently used and atime is stored as the time
+ * it was last used. */
 static void tags_cache_add (struct tags_cache *c, const char *file,
-                                  DBT *key, struct file_tags *tags)
+                            struct file_tags *tags, const int touch,
+                            const time_t atime)
 {
 	char *serialized_cache_rec;
 	int serial_len;
 	struct cache_record rec;
-	DBT data;
-	int ret;
 
 	assert (tags != NULL);
 
 	debug ("Adding/updating cache object");
 
 	rec.mod_time = get_mtime (file);
-	rec.atime = time (NULL);
+	rec.atime = touch ? time (NULL) : atime;
 	rec.tags = tags;
 
 	serialized_cache_rec = cache_record_serialize (&rec, &serial_len);
 	if (!serialized_cache_rec)
 		return;
 
-	memset (&data, 0, sizeof(data));
-	data.data = serialized_cache_rec;
-	data.size = serial_len;
-
-	tags_cache_gc (c);
-
-	ret = c->db->put (c->db, NULL, key, &data, 0);
-	if (ret)
-		error_errno ("DB put error", ret);
+	if (c->backend->put (c->store, file, serialized_cache_rec, serial_len)) {
+		if (touch)
+			lru_touch (c, file);
+		else
+			lru_add_unused (c, file, atime);
+		tags_cache_gc (c);
+	}
 
 	tags_cache_sync (c);
 
 	free (serialized_cache_rec);
 }
-#endif
 
 /* Read time tags for a file into tags structure (or create it if NULL). */
 struct file_tags *read_missing_tags (const char *file,
@@ -599,59 +763,122 @@ struct file_tags *read_missing_tags (const char *file,
 	return tags;
 }
 
-/* Read the selected tags for this file and add it to the cache. */
-#ifdef HAVE_DB_H
-static void *locked_read_add (struct tags_cache *c, const char *file,
-                              const int tags_sel, const int client_id,
-                              DBT *key, DBT *serialized_cache_rec)
+/* Look the file up in the cache with the record lock held.  Return 1 if
+ * its tags are up to date and have all of tags_sel, 0 if the record is
+ * outdated or lacks some of them and -1 if there is none.  *tags is set
+ * to the tags which are still valid (or NULL) and *atime to the time the
+ * record was last used. */
+static int lookup_record (struct tags_cache *c, const char *file,
+                          const int tags_sel, struct file_tags **tags,
+                          time_t *atime)
 {
-	int ret;
-	struct file_tags *tags = NULL;
+	char *data;
+	size_t size;
+	struct cache_record rec;
+	int found;
 
-	assert (c->db != NULL);
+	*tags = NULL;
+	*atime = 0;
 
-	ret = c->db->get (c->db, NULL, key, serialized_cache_rec, 0);
-	if (ret && ret != DB_NOTFOUND)
-		log_errno ("Cache DB get error", ret);
+	if (!c->backend->get (c->store, file, &data, &size))
+		return -1;
+
+	found = cache_record_deserialize (&rec, data, size, 0);
+	free (data);
+	if (!found)
+		return -1;
+
+	*atime = rec.atime;
+
+	if (rec.mod_time != get_mtime (file)) {
+		debug ("Tags in the cache are outdated");
+		tags_free (rec.tags);
+		return 0;
+	}
+
+	*tags = rec.tags;
+
+	return (rec.tags->filled & tags_sel) == tags_sel ? 1 : 0;
+}
+
+/* Add the tags read without the record lock held to the cache, unless
+ * another thread has stored up to date tags with all of them meanwhile. */
+static void store_read_tags (struct tags_cache *c, const char *file,
+                             struct file_tags *tags, const int touch,
+                             const time_t atime)
+{
+	pthread_mutex_t *lock = record_lock (c, file);
+	struct file_tags *stored;
+	time_t stored_atime;
+
+	LOCK (*lock);
+
+	if (lookup_record (c, file, tags->filled, &stored, &stored_atime) == 1) {
+		debug ("Tags were added to the cache meanwhile");
+		if (touch)
+			lru_touch (c, file);
+	}
+	else
+		tags_cache_add (c, file, tags, touch, atime);
+
+	UNLOCK (*lock);
+
+	if (stored)
+		tags_free (stored);
+}
+
+/* Read the selected tags for this file and add it to the cache.  The
+ * record lock is only held for the cache lookup and update, not while
+ * the file is read, so that add_request() never waits for a decoder. */
+static struct file_tags *cache_read_add (struct tags_cache *c,
+                                         const char *file, const int tags_sel,
+                                         const int client_id)
+{
+	pthread_mutex_t *lock = record_lock (c, file);
+	struct file_tags *tags;
+	time_t atime;
+	int found;
+
+	assert (c->store != NULL);
 
 	/* If this entry is already present in the cache, we have 3 options:
 	 * we must read different tags (TAGS_*) or the tags are outdated
 	 * or this is an immediate tags read (client_id == -1) */
-	if (ret == 0) {
-		struct cache_record rec;
-
-		if (cache_record_deserialize (&rec, serialized_cache_rec->data,
-		                              serialized_cache_rec->size, 0)) {
-			time_t curr_mtime = get_mtime (file);
-
-			if (rec.mod_time != curr_mtime) {
-				debug ("Tags in the cache are outdated");
-				tags_free (rec.tags);  /* remove them and reread tags */
-			}
-			else if ((rec.tags->filled & tags_sel) == tags_sel
-					&& client_id == -1) {
-				debug ("Tags are in the cache.");
-				return rec.tags;
-			}
-			else {
-				debug ("Tags in the cache are not what we want");
-				tags = rec.tags;  /* read additional tags */
-			}
-		}
+	LOCK (*lock);
+	found = lookup_record (c, file, tags_sel, &tags, &atime);
+	if (found == 1 && client_id == -1) {
+		debug ("Tags are in the cache.");
+		lru_touch (c, file);
 	}
+	UNLOCK (*lock);
+
+	if (found == 1 && client_id == -1)
+		return tags;
+	if (tags)
+		debug ("Tags in the cache are not what we want");
 
 	tags = read_missing_tags (file, tags, tags_sel);
-	tags_cache_add (c, file, key, tags);
+	store_read_tags (c, file, tags, 1, 0);
 
 	return tags;
 }
-#endif
+
+/* Pass the tags to the server for the client. */
+static void send_response (int client_id, const char *file,
+                           const struct file_tags *tags, int bulk)
+{
+	if (bulk)
+		tags_bulk_response (client_id, file, tags);
+	else
+		tags_response (client_id, file, tags);
+}
 
 /* Read the selected tags for this file and add it to the cache.
- * If client_id != -1, the server is notified using tags_response().
+ * If client_id != -1, the server is notified using tags_response() (or
+ * tags_bulk_response() if bulk is set).
  * If client_id == -1, copy of file_tags is returned. */
-static struct file_tags *tags_cache_read_add (struct tags_cache *c DB_ONLY,
-                     const char *file, int tags_sel, int client_id)
+static struct file_tags *tags_cache_read_add (struct tags_cache *c,
+                     const char *file, int tags_sel, int client_id, int bulk)
 {
 	struct file_tags *tags = NULL;
 
@@ -659,16 +886,13 @@ static struct file_tags *tags_cache_read_add (struct tags_cache *c DB_ONLY,
 
 	debug ("Getting tags for %s", file);
 
-#ifdef HAVE_DB_H
-	if (c->max_items)
-		tags = (struct file_tags *)with_db_lock (locked_read_add, c, file,
-		                                         tags_sel, client_id);
+	if (c->store)
+		tags = cache_read_add (c, file, tags_sel, client_id);
 	else
-#endif
 		tags = read_missing_tags (file, tags, tags_sel);
 
 	if (client_id != -1) {
-		tags_response (client_id, file, tags);
+		send_response (client_id, file, tags, bulk);
 		tags_free (tags);
 		tags = NULL;
 	}
@@ -679,11 +903,11 @@ static struct file_tags *tags_cache_read_add (struct tags_cache *c DB_ONLY,
 	return tags;
 }
 
+/* There can be several reader threads, they take requests from the queues
+ * in turn, so each client gets its share of them. */
 static void *reader_thread (void *cache_ptr)
 {
 	struct tags_cache *c;
-	int curr_queue = 0; /* index of the queue from where
-	                       we will get the next request */
 
 	logit ("Tags reader thread started");
 
@@ -694,17 +918,19 @@ static void *reader_thread (void *cache_ptr)
 	LOCK (c->mutex);
 
 	while (!c->stop_reader_thread) {
-		int i;
+		int i, curr_queue;
 		char *request_file;
-		int tags_sel = 0;
+		int tags_sel = 0, bulk = 0;
 
 		/* Find the queue with a request waiting.  Begin searching at
 		 * curr_queue: we want to get one request from each queue,
 		 * and then move to the next non-empty queue. */
+		curr_queue = c->curr_queue;
 		i = curr_queue;
-		while (i < CLIENTS_MAX && request_queue_empty (&c->queues[i]))
+		while (i < REQUEST_QUEUES
+				&& request_queue_empty (&c->queues[i]))
 			i++;
-		if (i == CLIENTS_MAX) {
+		if (i == REQUEST_QUEUES) {
 			i = 0;
 			while (i < curr_queue && request_queue_empty (&c->queues[i]))
 				i++;
@@ -717,14 +943,15 @@ static void *reader_thread (void *cache_ptr)
 		}
 		curr_queue = i;
 
-		request_file = request_queue_pop (&c->queues[curr_queue], &tags_sel);
+		request_file = request_queue_pop (&c->queues[curr_queue], &tags_sel,
+		                                  &bulk);
+		c->curr_queue = (curr_queue + 1) % REQUEST_QUEUES;
 		UNLOCK (c->mutex);
 
-		tags_cache_read_add (c, request_file, tags_sel, curr_queue);
+		tags_cache_read_add (c, request_file, tags_sel, curr_queue, bulk);
 		free (request_file);
 
 		LOCK (c->mutex);
-		curr_queue = (curr_queue + 1) % CLIENTS_MAX;
 	}
 
 	UNLOCK (c->mutex);
@@ -734,19 +961,27 @@ static void *reader_thread (void *cache_ptr)
 	return NULL;
 }
 
-struct tags_cache *tags_cache_new (size_t max_size)
+/* Create the cache with the given number of reader threads, or one per
+ * processor if it's 0. */
+struct tags_cache *tags_cache_new (size_t max_size, int readers)
 {
 	int i, rc;
 	struct tags_cache *result;
 
 	result = (struct tags_cache *)xmalloc (sizeof (struct tags_cache));
 
-#ifdef HAVE_DB_H
-	result->db_env = NULL;
-	result->db = NULL;
-#endif
+	result->backend = NULL;
+	result->store = NULL;
+	for (i = 0; i < RECORD_LOCKS; i++)
+		pthread_mutex_init (&result->record_locks[i], NULL);
+
+	result->lru_head = NULL;
+	result->lru_tail = NULL;
+	result->lru_tree = rb_tree_new (lru_compare, lru_fname_compare, NULL);
+	result->nitems = 0;
+	pthread_mutex_init (&result->lru_mutex, NULL);
 
-	for (i = 0; i < CLIENTS_MAX; i++)
+	for (i = 0; i < REQUEST_QUEUES; i++)
 		request_queue_init (&result->queues[i]);
 
 #if CACHE_DB_FORMAT_VERSION
@@ -754,6 +989,8 @@ struct tags_cache *tags_cache_new (size_t max_size)
 #else
 	result->max_items = 0;
 #endif
+	result->curr_queue = 0;
+	result->sync_count = 0;
 	result->stop_reader_thread = 0;
 	pthread_mutex_init (&result->mutex, NULL);
 
@@ -761,9 +998,20 @@ struct tags_cache *tags_cache_new (size_t max_size)
 	if (rc != 0)
 		fatal ("Can't create request_cond: %s", xstrerror (rc));
 
-	rc = pthread_create (&result->reader_thread, NULL, reader_thread, result);
-	if (rc != 0)
-		fatal ("Can't create tags cache thread: %s", xstrerror (rc));
+	if (readers <= 0)
+		readers = MAX(sysconf (_SC_NPROCESSORS_ONLN), 1);
+	logit ("Starting %d tags reader threads", readers);
+
+	result->readers_num = readers;
+	result->reader_threads = (pthread_t *)xcalloc (readers,
+			sizeof (pthread_t));
+	for (i = 0; i < readers; i++) {
+		rc = pthread_create (&result->reader_threads[i], NULL,
+				reader_thread, result);
+		if (rc != 0)
+			fatal ("Can't create tags cache thread: %s",
+					xstrerror (rc));
+	}
 
 	return result;
 }
@@ -776,41 +1024,37 @@ void tags_cache_free (struct tags_cache *c)
 
 	LOCK (c->mutex);
 	c->stop_reader_thread = 1;
-	pthread_cond_signal (&c->request_cond);
+	pthread_cond_broadcast (&c->request_cond);
 	UNLOCK (c->mutex);
 
-#ifdef HAVE_DB_H
-	if (c->db) {
-#ifndef NDEBUG
-		c->db->set_errcall (c->db, NULL);
-		c->db->set_msgcall (c->db, NULL);
-		c->db->set_paniccall (c->db, NULL);
-#endif
-		c->db->close (c->db, 0);
-		c->db = NULL;
+	/* Wait for the readers before closing the database they use. */
+	for (i = 0; i < c->readers_num; i++) {
+		rc = pthread_join (c->reader_threads[i], NULL);
+		if (rc != 0)
+			fatal ("pthread_join() on cache reader thread failed: %s",
+					xstrerror (rc));
 	}
-#endif
+	free (c->reader_threads);
 
-#ifdef HAVE_DB_H
-	if (c->db_env) {
-		c->db_env->lock_id_free (c->db_env, c->locker);
-#ifndef NDEBUG
-		c->db_env->set_errcall (c->db_env, NULL);
-		c->db_env->set_msgcall (c->db_env, NULL);
-		c->db_env->set_paniccall (c->db_env, NULL);
-#endif
-		c->db_env->close (c->db_env, 0);
-		c->db_env = NULL;
+	if (c->store) {
+		c->backend->close (c->store);
+		c->store = NULL;
 	}
-#endif
 
-	rc = pthread_join (c->reader_thread, NULL);
+	for (i = 0; i < REQUEST_QUEUES; i++)
+		request_queue_clear (&c->queues[i]);
+
+	lru_free (c);
+	rb_tree_free (c->lru_tree);
+	rc = pthread_mutex_destroy (&c->lru_mutex);
 	if (rc != 0)
-		fatal ("pthread_join() on cache reader thread failed: %s",
-		        xstrerror (rc));
+		log_errno ("Can't destroy lru_mutex", rc);
 
-	for (i = 0; i < CLIENTS_MAX; i++)
-		request_queue_clear (&c->queues[i]);
+	for (i = 0; i < RECORD_LOCKS; i++) {
+		rc = pthread_mutex_destroy (&c->record_locks[i]);
+		if (rc != 0)
+			log_errno ("Can't destroy record lock", rc);
+	}
 
 	rc = pthread_mutex_destroy (&c->mutex);
 	if (rc != 0)
@@ -822,34 +1066,29 @@ void tags_cache_free (struct tags_cache *c)
 	free (c);
 }
 
-#ifdef HAVE_DB_H
+/* Return the tags of the file if they are in the cache and up to date. */
 static void *locked_add_request (struct tags_cache *c, const char *file,
-                                 int tags_sel, int client_id,
-                                 DBT *key, DBT *serialized_cache_rec)
+                                 int tags_sel, int client_id ATTR_UNUSED)
 {
-	int db_ret;
+	char *data;
+	size_t size;
+	int found;
 	struct cache_record rec;
 
-	assert (c->db);
+	assert (c->store);
 
-	db_ret = c->db->get (c->db, NULL, key, serialized_cache_rec, 0);
-
-	if (db_ret == DB_NOTFOUND)
+	if (!c->backend->get (c->store, file, &data, &size))
 		return NULL;
 
-	if (db_ret) {
-		error_errno ("Cache DB search error", db_ret);
-		return NULL;
-	}
+	found = cache_record_deserialize (&rec, data, size, 0);
+	free (data);
 
-	if (cache_record_deserialize (&rec, serialized_cache_rec->data,
-				serialized_cache_rec->size, 0)) {
+	if (found) {
 		if (rec.mod_time == get_mtime (file)
 				&& (rec.tags->filled & tags_sel) == tags_sel) {
-			tags_response (client_id, file, rec.tags);
-			tags_free (rec.tags);
+			lru_touch (c, file);
 			debug ("Tags are present in the cache");
-			return (void *)1;
+			return rec.tags;
 		}
 
 		tags_free (rec.tags);
@@ -858,36 +1097,56 @@ static void *locked_add_request (struct tags_cache *c, const char *file,
 
 	return NULL;
 }
-#endif
 
-void tags_cache_add_request (struct tags_cache *c, const char *file,
-                                        int tags_sel, int client_id)
+static void add_request (struct tags_cache *c, const char *file,
+                         int tags_sel, int client_id, int bulk, int urgent)
 {
-	void *rc = NULL;
+	struct file_tags *tags = NULL;
 
 	assert (c != NULL);
 	assert (file != NULL);
-	assert (LIMIT(client_id, CLIENTS_MAX));
+	assert (LIMIT(client_id, REQUEST_QUEUES));
 
 	debug ("Request for tags for '%s' from client %d", file, client_id);
 
-#ifdef HAVE_DB_H
-	if (c->max_items)
-		rc = with_db_lock (locked_add_request, c, file, tags_sel, client_id);
-#endif
+	if (c->store)
+		tags = (struct file_tags *)with_record_lock (locked_add_request,
+		                                c, file, tags_sel, client_id);
 
-	if (!rc) {
-		LOCK (c->mutex);
-		request_queue_add (&c->queues[client_id], file, tags_sel);
-		pthread_cond_signal (&c->request_cond);
-		UNLOCK (c->mutex);
+	if (tags) {
+		send_response (client_id, file, tags, bulk);
+		tags_free (tags);
+		return;
 	}
+
+	LOCK (c->mutex);
+	if (urgent)
+		request_queue_add_urgent (&c->queues[client_id], file, tags_sel);
+	else
+		request_queue_add (&c->queues[client_id], file, tags_sel, bulk);
+	pthread_cond_signal (&c->request_cond);
+	UNLOCK (c->mutex);
+}
+
+void tags_cache_add_request (struct tags_cache *c, const char *file,
+                                        int tags_sel, int client_id)
+{
+	add_request (c, file, tags_sel, client_id, 0, 0);
+}
+
+/* Request from CMD_GET_FILE_TAGS_BULK, answered with tags_bulk_response().
+ * Urgent requests are for files visible to the user and go before all
+ * other requests of the client. */
+void tags_cache_add_bulk_request (struct tags_cache *c, const char *file,
+                                  int tags_sel, int client_id, int urgent)
+{
+	add_request (c, file, tags_sel, client_id, 1, urgent);
 }
 
 void tags_cache_clear_queue (struct tags_cache *c, int client_id)
 {
 	assert (c != NULL);
-	assert (LIMIT(client_id, CLIENTS_MAX));
+	assert (LIMIT(client_id, REQUEST_QUEUES));
 
 	LOCK (c->mutex);
 	request_queue_clear (&c->queues[client_id]);
@@ -901,7 +1160,7 @@ void tags_cache_clear_up_to (struct tags_cache *c, const char *file,
                                                       int client_id)
 {
 	assert (c != NULL);
-	assert (LIMIT(client_id, CLIENTS_MAX));
+	assert (LIMIT(client_id, REQUEST_QUEUES));
 	assert (file != NULL);
 
 	LOCK (c->mutex);
@@ -911,37 +1170,7 @@ void tags_cache_clear_up_to (struct tags_cache *c, const char *file,
 	UNLOCK (c->mutex);
 }
 
-#if defined(HAVE_DB_H) && !defined(NDEBUG)
-static void db_err_cb (const DB_ENV *unused ATTR_UNUSED, const char *errpfx,
-                                                         const char *msg)
-{
-	assert (msg);
-
-	if (errpfx && errpfx[0])
-		logit ("BDB said: %s: %s", errpfx, msg);
-	else
-		logit ("BDB said: %s", msg);
-}
-#endif
-
-#if defined(HAVE_DB_H) && !defined(NDEBUG)
-static void db_msg_cb (const DB_ENV *unused ATTR_UNUSED, const char *msg)
-{
-	assert (msg);
-
-	logit ("BDB said: %s", msg);
-}
-#endif
-
-#if defined(HAVE_DB_H) && !defined(NDEBUG)
-static void db_panic_cb (DB_ENV *unused ATTR_UNUSED, int errval)
-{
-	log_errno ("BDB said", errval);
-}
-#endif
-
 /* Purge content of a directory. */
-#ifdef HAVE_DB_H
 static int purge_directory (const char *dir_path)
 {
 	DIR *dir;
@@ -1014,36 +1243,33 @@ static int purge_directory (const char *dir_path)
 	closedir (dir);
 	return 1;
 }
-#endif
 
 /* Create a MOC/db version string.
  *
  * @param buf Output buffer (at least VERSION_TAG_MAX chars long)
  */
-#ifdef HAVE_DB_H
-static const char *create_version_tag (char *buf)
+static const char *create_version_tag (const struct tags_cache_backend *b,
+                                       char *buf)
 {
-	int db_major;
-	int db_minor;
+	char backend_tag[32];
 
-	db_version (&db_major, &db_minor, NULL);
+	b->version_tag (backend_tag, sizeof (backend_tag));
 
 #ifdef PACKAGE_REVISION
-	snprintf (buf, VERSION_TAG_MAX, "%d %d %d r%s",
-	          CACHE_DB_FORMAT_VERSION, db_major, db_minor, PACKAGE_REVISION);
+	snprintf (buf, VERSION_TAG_MAX, "%d %s r%s",
+	          CACHE_DB_FORMAT_VERSION, backend_tag, PACKAGE_REVISION);
 #else
-	snprintf (buf, VERSION_TAG_MAX, "%d %d %d",
-	          CACHE_DB_FORMAT_VERSION, db_major, db_minor);
+	snprintf (buf, VERSION_TAG_MAX, "%d %s",
+	          CACHE_DB_FORMAT_VERSION, backend_tag);
 #endif
 
 	return buf;
 }
-#endif
 
 /* Check version of the cache directory.  If it was created
  * using format not handled by this version of MOC, return 0. */
-#ifdef HAVE_DB_H
-static int cache_version_matches (const char *cache_dir)
+static int cache_version_matches (const char *cache_dir,
+                                  const struct tags_cache_backend *b)
 {
 	char *fname = NULL;
 	char disk_version_tag[VERSION_TAG_MAX];
@@ -1076,7 +1302,7 @@ static int cache_version_matches (const char *cache_dir)
 		if (ptr && ptr[1] == 'r')
 			*ptr = '\0';
 
-		create_version_tag (cur_version_tag);
+		create_version_tag (b, cur_version_tag);
 		ptr = strrchr (cur_version_tag, '\n');
 		if (ptr)
 			*ptr = '\0';
@@ -1092,10 +1318,9 @@ static int cache_version_matches (const char *cache_dir)
 
 	return compare_result;
 }
-#endif
 
-#ifdef HAVE_DB_H
-static void write_cache_version (const char *cache_dir)
+static void write_cache_version (const char *cache_dir,
+                                 const struct tags_cache_backend *b)
 {
 	char cur_version_tag[VERSION_TAG_MAX];
 	char *fname = NULL;
@@ -1112,7 +1337,7 @@ static void write_cache_version (const char *cache_dir)
 		return;
 	}
 
-	create_version_tag (cur_version_tag);
+	create_version_tag (b, cur_version_tag);
 	rc = fwrite (cur_version_tag, strlen (cur_version_tag), 1, f);
 	if (rc != 1)
 		logit ("Error writing cache version tag: %d", rc);
@@ -1120,14 +1345,13 @@ static void write_cache_version (const char *cache_dir)
 	free (fname);
 	fclose (f);
 }
-#endif
 
 /* Make sure that the cache directory exists and clear it if necessary. */
-#ifdef HAVE_DB_H
-static int prepare_cache_dir (const char *cache_dir)
+static int prepare_cache_dir (const char *cache_dir,
+                              const struct tags_cache_backend *b)
 {
 	if (mkdir (cache_dir, 0700) == 0) {
-		write_cache_version (cache_dir);
+		write_cache_version (cache_dir, b);
 		return 1;
 	}
 
@@ -1136,109 +1360,145 @@ static int prepare_cache_dir (const char *cache_dir)
 		return 0;
 	}
 
-	if (!cache_version_matches (cache_dir)) {
+	if (!cache_version_matches (cache_dir, b)) {
 		logit ("Tags cache directory is the wrong version, purging....");
 
 		if (!purge_directory (cache_dir))
 			return 0;
-		write_cache_version (cache_dir);
+		write_cache_version (cache_dir, b);
 	}
 
 	return 1;
 }
-#endif
 
-void tags_cache_load (struct tags_cache *c DB_ONLY,
-                      const char *cache_dir DB_ONLY)
+/* Open the cache in the directory using the named backend. */
+void tags_cache_load (struct tags_cache *c, const char *cache_dir,
+                      const char *backend_name)
 {
 	assert (c != NULL);
 	assert (cache_dir != NULL);
-
-#ifdef HAVE_DB_H
-	int ret;
+	assert (backend_name != NULL);
 
 	if (!c->max_items)
 		return;
 
-	if (!prepare_cache_dir (cache_dir)) {
+#ifdef HAVE_DB_H
+	if (!strcasecmp (backend_name, tags_cache_bdb_backend.name))
+		c->backend = &tags_cache_bdb_backend;
+	else
+#endif
+	{
+		if (strcasecmp (backend_name, tags_cache_native_backend.name))
+			logit ("Tags cache backend %s not available", backend_name);
+		c->backend = &tags_cache_native_backend;
+	}
+	logit ("Using %s tags cache backend", c->backend->name);
+
+	if (!prepare_cache_dir (cache_dir, c->backend)) {
 		error ("Can't prepare cache directory!");
 		goto err;
 	}
 
-	ret = db_env_create (&c->db_env, 0);
-	if (ret) {
-		error_errno ("Can't create DB environment", ret);
+	c->store = c->backend->open (cache_dir);
+	if (!c->store)
 		goto err;
-	}
 
-#ifndef NDEBUG
-	c->db_env->set_errcall (c->db_env, db_err_cb);
-	c->db_env->set_msgcall (c->db_env, db_msg_cb);
-	ret = c->db_env->set_paniccall (c->db_env, db_panic_cb);
-	if (ret)
-		logit ("Could not set DB panic callback");
-#endif
+	lru_load (c);
 
-	ret = c->db_env->open (c->db_env, cache_dir,
-	                       DB_CREATE | DB_PRIVATE | DB_INIT_MPOOL |
-	                       DB_THREAD | DB_INIT_LOCK, 0);
-	if (ret) {
-		error ("Can't open DB environment (%s): %s",
-				cache_dir, db_strerror (ret));
-		goto err;
-	}
+	return;
 
-	ret = c->db_env->lock_id (c->db_env, &c->locker);
-	if (ret) {
-		error_errno ("Failed to get DB locker", ret);
-		goto err;
-	}
+err:
+	c->max_items = 0;
+	error ("Failed to initialise tags cache: caching disabled");
+}
 
-	ret = db_create (&c->db, c->db_env, 0);
-	if (ret) {
-		error_errno ("Failed to create cache db", ret);
-		goto err;
+/* Read the tags for the library indexer if they are missing or outdated.
+ * As in cache_read_add(), the file is read without the record lock held. */
+static int index_file (struct tags_cache *c, const char *file,
+                       const int tags_sel)
+{
+	pthread_mutex_t *lock = record_lock (c, file);
+	struct file_tags *tags;
+	time_t atime;
+	int found, full;
+
+	LOCK (*lock);
+	found = lookup_record (c, file, tags_sel, &tags, &atime);
+	UNLOCK (*lock);
+
+	if (found == 1) {
+		tags_free (tags);
+		return 0;
 	}
 
-#ifndef NDEBUG
-	c->db->set_errcall (c->db, db_err_cb);
-	c->db->set_msgcall (c->db, db_msg_cb);
-	ret = c->db->set_paniccall (c->db, db_panic_cb);
-	if (ret)
-		logit ("Could not set DB panic callback");
-#endif
+	/* An outdated record is replaced, only a new one needs room. */
+	if (found == -1) {
+		LOCK (c->lru_mutex);
+		full = c->nitems >= c->max_items;
+		UNLOCK (c->lru_mutex);
 
-	ret = c->db->open (c->db, NULL, TAGS_DB, NULL, DB_BTREE,
-	                                DB_CREATE | DB_THREAD, 0);
-	if (ret) {
-		error_errno ("Failed to open (or create) tags cache db", ret);
-		goto err;
+		if (full)
+			return -1;
 	}
 
-	return;
+	tags = read_missing_tags (file, tags, tags_sel);
+	store_read_tags (c, file, tags, 0, atime);
+	tags_free (tags);
 
-err:
-	if (c->db) {
-#ifndef NDEBUG
-		c->db->set_errcall (c->db, NULL);
-		c->db->set_msgcall (c->db, NULL);
-		c->db->set_paniccall (c->db, NULL);
-#endif
-		c->db->close (c->db, 0);
-		c->db = NULL;
+	return 1;
+}
+
+/* Make sure that the tags of the file are in the cache, but unlike other
+ * reads don't mark the file as recently used: new files are added as the
+ * least recently used ones, and not at all if the cache is full.  Return 1
+ * if the tags were read, 0 if they were already in the cache or -1 if they
+ * could not be added. */
+int tags_cache_index_file (struct tags_cache *c, const char *file,
+                           int tags_sel)
+{
+	assert (c != NULL);
+	assert (file != NULL);
+
+	if (!c->store)
+		return -1;
+
+	return index_file (c, file, tags_sel);
+}
+
+static void *locked_remove (struct tags_cache *c, const char *file,
+                            int tags_sel ATTR_UNUSED,
+                            int client_id ATTR_UNUSED)
+{
+	struct rb_node *x;
+	struct lru_node *node = NULL;
+
+	LOCK (c->lru_mutex);
+	x = rb_search (c->lru_tree, file);
+	if (!rb_is_null (x)) {
+		node = (struct lru_node *)rb_get_data (x);
+		lru_unlink (c, node);
+		rb_delete (c->lru_tree, node->file);
+		c->nitems -= 1;
 	}
-	if (c->db_env) {
-#ifndef NDEBUG
-		c->db_env->set_errcall (c->db_env, NULL);
-		c->db_env->set_msgcall (c->db_env, NULL);
-		c->db_env->set_paniccall (c->db_env, NULL);
-#endif
-		c->db_env->close (c->db_env, 0);
-		c->db_env = NULL;
+	UNLOCK (c->lru_mutex);
+
+	if (node) {
+		tags_cache_remove_rec (c, file);
+		free (node->file);
+		free (node);
 	}
-	c->max_items = 0;
-	error ("Failed to initialise tags cache: caching disabled");
-#endif
+
+	return NULL;
+}
+
+/* Remove the file's record from the cache (the file was deleted). */
+void tags_cache_remove (struct tags_cache *c, const char *file)
+{
+	assert (c != NULL);
+	assert (file != NULL);
+
+	if (c->store)
+		with_record_lock (locked_remove, c, file, 0, -1);
 }
 
 /* Immediately read tags for a file bypassing the request queue. */
@@ -1253,7 +1513,7 @@ struct file_tags *tags_cache_get_immediate (struct tags_cache *c,
 	debug ("Immediate tags read for %s", file);
 
 	if (!is_url (file))
-		tags = tags_cache_read_add (c, file, tags_sel, -1);
+		tags = tags_cache_read_add (c, file, tags_sel, -1, 0);
 	else
 		tags = tags_new ();
 
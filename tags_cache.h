@@ -9,7 +9,7 @@ struct file_tags;
 struct tags_cache;
 
 /* Administrative functions: */
-struct tags_cache *tags_cache_new (size_t max_size);
+struct tags_cache *tags_cache_new (size_t max_size, int readers);
 void tags_cache_free (struct tags_cache *c);
 
 /* Request queue manipulation functions: */
@@ -18,11 +18,17 @@ void tags_cache_clear_up_to (struct tags_cache *c, const char *file,
                                                       int client_id);
 
 /* Cache DB manipulation functions: */
-void tags_cache_load (struct tags_cache *c, const char *cache_dir);
+void tags_cache_load (struct tags_cache *c, const char *cache_dir,
+                      const char *backend_name);
 void tags_cache_add_request (struct tags_cache *c, const char *file,
                                         int tags_sel, int client_id);
+void tags_cache_add_bulk_request (struct tags_cache *c, const char *file,
+                                  int tags_sel, int client_id, int urgent);
 struct file_tags *tags_cache_get_immediate (struct tags_cache *c,
                                   const char *file, int tags_sel);
+int tags_cache_index_file (struct tags_cache *c, const char *file,
+                           int tags_sel);
+void tags_cache_remove (struct tags_cache *c, const char *file);
 
 #ifdef __cplusplus
 }
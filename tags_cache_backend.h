@@ -0,0 +1,54 @@
+#ifndef TAGS_CACHE_BACKEND_H
+#define TAGS_CACHE_BACKEND_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef void t_backend_record_fn (const char *file, size_t file_len,
+                                  const char *data, size_t size, void *arg);
+
+/* Storage of the serialized tags cache records, keyed by the file name.
+ * All functions may be called from several threads at once. */
+struct tags_cache_backend
+{
+	/* Name used in the TagsCacheBackend option. */
+	const char *name;
+
+	/* Put the backend's on-disk format version into buf. */
+	void (*version_tag) (char *buf, size_t size);
+
+	/* Open (or create) the store in the directory, return NULL on
+	 * error. */
+	void *(*open) (const char *cache_dir);
+	void (*close) (void *store);
+
+	/* Get a malloc()ed copy of the file's record, return 0 if there
+	 * is none. */
+	int (*get) (void *store, const char *file, char **data, size_t *size);
+
+	/* Add or replace the file's record, return 0 on error. */
+	int (*put) (void *store, const char *file, const char *data,
+	            size_t size);
+
+	void (*del) (void *store, const char *file);
+
+	/* Call fn for every record. */
+	void (*foreach) (void *store, t_backend_record_fn *fn, void *arg);
+
+	/* Flush the changes to disk. */
+	void (*sync) (void *store);
+};
+
+extern const struct tags_cache_backend tags_cache_native_backend;
+#ifdef HAVE_DB_H
+extern const struct tags_cache_backend tags_cache_bdb_backend;
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
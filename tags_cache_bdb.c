@@ -0,0 +1,308 @@
+/*
+ * MOC - music on console
+ * Copyright (C) 2005, 2006 Damian Pietras <daper@daper.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+/* BerkeleyDB backend of the tags cache. */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#ifdef HAVE_DB_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <sys/types.h>
+
+#ifndef HAVE_U_INT
+typedef unsigned char u_char;
+typedef unsigned short u_short;
+typedef unsigned int u_int;
+typedef unsigned long int u_long;
+#endif
+#include <db.h>
+#define STRERROR_FN bdb_strerror
+
+#define DEBUG
+
+#include "common.h"
+#include "log.h"
+#include "tags_cache_backend.h"
+
+/* The name of the tags database in the cache directory. */
+#define TAGS_DB "tags.db"
+
+struct bdb_store
+{
+	DB_ENV *db_env;
+	DB *db;
+};
+
+/* BerkleyDB-provided error code to description function wrapper. */
+static inline char *bdb_strerror (int errnum)
+{
+	char *result;
+
+	if (errnum > 0)
+		result = xstrerror (errnum);
+	else
+		result = xstrdup (db_strerror (errnum));
+
+	return result;
+}
+
+#ifndef NDEBUG
+static void db_err_cb (const DB_ENV *unused ATTR_UNUSED, const char *errpfx,
+                                                         const char *msg)
+{
+	assert (msg);
+
+	if (errpfx && errpfx[0])
+		logit ("BDB said: %s: %s", errpfx, msg);
+	else
+		logit ("BDB said: %s", msg);
+}
+
+static void db_msg_cb (const DB_ENV *unused ATTR_UNUSED, const char *msg)
+{
+	assert (msg);
+
+	logit ("BDB said: %s", msg);
+}
+
+static void db_panic_cb (DB_ENV *unused ATTR_UNUSED, int errval)
+{
+	log_errno ("BDB said", errval);
+}
+#endif
+
+static void bdb_version_tag (char *buf, size_t size)
+{
+	int db_major;
+	int db_minor;
+
+	db_version (&db_major, &db_minor, NULL);
+	snprintf (buf, size, "%d %d", db_major, db_minor);
+}
+
+static void bdb_close (void *store)
+{
+	struct bdb_store *s = (struct bdb_store *)store;
+
+	if (s->db) {
+#ifndef NDEBUG
+		s->db->set_errcall (s->db, NULL);
+		s->db->set_msgcall (s->db, NULL);
+		s->db->set_paniccall (s->db, NULL);
+#endif
+		s->db->close (s->db, 0);
+	}
+
+	if (s->db_env) {
+#ifndef NDEBUG
+		s->db_env->set_errcall (s->db_env, NULL);
+		s->db_env->set_msgcall (s->db_env, NULL);
+		s->db_env->set_paniccall (s->db_env, NULL);
+#endif
+		s->db_env->close (s->db_env, 0);
+	}
+
+	free (s);
+}
+
+static void *bdb_open (const char *cache_dir)
+{
+	struct bdb_store *s;
+	int ret;
+
+	s = (struct bdb_store *)xcalloc (1, sizeof (struct bdb_store));
+
+	ret = db_env_create (&s->db_env, 0);
+	if (ret) {
+		error_errno ("Can't create DB environment", ret);
+		goto err;
+	}
+
+#ifndef NDEBUG
+	s->db_env->set_errcall (s->db_env, db_err_cb);
+	s->db_env->set_msgcall (s->db_env, db_msg_cb);
+	ret = s->db_env->set_paniccall (s->db_env, db_panic_cb);
+	if (ret)
+		logit ("Could not set DB panic callback");
+#endif
+
+	ret = s->db_env->open (s->db_env, cache_dir,
+	                       DB_CREATE | DB_PRIVATE | DB_INIT_MPOOL |
+	                       DB_THREAD | DB_INIT_LOCK, 0);
+	if (ret) {
+		error ("Can't open DB environment (%s): %s",
+				cache_dir, db_strerror (ret));
+		goto err;
+	}
+
+	ret = db_create (&s->db, s->db_env, 0);
+	if (ret) {
+		error_errno ("Failed to create cache db", ret);
+		goto err;
+	}
+
+#ifndef NDEBUG
+	s->db->set_errcall (s->db, db_err_cb);
+	s->db->set_msgcall (s->db, db_msg_cb);
+	ret = s->db->set_paniccall (s->db, db_panic_cb);
+	if (ret)
+		logit ("Could not set DB panic callback");
+#endif
+
+	ret = s->db->open (s->db, NULL, TAGS_DB, NULL, DB_BTREE,
+	                                DB_CREATE | DB_THREAD, 0);
+	if (ret) {
+		error_errno ("Failed to open (or create) tags cache db", ret);
+		goto err;
+	}
+
+	return s;
+
+err:
+	bdb_close (s);
+	return NULL;
+}
+
+static int bdb_get (void *store, const char *file, char **data, size_t *size)
+{
+	struct bdb_store *s = (struct bdb_store *)store;
+	DBT key, record;
+	int ret;
+
+	memset (&key, 0, sizeof (key));
+	key.data = (void *) file;
+	key.size = strlen (file);
+
+	memset (&record, 0, sizeof (record));
+	record.flags = DB_DBT_MALLOC;
+
+	ret = s->db->get (s->db, NULL, &key, &record, 0);
+	if (ret) {
+		if (ret != DB_NOTFOUND)
+			log_errno ("Cache DB get error", ret);
+		return 0;
+	}
+
+	*data = record.data;
+	*size = record.size;
+
+	return 1;
+}
+
+static int bdb_put (void *store, const char *file, const char *data,
+                    size_t size)
+{
+	struct bdb_store *s = (struct bdb_store *)store;
+	DBT key, record;
+	int ret;
+
+	memset (&key, 0, sizeof (key));
+	key.data = (void *) file;
+	key.size = strlen (file);
+
+	memset (&record, 0, sizeof (record));
+	record.data = (void *) data;
+	record.size = size;
+
+	ret = s->db->put (s->db, NULL, &key, &record, 0);
+	if (ret) {
+		error_errno ("DB put error", ret);
+		return 0;
+	}
+
+	return 1;
+}
+
+static void bdb_del (void *store, const char *file)
+{
+	struct bdb_store *s = (struct bdb_store *)store;
+	DBT key;
+	int ret;
+
+	memset (&key, 0, sizeof(key));
+	key.data = (void *)file;
+	key.size = strlen (file);
+
+	ret = s->db->del (s->db, NULL, &key, 0);
+	if (ret)
+		logit ("Can't remove item for %s from the cache: %s",
+				file, db_strerror (ret));
+}
+
+static void bdb_foreach (void *store, t_backend_record_fn *fn, void *arg)
+{
+	struct bdb_store *s = (struct bdb_store *)store;
+	DBC *cur;
+	DBT key;
+	DBT serialized_cache_rec;
+	int ret;
+
+	s->db->cursor (s->db, NULL, &cur, 0);
+
+	memset (&key, 0, sizeof(key));
+	memset (&serialized_cache_rec, 0, sizeof(serialized_cache_rec));
+
+	key.flags = DB_DBT_MALLOC;
+	serialized_cache_rec.flags = DB_DBT_MALLOC;
+
+	while (true) {
+#if DB_VERSION_MAJOR == 4 && DB_VERSION_MINOR < 6
+		ret = cur->c_get (cur, &key, &serialized_cache_rec, DB_NEXT);
+#else
+		ret = cur->get (cur, &key, &serialized_cache_rec, DB_NEXT);
+#endif
+
+		if (ret != 0)
+			break;
+
+		fn (key.data, key.size, serialized_cache_rec.data,
+				serialized_cache_rec.size, arg);
+
+		free (key.data);
+		free (serialized_cache_rec.data);
+	}
+
+	if (ret != DB_NOTFOUND)
+		log_errno ("Reading the cache failed (cursor)", ret);
+
+#if DB_VERSION_MAJOR == 4 && DB_VERSION_MINOR < 6
+	cur->c_close (cur);
+#else
+	cur->close (cur);
+#endif
+}
+
+static void bdb_sync (void *store)
+{
+	struct bdb_store *s = (struct bdb_store *)store;
+
+	s->db->sync (s->db, 0);
+}
+
+const struct tags_cache_backend tags_cache_bdb_backend = {
+	"BerkeleyDB",
+	bdb_version_tag,
+	bdb_open,
+	bdb_close,
+	bdb_get,
+	bdb_put,
+	bdb_del,
+	bdb_foreach,
+	bdb_sync
+};
+
+#endif
@@ -0,0 +1,558 @@
+/*
+ * MOC - music on console
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+/* Native backend of the tags cache: one file mapped into memory.
+ *
+ * The file starts with a header and a hash table holding the offset of the
+ * newest record in each bucket, followed by the records.  Records are only
+ * appended: a replaced or removed record is marked dead and the space is
+ * reclaimed by rewriting the file when dead records take more than half of
+ * it.  The file is also rewritten with a larger hash table when there are
+ * more than MAX_LOAD records per bucket.  A record is written before it's
+ * linked into the table and records only point to older ones, so another
+ * process can read the file without locking.  It only has to remap the
+ * file when the end in the header is past its mapping and reopen it when
+ * the header says it's obsolete (replaced by a compacted file). */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#define DEBUG
+
+#include "common.h"
+#include "log.h"
+#include "tags_cache_backend.h"
+
+/* The name of the cache file in the cache directory. */
+#define NATIVE_FILE "tags.mcache"
+
+#define NATIVE_MAGIC "MOCTAGS"
+#define NATIVE_VERSION 1
+
+/* Minimal number of hash buckets, must be a power of 2. */
+#define MIN_BUCKETS 4096
+
+/* Rehash when the average chain is longer than this. */
+#define MAX_LOAD 2
+
+/* The file grows at least by this much. */
+#define GROW_SIZE (256 * 1024)
+
+/* Don't compact files smaller than this. */
+#define COMPACT_MIN (1024 * 1024)
+
+#define ALIGN8(n) (((n) + 7) & ~(size_t)7)
+
+struct native_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t buckets;	/* number of hash buckets */
+	uint64_t end;		/* end of the last record */
+	uint64_t dead;		/* bytes taken by dead records */
+	uint32_t records;	/* number of live records */
+	uint32_t obsolete;	/* was the file replaced by a compacted one? */
+};
+
+struct native_record
+{
+	uint64_t next;		/* older record in the same bucket, 0 if none */
+	uint32_t hash;
+	uint32_t dead;		/* was it replaced or removed? */
+	uint32_t key_len;
+	uint32_t data_len;
+	/* followed by the key and the data */
+};
+
+struct native_store
+{
+	char *path;
+	int fd;
+	char *map;
+	size_t size;		/* size of the file and the mapping */
+	int rehash_failed;	/* don't retry compact() on every put */
+	pthread_rwlock_t lock;	/* write lock for modifying the file */
+};
+
+#define HEADER(s)	((struct native_header *)(s)->map)
+#define TABLE(s)	((uint64_t *)((s)->map + sizeof (struct native_header)))
+#define RECORD(s, off)	((struct native_record *)((s)->map + (off)))
+#define RECORD_KEY(r)	((char *)(r) + sizeof (struct native_record))
+#define RECORD_DATA(r)	(RECORD_KEY(r) + (r)->key_len)
+
+static size_t data_start (const uint32_t buckets)
+{
+	return sizeof (struct native_header) + buckets * sizeof (uint64_t);
+}
+
+static size_t record_size (const size_t key_len, const size_t data_len)
+{
+	return ALIGN8(sizeof (struct native_record) + key_len + data_len);
+}
+
+/* FNV-1a */
+static uint32_t hash_key (const char *key, const size_t len)
+{
+	uint32_t hash = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= (unsigned char)key[i];
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+static void native_version_tag (char *buf, size_t size)
+{
+	snprintf (buf, size, "native %d", NATIVE_VERSION);
+}
+
+/* Make the file an empty cache of the given size. */
+static int init_file (const int fd, const uint32_t buckets, const size_t size)
+{
+	struct native_header hdr;
+
+	memset (&hdr, 0, sizeof (hdr));
+	memcpy (hdr.magic, NATIVE_MAGIC, sizeof (hdr.magic));
+	hdr.version = NATIVE_VERSION;
+	hdr.buckets = buckets;
+	hdr.end = data_start (buckets);
+
+	if (ftruncate (fd, 0) == -1 || ftruncate (fd, size) == -1
+			|| pwrite (fd, &hdr, sizeof (hdr), 0) != sizeof (hdr)) {
+		log_errno ("Can't initialise the tags cache file", errno);
+		return 0;
+	}
+
+	return 1;
+}
+
+static int valid_header (const struct native_header *hdr, const off_t size)
+{
+	return !memcmp (hdr->magic, NATIVE_MAGIC, sizeof (hdr->magic))
+		&& hdr->version == NATIVE_VERSION
+		&& hdr->buckets >= MIN_BUCKETS
+		&& !(hdr->buckets & (hdr->buckets - 1))
+		&& (off_t)data_start (hdr->buckets) <= size
+		&& hdr->end >= data_start (hdr->buckets)
+		&& hdr->end <= (uint64_t)size
+		&& !hdr->obsolete;
+}
+
+/* Return the offset of the live record of the key, 0 if there is none. */
+static uint64_t find (const struct native_store *s, const char *key,
+		const size_t key_len, const uint32_t hash)
+{
+	const struct native_header *hdr = HEADER(s);
+	uint64_t off;
+
+	off = __atomic_load_n (&TABLE(s)[hash & (hdr->buckets - 1)],
+			__ATOMIC_ACQUIRE);
+
+	while (off) {
+		const struct native_record *rec;
+
+		/* Don't trust the file: stay inside of it and only go to
+		 * older records, so there are no loops. */
+		if (off < data_start (hdr->buckets)
+				|| off + sizeof (struct native_record) > hdr->end)
+			break;
+		rec = RECORD(s, off);
+		if (off + record_size (rec->key_len, rec->data_len) > hdr->end)
+			break;
+
+		if (rec->hash == hash && rec->key_len == key_len
+				&& !__atomic_load_n (&rec->dead, __ATOMIC_RELAXED)
+				&& !memcmp (RECORD_KEY(rec), key, key_len))
+			return off;
+
+		if (rec->next >= off)
+			break;
+		off = rec->next;
+	}
+
+	return 0;
+}
+
+static int map_file (struct native_store *s)
+{
+	s->map = mmap (NULL, s->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			s->fd, 0);
+	if (s->map == MAP_FAILED) {
+		s->map = NULL;
+		log_errno ("Can't map the tags cache file", errno);
+		return 0;
+	}
+
+	return 1;
+}
+
+/* Make room for size more bytes at the end. */
+static int ensure_space (struct native_store *s, const size_t size)
+{
+	size_t new_size;
+	char *map;
+
+	if (HEADER(s)->end + size <= s->size)
+		return 1;
+
+	new_size = MAX(s->size * 2, HEADER(s)->end + size + GROW_SIZE);
+	if (ftruncate (s->fd, new_size) == -1) {
+		log_errno ("Can't extend the tags cache file", errno);
+		return 0;
+	}
+
+	/* Keep the old mapping until the new one succeeds. */
+	map = mmap (NULL, new_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			s->fd, 0);
+	if (map == MAP_FAILED) {
+		log_errno ("Can't map the tags cache file", errno);
+		return 0;
+	}
+
+	munmap (s->map, s->size);
+	s->map = map;
+	s->size = new_size;
+
+	return 1;
+}
+
+/* Append the record to the file mapped at map and link it. */
+static void append (char *map, const char *key, const size_t key_len,
+		const char *data, const size_t data_len, const uint32_t hash)
+{
+	struct native_header *hdr = (struct native_header *)map;
+	uint64_t *table = (uint64_t *)(map + sizeof (struct native_header));
+	struct native_record *rec;
+	uint64_t off = hdr->end;
+	uint32_t bucket = hash & (hdr->buckets - 1);
+
+	rec = (struct native_record *)(map + off);
+	rec->next = table[bucket];
+	rec->hash = hash;
+	rec->dead = 0;
+	rec->key_len = key_len;
+	rec->data_len = data_len;
+	memcpy (RECORD_KEY(rec), key, key_len);
+	memcpy (RECORD_DATA(rec), data, data_len);
+
+	hdr->end = off + record_size (key_len, data_len);
+	hdr->records += 1;
+
+	/* Readers must see the whole record once it's in the table. */
+	__atomic_store_n (&table[bucket], off, __ATOMIC_RELEASE);
+}
+
+static void kill_record (struct native_store *s, const uint64_t off)
+{
+	struct native_record *rec = RECORD(s, off);
+
+	__atomic_store_n (&rec->dead, 1, __ATOMIC_RELEASE);
+	HEADER(s)->dead += record_size (rec->key_len, rec->data_len);
+	HEADER(s)->records -= 1;
+}
+
+/* Is the record at off the live one for its key? */
+static int live_record (const struct native_store *s, const uint64_t off)
+{
+	const struct native_record *rec = RECORD(s, off);
+
+	return !rec->dead
+		&& find (s, RECORD_KEY(rec), rec->key_len, rec->hash) == off;
+}
+
+/* Rewrite the file without the dead records. */
+static void compact (struct native_store *s)
+{
+	struct native_header *hdr = HEADER(s);
+	char *tmp_path, *map;
+	uint32_t buckets = MIN_BUCKETS;
+	size_t size;
+	uint64_t off;
+	int fd;
+
+	debug ("Compacting the tags cache: %"PRIu64" of %"PRIu64" bytes dead",
+			hdr->dead, hdr->end);
+
+	while (buckets < hdr->records * 2)
+		buckets *= 2;
+	size = data_start (buckets) + (hdr->end - data_start (hdr->buckets)
+			- hdr->dead) + GROW_SIZE;
+
+	tmp_path = (char *)xmalloc (strlen (s->path) + sizeof (".tmp"));
+	sprintf (tmp_path, "%s.tmp", s->path);
+
+	fd = open (tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1) {
+		log_errno ("Can't create the compacted tags cache", errno);
+		free (tmp_path);
+		return;
+	}
+
+	if (!init_file (fd, buckets, size))
+		goto err;
+
+	map = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		log_errno ("Can't map the compacted tags cache", errno);
+		goto err;
+	}
+
+	off = data_start (hdr->buckets);
+	while (off + sizeof (struct native_record) <= hdr->end) {
+		struct native_record *rec = RECORD(s, off);
+		size_t rec_size = record_size (rec->key_len, rec->data_len);
+
+		if (off + rec_size > hdr->end)
+			break;
+		if (live_record (s, off))
+			append (map, RECORD_KEY(rec), rec->key_len,
+					RECORD_DATA(rec), rec->data_len, rec->hash);
+		off += rec_size;
+	}
+
+	if (msync (map, size, MS_SYNC) == -1
+			|| rename (tmp_path, s->path) == -1) {
+		log_errno ("Can't replace the tags cache file", errno);
+		munmap (map, size);
+		goto err;
+	}
+
+	__atomic_store_n (&hdr->obsolete, 1, __ATOMIC_RELEASE);
+	munmap (s->map, s->size);
+	close (s->fd);
+
+	s->fd = fd;
+	s->map = map;
+	s->size = size;
+	free (tmp_path);
+
+	debug ("Tags cache compacted to %"PRIu64" bytes", HEADER(s)->end);
+	return;
+
+err:
+	close (fd);
+	unlink (tmp_path);
+	free (tmp_path);
+}
+
+static int need_rehash (const struct native_store *s)
+{
+	const struct native_header *hdr = HEADER(s);
+
+	return hdr->records > (uint64_t)hdr->buckets * MAX_LOAD;
+}
+
+static int need_compacting (const struct native_store *s)
+{
+	const struct native_header *hdr = HEADER(s);
+
+	return need_rehash (s) || (hdr->end > COMPACT_MIN
+		&& hdr->dead > (hdr->end - data_start (hdr->buckets)) / 2);
+}
+
+static void native_close (void *store)
+{
+	struct native_store *s = (struct native_store *)store;
+
+	if (s->map) {
+		msync (s->map, s->size, MS_SYNC);
+		munmap (s->map, s->size);
+	}
+	if (s->fd != -1)
+		close (s->fd);
+
+	pthread_rwlock_destroy (&s->lock);
+	free (s->path);
+	free (s);
+}
+
+static void *native_open (const char *cache_dir)
+{
+	struct native_store *s;
+	struct native_header hdr;
+	struct stat st;
+
+	s = (struct native_store *)xcalloc (1, sizeof (struct native_store));
+	pthread_rwlock_init (&s->lock, NULL);
+	s->path = (char *)xmalloc (strlen (cache_dir) + sizeof (NATIVE_FILE)
+			+ 1);
+	sprintf (s->path, "%s/%s", cache_dir, NATIVE_FILE);
+
+	s->fd = open (s->path, O_RDWR | O_CREAT, 0600);
+	if (s->fd == -1 || fstat (s->fd, &st) == -1) {
+		error_errno ("Can't open the tags cache file", errno);
+		goto err;
+	}
+
+	if (st.st_size < (off_t)sizeof (hdr)
+			|| pread (s->fd, &hdr, sizeof (hdr), 0) != sizeof (hdr)
+			|| !valid_header (&hdr, st.st_size)) {
+		if (st.st_size)
+			logit ("The tags cache file is invalid, recreating");
+		s->size = data_start (MIN_BUCKETS) + GROW_SIZE;
+		if (!init_file (s->fd, MIN_BUCKETS, s->size))
+			goto err;
+	}
+	else
+		s->size = st.st_size;
+
+	if (!map_file (s))
+		goto err;
+
+	debug ("Tags cache file: %u records, %zu bytes", HEADER(s)->records,
+			s->size);
+
+	if (need_compacting (s))
+		compact (s);
+
+	return s;
+
+err:
+	native_close (s);
+	return NULL;
+}
+
+static int native_get (void *store, const char *file, char **data,
+		size_t *size)
+{
+	struct native_store *s = (struct native_store *)store;
+	size_t key_len = strlen (file);
+	uint64_t off;
+
+	pthread_rwlock_rdlock (&s->lock);
+
+	off = find (s, file, key_len, hash_key (file, key_len));
+	if (off) {
+		struct native_record *rec = RECORD(s, off);
+
+		*size = rec->data_len;
+		*data = (char *)xmalloc (MAX(*size, 1));
+		memcpy (*data, RECORD_DATA(rec), *size);
+	}
+
+	pthread_rwlock_unlock (&s->lock);
+
+	return off != 0;
+}
+
+static int native_put (void *store, const char *file, const char *data,
+		size_t size)
+{
+	struct native_store *s = (struct native_store *)store;
+	size_t key_len = strlen (file);
+	uint32_t hash = hash_key (file, key_len);
+	uint64_t old;
+	int ok;
+
+	pthread_rwlock_wrlock (&s->lock);
+
+	ok = ensure_space (s, record_size (key_len, size));
+	if (ok) {
+		old = find (s, file, key_len, hash);
+		append (s->map, file, key_len, data, size, hash);
+		if (old)
+			kill_record (s, old);
+
+		/* compact() sizes the table for the records, so this happens
+		 * each time their number quadruples. */
+		if (need_rehash (s) && !s->rehash_failed) {
+			compact (s);
+			s->rehash_failed = need_rehash (s);
+		}
+	}
+
+	pthread_rwlock_unlock (&s->lock);
+
+	return ok;
+}
+
+static void native_del (void *store, const char *file)
+{
+	struct native_store *s = (struct native_store *)store;
+	size_t key_len = strlen (file);
+	uint64_t off;
+
+	pthread_rwlock_wrlock (&s->lock);
+
+	off = find (s, file, key_len, hash_key (file, key_len));
+	if (off)
+		kill_record (s, off);
+
+	pthread_rwlock_unlock (&s->lock);
+}
+
+static void native_foreach (void *store, t_backend_record_fn *fn, void *arg)
+{
+	struct native_store *s = (struct native_store *)store;
+	const struct native_header *hdr;
+	uint64_t off;
+
+	pthread_rwlock_rdlock (&s->lock);
+
+	hdr = HEADER(s);
+	off = data_start (hdr->buckets);
+	while (off + sizeof (struct native_record) <= hdr->end) {
+		struct native_record *rec = RECORD(s, off);
+		size_t rec_size = record_size (rec->key_len, rec->data_len);
+
+		if (off + rec_size > hdr->end)
+			break;
+		if (live_record (s, off))
+			fn (RECORD_KEY(rec), rec->key_len, RECORD_DATA(rec),
+					rec->data_len, arg);
+		off += rec_size;
+	}
+
+	pthread_rwlock_unlock (&s->lock);
+}
+
+static void native_sync (void *store)
+{
+	struct native_store *s = (struct native_store *)store;
+
+	pthread_rwlock_wrlock (&s->lock);
+
+	if (need_compacting (s))
+		compact (s);
+	else if (msync (s->map, s->size, MS_ASYNC) == -1)
+		log_errno ("Can't sync the tags cache file", errno);
+
+	pthread_rwlock_unlock (&s->lock);
+}
+
+const struct tags_cache_backend tags_cache_native_backend = {
+	"Native",
+	native_version_tag,
+	native_open,
+	native_close,
+	native_get,
+	native_put,
+	native_del,
+	native_foreach,
+	native_sync
+};
@@ -0,0 +1,268 @@
+/*
+ * MOC - music on console
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+/* Benchmark the softmixer for every sample format, once with the scalar
+ * kernels and once with those selected for the CPU.  The output of both
+ * is compared, and mixing two identical channels to mono is checked to
+ * leave the samples unchanged, which catches midpoint errors of the
+ * unsigned formats.
+ *
+ * Build it in the configured build directory (see the README). */
+
+#include "../softmixer.c"
+#include "../simd.c"
+
+#include <stdarg.h>
+#include <time.h>
+
+/* Size of the buffer processed at once, as the player does. */
+#define BUF_SIZE	(36 * 1024)
+
+/* Number of times each buffer is processed. */
+#define ROUNDS		4000
+
+static int failures = 0;
+
+/* Stubs for what softmixer.c uses outside of the mixing code. */
+void internal_logit (const char *file ATTR_UNUSED, const int line ATTR_UNUSED,
+		const char *function ATTR_UNUSED,
+		const char *format ATTR_UNUSED, ...)
+{
+}
+
+char *xstrdup (const char *s)
+{
+	char *n = strdup (s);
+
+	if (!n)
+		abort ();
+
+	return n;
+}
+
+char *create_file_name (const char *file)
+{
+	return xstrdup (file);
+}
+
+char *read_line (FILE *file ATTR_UNUSED)
+{
+	return NULL;
+}
+
+bool options_get_bool (const char *name ATTR_UNUSED)
+{
+	return false;
+}
+
+int sfmt_Bps (const long format)
+{
+	switch (format & SFMT_MASK_FORMAT) {
+		case SFMT_S8:
+		case SFMT_U8:
+			return 1;
+		case SFMT_S16:
+		case SFMT_U16:
+			return 2;
+		default:
+			return 4;
+	}
+}
+
+/* A scalar version of the one in audio_conversion.c, the time spent here
+ * is included in the results for the unsigned formats. */
+void audio_conv_change_sign (char *buf, const size_t size, long *fmt)
+{
+	size_t i;
+
+	switch (*fmt & SFMT_MASK_FORMAT) {
+		case SFMT_S8:
+		case SFMT_U8:
+			for (i = 0; i < size; i++)
+				buf[i] ^= 0x80;
+			*fmt ^= SFMT_S8 | SFMT_U8;
+			break;
+		case SFMT_S16:
+		case SFMT_U16:
+			for (i = 0; i < size / 2; i++)
+				((uint16_t *)buf)[i] ^= 1 << 15;
+			*fmt ^= SFMT_S16 | SFMT_U16;
+			break;
+		case SFMT_S24:
+		case SFMT_U24:
+			for (i = 0; i < size / 4; i++)
+				((uint32_t *)buf)[i] ^= 1 << 23;
+			*fmt ^= SFMT_S24 | SFMT_U24;
+			break;
+		case SFMT_S32:
+		case SFMT_U32:
+			for (i = 0; i < size / 4; i++)
+				((uint32_t *)buf)[i] ^= 1U << 31;
+			*fmt ^= SFMT_S32 | SFMT_U32;
+			break;
+	}
+}
+
+static const struct
+{
+	long fmt;
+	const char *name;
+} formats[] = {
+	{ SFMT_S8, "s8" },
+	{ SFMT_U8, "u8" },
+	{ SFMT_S16, "s16" },
+	{ SFMT_U16, "u16" },
+	{ SFMT_S24, "s24" },
+	{ SFMT_U24, "u24" },
+	{ SFMT_S32, "s32" },
+	{ SFMT_U32, "u32" },
+	{ SFMT_FLOAT, "float" }
+};
+
+static double now ()
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Fill the buffer with stereo samples of the format, both channels the
+ * same. */
+static void fill (char *buf, const long fmt)
+{
+	int Bps = sfmt_Bps (fmt);
+	size_t i;
+
+	for (i = 0; i < BUF_SIZE; i += 2 * Bps) {
+		if (fmt == SFMT_FLOAT)
+			*(float *)(buf + i) =
+				rand () / (float)RAND_MAX * 2.0 - 1.0;
+		else if (fmt & (SFMT_S24 | SFMT_U24)) {
+			int32_t s = rand () % (1 << 24);
+
+			/* S24 samples are sign extended, U24 ones are not. */
+			if (fmt == SFMT_S24)
+				s -= 1 << 23;
+			memcpy (buf + i, &s, 4);
+		}
+		else {
+			int j;
+
+			for (j = 0; j < Bps; j++)
+				buf[i + j] = rand ();
+		}
+
+		memcpy (buf + i + Bps, buf + i, Bps);
+	}
+}
+
+/* Process the buffer ROUNDS times and return the speed in MB/s.  The gain
+ * is just below one so that float samples don't become denormal. */
+static double bench (char *buf, const long fmt, const int gain)
+{
+	struct sound_params params = { 2, 44100, fmt | SFMT_NE };
+	double start, speed;
+	int i;
+
+	mixer_real = 999;
+	mixer_realf = mixer_real / 1000.0f;
+	mixer_reald = mixer_real / 1000.0;
+	mixer_gain = ((mixer_real << SOFTMIXER_GAIN_SHIFT) + 500) / 1000;
+
+	start = now ();
+
+	for (i = 0; i < ROUNDS; i++)
+		softmixer_process_buffer (buf, BUF_SIZE, &params, gain);
+
+	speed = (double)BUF_SIZE * ROUNDS / (now () - start) / 1e6;
+	softmixer_set_value (mixer_val);
+
+	return speed;
+}
+
+int main ()
+{
+	static char orig[BUF_SIZE], scalar_out[BUF_SIZE], buf[BUF_SIZE];
+	static char scalar_kernels[sizeof(kernels)];
+	static char selected_kernels[sizeof(kernels)];
+	struct sound_params params;
+	size_t i;
+
+	srand (1);
+
+	memcpy (scalar_kernels, &kernels, sizeof(kernels));
+	softmixer_select_kernels ();
+	memcpy (selected_kernels, &kernels, sizeof(kernels));
+
+	active = 1;
+	mixer_amp = 100;
+	softmixer_set_value (70);
+
+	printf ("%-6s %-5s %10s %10s\n", "format", "mode", "scalar",
+			"selected");
+
+	for (i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+		long fmt = formats[i].fmt;
+		int mode;
+
+		fill (orig, fmt);
+
+		/* Mixing identical channels to mono must not change them.  The
+		 * selected kernels are compared with the scalar ones below. */
+		mix_mono = 1;
+		params.channels = 2;
+		params.rate = 44100;
+		params.fmt = fmt | SFMT_NE;
+		memcpy (buf, orig, BUF_SIZE);
+		memcpy (&kernels, scalar_kernels, sizeof(kernels));
+		softmixer_process_buffer (buf, BUF_SIZE, &params, 0);
+		if (memcmp (buf, orig, BUF_SIZE)) {
+			printf ("%s: mono mixing changed the samples\n",
+					formats[i].name);
+			failures++;
+		}
+
+		/* 0: gain, 1: mono, 2: both */
+		for (mode = 0; mode < 3; mode++) {
+			static const char *mode_names[] = {
+				"gain", "mono", "both"
+			};
+			double scalar_speed, selected_speed;
+			int gain = mode != 1;
+
+			mix_mono = mode > 0;
+
+			memcpy (&kernels, scalar_kernels, sizeof(kernels));
+			memcpy (buf, orig, BUF_SIZE);
+			softmixer_process_buffer (buf, BUF_SIZE, &params, gain);
+			memcpy (scalar_out, buf, BUF_SIZE);
+			scalar_speed = bench (buf, fmt, gain);
+
+			memcpy (&kernels, selected_kernels, sizeof(kernels));
+			memcpy (buf, orig, BUF_SIZE);
+			softmixer_process_buffer (buf, BUF_SIZE, &params, gain);
+			if (memcmp (buf, scalar_out, BUF_SIZE)) {
+				printf ("%s %s: output differs from the scalar "
+						"kernels\n", formats[i].name,
+						mode_names[mode]);
+				failures++;
+			}
+			selected_speed = bench (buf, fmt, gain);
+
+			printf ("%-6s %-5s %10.1f %10.1f MB/s\n",
+					formats[i].name, mode_names[mode],
+					scalar_speed, selected_speed);
+		}
+	}
+
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,294 @@
+/*
+ * MOC - music on console
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+/* Check that the SIMD sample conversion kernels give bit-exactly the same
+ * output as the scalar ones.  Every kernel set the CPU supports is run on
+ * random and edge-case data of random lengths and alignments, and the
+ * whole output buffer is compared, so writing past the end is caught too.
+ *
+ * Build it in the configured build directory (see the README). */
+
+#include "../audio_conversion.c"
+#include "../simd.c"
+
+#include <stdio.h>
+#include <stdarg.h>
+
+/* Largest number of samples in one test. */
+#define MAX_SAMPLES	1037
+
+/* Number of tests for each kernel set. */
+#define TESTS		2000
+
+/* The sample buffers are shifted by up to this many bytes. */
+#define MAX_SHIFT	15
+
+/* Stubs for what audio_conversion.c uses outside of the kernels. */
+void internal_logit (const char *file ATTR_UNUSED, const int line ATTR_UNUSED,
+		const char *function ATTR_UNUSED,
+		const char *format ATTR_UNUSED, ...)
+{
+}
+
+void internal_error (const char *file ATTR_UNUSED, int line ATTR_UNUSED,
+		const char *function ATTR_UNUSED, const char *format, ...)
+{
+	va_list va;
+
+	va_start (va, format);
+	vfprintf (stderr, format, va);
+	va_end (va);
+	fputc ('\n', stderr);
+}
+
+void *xrealloc (void *ptr, const size_t size)
+{
+	void *p = realloc (ptr, size);
+
+	if (!p)
+		abort ();
+
+	return p;
+}
+
+int options_get_int (const char *name ATTR_UNUSED)
+{
+	return 0;
+}
+
+int sfmt_Bps (const long format ATTR_UNUSED)
+{
+	return 0;
+}
+
+int sfmt_same_bps (const long fmt1 ATTR_UNUSED, const long fmt2 ATTR_UNUSED)
+{
+	return 0;
+}
+
+char *sfmt_str (const long format ATTR_UNUSED, char *msg,
+		const size_t buf_size ATTR_UNUSED)
+{
+	msg[0] = 0;
+	return msg;
+}
+
+static int failures = 0;
+
+static float random_float ()
+{
+	switch (rand () % 12) {
+		case 0:
+			return (rand () % 2 ? 1.0 : -1.0)
+				* (1.0 + rand () / (float)RAND_MAX);
+		case 1:
+			return rand () % 2 ? 1.0 : -1.0;
+		case 2:
+			return (rand () % 2 ? 1.0 : -1.0)
+				* (1.0 - 1e-7 * (rand () % 50));
+		case 3:
+			return NAN;
+		case 4:
+			return 0.0;
+		default:
+			return rand () / (float)RAND_MAX * 2.0 - 1.0;
+	}
+}
+
+static void random_bytes (char *buf, const size_t size)
+{
+	size_t i;
+
+	for (i = 0; i < size; i++)
+		buf[i] = rand ();
+}
+
+static void compare (const char *set, const char *kernel, const char *ref,
+		const char *res, const size_t size, const size_t samples)
+{
+	if (memcmp (ref, res, size)) {
+		printf ("%s %s: output differs (%zu samples)\n", set, kernel,
+				samples);
+		failures++;
+	}
+}
+
+/* Run the kernels of the set which are not NULL against the scalar ones on
+ * one piece of data. */
+static void check_once (const char *name, const struct conv_kernels *k)
+{
+	static float fin[MAX_SAMPLES + MAX_SHIFT];
+	static int32_t in_buf[MAX_SAMPLES + MAX_SHIFT];
+	static int32_t ref_buf[MAX_SAMPLES + MAX_SHIFT];
+	static int32_t res_buf[MAX_SAMPLES + MAX_SHIFT];
+	char *in = (char *)in_buf;
+	char *ref = (char *)ref_buf;
+	char *res = (char *)res_buf;
+	size_t samples = rand () % (MAX_SAMPLES + 1);
+	size_t in_shift = rand () % (MAX_SHIFT + 1);
+	size_t out_shift = rand () % (MAX_SHIFT + 1);
+	float *f = (float *)((char *)fin + (in_shift & ~3));
+	char *ref_out = ref + out_shift;
+	char *res_out = res + out_shift;
+	size_t i;
+
+	for (i = 0; i < samples; i++)
+		f[i] = random_float ();
+	random_bytes (in, sizeof(in_buf));
+
+#define PREPARE() \
+	do { \
+		memset (ref, 0x5a, sizeof(ref_buf)); \
+		memset (res, 0x5a, sizeof(res_buf)); \
+	} while (0)
+
+	if (k->float_to_s16) {
+		PREPARE ();
+		float_to_s16 (f, ref_out, samples);
+		k->float_to_s16 (f, res_out, samples);
+		compare (name, "float_to_s16", ref, res, sizeof(ref_buf),
+				samples);
+	}
+
+	if (k->s16_to_float) {
+		PREPARE ();
+		s16_to_float (in + in_shift, (float *)ref_out, samples);
+		k->s16_to_float (in + in_shift, (float *)res_out, samples);
+		compare (name, "s16_to_float", ref, res, sizeof(ref_buf),
+				samples);
+	}
+
+	if (k->float_to_s24_3) {
+		PREPARE ();
+		float_to_s24_3 (f, ref_out, samples);
+		k->float_to_s24_3 (f, res_out, samples);
+		compare (name, "float_to_s24_3", ref, res, sizeof(ref_buf),
+				samples);
+	}
+
+	if (k->s24_3_to_float) {
+		PREPARE ();
+		s24_3_to_float (in + in_shift, (float *)ref_out, samples);
+		k->s24_3_to_float (in + in_shift, (float *)res_out, samples);
+		compare (name, "s24_3_to_float", ref, res, sizeof(ref_buf),
+				samples);
+	}
+
+	/* The in-place kernels, the buffers are aligned to the sample. */
+#define CHECK_IN_PLACE(kernel, type) \
+	do { \
+		if (k->kernel) { \
+			char *r = ref + (out_shift & ~(sizeof(type) - 1)); \
+			char *s = res + (out_shift & ~(sizeof(type) - 1)); \
+			random_bytes (ref, sizeof(ref_buf)); \
+			memcpy (res, ref, sizeof(ref_buf)); \
+			kernel ((type *)r, samples); \
+			k->kernel ((type *)s, samples); \
+			compare (name, #kernel, ref, res, sizeof(ref_buf), \
+					samples); \
+		} \
+	} while (0)
+
+	CHECK_IN_PLACE (change_sign_8, uint8_t);
+	CHECK_IN_PLACE (change_sign_16, uint16_t);
+	CHECK_IN_PLACE (change_sign_24, uint32_t);
+	CHECK_IN_PLACE (change_sign_32, uint32_t);
+	CHECK_IN_PLACE (swap_16, int16_t);
+	CHECK_IN_PLACE (swap_32, int32_t);
+
+#undef CHECK_IN_PLACE
+#undef PREPARE
+}
+
+static void check_set (const char *name, const struct conv_kernels *k)
+{
+	int failed = failures;
+	int i;
+
+	for (i = 0; i < TESTS; i++)
+		check_once (name, k);
+
+	printf ("%s: %s\n", name, failures == failed ? "OK" : "FAILED");
+}
+
+int main ()
+{
+	int features = simd_features ();
+	int checked = 0;
+
+	srand (1);
+
+#ifdef HAVE_SIMD_X86
+	if (features & SIMD_SSE2) {
+		struct conv_kernels k;
+
+		memset (&k, 0, sizeof(k));
+		k.float_to_s16 = float_to_s16_sse2;
+		k.s16_to_float = s16_to_float_sse2;
+		k.change_sign_8 = change_sign_8_sse2;
+		k.change_sign_16 = change_sign_16_sse2;
+		k.change_sign_24 = change_sign_24_sse2;
+		k.change_sign_32 = change_sign_32_sse2;
+		k.swap_16 = swap_16_sse2;
+		k.swap_32 = swap_32_sse2;
+		check_set ("SSE2", &k);
+		checked++;
+	}
+
+	if ((features & (SIMD_SSE2 | SIMD_AVX2)) == (SIMD_SSE2 | SIMD_AVX2)) {
+		struct conv_kernels k = {
+			float_to_s16_avx2,
+			s16_to_float_avx2,
+			float_to_s24_3_avx2,
+			s24_3_to_float_avx2,
+			change_sign_8_avx2,
+			change_sign_16_avx2,
+			change_sign_24_avx2,
+			change_sign_32_avx2,
+			swap_16_avx2,
+			swap_32_avx2
+		};
+
+		check_set ("AVX2", &k);
+		checked++;
+	}
+#endif
+
+#ifdef HAVE_NEON
+	if (features & SIMD_NEON) {
+		struct conv_kernels k;
+
+		memset (&k, 0, sizeof(k));
+		k.s16_to_float = s16_to_float_neon;
+		k.change_sign_8 = change_sign_8_neon;
+		k.change_sign_16 = change_sign_16_neon;
+		k.change_sign_24 = change_sign_24_neon;
+		k.change_sign_32 = change_sign_32_neon;
+		k.swap_16 = swap_16_neon;
+		k.swap_32 = swap_32_neon;
+# ifdef __aarch64__
+		k.float_to_s16 = float_to_s16_neon;
+# endif
+# ifndef WORDS_BIGENDIAN
+		k.s24_3_to_float = s24_3_to_float_neon;
+#  ifdef __aarch64__
+		k.float_to_s24_3 = float_to_s24_3_neon;
+#  endif
+# endif
+		check_set ("NEON", &k);
+		checked++;
+	}
+#endif
+
+	if (!checked)
+		printf ("No SIMD kernels to check on this CPU.\n");
+
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}